@@ -20,6 +20,7 @@
 
 #include "drive.h"
 
+#include <algorithm>
 #include <cstring>
 #include <sstream>
 #include <unordered_map>
@@ -37,7 +38,10 @@
 #include "utils.h"
 #include "display.h"
 
+#include "meat_broker.h"
 #include "meat_media.h"
+#include "meat_prefetch.h"
+#include "disk/format.h"
 #include "qrmanager.h"
 
 
@@ -54,6 +58,8 @@
 #define ST_WRITE_PROTECT      26
 #define ST_SYNTAX_ERROR_31    31
 #define ST_SYNTAX_ERROR_33    33
+#define ST_RECORD_NOT_PRESENT 50
+#define ST_OVERFLOW_IN_RECORD 51
 #define ST_FILE_NOT_OPEN      61
 #define ST_FILE_NOT_FOUND     62
 #define ST_FILE_EXISTS        63
@@ -88,7 +94,9 @@ static bool isMatch(std::string name, std::string pattern)
 iecChannelHandler::iecChannelHandler(iecDrive *drive)
 { 
   m_drive = drive;
-  m_data = new uint8_t[BUFFER_SIZE]; 
+  m_buffer = BufferPool::acquire(BUFFER_SIZE, BufferPool::DMA);
+  m_data = m_buffer.data();
+  m_view = m_data;
   m_len = 0; 
   m_ptr = 0; 
 }
@@ -96,7 +104,6 @@ iecChannelHandler::iecChannelHandler(iecDrive *drive)
 
 iecChannelHandler::~iecChannelHandler()
 { 
-  delete [] m_data; 
 }
 
 
@@ -122,14 +129,14 @@ uint8_t iecChannelHandler::read(uint8_t *data, uint8_t n)
       if( n==1 )
         {
           // common case during regular (non-fastloader) load
-          data[0] = m_data[m_ptr++];
+          data[0] = m_view[m_ptr++];
           return 1;
         }
       else
         {
           // copy as much data as possible
           n = std::min((size_t) n, (size_t) (m_len - m_ptr));
-          memcpy(data, m_data + m_ptr, n);
+          memcpy(data, m_view + m_ptr, n);
           m_ptr += n;
           return n;
         }
@@ -143,6 +150,13 @@ uint8_t iecChannelHandler::read(uint8_t *data, uint8_t n)
 
 uint8_t iecChannelHandler::write(uint8_t *data, uint8_t n)
 {
+  // whatever is left of a record read before isn't part of this one
+  if( m_ptr>0 )
+    {
+      m_ptr = 0;
+      m_len = 0;
+    }
+
   // if buffer is full then empty it
   if( m_len+n > BUFFER_SIZE )
     {
@@ -174,13 +188,25 @@ uint8_t iecChannelHandler::write(uint8_t *data, uint8_t n)
 }
 
 
+uint8_t iecChannelHandler::flush()
+{
+  uint8_t st = (m_len>0) ? writeBufferData() : ST_OK;
+  m_ptr = 0;
+  m_len = 0;
+  return st;
+}
+
+
 // -------------------------------------------------------------------------------------------------
 
 
 iecChannelHandlerFile::iecChannelHandlerFile(iecDrive *drive, std::shared_ptr<MStream> stream, int fixLoadAddress) : iecChannelHandler(drive)
 {
-  m_stream = stream;
+  // Let the I/O worker read ahead while the bus is busy sending
+  m_stream = PrefetchMStream::wrap(stream);
+  m_stream->prefetch(m_stream->position(), m_stream->available());
   m_fixLoadAddress = fixLoadAddress;
+  m_viewLen = 0;
   m_timeStart = esp_timer_get_time();
   m_byteCount = 0;
   m_transportTimeUS = 0;
@@ -194,6 +220,13 @@ iecChannelHandlerFile::~iecChannelHandlerFile()
   if( m_stream->mode == std::ios_base::out && m_len>0 )
     writeBufferData();
 
+  // sizes and blocks free changed while the file was written
+  if( m_stream->mode & std::ios_base::out )
+    ListingCache::invalidate(m_stream->url);
+
+  if( m_viewLen>0 )
+    m_stream->consume(0);
+
   m_stream->close();
   Debug_printv("Stream closed.");
 
@@ -227,7 +260,13 @@ uint8_t iecChannelHandlerFile::writeBufferData()
       size_t n = m_stream->write(m_data, m_len);
       m_transportTimeUS += (esp_timer_get_time()-t);
       m_byteCount += n;
-      if( n<m_len )
+      if( n>0 && n<m_len && isRecordFile() )
+        {
+          // the record got what fit, like a real drive
+          Debug_printv("Record overflow: n[%d] < m_len[%d]", n, m_len);
+          return ST_OVERFLOW_IN_RECORD;
+        }
+      else if( n<m_len )
         {
           Debug_printv("Error: write failed: n[%d] < m_len[%d]", n, m_len);
           return ST_WRITE_ERROR;
@@ -247,6 +286,24 @@ uint8_t iecChannelHandlerFile::readBufferData()
   else
   */
     {
+      // done with the view lent for the previous buffer
+      if( m_viewLen>0 )
+        {
+          m_stream->consume(m_viewLen);
+          m_viewLen = 0;
+        }
+      m_view = m_data;
+
+      // relative files send one record per buffer, the drive ends it with EOI
+      if( isRecordFile() )
+        {
+          uint64_t t = esp_timer_get_time();
+          m_len = m_stream->read(m_data, BUFFER_SIZE);
+          m_transportTimeUS += (esp_timer_get_time()-t);
+          m_byteCount += m_len;
+          return (m_len>0) ? ST_OK : ST_RECORD_NOT_PRESENT;
+        }
+
       Debug_printv("size[%lu] avail[%lu] pos[%lu]", m_stream->size(), m_stream->available(), m_stream->position());
       if (m_stream->size() == 0)
         return ST_FILE_NOT_FOUND;
@@ -270,7 +327,20 @@ uint8_t iecChannelHandlerFile::readBufferData()
           m_fixLoadAddress = -1;
         }
       else
-        m_len = 0;
+        {
+          // send straight out of the stream's buffer if it can lend one
+          const uint8_t *view;
+          uint64_t t = esp_timer_get_time();
+          m_len = m_stream->peekView(&view);
+          m_transportTimeUS += (esp_timer_get_time()-t);
+          if( m_len>0 )
+            {
+              m_view = view;
+              m_viewLen = m_len;
+              m_byteCount += m_len;
+              return ST_OK;
+            }
+        }
 
       // try to fill buffer
       while( m_len<BUFFER_SIZE && !m_stream->eos() )
@@ -291,10 +361,25 @@ uint8_t iecChannelHandlerFile::readBufferData()
 // -------------------------------------------------------------------------------------------------
 
 
-iecChannelHandlerDir::iecChannelHandlerDir(iecDrive *drive, MFile *dir) : iecChannelHandler(drive)
+iecChannelHandlerDir::iecChannelHandlerDir(iecDrive *drive, MFile *dir, ListingCache::Listing listing) : iecChannelHandler(drive)
 {
   m_dir = dir;
   m_headerLine = 1;
+  m_listing = listing;
+  m_listingPos = 0;
+  m_listingStamp = 0;
+
+  if( m_listing )
+    {
+#ifdef ENABLE_DISPLAY
+      DISPLAY.speed = 100;
+      DISPLAY.activity = true;
+#endif
+      return;
+    }
+
+  m_listingKey = listingKey(drive, dir, dir->dir_filter);
+  m_listingStamp = listingStamp(dir);
   
   std::string url = m_dir->host;
   url = mstr::toPETSCII2(url);
@@ -352,6 +437,27 @@ void iecChannelHandlerDir::addExtraInfo(std::string title, std::string text)
 }
 
 
+// Listings differ by directory, filter pattern and header mode: the drive
+// number is the ID in browser mode and the root lists the SD card
+std::string iecChannelHandlerDir::listingKey(iecDrive *drive, MFile *dir, const DirFilter &filter)
+{
+  uint8_t mode = drive->id() & 0x1F;
+  if( dir->url.size()<2 && fnSDFAT.running() ) mode |= 0x80;
+
+  std::string pattern = filter.petscii;
+  if( filter.type ) { pattern += '='; pattern += filter.type; }
+  return ListingCache::key(dir->url, pattern, mode);
+}
+
+
+// Modification time of the directory or of the image holding it, 0 if unknown
+time_t iecChannelHandlerDir::listingStamp(MFile *dir)
+{
+  MFile *source = dir->sourceFile!=nullptr ? dir->sourceFile : dir;
+  return source->getLastWrite();
+}
+
+
 uint8_t iecChannelHandlerDir::writeBufferData()
 {
   return ST_FILE_TYPE_MISMATCH;
@@ -360,6 +466,15 @@ uint8_t iecChannelHandlerDir::writeBufferData()
 
 uint8_t iecChannelHandlerDir::readBufferData()
 {
+  if( m_listing )
+    {
+      // cached listing, send it straight from its buffer
+      m_len = std::min((size_t) BUFFER_SIZE, m_listing->size() - m_listingPos);
+      m_view = m_listing->data() + m_listingPos;
+      m_listingPos += m_len;
+      return ST_OK;
+    }
+
   if( m_headerLine==1 )
     {
       // main header line
@@ -408,20 +523,21 @@ uint8_t iecChannelHandlerDir::readBufferData()
   else if( m_headerLine < 0xFF )
     {
       // file entries
-      std::unique_ptr<MFile> entry; 
+      DirEntry entry;
+      bool found;
 
       // skip over files starting with "."
       do 
         { 
-          entry = std::unique_ptr<MFile>( m_dir->getNextFileInDir() ); 
-          if( entry!=nullptr ) Debug_printv("[%s]", entry->name.c_str());
+          found = m_dir->getNextEntry(entry);
+          if( found ) Debug_printv("[%s]", entry.name);
         }
-      while( entry!=nullptr && entry->name[0] == '.' );
+      while( found && entry.name[0] == '.' );
 
-      if( entry != nullptr )
+      if( found )
         {
           // directory entry
-          uint16_t blocks = entry->blocks();
+          uint16_t blocks = entry.blocks;
           m_data[m_len++] = 1;
           m_data[m_len++] = 1;
           m_data[m_len++] = blocks&255;
@@ -430,45 +546,50 @@ uint8_t iecChannelHandlerDir::readBufferData()
           if( blocks<100 )   m_data[m_len++] = ' ';
           if( blocks<1000 )  m_data[m_len++] = ' ';
 
-          std::string ext = entry->extension;
-          mstr::ltrim(ext);
-          if( entry->isDirectory() )
-            ext = "dir";
-          else if( ext.length()>0 )
+          char ext[3];
+          if( entry.flags & DirEntry::DIRECTORY )
+            memcpy(ext, "dir", 3);
+          else if( entry.type[0] )
             {
-              if( ext.size()>3 )
-                ext = ext.substr(0, 3);
-              else
-                ext += std::string(3-ext.size(), ' ');
+              size_t n = strlen(entry.type);
+              memcpy(ext, entry.type, n);
+              memset(ext+n, ' ', 3-n);
             }
           else
-            ext = "prg";
+            memcpy(ext, "prg", 3);
 
-          std::string name = entry->name;
+          char name[16];
+          size_t n;
           if ( !m_dir->isPETSCII )
             {
-              name = mstr::toPETSCII2( name );
-              ext  = mstr::toPETSCII2( ext );
+              n = mstr::toPETSCII2(entry.name, strlen(entry.name), name, sizeof(name));
+              mstr::toPETSCII2(ext, 3, ext, 3);
             }
-          mstr::replaceAll(name, "\\", "/");
+          else
+            {
+              n = std::min(strlen(entry.name), sizeof(name));
+              memcpy(name, entry.name, n);
+            }
+          std::replace(name, name+n, '\\', '/');
           
           // File name
           m_data[m_len++] = '"';
 
           // C64 compatibale name
           {
-            size_t n = std::min(16, (int) name.size());
-            memcpy(m_data+m_len, name.data(), n);
+            memcpy(m_data+m_len, name, n);
             m_len += n;
             m_data[m_len++] = '"';
 
-            // Extension gap
+            // Extension gap, its last column holds the splat
             n = 17-n;
             while(n-->0) m_data[m_len++] = ' ';
+            if( entry.flags & DirEntry::SPLAT ) m_data[m_len-1] = '*';
 
             // Extension
-            memcpy(m_data+m_len, ext.data(), 3);
+            memcpy(m_data+m_len, ext, 3);
             m_len+=3;
+            if( entry.flags & DirEntry::LOCKED ) m_data[m_len++] = '<';
             while( m_len<31 ) m_data[m_len++] = ' ';
             m_data[31] = 0;
             m_len = 32;
@@ -530,6 +651,17 @@ uint8_t iecChannelHandlerDir::readBufferData()
         }
     }
 
+  // keep the rendered bytes, the listing is cached once the footer is out
+  if( !m_listingKey.empty() )
+    {
+      m_render.insert(m_render.end(), m_data, m_data+m_len);
+      if( m_headerLine==0xFF )
+        {
+          ListingCache::store(m_listingKey, m_listingStamp, std::move(m_render));
+          m_listingKey.clear();
+        }
+    }
+
   return ST_OK;
 }
 
@@ -563,6 +695,9 @@ void iecDrive::begin()
 
   m_memory.setROM("dos1541"); // Default to 1541 ROM
 
+  // Channel buffers for the first opens, so they don't wait on the heap mid transaction
+  BufferPool::reserve(BUFFER_SIZE, BufferPool::DMA, 2);
+
   m_vdrive = NULL;
 
   for(int i=0; i<16; i++) 
@@ -613,6 +748,17 @@ bool iecDrive::open(uint8_t channel, const char *cname)
                 mode = std::ios_base::out;
         }
 
+        // relative file: "NAME,L,"+CHR$(record length), an existing one
+        // can leave the length out. Taken from cname, the length byte may
+        // well be a comma itself.
+        uint8_t record_length = 0;
+        const char *rel = strstr(cname, ",L");
+        if( rel!=nullptr && (rel[2]==',' || rel[2]==0) )
+        {
+            mode = std::ios_base::in | std::ios_base::out;
+            record_length = (rel[2]==',' && rel[3]!=0) ? (uint8_t) rel[3] : 0xFF;
+        }
+
         if( mstr::startsWith(name, "@") )
         {
             overwrite = true;
@@ -653,8 +799,15 @@ bool iecDrive::open(uint8_t channel, const char *cname)
                 close(channel);
                 }
 
+            // "$0:A*=P" only lists names starting with A, PRG files only
+            DirFilter filter;
             if ( name[0] == '$' ) 
+                {
+                size_t colon = name.find(':');
+                if( colon != std::string::npos )
+                    filter = DirFilter::parse(name.substr(colon + 1));
                 name.clear();
+                }
 
             // get file
             MFile *f = m_cwd->cd( mstr::toUTF8( name ) );
@@ -669,7 +822,21 @@ bool iecDrive::open(uint8_t channel, const char *cname)
                 }
             else if( f->isDirectory() )
                 {
+                ListingCache::Listing listing;
                 if( mode == std::ios_base::in )
+                    listing = ListingCache::lookup(iecChannelHandlerDir::listingKey(this, f, filter), iecChannelHandlerDir::listingStamp(f));
+
+                if( listing )
+                    {
+                    // same listing as last time, no need to read the directory
+                    m_channels[channel] = new iecChannelHandlerDir(this, f, listing);
+                    m_numOpenChannels++;
+                    m_cwd.reset(MFSOwner::File(f->url));
+                    Debug_printv("Cached directory [%s] bytes[%d]", f->url.c_str(), listing->size());
+                    f = nullptr; // f will be deleted in iecChannelHandlerDir destructor
+                    setStatusCode(ST_OK);
+                    }
+                else if( mode == std::ios_base::in )
                     {
                     // reading directory
                     bool isProperDir = false;
@@ -695,7 +862,7 @@ bool iecDrive::open(uint8_t channel, const char *cname)
                     if( isProperDir )
                         {
                         // regular directory
-                        f->rewindDirectory();
+                        f->rewindDirectory(filter);
                         m_channels[channel] = new iecChannelHandlerDir(this, f);
                         m_numOpenChannels++;
                         m_cwd.reset(MFSOwner::File(f->url));
@@ -728,9 +895,9 @@ bool iecDrive::open(uint8_t channel, const char *cname)
                     Debug_printv("Error: file doesn't exist [%s]", f->url.c_str());
                     setStatusCode(ST_FILE_NOT_FOUND);
                     }
-                else if( (mode == std::ios_base::out) && f->media_image.size()>0 )
+                else if( (mode & std::ios_base::out) && f->media_image.size()>0 && !f->isWritable )
                     {
-                    Debug_printv("Error: writing to files on disk media not supported [%s]", f->url.c_str());
+                    Debug_printv("Error: media is write protected [%s]", f->url.c_str());
                     setStatusCode(ST_WRITE_PROTECT);
                     }
                 else if( (mode == std::ios_base::out) && f->exists() && !overwrite )
@@ -747,6 +914,7 @@ bool iecDrive::open(uint8_t channel, const char *cname)
                           return m_vdrive->openFile(channel, "$");
                         }
 
+                    f->record_length = record_length;
                     std::shared_ptr<MStream> new_stream = f->getSourceStream(mode);
                     
                     if( new_stream==nullptr )
@@ -754,6 +922,11 @@ bool iecDrive::open(uint8_t channel, const char *cname)
                         Debug_printv("Error: could not get stream for file [%s]", f->url.c_str());
                         setStatusCode(ST_DRIVE_NOT_READY);
                         }
+                    else if( record_length>0 && new_stream->record_length==0 )
+                        {
+                        Debug_printv("Error: not a relative file [%s]", f->url.c_str());
+                        setStatusCode(ST_FILE_TYPE_MISMATCH);
+                        }
                     else if( (mode == std::ios_base::in) && new_stream->size()==0 && !f->isDirectory() )
                         {
                         Debug_printv("Error: file length is zero [%s]", f->url.c_str());
@@ -852,7 +1025,18 @@ uint8_t iecDrive::write(uint8_t channel, uint8_t *data, uint8_t dataLen, bool eo
           return 0;
         }
       else
-        return handler->write(data, dataLen);
+        {
+          uint8_t n = handler->write(data, dataLen);
+
+          // every PRINT# to a relative file is one record
+          if( eoi && n==dataLen && handler->isRecordFile() )
+            {
+              uint8_t st = handler->flush();
+              if( st!=ST_OK ) setStatusCode(st);
+            }
+
+          return n;
+        }
     }
 }
 
@@ -883,6 +1067,11 @@ uint8_t iecDrive::read(uint8_t channel, uint8_t *data, uint8_t maxDataLen, bool
       else
       {
           uint8_t bytes_read = handler->read(data, maxDataLen);
+
+          // every record of a relative file ends with EOI
+          if( bytes_read>0 && handler->isRecordFile() && handler->endOfBuffer() )
+            *eoi = true;
+
           if( m_statusCode==ST_FILE_NOT_FOUND)
           {
               Debug_printv("Subdir Change Directory Here! stream[%s] > base[%s]", m_cwd->url.c_str(), m_cwd->base().c_str());
@@ -1106,6 +1295,34 @@ void iecDrive::execute(const char *cmd, uint8_t cmdLen)
         break;
         case 'N':
           {
+            // "N:GAMES.D81,NAME,ID" outside of an image creates a blank one
+            // from its template, VDrive only handles the other formats
+            std::string spec = command.substr(colon_position+1);
+            size_t comma = spec.find(',');
+            std::string filename = mstr::toUTF8(spec.substr(0, comma));
+            size_t dot = filename.rfind('.');
+            if ( colon_position && m_cwd->media_image.empty() && dot!=std::string::npos && ImageFormat::find(filename.substr(dot+1)) )
+                {
+                // disk name defaults to the file name
+                std::string header_info = (comma==std::string::npos) ? spec.substr(0, spec.rfind('.')) : spec.substr(comma+1);
+
+                fnLedManager.set(eLed::LED_BUS, true);
+                MFile *f = m_cwd->cd(filename);
+                if( f==nullptr || !f->isWritable )
+                  setStatusCode(ST_WRITE_PROTECT);
+                else if( f->exists() )
+                  setStatusCode(ST_FILE_EXISTS);
+                else if( !ImageFormat::create(f, header_info) )
+                  setStatusCode(ST_WRITE_ERROR);
+                else
+                  setStatusCode(ST_OK);
+                fnLedManager.set(eLed::LED_BUS, false);
+
+                if( f!=nullptr ) delete f;
+                ListingCache::invalidate(m_cwd->url);
+                return;
+                }
+
 //#ifdef USE_VDRIVE
             if ( Meatloaf.use_vdrive )
                 {
@@ -1151,6 +1368,7 @@ void iecDrive::execute(const char *cmd, uint8_t cmdLen)
                 //New();
                 Debug_printv( "new (format)");
                 command = mstr::toUTF8(command.substr(colon_position + 1));
+                ListingCache::invalidate(m_cwd->url);
                 if (!m_cwd->format(command))
                 setStatusCode(ST_WRITE_ERROR);
                 else
@@ -1161,6 +1379,34 @@ void iecDrive::execute(const char *cmd, uint8_t cmdLen)
 //#endif
           }
         break;
+        case 'P': // Position relative file
+            if ( command.size() >= 4 )
+            {
+                // record and position count from 1, 0 is taken as 1
+                uint8_t channel = command[1] & 0x0f;
+                uint16_t record = (uint8_t) command[2] | ((uint8_t) command[3] << 8);
+                uint8_t position = (command.size() >= 5) ? (uint8_t) command[4] : 1;
+                Debug_printv("position channel[%d] record[%d] position[%d]", channel, record, position);
+
+                auto handler = m_channels[channel];
+                auto stream = (handler != nullptr) ? handler->getStream() : nullptr;
+                if ( stream == nullptr || stream->record_length == 0 )
+                {
+                    setStatusCode(ST_FILE_NOT_OPEN);
+                    return;
+                }
+
+                // whatever is left of the previous record is dropped
+                handler->discard();
+                clearReadBuffer(channel);
+
+                if ( stream->seekRecord(record ? record - 1 : 0, position ? position - 1 : 0) )
+                    setStatusCode(ST_OK);
+                else
+                    setStatusCode(ST_RECORD_NOT_PRESENT);
+                return;
+            }
+        break;
         case 'R':
             if ( command[1] != 'D' && colon_position ) // Rename
             {
@@ -1197,6 +1443,8 @@ void iecDrive::execute(const char *cmd, uint8_t cmdLen)
                     delete dir;
                   }
 
+                if( n>0 )
+                  ListingCache::invalidate(m_cwd->url);
                 setStatusCode(ST_SCRATCHED, n);
                 return;
             }
@@ -1322,6 +1570,8 @@ void iecDrive::execute(const char *cmd, uint8_t cmdLen)
                   else
                     setStatusCode(ST_WRITE_ERROR);
 
+                  if( m_statusCode==ST_OK )
+                    ListingCache::invalidate(f->url);
                   delete f;
                 }
             }
@@ -1347,6 +1597,8 @@ void iecDrive::execute(const char *cmd, uint8_t cmdLen)
                   else
                     setStatusCode(ST_WRITE_ERROR);
 
+                  if( m_statusCode==ST_OK )
+                    ListingCache::invalidate(f->url);
                   delete f;
                 }
             }
@@ -1410,6 +1662,24 @@ void iecDrive::execute(const char *cmd, uint8_t cmdLen)
     // Meatloaf Extended Commands
     switch ( command[0] )
     {
+      case 'F': // Find a program in the catalog, change into its image
+        if ( mstr::startsWith(command, "FIND:") )
+        {
+            CatalogIndex::Match match;
+            MFile *image = nullptr;
+            if ( CatalogIndex::find(mstr::toUTF8(command.substr(5)), match) )
+                image = MFSOwner::File(match.image);
+
+            Debug_printv("find[%s] image[%s]", command.c_str(), match.image.c_str());
+            if ( image != nullptr )
+            {
+                m_cwd.reset(image);
+                setStatusCode(ST_OK);
+            }
+            else
+                setStatusCode(ST_FILE_NOT_FOUND);
+        }
+      break;
       case 'Q': // Generate QRCode
         if (command[1] == 'R' && colon_position)
         {
@@ -1487,6 +1757,8 @@ void iecDrive::getStatus(char *buffer, uint8_t bufferSize)
     case ST_SCRATCHED      : msg = "FILES SCRATCHED"; break;
     case ST_WRITE_ERROR    : msg = "WRITE ERROR"; break;
     case ST_WRITE_PROTECT  : msg = "WRITE PROTECT"; break;
+    case ST_RECORD_NOT_PRESENT: msg = "RECORD NOT PRESENT"; break;
+    case ST_OVERFLOW_IN_RECORD: msg = "OVERFLOW IN RECORD"; break;
     case ST_SYNTAX_ERROR_31:
     case ST_SYNTAX_ERROR_33: msg = "SYNTAX ERROR"; break;
     case ST_FILE_NOT_FOUND : msg = "FILE NOT FOUND"; break;
@@ -1530,10 +1802,24 @@ void iecDrive::reset()
 
   IECFileDevice::reset();
 
-
+  auto image_stats = ImageBroker::stats();
+  Debug_printv("ImageBroker entries[%d] bytes[%d] budget[%d] hits[%lu] misses[%lu] evictions[%lu]",
+               image_stats.entries, image_stats.bytes, image_stats.budget,
+               image_stats.hits, image_stats.misses, image_stats.evictions);
   ImageBroker::clear();
+
+  auto prefetch_stats = PrefetchWorker::stats();
+  Debug_printv("Prefetch depth[%lu] peak[%lu] fills[%lu] bytes[%llu] stalls[%lu] stall_us[%llu]",
+               prefetch_stats.depth, prefetch_stats.depth_peak, prefetch_stats.fills,
+               prefetch_stats.bytes, prefetch_stats.stalls, prefetch_stats.stall_us);
   //FileBroker::clear();
-  //StreamBroker::clear();
+
+  BufferPool::report();
+
+  auto stream_stats = StreamBroker::stats();
+  Debug_printv("StreamBroker streams[%d] hits[%lu] misses[%lu] expired[%lu]",
+               stream_stats.entries, stream_stats.hits, stream_stats.misses, stream_stats.expired);
+  StreamBroker::clear();
 
 #ifdef ENABLE_DISPLAY
   DISPLAY.idle();
@@ -30,9 +30,12 @@
 #include "../../media/media.h"
 #include "../meatloaf/meatloaf.h"
 #include "../meatloaf/meat_buffer.h"
+#include "../meatloaf/meat_catalog.h"
+#include "../meatloaf/meat_listing.h"
 #include "../meatloaf/wrappers/iec_buffer.h"
 #include "../meatloaf/wrappers/directory_stream.h"
 #include "utils.h"
+#include "buffer_pool.h"
 
 //#ifdef USE_VDRIVE
 #include "../vdrive/VDriveClass.h"
@@ -58,9 +61,18 @@ class iecChannelHandler
   virtual uint8_t readBufferData()  = 0;
   virtual std::shared_ptr<MStream> getStream() { return nullptr; };
 
+  // relative files move a record at a time: EOI after each record sent,
+  // flush() after each record received, discard() on the P command
+  virtual bool isRecordFile() { return false; };
+  bool endOfBuffer() { return m_ptr >= m_len; };
+  uint8_t flush();
+  void discard() { m_ptr = 0; m_len = 0; };
+
  protected:
   iecDrive *m_drive;
+  BufferPool::Buffer m_buffer;
   uint8_t  *m_data;
+  const uint8_t *m_view; // data being sent, m_data or a view lent by the stream
   size_t    m_len, m_ptr;
 };
 
@@ -74,10 +86,12 @@ class iecChannelHandlerFile : public iecChannelHandler
   virtual uint8_t readBufferData();
   virtual uint8_t writeBufferData();
   virtual std::shared_ptr<MStream> getStream() override { return m_stream; };
+  virtual bool isRecordFile() override { return m_stream->record_length>0; };
 
  private:
   std::shared_ptr<MStream> m_stream;
   int       m_fixLoadAddress;
+  uint32_t  m_viewLen;
   uint32_t  m_byteCount;
   uint64_t  m_timeStart, m_transportTimeUS;
 };
@@ -86,18 +100,29 @@ class iecChannelHandlerFile : public iecChannelHandler
 class iecChannelHandlerDir : public iecChannelHandler
 {
  public: 
-  iecChannelHandlerDir(iecDrive *drive, MFile *dir);
+  // With a cached listing the bytes are replayed as they are, otherwise
+  // the listing is rendered and cached once it is complete
+  iecChannelHandlerDir(iecDrive *drive, MFile *dir, ListingCache::Listing listing = nullptr);
   virtual ~iecChannelHandlerDir();
 
   virtual uint8_t readBufferData();
   virtual uint8_t writeBufferData();
 
+  static std::string listingKey(iecDrive *drive, MFile *dir, const DirFilter &filter);
+  static time_t listingStamp(MFile *dir);
+
  private:
   void addExtraInfo(std::string title, std::string text);
   
   MFile   *m_dir;
   uint8_t  m_headerLine;
   std::vector<std::string> m_headers;
+
+  ListingCache::Listing m_listing;
+  size_t   m_listingPos;
+  std::string m_listingKey;
+  time_t   m_listingStamp;
+  std::vector<uint8_t> m_render;
 };
 
 
@@ -21,7 +21,13 @@
 #include <archive_entry.h>
 #include <string.h>
 
+#include <mutex>
+#include <set>
+
+#include <esp_timer.h>
+
 #include "../meatloaf.h"
+#include "../meat_broker.h"
 
 // int cb_open(struct archive *, void *userData)
 // {
@@ -50,8 +56,8 @@ ssize_t cb_read(struct archive *, void *userData, const void **buff) {
     // block of data read.
     // https://github.com/libarchive/libarchive/wiki/LibarchiveIO
     Archive *a = (Archive *)userData;
-    *buff = a->m_srcBuffer;
-  return a->m_archive==NULL ? 0 : a->m_srcStream->read(a->m_srcBuffer, a->m_buffSize);
+    *buff = a->m_srcBuffer.data();
+  return a->m_archive==NULL ? 0 : a->m_srcStream->read(a->m_srcBuffer.data(), a->m_buffSize);
 }
 
 
@@ -104,22 +110,42 @@ int64_t cb_seek(struct archive *, void *userData, int64_t offset, int whence)
 
 
 bool Archive::open(std::ios_base::openmode mode) {
+    return begin(0, false);
+}
+
+bool Archive::openMember(uint32_t offset) {
+    return begin(offset, true);
+}
+
+bool Archive::begin(uint32_t offset, bool member) {
     // close the archive if it was already open
     close();
 
-    Debug_printv("Archive::open [%s]", m_srcStream->url.c_str());
-    m_srcBuffer = new uint8_t[m_buffSize];
-    m_archive = archive_read_new();
-    m_srcStream->seek(0, SEEK_SET);
+    Debug_printv("Archive::open [%s] offset[%lu]", m_srcStream->url.c_str(), offset);
+    // Kept across reopens, rewinding the directory reopens the archive
+    BufferPool::move(m_srcBuffer, m_placement);
+    if (!m_srcBuffer)
+        m_srcBuffer = BufferPool::acquire(m_buffSize, m_placement);
+    if (!m_srcBuffer)
+        return false;
 
-    archive_read_support_filter_all(m_archive);
-    archive_read_support_format_all(m_archive);
+    m_archive = archive_read_new();
+    m_srcStream->seek(offset, SEEK_SET);
+
+    if (member) {
+        // The streaming reader goes from local header to local header and
+        // never asks for the central directory, so no seek callback
+        archive_read_support_format_zip_streamable(m_archive);
+    } else {
+        archive_read_support_filter_all(m_archive);
+        archive_read_support_format_all(m_archive);
+        archive_read_set_seek_callback(m_archive, cb_seek);
+    }
 
     //archive_read_set_open_callback(m_archive, cb_open);
     //archive_read_set_close_callback(m_archive, cb_close);
     archive_read_set_read_callback(m_archive, cb_read);
     archive_read_set_skip_callback(m_archive, cb_skip);
-    archive_read_set_seek_callback(m_archive, cb_seek);
     archive_read_set_callback_data(m_archive, this);
 
     Debug_printv("Calling archive_read_open1");
@@ -141,15 +167,16 @@ void Archive::close() {
     }
 }
 
+void Archive::setPlacement(BufferPool::Placement placement) {
+    m_placement = placement;
+    if (!isOpen())
+        BufferPool::move(m_srcBuffer, placement);
+}
+
 /********************************************************
  * Streams implementations
  ********************************************************/
 
-#if defined(CONFIG_IDF_TARGET_ESP32) && defined(BOARD_HAS_PSRAM)
-int ArchiveMStream::s_rangeUsed = 0;
-esp_himem_rangehandle_t ArchiveMStream::s_range;
-#endif
-
 bool ArchiveMStream::open(std::ios_base::openmode mode) {
     m_mode = mode;
     return m_archive->open(mode);
@@ -158,21 +185,16 @@ bool ArchiveMStream::open(std::ios_base::openmode mode) {
 void ArchiveMStream::close() {
     m_archive->close();
 
-    if (m_haveData > 0) {
-        if (m_dirty) {
-            m_dirty = false;
-        }
+    if (m_peakBytes)
+        Debug_printv("peak memory[%u] streamed[%lu]", m_peakBytes, m_streamed);
+    m_peakBytes = 0;
+    m_window.reset();
+    resetStream();
 
-#if defined(CONFIG_IDF_TARGET_ESP32) && defined(BOARD_HAS_PSRAM)
-        ESP_ERROR_CHECK(esp_himem_free(m_data));
-        Debug_printv("HIMEM available after free: %lu ", (uint32_t)esp_himem_get_free_size());
-
-        // if this was the last archive in use then free up the mapped range
-        if (s_rangeUsed > 0) s_rangeUsed--;
-        if (s_rangeUsed == 0) esp_himem_free_map_range(s_range);
-#else
-        delete[] m_data;
-#endif
+    if (m_haveData > 0) {
+        flush();
+        m_dirty = false;
+        m_data.release();
     }
 
     m_haveData = 0;
@@ -183,127 +205,228 @@ bool ArchiveMStream::isOpen() { return m_archive->isOpen(); }
 void ArchiveMStream::readArchiveData() {
     if (m_archive->isOpen() && m_haveData == 0) {
 
-#if defined(CONFIG_IDF_TARGET_ESP32) && defined(BOARD_HAS_PSRAM)
-        // allocate HIMEM memory for archive data (size must be multiple of
-        // ESP_HIMEM_BLKSZ);
-        uint32_t size = (_size / ESP_HIMEM_BLKSZ) * ESP_HIMEM_BLKSZ;
-        if (_size > size) size += ESP_HIMEM_BLKSZ;
-
-        Debug_printv("HIMEM physical size: %lu", (uint32_t)esp_himem_get_phys_size());
-        Debug_printv("HIMEM available before alloc: %lu ", (uint32_t)esp_himem_get_free_size());
-
-        esp_err_t status = esp_himem_alloc(size, &m_data);
-        if (status == ESP_OK)
-            m_haveData = 1;
-        else {
-            Debug_printv("Unable to allocate HIMEM memory: %s", esp_err_to_name(status));
-            m_haveData = -1;
-            return;
-        }
-
-        // if mapped range is not yet created then create it now
-        if (s_rangeUsed == 0) {
-            esp_err_t status =
-                esp_himem_alloc_map_range(ESP_HIMEM_BLKSZ, &s_range);
-            if (status != ESP_OK) {
-                Debug_printv("Unable to allocate mapped range for HIMEM: %s", esp_err_to_name(status));
-                ESP_ERROR_CHECK(esp_himem_free(m_data));
+        // A sequential reader was here first, start the member over
+        if (m_streamed > 0) {
+            Debug_printv("random access at [%lu], decompressing the whole member", _position);
+            std::string filename = entry.filename;
+            uint32_t size = _size;
+            if (!seekEntry(filename)) {
                 m_haveData = -1;
                 return;
             }
+            _size = size;
+
+            if (m_cacheKey)
+                MemberCache::create(m_cacheKey, _size, m_cacheWriter);
         }
 
-        Debug_printv("HIMEM available after alloc : %lu ", (uint32_t)esp_himem_get_free_size());
+        int64_t start = esp_timer_get_time();
 
-        // increment mapped range usage counter
-        s_rangeUsed++;
-#else
-        m_data = new uint8_t[_size];
+        // HIMEM on the ESP32, heap everywhere else
+        if (!m_data.allocate(_size)) {
+            Debug_printv("Unable to allocate %lu bytes for archive data", _size);
+            m_haveData = -1;
+            return;
+        }
         m_haveData = 1;
-#endif
 
         Debug_printv("reading %lu bytes from archive", _size);
         archive *a = m_archive->getArchive();
 
-#if defined(CONFIG_IDF_TARGET_ESP32) && defined(BOARD_HAS_PSRAM)
-        size = _size;
-        uint32_t pageStart = 0;
-        while (size > 0) {
-            
-            uint32_t s = std::min(size, (uint32_t)ESP_HIMEM_BLKSZ);
-
-            uint8_t *ptr;
-            ESP_ERROR_CHECK(esp_himem_map(m_data, s_range, pageStart, 0, ESP_HIMEM_BLKSZ, 0, (void **)&ptr));
-            uint32_t r = archive_read_data(a, ptr, s);
-            ESP_ERROR_CHECK(esp_himem_unmap(s_range, ptr, ESP_HIMEM_BLKSZ));
-            if (archive_errno(a) != ARCHIVE_OK || r != s) {
-                if (archive_errno(a) != ARCHIVE_OK) {
-                    Debug_printv("archive read error %i: %s", archive_errno(a), archive_error_string(a));
-                } else {
-                    Debug_printv(
-                        "expected to read %lu bytes from archive, got %lu", s, r);
+        bool ok = m_data.fill([&](uint8_t *data, uint32_t size) {
+            while (size > 0) {
+                la_ssize_t r = archive_read_data(a, data, size);
+                if (r <= 0) {
+                    if (r < 0)
+                        Debug_printv("archive read error %i: %s", archive_errno(a), archive_error_string(a));
+                    else
+                        Debug_printv("archive data ended %lu bytes early", size);
+                    return false;
                 }
-
-                ESP_ERROR_CHECK(esp_himem_free(m_data));
-                m_haveData = -1;
-                return;
+                cacheWrite(data, r);
+                data += r;
+                size -= r;
             }
+            return true;
+        });
+
+        if (!ok) {
+            m_data.release();
+            m_haveData = -1;
+            return;
+        }
+
+        Debug_printv("decompressed [%lu] bytes in [%lld]us", _size, esp_timer_get_time() - start);
+        m_peakBytes = std::max(m_peakBytes, (size_t)_size);
+        m_window.reset();
+        resetStream();
+    }
+}
+
+void ArchiveMStream::setResidency(bool hot) {
+    MMediaStream::setResidency(hot);
+    m_archive->setPlacement(placement());
+
+    // A view lent out by peekView() is consumed before anything else
+    // touches the broker, so the window can move
+    if (!BufferPool::move(m_window, placement()))
+        Debug_printv("window stays put, no memory");
+}
+
+void ArchiveMStream::resetStream() {
+    m_windowStart = 0;
+    m_streamed = 0;
+    m_cacheWriter.abort();
+}
+
+void ArchiveMStream::cacheWrite(const uint8_t *data, uint32_t size) {
+    if (!m_cacheWriter.isOpen())
+        return;
+
+    if (m_cacheWriter.write(data, size) && m_cacheWriter.complete())
+        MemberCache::commit(m_cacheKey, m_cacheWriter);
+}
+
+// Keep the tail of what went to the reader, the window covers
+// [m_windowStart, m_streamed) afterwards
+void ArchiveMStream::keepWindow(const uint8_t *data, uint32_t size) {
+    if (!m_window)
+        m_window = BufferPool::acquire(ARCHIVE_WINDOW_SIZE, placement());
+    if (!m_window) {
+        m_windowStart = m_streamed;
+        return;
+    }
+
+    uint32_t kept = m_streamed - size - m_windowStart;
+    uint32_t length = std::min(kept + size, (uint32_t)m_window.size());
+    if (size >= length) {
+        memcpy(m_window.data(), data + size - length, length);
+    } else {
+        uint32_t keep = length - size;
+        memmove(m_window.data(), m_window.data() + kept - keep, keep);
+        memcpy(m_window.data() + keep, data, size);
+    }
+    m_windowStart = m_streamed - length;
+    m_peakBytes = std::max(m_peakBytes, m_window.size());
+}
 
-            pageStart += s;
-            size -= s;
+// Decompress the next window full at m_streamed
+bool ArchiveMStream::fillWindow() {
+    if (!m_window)
+        m_window = BufferPool::acquire(ARCHIVE_WINDOW_SIZE, placement());
+    if (!m_window || m_streamed >= _size)
+        return false;
+
+    archive *a = m_archive->getArchive();
+    uint32_t want = std::min((uint32_t)m_window.size(), _size - m_streamed);
+    la_ssize_t r = archive_read_data(a, m_window.data(), want);
+    if (r <= 0) {
+        if (r < 0) {
+            Debug_printv("archive read error %i: %s", archive_errno(a), archive_error_string(a));
+            m_haveData = -1;
         }
-#else
-        uint32_t r = archive_read_data(a, m_data, _size);
-        if (archive_errno(a) != ARCHIVE_OK || r != _size) {
-            if (archive_errno(a) != ARCHIVE_OK) {
+        return false;
+    }
+
+    if (m_streamed == 0)
+        Debug_printv("first byte after [%lld]us", esp_timer_get_time() - m_openedAt);
+
+    cacheWrite(m_window.data(), r);
+    m_windowStart = m_streamed;
+    m_streamed += r;
+    m_peakBytes = std::max(m_peakBytes, m_window.size());
+    return true;
+}
+
+uint32_t ArchiveMStream::streamRead(uint8_t *buf, uint32_t size) {
+    if (_position >= _size) return 0;
+    if (_position + size > _size) size = _size - _position;
+
+    // What a peek or a seek back left in the window first
+    uint32_t numRead = 0;
+    if (_position < m_streamed) {
+        numRead = std::min(size, m_streamed - _position);
+        memcpy(buf, m_window.data() + (_position - m_windowStart), numRead);
+        _position += numRead;
+    }
+
+    // Then straight from the decompressor into the caller's buffer
+    archive *a = m_archive->getArchive();
+    uint32_t copied = numRead;
+    while (numRead < size) {
+        la_ssize_t r = archive_read_data(a, buf + numRead, size - numRead);
+        if (r <= 0) {
+            if (r < 0) {
                 Debug_printv("archive read error %i: %s", archive_errno(a), archive_error_string(a));
-            } else {
-                Debug_printv("expected to read %lu bytes from archive, got %lu", _size, r);
+                m_haveData = -1;
             }
-            delete[] m_data;
-            m_haveData = -1;
-            return;
+            break;
         }
-#endif
+        numRead += r;
     }
+
+    if (numRead > copied) {
+        if (m_streamed == 0)
+            Debug_printv("first byte after [%lld]us", esp_timer_get_time() - m_openedAt);
+
+        m_streamed += numRead - copied;
+        _position = m_streamed;
+        keepWindow(buf + copied, numRead - copied);
+        cacheWrite(buf + copied, numRead - copied);
+    }
+    return numRead;
 }
 
 uint32_t ArchiveMStream::read(uint8_t *buf, uint32_t size) {
+    if (streaming())
+        return streamRead(buf, size);
+
     readArchiveData();
 
     if (m_haveData > 0) {
         // Debug_printv("calling read, buff size=[%ld]", size);
 
-#if defined(CONFIG_IDF_TARGET_ESP32) && defined(BOARD_HAS_PSRAM)
-        if (_position + size > _size) size = _size - _position;
-        uint32_t numRead = 0;
-        while (size > 0) {
-
-            uint32_t pageStart = (_position / ESP_HIMEM_BLKSZ) * ESP_HIMEM_BLKSZ;
-            uint32_t offset = _position - pageStart;
-            uint32_t n = std::min(size, (uint32_t)ESP_HIMEM_BLKSZ - offset);
-
-            uint8_t *ptr;
-            ESP_ERROR_CHECK(esp_himem_map(m_data, s_range, pageStart, 0, ESP_HIMEM_BLKSZ, 0, (void **)&ptr));
-            memcpy(buf + numRead, ptr + offset, n);
-            ESP_ERROR_CHECK(esp_himem_unmap(s_range, ptr, ESP_HIMEM_BLKSZ));
-            size -= n;
-            numRead += n;
-            _position += n;
-        }
-
-        // Debug_printv("read [%lu] bytes", numRead);
+        uint32_t numRead = m_data.read(_position, buf, size);
+        _position += numRead;
         return numRead;
-
-#else
-        memcpy(buf, m_data + _position, size);
-        _position += size;
-        return size;
-#endif
     } else
         return 0;
 }
 
+uint32_t ArchiveMStream::peekView(const uint8_t **view) {
+    *view = nullptr;
+
+    if (streaming()) {
+        if (_position >= _size)
+            return 0;
+        if (_position == m_streamed && !fillWindow())
+            return 0;
+
+        *view = m_window.data() + (_position - m_windowStart);
+        return m_streamed - _position;
+    }
+
+    readArchiveData();
+
+    if (m_haveData <= 0 || _position >= _size)
+        return 0;
+
+    // Up to the end of the bank, the next call maps the next one
+    uint8_t *data;
+    uint32_t length = m_data.view(_position, &data);
+    *view = data;
+    return length;
+}
+
+uint32_t ArchiveMStream::consume(uint32_t size) {
+    // Nothing past the window has been decompressed yet
+    uint32_t end = streaming() ? m_streamed : _size;
+    if (_position >= end) return 0;
+    if (_position + size > end) size = end - _position;
+    _position += size;
+    return size;
+}
+
 uint32_t ArchiveMStream::write(const uint8_t *buf, uint32_t size) {
     readArchiveData();
 
@@ -314,32 +437,18 @@ uint32_t ArchiveMStream::write(const uint8_t *buf, uint32_t size) {
     if (m_haveData > 0) {
         // Debug_printv("calling write, size=[%ld]", size);
 
-        if (_position + size > _size) size = _size - _position;
-        uint32_t numWritten = 0;
-
-#if defined(CONFIG_IDF_TARGET_ESP32) && defined(BOARD_HAS_PSRAM)
-        while (size > 0) {
-            uint32_t pageStart = (_position / ESP_HIMEM_BLKSZ) * ESP_HIMEM_BLKSZ;
-            uint32_t offset = _position - pageStart;
-            uint32_t n = std::min(size, (uint32_t)ESP_HIMEM_BLKSZ - offset);
-
-            uint8_t *ptr;
-            ESP_ERROR_CHECK(esp_himem_map(m_data, s_range, pageStart, 0, ESP_HIMEM_BLKSZ, 0, (void **)&ptr));
-            memcpy(ptr + offset, buf + numWritten, n);
-            ESP_ERROR_CHECK(esp_himem_unmap(s_range, ptr, ESP_HIMEM_BLKSZ));
-            size -= n;
-            numWritten += n;
-            _position += n;
-        }
-#else
-        memcpy(m_data + _position, buf, size);
-        _position += size;
-        numWritten = size;
-#endif
+        uint32_t numWritten = m_data.write(_position, buf, size);
+        _position += numWritten;
 
         // remember that data was written so we can re-zip the archive
         if (numWritten > 0) m_dirty = true;
 
+        // The cached copy is stale now
+        if (numWritten > 0 && m_cacheKey) {
+            MemberCache::remove(m_cacheKey);
+            m_cacheKey = 0;
+        }
+
         // Debug_printv("wrote [%lu] bytes", numWritten);
         return numWritten;
     } else
@@ -347,6 +456,18 @@ uint32_t ArchiveMStream::write(const uint8_t *buf, uint32_t size) {
 }
 
 bool ArchiveMStream::seek(uint32_t pos) {
+    // Back into the window or a short skip ahead keeps streaming, anything
+    // else is random access
+    if (streaming() && pos < _size && pos >= m_windowStart && pos <= m_streamed + ARCHIVE_WINDOW_SIZE) {
+        while (pos > m_streamed) {
+            _position = m_streamed;
+            if (!fillWindow())
+                return false;
+        }
+        _position = pos;
+        return true;
+    }
+
     readArchiveData();
 
     //Debug_printv("pos[%lu]", pos);
@@ -362,11 +483,209 @@ bool ArchiveMStream::seek(uint32_t pos) {
         return false;
 }
 
+void ArchiveMStream::loadZipIndex()
+{
+    if (m_zipChecked)
+        return;
+
+    m_zipChecked = true;
+    if (!mstr::endsWith(containerStream->url, ".zip", false) && !mstr::endsWith(containerStream->url, ".rp9", false))
+        return;
+
+    ZipStreamSource src(containerStream);
+    if (m_zip.load(src))
+        Debug_printv("central directory entries[%d]", m_zip.entries().size());
+    else
+        Debug_printv("no usable central directory, scanning headers");
+}
+
+const ZipIndex::Entry *ArchiveMStream::findZipEntry(std::string &filename)
+{
+    // Same rules as the header scan, file names without their path
+    bool wildcard = (mstr::contains(filename, "*") || mstr::contains(filename, "?"));
+    for (auto &zip_entry : m_zip.entries())
+    {
+        if (zip_entry.isDirectory())
+            continue;
+
+        std::string entryFilename = zip_entry.basename();
+        if (filename == entryFilename)
+            return &zip_entry;
+
+        if (wildcard)
+        {
+            if (filename == "*")
+            {
+                filename = entryFilename;
+                return &zip_entry;
+            }
+            else if (mstr::compare(filename, entryFilename))
+                return &zip_entry;
+        }
+    }
+    return nullptr;
+}
+
+bool ArchiveMStream::openZipEntry(const ZipIndex::Entry &zip_entry)
+{
+    // A stored member followed by a data descriptor has no length in its
+    // local header, the streaming reader can't find where it ends
+    if (zip_entry.method == ZIP_METHOD_STORED && (zip_entry.flags & ZIP_FLAG_DATA_DESCRIPTOR))
+        return false;
+
+    if (!m_archive->openMember(zip_entry.header_offset) || !seekEntry((uint16_t)1))
+        return false;
+
+    if (entry.filename != zip_entry.basename())
+    {
+        Debug_printv("local header[%s] doesn't match central directory[%s]", entry.filename.c_str(), zip_entry.name.c_str());
+        return false;
+    }
+
+    // The local header has no sizes when a data descriptor follows
+    entry.size = zip_entry.size;
+    return true;
+}
+
+// The member's new contents for the repacker
+class BankedSource : public ZipIndex::Source {
+public:
+    BankedSource(BankedBuffer &buffer) : m_buffer(buffer) {};
+
+    uint32_t size() override { return m_buffer.size(); }
+    bool read(uint32_t offset, uint8_t *buf, uint32_t size) override {
+        return m_buffer.read(offset, buf, size) == size;
+    }
+
+private:
+    BankedBuffer &m_buffer;
+};
+
+// Old copies of archives that readers still had open, removed once they
+// let go. FAT frees the clusters of a removed file even while it is open.
+static std::set<std::string> old_archives;
+static std::mutex old_archives_lock;
+
+bool ArchiveMStream::flush()
+{
+    if (!m_dirty || m_haveData <= 0)
+        return true;
+
+    // Closing the streams of the old archive comes back here
+    m_dirty = false;
+    if (writeBack())
+        return true;
+
+    m_dirty = true;
+    return false;
+}
+
+bool ArchiveMStream::writeBack()
+{
+    // Only files we can replace, found in the central directory
+    std::string path = containerStream->info()["path"];
+    if (path.empty() || !m_zip.loaded() || m_zipEntry == nullptr) {
+        Debug_printv("can't write [%s] back, only members of local ZIP files can be changed", entry.filename.c_str());
+        return false;
+    }
+
+    // The copy from the last write back has to be gone before this one
+    // can take its name
+    std::string old = path + ".old";
+    StreamBroker::flushInactiveStreams();
+    {
+        std::lock_guard<std::mutex> guard(old_archives_lock);
+        if (old_archives.count(old)) {
+            Debug_printv("[%s] is still in use, try again later", old.c_str());
+            return false;
+        }
+    }
+
+    int64_t start = esp_timer_get_time();
+    std::string temp = path + ".new";
+    FILE *file = fopen(temp.c_str(), "wb");
+    if (file == nullptr) {
+        Debug_printv("Unable to create [%s]", temp.c_str());
+        return false;
+    }
+
+    ZipStreamSource archive(containerStream);
+    BankedSource data(m_data);
+    ZipRepacker repacker(archive, m_zip);
+    ZipRepacker::FileSink out(file);
+    bool ok = repacker.repack(*m_zipEntry, data, out);
+    ok = (fclose(file) == 0) && ok;
+    if (!ok) {
+        Debug_printv("repacking [%s] failed", containerStream->url.c_str());
+        ::remove(temp.c_str());
+        return false;
+    }
+
+    // FAT can't rename over a file. The old archive stays around until the
+    // new one has its name.
+    containerStream->close();
+    ::remove(old.c_str());
+    if (::rename(path.c_str(), old.c_str()) != 0 || ::rename(temp.c_str(), path.c_str()) != 0) {
+        Debug_printv("Unable to replace [%s]", path.c_str());
+        ::rename(old.c_str(), path.c_str());
+        ::remove(temp.c_str());
+        containerStream->open(std::ios_base::in);
+        return false;
+    }
+
+    // Offsets have moved, cached images of the archive and its members go
+    // and new readers open the new file. Readers that still have the old
+    // one keep reading it, it is removed after they let go.
+    std::string name = m_zipEntry->name;
+    ImageBroker::dispose(containerStream->url, true);
+    {
+        std::lock_guard<std::mutex> guard(old_archives_lock);
+        old_archives.insert(old);
+    }
+    StreamBroker::dispose(containerStream->url, [old]() {
+        ::remove(old.c_str());
+        std::lock_guard<std::mutex> guard(old_archives_lock);
+        old_archives.erase(old);
+    });
+
+    // Later changes go into the new archive
+    m_zip = ZipIndex();
+    m_zipChecked = false;
+    m_zipEntry = nullptr;
+    if (containerStream->open(std::ios_base::in)) {
+        loadZipIndex();
+        for (auto &zip_entry : m_zip.entries()) {
+            if (zip_entry.name == name)
+                m_zipEntry = &zip_entry;
+        }
+    }
+
+    auto &stats = repacker.stats();
+    Debug_printv("wrote [%s] back in [%lld]us copied[%lu] packed[%lu] archive[%lu]", entry.filename.c_str(), esp_timer_get_time() - start, stats.copied, stats.packed, stats.written);
+    return true;
+}
+
 bool ArchiveMStream::seekEntry(std::string filename)
 {
     // Read Directory Entries
     if (filename.size())
     {
+        loadZipIndex();
+        m_zipEntry = nullptr;
+        if (m_zip.loaded())
+        {
+            auto zip_entry = findZipEntry(filename);
+            m_zipEntry = zip_entry;
+            if (zip_entry == nullptr)
+            {
+                entry.filename.clear();
+                return false;
+            }
+
+            if (openZipEntry(*zip_entry))
+                return true;
+        }
+
         m_archive->open( std::ios_base::in );
 
         size_t index = 1;
@@ -418,6 +737,9 @@ bool ArchiveMStream::seekEntry( uint16_t index )
 
     index--;
 
+    // The decompressor moves on to the next member
+    resetStream();
+
     entry.filename.clear();
     entry.size = 0;
 
@@ -453,6 +775,7 @@ bool ArchiveMStream::seekPath(std::string path) {
     Debug_printv("seekPath called for path: %s", path.c_str());
 
     seekCalled = true;
+    m_openedAt = esp_timer_get_time();
 
     entry_index = 0;
 
@@ -461,6 +784,9 @@ bool ArchiveMStream::seekPath(std::string path) {
         _size = entry.size;
         _position = 0;
 
+        if (m_cacheKey)
+            MemberCache::create(m_cacheKey, _size, m_cacheWriter);
+
         Debug_printv("File Size: size[%ld] available[%ld] position[%ld]", _size, available(), _position);
         return true;
     }
@@ -475,6 +801,42 @@ bool ArchiveMStream::seekPath(std::string path) {
  * Files implementations
  ********************************************************/
 
+std::shared_ptr<MStream> ArchiveMFile::getSourceStream(std::ios_base::openmode mode) {
+    // getDecodedStream() doesn't get to see the mode
+    m_openMode = mode;
+    return MFile::getSourceStream(mode);
+}
+
+std::shared_ptr<MStream> ArchiveMFile::getDecodedStream(std::shared_ptr<MStream> is) {
+    Debug_printv("[%s]", url.c_str());
+
+    uint64_t key = memberKey(is);
+    if (key && m_openMode == std::ios_base::in) {
+        auto cached = MemberCacheMStream::obtain(key);
+        if (cached != nullptr)
+            return cached;
+    }
+
+    auto stream = std::make_shared<ArchiveMStream>(is);
+    stream->m_cacheKey = key;
+    return stream;
+}
+
+// The archive's url and version, and the member. Servers send an ETag or
+// Last-Modified, local files have their mtime.
+uint64_t ArchiveMFile::memberKey(std::shared_ptr<MStream> is) {
+    if (pathInStream.empty() || sourceFile == nullptr || !MemberCache::enabled())
+        return 0;
+
+    auto info = is->info();
+    std::string version = info["etag"];
+    if (version.empty()) version = info["last-modified"];
+    if (version.empty()) version = info["mtime"];
+    version += ":" + std::to_string(is->size());
+
+    return MemberCache::key(sourceFile->url, version, pathInStream);
+}
+
 // archive file is always a directory
 bool ArchiveMFile::isDirectory() {
     // Debug_printv("pathInStream[%s]", pathInStream.c_str());
@@ -539,3 +901,50 @@ exit:
     Debug_printv( "END OF DIRECTORY" );
     return nullptr;
 }
+
+bool ArchiveMFile::getNextEntry(DirEntry &entry)
+{
+    bool r = false;
+
+    if (!dirIsOpen)
+        rewindDirectory();
+
+    // Held for the whole listing instead of looked up by url per entry
+    if (dir_image == nullptr)
+        dir_image = ImageBroker::obtain<ArchiveMStream>(sourceFile->url);
+
+    if (dir_image == nullptr)
+        return false;
+
+    // Don't want empty entries, or the ones the filter doesn't want
+    do
+    {
+        r = dir_image->getNextImageEntry();
+        if (!r || dir_image->entry.filename.empty())
+            continue;
+
+        // entry.filename keeps its capacity between entries
+        const std::string &filename = dir_image->entry.filename;
+        size_t dot = filename.find_last_of('.');
+
+        entry.clear();
+        entry.setName(filename.data(), filename.size());
+        if (dot != std::string::npos && dot > 0)
+            entry.setType(filename.data() + dot + 1, filename.size() - dot - 1);
+        if (dir_filter.matches(entry))
+            break;
+    } while (r);
+
+    if (!r)
+    {
+        dirIsOpen = false;
+        dir_image->m_archive->close();
+        dir_image = nullptr;
+        return false;
+    }
+
+    entry.size = dir_image->entry.size;
+    entry.setBlocks(media_block_size);
+
+    return true;
+}
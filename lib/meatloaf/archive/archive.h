@@ -30,11 +30,19 @@
 #include "../../../include/debug.h"
 #include "../meat_media.h"
 #include "../meatloaf.h"
-
+#include "banked_buffer.h"
+#include "buffer_pool.h"
+#include "member_cache.h"
+#include "zip_index.h"
+#include "zip_repack.h"
+
+// Decompressed bytes kept behind a sequential reader, for peekView() and
+// short seeks back. Seeking further back decompresses the whole member.
+#ifndef ARCHIVE_WINDOW_SIZE
 #ifdef BOARD_HAS_PSRAM
-#include <esp_psram.h>
-#ifdef CONFIG_IDF_TARGET_ESP32
-#include <esp32/himem.h>
+#define ARCHIVE_WINDOW_SIZE 8192
+#else
+#define ARCHIVE_WINDOW_SIZE 4096
 #endif
 #endif
 
@@ -42,28 +50,35 @@ class Archive {
    public:
     Archive(std::shared_ptr<MStream> srcStream) {
         m_srcStream = srcStream;
-        m_srcBuffer = nullptr;
         m_archive = nullptr;
         Debug_printv("Archive constructor");
     }
 
     ~Archive() {
         close();
-        if (m_srcBuffer != nullptr) {
-            delete m_srcBuffer;
-        }
         Debug_printv("Archive destructor");
     }
 
     bool open(std::ios_base::openmode mode);
     void close();
 
+    // Open a ZIP right at a member's local header, the next header read
+    // is that member
+    bool openMember(uint32_t offset);
+
     bool isOpen() { return m_archive != nullptr; }
     archive *getArchive() { return m_archive; }
 
+    // libarchive holds on to the source buffer while the archive is open,
+    // so it only moves when closed or at the next open
+    void setPlacement(BufferPool::Placement placement);
+
    private:
+    bool begin(uint32_t offset, bool member);
+
     struct archive *m_archive = nullptr;
-    uint8_t *m_srcBuffer = nullptr;
+    BufferPool::Buffer m_srcBuffer;  // libarchive reads the source through this
+    BufferPool::Placement m_placement = BufferPool::DMA;
     std::shared_ptr<MStream> m_srcStream = nullptr;  // a stream that is able to serve bytes of this archive
 
   static const size_t m_buffSize = 4096;
@@ -114,8 +129,26 @@ class ArchiveMStream : public MMediaStream {
     uint32_t read(uint8_t *buf, uint32_t size) override;
     uint32_t write(const uint8_t *buf, uint32_t size) override;
 
+    // Write changes back without waiting for close, the sector cache can
+    // keep this stream open while listings of the image are around
+    bool flush() override;
+
+    uint32_t peekView(const uint8_t **view) override;
+    uint32_t consume(uint32_t size) override;
+
     virtual bool seek(uint32_t pos) override;
 
+    size_t footprint() override {
+        size_t bytes = sizeof(ArchiveMStream) + m_data.footprint();
+        if (streaming()) bytes += m_window.size();
+        return bytes;
+    }
+
+    // Hot streams keep the source buffer and the window in internal RAM,
+    // cold ones move them to PSRAM. The decompressed member already lives
+    // in PSRAM (or himem) either way.
+    void setResidency(bool hot) override;
+
     bool readHeader() override { return true; };
     bool seekEntry(std::string filename) override;
     bool seekEntry( uint16_t index ) override;
@@ -129,22 +162,49 @@ class ArchiveMStream : public MMediaStream {
    private:
     void readArchiveData();
 
+    // Until something seeks back or writes, the member is decompressed as
+    // it is read and only the window is kept
+    bool streaming() { return m_haveData == 0 && m_archive->isOpen(); }
+    uint32_t streamRead(uint8_t *buf, uint32_t size);
+    bool fillWindow();
+    void keepWindow(const uint8_t *data, uint32_t size);
+    void resetStream();
+    BufferPool::Placement placement() { return is_hot ? BufferPool::DMA : BufferPool::PSRAM; }
+
+    BufferPool::Buffer m_window;
+    uint32_t m_windowStart = 0;     // Member offset of m_window[0]
+    uint32_t m_streamed = 0;        // Decompressed so far, the window ends here
+    int64_t m_openedAt = 0;         // For time to first byte
+    size_t m_peakBytes = 0;
+
+    // Decompressed bytes also go to the member cache, set by ArchiveMFile
+    void cacheWrite(const uint8_t *data, uint32_t size);
+    uint64_t m_cacheKey = 0;
+    MemberCache::Writer m_cacheWriter;
+
+    // ZIP members are found in the central directory instead of by
+    // reading every header in front of them
+    void loadZipIndex();
+    const ZipIndex::Entry *findZipEntry(std::string &filename);
+    bool openZipEntry(const ZipIndex::Entry &zip_entry);
+
+    ZipIndex m_zip;
+    bool m_zipChecked = false;
+    const ZipIndex::Entry *m_zipEntry = nullptr;   // The open member
+
+    // Changed members go back into local ZIP files, the other members are
+    // copied without decompressing them. The stream stays usable for more
+    // changes afterwards.
+    bool writeBack();
+
     Archive *m_archive;
     std::ios_base::openmode m_mode;
 
     int m_haveData;
     bool m_dirty;
 
-#if defined(CONFIG_IDF_TARGET_ESP32) && defined(BOARD_HAS_PSRAM)
-    // contains unzipped contents of archive (in HIMEM)
-    esp_himem_handle_t m_data;
-
-    // memory range mapped to HIMEM
-    static esp_himem_rangehandle_t s_range;
-    static int s_rangeUsed;
-#else
-    uint8_t *m_data;
-#endif
+    // Unzipped contents of the member, in HIMEM on the ESP32
+    BankedBuffer m_data;
 
     friend class ArchiveMFile;
 };
@@ -164,15 +224,13 @@ class ArchiveMFile : public MFile {
         if (m_archive != nullptr) delete m_archive;
     }
 
-    std::shared_ptr<MStream> getDecodedStream(std::shared_ptr<MStream> is) {
-        Debug_printv("[%s]", url.c_str());
-
-        return std::make_shared<ArchiveMStream>(is);
-    }
+    std::shared_ptr<MStream> getSourceStream(std::ios_base::openmode mode=std::ios_base::in) override;
+    std::shared_ptr<MStream> getDecodedStream(std::shared_ptr<MStream> is) override;
 
     bool isDirectory() override;
     bool rewindDirectory() override;
     MFile *getNextFileInDir() override;
+    bool getNextEntry(DirEntry &entry) override;
     bool mkDir() override { return false; };
 
     bool exists() override { return true; };
@@ -185,7 +243,11 @@ class ArchiveMFile : public MFile {
     bool dirIsOpen = false;
 
    private:
+    uint64_t memberKey(std::shared_ptr<MStream> is);
+
     Archive *m_archive = nullptr;
+    std::shared_ptr<ArchiveMStream> dir_image;
+    std::ios_base::openmode m_openMode = std::ios_base::in;
 };
 
 /********************************************************
@@ -195,40 +257,39 @@ class ArchiveMFile : public MFile {
 class ArchiveMFileSystem : public MFileSystem
 {
 public:
-    ArchiveMFileSystem() : MFileSystem("archive") {};
+    ArchiveMFileSystem() : MFileSystem("archive") {
+        extensions = {
+            ".tar.xz",
+            ".tar.bz2",
+            ".tar.gz",
+            ".tar.z",
+            ".tar.lz",
+            ".tar",
+            ".tgz",
+            ".7z",
+            ".bz2",
+            ".gz",
+            ".lha",
+            ".lzh",
+            ".lzx",
+            ".rar",
+            ".xar",
+            ".zip",
+            ".zst",
+            ".iso",
+            ".lz4",
+            ".cpgz",
+            ".cpio",
+            ".rp9",     // Cloanto RetroPlatform Archive (https://www.retroplatform.com/kb/15-122)
+            ".vms"      // Meatloaf Virtual Media Stack!
+            //".arc",  // Have to find a way to distinquish between PC/C64 ARC file
+            //".ark",  // Have to find a way to distinquish between PC/C64 ARK file
+        };
+    };
 
     bool handles(std::string fileName)
     {
-        return byExtension(
-            {
-                ".tar.xz",
-                ".tar.bz2",
-                ".tar.gz",
-                ".tar.z",
-                ".tar.lz",
-                ".tar",
-                ".tgz",
-                ".7z",
-                ".bz2",
-                ".gz",
-                ".lha",
-                ".lzh",
-                ".lzx",
-                ".rar",
-                ".xar",
-                ".zip",
-                ".zst",
-                ".iso",
-                ".lz4",
-                ".cpgz",
-                ".cpio",
-                ".rp9",     // Cloanto RetroPlatform Archive (https://www.retroplatform.com/kb/15-122)
-                ".vms"      // Meatloaf Virtual Media Stack!
-                //".arc",  // Have to find a way to distinquish between PC/C64 ARC file
-                //".ark",  // Have to find a way to distinquish between PC/C64 ARK file
-            },
-            fileName
-        );
+        return byExtension(extensions, fileName);
     }
 
     MFile *getFile(std::string path)
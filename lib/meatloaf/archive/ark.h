@@ -134,10 +134,12 @@ public:
 class ARKMFileSystem: public MFileSystem
 {
 public:
-    ARKMFileSystem(): MFileSystem("ark") {};
+    ARKMFileSystem(): MFileSystem("ark") {
+        extensions = { ".ark" };
+    };
 
     bool handles(std::string fileName) override {
-        return byExtension(".ark", fileName);
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
@@ -122,10 +122,12 @@ public:
 class LBRMFileSystem: public MFileSystem
 {
 public:
-    LBRMFileSystem(): MFileSystem("lbr") {};
+    LBRMFileSystem(): MFileSystem("lbr") {
+        extensions = { ".lbr" };
+    };
 
     bool handles(std::string fileName) override {
-        return byExtension(".lbr", fileName);
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
@@ -0,0 +1,610 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "member_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+
+#include <lz4.h>
+
+#ifndef TEST_NATIVE
+#include "fnFsSD.h"
+
+#include "../../../include/global_defines.h"
+#include "../../../include/debug.h"
+#else
+#define Debug_printv(...)
+#endif
+
+#define MEMBER_CACHE_VERSION 1
+#define MEMBER_CACHE_FLAG_LZ4 0x01
+
+std::vector<MemberCache::Record> MemberCache::records;
+bool MemberCache::loaded = false;
+uint32_t MemberCache::ticks = 0;
+std::string MemberCache::root;
+MemberCache::Stats MemberCache::totals = {};
+std::mutex MemberCache::lock;
+
+
+/********************************************************
+ * Member files
+ ********************************************************/
+
+bool MemberCache::Writer::begin(const std::string &path, uint32_t size)
+{
+    abort();
+
+    m_file = fopen((path + ".new").c_str(), "wb");
+    if ( m_file == nullptr )
+        return false;
+
+    m_path = path;
+    m_size = size;
+    m_written = 0;
+
+    FileHeader header = {};
+    memcpy(header.magic, "MLMC", sizeof(header.magic));
+    header.version = MEMBER_CACHE_VERSION;
+    header.flags = MEMBER_CACHE_LZ4 ? MEMBER_CACHE_FLAG_LZ4 : 0;
+    header.block_size = MEMBER_CACHE_BLOCK_SIZE;
+    header.size = size;
+    header.blocks = (size + MEMBER_CACHE_BLOCK_SIZE - 1) / MEMBER_CACHE_BLOCK_SIZE;
+
+    // The block table is filled in by finish()
+    m_table.clear();
+    if ( header.flags & MEMBER_CACHE_FLAG_LZ4 )
+    {
+        m_table.assign(header.blocks + 1, 0);
+        m_block.reserve(MEMBER_CACHE_BLOCK_SIZE);
+        m_packed.resize(MEMBER_CACHE_BLOCK_SIZE);
+    }
+
+    m_offset = sizeof(header) + m_table.size() * sizeof(uint32_t);
+    if ( fwrite(&header, sizeof(header), 1, m_file) != 1 ||
+         (m_table.size() && fwrite(m_table.data(), sizeof(uint32_t), m_table.size(), m_file) != m_table.size()) )
+    {
+        abort();
+        return false;
+    }
+    return true;
+}
+
+bool MemberCache::Writer::write(const uint8_t *data, uint32_t size)
+{
+    if ( m_file == nullptr )
+        return false;
+
+    if ( m_written + size > m_size )
+    {
+        abort();
+        return false;
+    }
+
+    if ( m_table.empty() )
+    {
+        if ( fwrite(data, 1, size, m_file) != size )
+        {
+            abort();
+            return false;
+        }
+        m_written += size;
+        m_offset += size;
+        return true;
+    }
+
+    while ( size > 0 )
+    {
+        uint32_t n = std::min(size, (uint32_t)(MEMBER_CACHE_BLOCK_SIZE - m_block.size()));
+        m_block.insert(m_block.end(), data, data + n);
+        m_written += n;
+        data += n;
+        size -= n;
+
+        if ( (m_block.size() == MEMBER_CACHE_BLOCK_SIZE || m_written == m_size) && !flushBlock() )
+        {
+            abort();
+            return false;
+        }
+    }
+    return true;
+}
+
+// Blocks that don't get smaller are stored as they are, the reader tells
+// them apart by their length
+bool MemberCache::Writer::flushBlock()
+{
+    uint32_t index = (m_written - 1) / MEMBER_CACHE_BLOCK_SIZE;
+    int packed = LZ4_compress_default((const char *)m_block.data(), (char *)m_packed.data(), m_block.size(), m_block.size() - 1);
+
+    const uint8_t *data = (packed > 0) ? m_packed.data() : m_block.data();
+    uint32_t length = (packed > 0) ? packed : m_block.size();
+    if ( fwrite(data, 1, length, m_file) != length )
+        return false;
+
+    m_table[index] = m_offset;
+    m_offset += length;
+    m_table[index + 1] = m_offset;
+    m_block.clear();
+    return true;
+}
+
+uint32_t MemberCache::Writer::finish()
+{
+    if ( !complete() )
+    {
+        abort();
+        return 0;
+    }
+
+    bool ok = true;
+    if ( m_table.size() )
+    {
+        ok = fseek(m_file, sizeof(FileHeader), SEEK_SET) == 0 &&
+             fwrite(m_table.data(), sizeof(uint32_t), m_table.size(), m_file) == m_table.size();
+    }
+    ok = (fclose(m_file) == 0) && ok;
+    m_file = nullptr;
+
+    std::string temp = m_path + ".new";
+    if ( ok )
+    {
+        ::remove(m_path.c_str());
+        ok = rename(temp.c_str(), m_path.c_str()) == 0;
+    }
+    if ( !ok )
+    {
+        ::remove(temp.c_str());
+        return 0;
+    }
+
+    m_block = std::vector<uint8_t>();
+    m_packed = std::vector<uint8_t>();
+    return m_offset;
+}
+
+void MemberCache::Writer::abort()
+{
+    if ( m_file == nullptr )
+        return;
+
+    fclose(m_file);
+    m_file = nullptr;
+    ::remove((m_path + ".new").c_str());
+    m_block = std::vector<uint8_t>();
+    m_packed = std::vector<uint8_t>();
+}
+
+
+bool MemberCache::Reader::open(const std::string &path)
+{
+    close();
+
+    m_file = fopen(path.c_str(), "rb");
+    if ( m_file == nullptr )
+        return false;
+
+    if ( fread(&m_header, sizeof(m_header), 1, m_file) != 1 ||
+         memcmp(m_header.magic, "MLMC", sizeof(m_header.magic)) != 0 ||
+         m_header.version != MEMBER_CACHE_VERSION ||
+         m_header.block_size == 0 ||
+         m_header.blocks != (m_header.size + m_header.block_size - 1) / m_header.block_size )
+    {
+        close();
+        return false;
+    }
+
+    if ( m_header.flags & MEMBER_CACHE_FLAG_LZ4 )
+    {
+        m_table.resize(m_header.blocks + 1);
+        if ( fread(m_table.data(), sizeof(uint32_t), m_table.size(), m_file) != m_table.size() )
+        {
+            close();
+            return false;
+        }
+        m_packed.resize(m_header.block_size);
+    }
+
+    m_block.resize(m_header.block_size);
+    return true;
+}
+
+void MemberCache::Reader::close()
+{
+    if ( m_file != nullptr )
+        fclose(m_file);
+
+    m_file = nullptr;
+    m_header = {};
+    m_current = UINT32_MAX;
+    m_length = 0;
+    m_table = std::vector<uint32_t>();
+    m_block = std::vector<uint8_t>();
+    m_packed = std::vector<uint8_t>();
+}
+
+bool MemberCache::Reader::loadBlock(uint32_t index)
+{
+    if ( index == m_current )
+        return true;
+
+    m_current = UINT32_MAX;
+    uint32_t length = std::min(m_header.block_size, m_header.size - index * m_header.block_size);
+
+    if ( m_table.empty() )
+    {
+        // Stored as is, right behind the header
+        if ( fseek(m_file, sizeof(FileHeader) + index * m_header.block_size, SEEK_SET) != 0 ||
+             fread(m_block.data(), 1, length, m_file) != length )
+            return false;
+    }
+    else
+    {
+        uint32_t packed = m_table[index + 1] - m_table[index];
+        if ( packed > m_header.block_size || fseek(m_file, m_table[index], SEEK_SET) != 0 )
+            return false;
+
+        uint8_t *target = (packed == length) ? m_block.data() : m_packed.data();
+        if ( fread(target, 1, packed, m_file) != packed )
+            return false;
+
+        if ( packed != length &&
+             LZ4_decompress_safe((const char *)m_packed.data(), (char *)m_block.data(), packed, m_header.block_size) != (int)length )
+            return false;
+    }
+
+    m_current = index;
+    m_length = length;
+    return true;
+}
+
+uint32_t MemberCache::Reader::view(uint32_t offset, const uint8_t **view)
+{
+    *view = nullptr;
+    if ( m_file == nullptr || offset >= m_header.size )
+        return 0;
+
+    uint32_t index = offset / m_header.block_size;
+    if ( !loadBlock(index) )
+        return 0;
+
+    uint32_t start = offset - index * m_header.block_size;
+    *view = m_block.data() + start;
+    return m_length - start;
+}
+
+uint32_t MemberCache::Reader::read(uint32_t offset, uint8_t *buf, uint32_t size)
+{
+    uint32_t done = 0;
+    while ( done < size )
+    {
+        const uint8_t *data;
+        uint32_t n = std::min(view(offset + done, &data), size - done);
+        if ( n == 0 )
+            break;
+
+        memcpy(buf + done, data, n);
+        done += n;
+    }
+    return done;
+}
+
+
+/********************************************************
+ * Index
+ ********************************************************/
+
+// FNV-1a over the three parts, a zero byte between them
+uint64_t MemberCache::key(const std::string &url, const std::string &version, const std::string &member)
+{
+    uint64_t h = 14695981039346656037ull;
+    for ( const std::string *part : { &url, &version, &member } )
+    {
+        for ( uint8_t c : *part )
+            h = (h ^ c) * 1099511628211ull;
+        h *= 1099511628211ull;
+    }
+    return h ? h : 1;
+}
+
+void MemberCache::setRoot(const std::string &path)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    root = path;
+    records.clear();
+    loaded = false;
+    totals = {};
+}
+
+std::string MemberCache::location()
+{
+    if ( root.size() )
+        return root;
+
+#if defined(SD_CARD) && !defined(TEST_NATIVE)
+    // Flash is too small and wears out, the cache is on SD only
+    if ( fnSDFAT.running() )
+        return std::string(fnSDFAT.basepath()) + SYSTEM_DIR "/members";
+#endif
+    return "";
+}
+
+bool MemberCache::enabled()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return location().size();
+}
+
+std::string MemberCache::path(uint64_t key)
+{
+    char name[24];
+    snprintf(name, sizeof(name), "/%08x%08x.mc", (uint32_t)(key >> 32), (uint32_t)key);
+    return location() + name;
+}
+
+void MemberCache::load()
+{
+    if ( loaded )
+        return;
+
+    loaded = true;
+    records.clear();
+    totals.members = 0;
+    totals.bytes = 0;
+
+    std::string base = location();
+    if ( base.empty() )
+        return;
+
+    mkdir(base.c_str(), 0755);
+
+    FILE *file = fopen((base + "/members.idx").c_str(), "rb");
+    if ( file == nullptr )
+        return;
+
+    IndexHeader header;
+    if ( fread(&header, sizeof(header), 1, file) == 1 &&
+         memcmp(header.magic, "MLMI", sizeof(header.magic)) == 0 &&
+         header.version == MEMBER_CACHE_VERSION )
+    {
+        records.resize(header.count);
+        if ( fread(records.data(), sizeof(Record), records.size(), file) != records.size() )
+            records.clear();
+        ticks = header.ticks;
+    }
+    fclose(file);
+
+    for ( auto &r : records )
+        totals.bytes += r.bytes;
+    totals.members = records.size();
+}
+
+void MemberCache::save()
+{
+    std::string base = location();
+    if ( base.empty() )
+        return;
+
+    std::string temp = base + "/members.idx.new";
+    FILE *file = fopen(temp.c_str(), "wb");
+    if ( file == nullptr )
+        return;
+
+    IndexHeader header = {};
+    memcpy(header.magic, "MLMI", sizeof(header.magic));
+    header.version = MEMBER_CACHE_VERSION;
+    header.count = records.size();
+    header.ticks = ticks;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              (records.empty() || fwrite(records.data(), sizeof(Record), records.size(), file) == records.size());
+    ok = (fclose(file) == 0) && ok;
+
+    std::string index = base + "/members.idx";
+    if ( ok )
+    {
+        ::remove(index.c_str());
+        ok = rename(temp.c_str(), index.c_str()) == 0;
+    }
+    if ( !ok )
+        ::remove(temp.c_str());
+}
+
+MemberCache::Record *MemberCache::find(uint64_t key)
+{
+    for ( auto &r : records )
+    {
+        if ( r.key == key )
+            return &r;
+    }
+    return nullptr;
+}
+
+// Least recently used members go until the rest fits, keep is the one
+// that was just added
+void MemberCache::evict(uint64_t keep)
+{
+    while ( totals.bytes > MEMBER_CACHE_MAX_SIZE )
+    {
+        auto victim = records.end();
+        for ( auto r = records.begin(); r != records.end(); ++r )
+        {
+            if ( r->key != keep && (victim == records.end() || r->used < victim->used) )
+                victim = r;
+        }
+        if ( victim == records.end() )
+            break;
+
+        Debug_printv("evict key[%016llx] bytes[%lu]", victim->key, victim->bytes);
+        ::remove(path(victim->key).c_str());
+        totals.bytes -= victim->bytes;
+        totals.evicted++;
+        records.erase(victim);
+    }
+    totals.members = records.size();
+}
+
+bool MemberCache::open(uint64_t key, Reader &reader)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    load();
+
+    Record *r = find(key);
+    if ( r == nullptr || !reader.open(path(key)) )
+    {
+        // Gone from the card behind our back
+        if ( r != nullptr )
+        {
+            totals.bytes -= r->bytes;
+            records.erase(records.begin() + (r - records.data()));
+            totals.members = records.size();
+            save();
+        }
+        totals.misses++;
+        return false;
+    }
+
+    r->used = ++ticks;
+    totals.hits++;
+    save();
+    return true;
+}
+
+bool MemberCache::create(uint64_t key, uint32_t size, Writer &writer)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    load();
+
+    if ( location().empty() || size > MEMBER_CACHE_MAX_SIZE )
+        return false;
+
+    return writer.begin(path(key), size);
+}
+
+bool MemberCache::commit(uint64_t key, Writer &writer)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    load();
+
+    uint32_t bytes = writer.finish();
+    if ( bytes == 0 )
+        return false;
+
+    Record *r = find(key);
+    if ( r != nullptr )
+    {
+        totals.bytes -= r->bytes;
+        r->bytes = bytes;
+        r->used = ++ticks;
+    }
+    else
+    {
+        records.push_back({ key, bytes, ++ticks });
+    }
+    totals.bytes += bytes;
+    totals.stored++;
+
+    evict(key);
+    save();
+
+    Debug_printv("stored key[%016llx] bytes[%lu] members[%lu] total[%lu]", key, bytes, totals.members, totals.bytes);
+    return true;
+}
+
+void MemberCache::remove(uint64_t key)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    load();
+
+    Record *r = find(key);
+    if ( r == nullptr )
+        return;
+
+    ::remove(path(key).c_str());
+    totals.bytes -= r->bytes;
+    records.erase(records.begin() + (r - records.data()));
+    totals.members = records.size();
+    save();
+}
+
+MemberCache::Stats MemberCache::stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    load();
+    return totals;
+}
+
+
+/********************************************************
+ * Stream
+ ********************************************************/
+
+#ifndef TEST_NATIVE
+std::shared_ptr<MStream> MemberCacheMStream::obtain(uint64_t key)
+{
+    auto stream = std::make_shared<MemberCacheMStream>(key);
+    if ( !stream->open(std::ios_base::in) )
+        return nullptr;
+
+    return stream;
+}
+
+bool MemberCacheMStream::open(std::ios_base::openmode mode)
+{
+    if ( mode & std::ios_base::out )
+        return false;
+
+    if ( !MemberCache::open(m_key, m_reader) )
+        return false;
+
+    _size = m_reader.size();
+    _position = 0;
+    Debug_printv("cached member key[%016llx] size[%lu]", m_key, _size);
+    return true;
+}
+
+uint32_t MemberCacheMStream::read(uint8_t *buf, uint32_t size)
+{
+    uint32_t bytesRead = m_reader.read(_position, buf, size);
+    _position += bytesRead;
+    return bytesRead;
+}
+
+uint32_t MemberCacheMStream::peekView(const uint8_t **view)
+{
+    return m_reader.view(_position, view);
+}
+
+uint32_t MemberCacheMStream::consume(uint32_t size)
+{
+    if ( _position >= _size ) return 0;
+    if ( _position + size > _size ) size = _size - _position;
+    _position += size;
+    return size;
+}
+
+bool MemberCacheMStream::seek(uint32_t pos)
+{
+    if ( pos > _size )
+        return false;
+
+    _position = pos;
+    return true;
+}
+#endif
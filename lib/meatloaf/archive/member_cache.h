@@ -0,0 +1,228 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// Decompressed archive members on SD
+//
+// Mounting a D64 from a remote ZIP downloads and inflates it every time.
+// The first time a member is read all the way through it is also written
+// to SYSTEM_DIR/members, named by a hash of the archive url, its version
+// (ETag, Last-Modified or mtime, and size) and the member path.
+// ArchiveMFile looks there before it opens the archive. An archive that
+// changes gets new keys and its old members age out.
+//
+// Members are stored in blocks, LZ4 compressed with MEMBER_CACHE_LZ4, so
+// a cached disk image is still random access. members.idx lists every
+// member with its size on the card and when it was last used, past
+// MEMBER_CACHE_MAX_SIZE the least recently used ones are removed.
+//
+
+#ifndef MEATLOAF_ARCHIVE_MEMBER_CACHE
+#define MEATLOAF_ARCHIVE_MEMBER_CACHE
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Space on the card for cached members
+#ifndef MEMBER_CACHE_MAX_SIZE
+#define MEMBER_CACHE_MAX_SIZE (64 * 1024 * 1024)
+#endif
+
+// Store members LZ4 compressed, 0 writes them as they are
+#ifndef MEMBER_CACHE_LZ4
+#define MEMBER_CACHE_LZ4 1
+#endif
+
+// Unit of compression and of reads from a cached member
+#ifndef MEMBER_CACHE_BLOCK_SIZE
+#ifdef BOARD_HAS_PSRAM
+#define MEMBER_CACHE_BLOCK_SIZE 8192
+#else
+#define MEMBER_CACHE_BLOCK_SIZE 4096
+#endif
+#endif
+
+class MemberCache {
+private:
+    // Member file, followed by the offsets of the blocks when they are
+    // compressed, then the blocks
+    struct FileHeader {
+        char magic[4];
+        uint16_t version;
+        uint8_t flags;
+        uint8_t reserved;
+        uint32_t block_size;
+        uint32_t size;          // Decompressed
+        uint32_t blocks;
+    };
+
+public:
+    struct Stats {
+        uint32_t members;
+        uint32_t bytes;         // On the card
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t stored;
+        uint32_t evicted;
+    };
+
+    // Member file, written front to back as the archive is read
+    class Writer {
+    public:
+        ~Writer() { abort(); };
+
+        bool begin(const std::string &path, uint32_t size);
+        bool write(const uint8_t *data, uint32_t size);
+        bool isOpen() const { return m_file != nullptr; };
+        bool complete() const { return m_file && m_written == m_size; };
+
+        // Close and move into place, bytes on the card or 0
+        uint32_t finish();
+        void abort();
+
+    private:
+        bool flushBlock();
+
+        FILE *m_file = nullptr;
+        std::string m_path;
+        uint32_t m_size = 0;
+        uint32_t m_written = 0;
+        uint32_t m_offset = 0;      // End of the file
+        std::vector<uint32_t> m_table;
+        std::vector<uint8_t> m_block;
+        std::vector<uint8_t> m_packed;
+    };
+
+    // Random access to a member file, one block at a time
+    class Reader {
+    public:
+        ~Reader() { close(); };
+
+        bool open(const std::string &path);
+        void close();
+        bool isOpen() const { return m_file != nullptr; };
+        uint32_t size() const { return m_header.size; };
+
+        uint32_t read(uint32_t offset, uint8_t *buf, uint32_t size);
+
+        // The rest of the block holding offset, valid until the next call
+        uint32_t view(uint32_t offset, const uint8_t **view);
+
+    private:
+        bool loadBlock(uint32_t index);
+
+        FILE *m_file = nullptr;
+        FileHeader m_header = {};
+        uint32_t m_current = UINT32_MAX;
+        uint32_t m_length = 0;
+        std::vector<uint32_t> m_table;
+        std::vector<uint8_t> m_block;
+        std::vector<uint8_t> m_packed;
+    };
+
+    // Cache key of a member, version tells archive revisions apart
+    static uint64_t key(const std::string &url, const std::string &version, const std::string &member);
+
+    static bool enabled();
+
+    // Open a cached member, false on a miss
+    static bool open(uint64_t key, Reader &reader);
+
+    // Start writing a member that isn't cached, then commit() it once all
+    // of it was written
+    static bool create(uint64_t key, uint32_t size, Writer &writer);
+    static bool commit(uint64_t key, Writer &writer);
+
+    // Drop a member, its archive copy was changed
+    static void remove(uint64_t key);
+
+    static Stats stats();
+
+    // Directory for the cache, the SD card by default
+    static void setRoot(const std::string &root);
+
+private:
+    struct Record {
+        uint64_t key;
+        uint32_t bytes;
+        uint32_t used;
+    };
+
+    struct IndexHeader {
+        char magic[4];
+        uint16_t version;
+        uint16_t reserved;
+        uint32_t count;
+        uint32_t ticks;
+    };
+
+    static std::string location();
+    static std::string path(uint64_t key);
+    static void load();
+    static void save();
+    static Record *find(uint64_t key);
+    static void evict(uint64_t keep);
+
+    static std::vector<Record> records;
+    static bool loaded;
+    static uint32_t ticks;     // Last use, counts up
+    static std::string root;
+    static Stats totals;
+    static std::mutex lock;
+};
+
+#ifndef TEST_NATIVE
+#include <memory>
+
+#include "../meatloaf.h"
+
+// Cached member, handed out by ArchiveMFile instead of the archive stream
+class MemberCacheMStream : public MStream {
+public:
+    MemberCacheMStream(uint64_t key) : m_key(key) {};
+    ~MemberCacheMStream() { close(); };
+
+    // Opened if the member is cached, nullptr otherwise
+    static std::shared_ptr<MStream> obtain(uint64_t key);
+
+protected:
+    bool isOpen() override { return m_reader.isOpen(); };
+    bool isRandomAccess() override { return true; };
+
+    bool open(std::ios_base::openmode mode) override;
+    void close() override { m_reader.close(); };
+
+    uint32_t read(uint8_t *buf, uint32_t size) override;
+    uint32_t write(const uint8_t *buf, uint32_t size) override { return 0; };
+
+    uint32_t peekView(const uint8_t **view) override;
+    uint32_t consume(uint32_t size) override;
+
+    bool seek(uint32_t pos) override;
+
+    // Already positioned on the member
+    bool seekPath(std::string path) override { return isOpen(); };
+
+private:
+    uint64_t m_key;
+    MemberCache::Reader m_reader;
+};
+#endif
+
+#endif // MEATLOAF_ARCHIVE_MEMBER_CACHE
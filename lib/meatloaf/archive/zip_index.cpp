@@ -0,0 +1,211 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "zip_index.h"
+
+#include <algorithm>
+
+#ifndef TEST_NATIVE
+#include "../meatloaf.h"
+#endif
+
+static inline uint16_t le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// End of central directory record in tail, searched from the back. The
+// comment length has to reach exactly to the end of the file.
+static bool findEnd(const std::vector<uint8_t> &tail, uint32_t &end)
+{
+    if (tail.size() < ZIP_END_SIZE)
+        return false;
+
+    for (int32_t i = tail.size() - ZIP_END_SIZE; i >= 0; i--)
+    {
+        const uint8_t *p = tail.data() + i;
+        if (le32(p) == ZIP_END_SIGNATURE && (uint32_t)i + ZIP_END_SIZE + le16(p + 20) == tail.size())
+        {
+            end = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ZipIndex::load(Source &src)
+{
+    m_loaded = false;
+    m_entries.clear();
+
+    uint32_t size = src.size();
+    if (size < ZIP_END_SIZE)
+        return false;
+
+    // Usually the record is the last thing in the file, a long comment
+    // behind it takes a second read
+    std::vector<uint8_t> tail;
+    uint32_t end = 0;
+    bool found = false;
+    for (uint32_t want : { (uint32_t)ZIP_TAIL_SIZE, (uint32_t)(ZIP_END_SIZE + 0xFFFF) })
+    {
+        uint32_t tail_size = std::min(size, want);
+        if (tail_size <= tail.size())
+            break;
+
+        tail.resize(tail_size);
+        if (!src.read(size - tail_size, tail.data(), tail_size))
+            return false;
+
+        found = findEnd(tail, end);
+        if (found)
+            break;
+    }
+    if (!found)
+        return false;
+
+    const uint8_t *record = tail.data() + end;
+    uint16_t disk = le16(record + 4);
+    uint16_t directory_disk = le16(record + 6);
+    uint16_t count = le16(record + 10);
+    uint32_t directory_size = le32(record + 12);
+    uint32_t directory_offset = le32(record + 16);
+
+    // Spanned archives and ZIP64 are not indexed
+    if (disk || directory_disk || count == 0xFFFF || directory_offset == 0xFFFFFFFF)
+        return false;
+
+    uint32_t tail_start = size - tail.size();
+    if (directory_size > ZIP_INDEX_MAX_SIZE || directory_offset + directory_size > tail_start + end)
+        return false;
+
+    m_directory_offset = directory_offset;
+    m_directory_size = directory_size;
+    m_end_offset = tail_start + end;
+
+    // Small directories were part of the tail
+    if (directory_offset >= tail_start)
+        return parse(tail.data() + (directory_offset - tail_start), directory_size, count);
+
+    std::vector<uint8_t> directory(directory_size);
+    if (!src.read(directory_offset, directory.data(), directory_size))
+        return false;
+
+    return parse(directory.data(), directory_size, count);
+}
+
+bool ZipIndex::parse(const uint8_t *directory, uint32_t size, uint16_t count)
+{
+    m_loaded = false;
+    m_entries.clear();
+    m_entries.reserve(count);
+
+    const uint8_t *p = directory;
+    const uint8_t *end = directory + size;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        if (p + ZIP_CENTRAL_HEADER_SIZE > end || le32(p) != ZIP_CENTRAL_SIGNATURE)
+            return false;
+
+        uint16_t name_size = le16(p + 28);
+        uint16_t extra_size = le16(p + 30);
+        uint16_t comment_size = le16(p + 32);
+        const uint8_t *next = p + ZIP_CENTRAL_HEADER_SIZE + name_size + extra_size + comment_size;
+        if (next > end)
+            return false;
+
+        Entry entry;
+        entry.flags = le16(p + 8);
+        entry.method = le16(p + 10);
+        entry.time = le16(p + 12);
+        entry.date = le16(p + 14);
+        entry.crc = le32(p + 16);
+        entry.compressed_size = le32(p + 20);
+        entry.size = le32(p + 24);
+        entry.header_offset = le32(p + 42);
+        entry.record_offset = p - directory;
+        entry.name.assign((const char *)p + ZIP_CENTRAL_HEADER_SIZE, name_size);
+
+        // Sizes and offsets live in the ZIP64 extra field
+        if (entry.size == 0xFFFFFFFF || entry.compressed_size == 0xFFFFFFFF || entry.header_offset == 0xFFFFFFFF)
+            return false;
+
+        m_entries.push_back(std::move(entry));
+        p = next;
+    }
+
+    m_loaded = true;
+    return true;
+}
+
+const ZipIndex::Entry *ZipIndex::find(const std::string &name) const
+{
+    for (auto &entry : m_entries)
+    {
+        if (entry.name == name)
+            return &entry;
+    }
+
+    // Listings only show the file name
+    for (auto &entry : m_entries)
+    {
+        if (!entry.isDirectory() && entry.basename() == name)
+            return &entry;
+    }
+    return nullptr;
+}
+
+bool ZipIndex::dataOffset(Source &src, const Entry &entry, uint32_t &offset) const
+{
+    uint8_t header[ZIP_LOCAL_HEADER_SIZE];
+    if (!src.read(entry.header_offset, header, sizeof(header)) || le32(header) != ZIP_LOCAL_SIGNATURE)
+        return false;
+
+    // Local name and extra field can differ from the central directory
+    offset = entry.header_offset + ZIP_LOCAL_HEADER_SIZE + le16(header + 26) + le16(header + 28);
+    return true;
+}
+
+
+#ifndef TEST_NATIVE
+uint32_t ZipStreamSource::size()
+{
+    return m_stream->size();
+}
+
+bool ZipStreamSource::read(uint32_t offset, uint8_t *buf, uint32_t size)
+{
+    if (!m_stream->seek(offset))
+        return false;
+
+    // Network streams hand out what has arrived so far
+    while (size > 0)
+    {
+        uint32_t bytes = m_stream->read(buf, size);
+        if (bytes == 0)
+            return false;
+        buf += bytes;
+        size -= bytes;
+    }
+    return true;
+}
+#endif
@@ -0,0 +1,138 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// ZIP central directory index
+//
+// A ZIP lists all its members at the end of the file. Reading the end of
+// central directory record and the directory itself gives name, sizes,
+// method and local header offset of every member, so one member can be
+// opened without reading the ones in front of it. Over HTTP that is a
+// range read for the tail, maybe one for the directory, then the member.
+//
+// https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT
+//
+
+#ifndef MEATLOAF_ARCHIVE_ZIP_INDEX
+#define MEATLOAF_ARCHIVE_ZIP_INDEX
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Bytes read from the end of the file to find the end of central directory
+// record. Small directories come along in the same read.
+#ifndef ZIP_TAIL_SIZE
+#define ZIP_TAIL_SIZE 1024
+#endif
+
+// Larger central directories are left to libarchive
+#ifndef ZIP_INDEX_MAX_SIZE
+#ifdef BOARD_HAS_PSRAM
+#define ZIP_INDEX_MAX_SIZE (1024 * 1024)
+#else
+#define ZIP_INDEX_MAX_SIZE (64 * 1024)
+#endif
+#endif
+
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_SIZE 22
+
+#define ZIP_LOCAL_SIGNATURE   0x04034b50
+#define ZIP_CENTRAL_SIGNATURE 0x02014b50
+#define ZIP_END_SIGNATURE     0x06054b50
+
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATED 8
+
+#define ZIP_FLAG_ENCRYPTED 0x0001
+#define ZIP_FLAG_DATA_DESCRIPTOR 0x0008
+
+class ZipIndex {
+public:
+    struct Entry {
+        std::string name;           // Path inside the archive
+        uint32_t size;
+        uint32_t compressed_size;
+        uint32_t crc;
+        uint32_t header_offset;     // Local file header
+        uint32_t record_offset;     // Central directory record, from the directory start
+        uint16_t method;
+        uint16_t flags;
+        uint16_t time;
+        uint16_t date;
+
+        bool isDirectory() const { return !name.empty() && name.back() == '/'; }
+        std::string basename() const { return name.substr(name.find_last_of('/') + 1); }
+    };
+
+    // Random access to the archive, an MStream on the device
+    class Source {
+    public:
+        virtual ~Source() {};
+        virtual uint32_t size() = 0;
+        virtual bool read(uint32_t offset, uint8_t *buf, uint32_t size) = 0;
+    };
+
+    // Read the central directory. False if this isn't a ZIP the index can
+    // handle (ZIP64, spanned, directory too big), libarchive still can.
+    bool load(Source &src);
+
+    bool loaded() const { return m_loaded; }
+    const std::vector<Entry> &entries() const { return m_entries; }
+    uint32_t directoryOffset() const { return m_directory_offset; }
+    uint32_t directorySize() const { return m_directory_size; }
+
+    // End of central directory record, the comment follows it
+    uint32_t endOffset() const { return m_end_offset; }
+
+    // Member by path or by file name only, nullptr if there is none
+    const Entry *find(const std::string &name) const;
+
+    // Offset of the member's data behind its local header
+    bool dataOffset(Source &src, const Entry &entry, uint32_t &offset) const;
+
+    // Central directory from memory, for load() and the tests
+    bool parse(const uint8_t *directory, uint32_t size, uint16_t count);
+
+private:
+    std::vector<Entry> m_entries;
+    uint32_t m_directory_offset = 0;
+    uint32_t m_directory_size = 0;
+    uint32_t m_end_offset = 0;
+    bool m_loaded = false;
+};
+
+#ifndef TEST_NATIVE
+#include <memory>
+
+class MStream;
+
+// Source for a container stream
+class ZipStreamSource : public ZipIndex::Source {
+public:
+    ZipStreamSource(std::shared_ptr<MStream> stream) : m_stream(stream) {};
+
+    uint32_t size() override;
+    bool read(uint32_t offset, uint8_t *buf, uint32_t size) override;
+
+private:
+    std::shared_ptr<MStream> m_stream;
+};
+#endif
+
+#endif // MEATLOAF_ARCHIVE_ZIP_INDEX
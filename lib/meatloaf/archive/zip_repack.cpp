@@ -0,0 +1,256 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "zip_repack.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <zlib.h>
+
+#ifndef TEST_NATIVE
+#include "../../../include/debug.h"
+#else
+#define Debug_printv(...)
+#endif
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void set16(uint8_t *p, uint16_t x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+}
+
+static inline void set32(uint8_t *p, uint32_t x)
+{
+    set16(p, x);
+    set16(p + 2, x >> 16);
+}
+
+bool ZipRepacker::repack(const ZipIndex::Entry &member, ZipIndex::Source &data, Sink &out)
+{
+    m_stats = { 0, 0, 0 };
+
+    // Encrypted members would need the password
+    if (!m_index.loaded() || (member.flags & ZIP_FLAG_ENCRYPTED))
+        return false;
+
+    // The member with its data descriptor ends where the next member or
+    // the directory starts
+    uint32_t start = member.header_offset;
+    uint32_t end = m_index.directoryOffset();
+    for (auto &entry : m_index.entries())
+    {
+        if (entry.header_offset > start && entry.header_offset < end)
+            end = entry.header_offset;
+    }
+
+    uint8_t header[ZIP_LOCAL_HEADER_SIZE];
+    if (!m_archive.read(start, header, sizeof(header)) || get32(header) != ZIP_LOCAL_SIGNATURE)
+        return false;
+
+    // Name and extra field stay as they were
+    std::vector<uint8_t> local(ZIP_LOCAL_HEADER_SIZE + get16(header + 26) + get16(header + 28));
+    if (start + local.size() > end || !m_archive.read(start, local.data(), local.size()))
+        return false;
+
+    // Members in front of this one don't move
+    if (!copy(0, start, out) || out.position() != start)
+        return false;
+
+    // Sizes are known in advance now, no data descriptor
+    uint16_t method = (member.method == ZIP_METHOD_STORED) ? ZIP_METHOD_STORED : ZIP_METHOD_DEFLATED;
+    uint16_t flags = member.flags & ~ZIP_FLAG_DATA_DESCRIPTOR;
+    uint16_t version = std::max(get16(local.data() + 4), (uint16_t)20);
+    set16(local.data() + 4, version);
+    set16(local.data() + 6, flags);
+    set16(local.data() + 8, method);
+    std::fill(local.begin() + 14, local.begin() + 26, 0);
+    if (!out.write(local.data(), local.size()))
+        return false;
+
+    uint32_t crc = 0;
+    uint32_t packed = 0;
+    bool ok = (method == ZIP_METHOD_STORED) ? store(data, out, crc, packed) : pack(data, out, crc, packed);
+    if (!ok)
+        return false;
+
+    set32(local.data() + 14, crc);
+    set32(local.data() + 18, packed);
+    set32(local.data() + 22, data.size());
+    if (!out.patch(start + 14, local.data() + 14, 12))
+        return false;
+    m_stats.packed = packed;
+
+    // Members behind it move by the difference, offsets wrap like the
+    // 32 bit fields do
+    uint32_t shift = out.position() - end;
+    if (!copy(end, m_index.directoryOffset() - end, out))
+        return false;
+
+    std::vector<uint8_t> directory(m_index.directorySize());
+    if (!m_archive.read(m_index.directoryOffset(), directory.data(), directory.size()))
+        return false;
+
+    for (auto &entry : m_index.entries())
+    {
+        uint8_t *record = directory.data() + entry.record_offset;
+        if (entry.header_offset == start)
+        {
+            set16(record + 6, std::max(get16(record + 6), (uint16_t)20));
+            set16(record + 8, flags);
+            set16(record + 10, method);
+            set32(record + 16, crc);
+            set32(record + 20, packed);
+            set32(record + 24, data.size());
+        }
+        else if (entry.header_offset > start)
+        {
+            set32(record + 42, entry.header_offset + shift);
+        }
+    }
+
+    uint32_t directory_offset = out.position();
+    if (!out.write(directory.data(), directory.size()))
+        return false;
+
+    // End record and comment, pointing at the new directory
+    std::vector<uint8_t> tail(m_archive.size() - m_index.endOffset());
+    if (!m_archive.read(m_index.endOffset(), tail.data(), tail.size()))
+        return false;
+
+    set32(tail.data() + 16, directory_offset);
+    if (!out.write(tail.data(), tail.size()))
+        return false;
+
+    m_stats.copied += directory.size() + tail.size();
+    m_stats.written = out.position();
+    Debug_printv("member[%s] copied[%lu] packed[%lu] written[%lu]", member.name.c_str(), m_stats.copied, m_stats.packed, m_stats.written);
+    return true;
+}
+
+bool ZipRepacker::copy(uint32_t offset, uint32_t size, Sink &out)
+{
+    std::vector<uint8_t> buffer(std::min(size, (uint32_t)ZIP_REPACK_BUFFER_SIZE));
+    while (size > 0)
+    {
+        uint32_t n = std::min(size, (uint32_t)buffer.size());
+        if (!m_archive.read(offset, buffer.data(), n) || !out.write(buffer.data(), n))
+            return false;
+
+        offset += n;
+        size -= n;
+        m_stats.copied += n;
+    }
+    return true;
+}
+
+bool ZipRepacker::store(ZipIndex::Source &data, Sink &out, uint32_t &crc, uint32_t &packed)
+{
+    std::vector<uint8_t> buffer(ZIP_REPACK_BUFFER_SIZE);
+    uint32_t size = data.size();
+    for (uint32_t offset = 0; offset < size; )
+    {
+        uint32_t n = std::min(size - offset, (uint32_t)buffer.size());
+        if (!data.read(offset, buffer.data(), n) || !out.write(buffer.data(), n))
+            return false;
+
+        crc = crc32(crc, buffer.data(), n);
+        offset += n;
+    }
+    packed = size;
+    return true;
+}
+
+bool ZipRepacker::pack(ZipIndex::Source &data, Sink &out, uint32_t &crc, uint32_t &packed)
+{
+    // Raw deflate, the ZIP headers take the place of zlib's
+    z_stream z = {};
+    int status = deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -ZIP_REPACK_WINDOW_BITS, ZIP_REPACK_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (status != Z_OK)
+    {
+        Debug_printv("deflateInit2 failed: %d", status);
+        return false;
+    }
+
+    std::vector<uint8_t> input(ZIP_REPACK_BUFFER_SIZE);
+    std::vector<uint8_t> output(ZIP_REPACK_BUFFER_SIZE);
+    uint32_t size = data.size();
+    uint32_t offset = 0;
+    int flush;
+    bool ok = true;
+    do
+    {
+        uint32_t n = std::min(size - offset, (uint32_t)input.size());
+        if (!data.read(offset, input.data(), n))
+        {
+            ok = false;
+            break;
+        }
+        crc = crc32(crc, input.data(), n);
+        offset += n;
+        flush = (offset == size) ? Z_FINISH : Z_NO_FLUSH;
+
+        z.next_in = input.data();
+        z.avail_in = n;
+        do
+        {
+            z.next_out = output.data();
+            z.avail_out = output.size();
+            if (::deflate(&z, flush) == Z_STREAM_ERROR)
+            {
+                ok = false;
+                break;
+            }
+
+            uint32_t have = output.size() - z.avail_out;
+            if (have > 0 && !out.write(output.data(), have))
+                ok = false;
+            packed += have;
+        } while (ok && z.avail_out == 0);
+    } while (ok && flush != Z_FINISH);
+
+    deflateEnd(&z);
+    return ok;
+}
+
+
+uint32_t ZipRepacker::FileSink::position()
+{
+    return ftell(m_file);
+}
+
+bool ZipRepacker::FileSink::write(const uint8_t *buf, uint32_t size)
+{
+    return fwrite(buf, 1, size, m_file) == size;
+}
+
+bool ZipRepacker::FileSink::patch(uint32_t offset, const uint8_t *buf, uint32_t size)
+{
+    long here = ftell(m_file);
+    bool ok = fseek(m_file, offset, SEEK_SET) == 0 && fwrite(buf, 1, size, m_file) == size;
+    return fseek(m_file, here, SEEK_SET) == 0 && ok;
+}
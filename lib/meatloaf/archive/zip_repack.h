@@ -0,0 +1,103 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// ZIP repacking
+//
+// Writes an archive with one member replaced. Everything in front of the
+// member and behind it is copied as it is, compressed data, data
+// descriptors and all. Only the new contents are compressed, then the
+// central directory is copied with the local header offsets behind the
+// member moved. Saving a disk image in a large ZIP costs about the size of
+// the image instead of recompressing every member.
+//
+
+#ifndef MEATLOAF_ARCHIVE_ZIP_REPACK
+#define MEATLOAF_ARCHIVE_ZIP_REPACK
+
+#include <cstdint>
+#include <cstdio>
+
+#include "zip_index.h"
+
+// Chunk size for copying and compressing
+#ifndef ZIP_REPACK_BUFFER_SIZE
+#define ZIP_REPACK_BUFFER_SIZE 4096
+#endif
+
+// Deflate memory is about (1 << (WINDOW_BITS + 2)) + (1 << (MEM_LEVEL + 9)),
+// a smaller window still inflates everywhere
+#ifndef ZIP_REPACK_WINDOW_BITS
+#ifdef BOARD_HAS_PSRAM
+#define ZIP_REPACK_WINDOW_BITS 15
+#define ZIP_REPACK_MEM_LEVEL 8
+#else
+#define ZIP_REPACK_WINDOW_BITS 12
+#define ZIP_REPACK_MEM_LEVEL 6
+#endif
+#endif
+
+class ZipRepacker {
+public:
+    // Where the new archive goes
+    class Sink {
+    public:
+        virtual ~Sink() {};
+        virtual uint32_t position() = 0;
+        virtual bool write(const uint8_t *buf, uint32_t size) = 0;
+
+        // Overwrite bytes written before, the local header gets its sizes
+        // once the member is compressed
+        virtual bool patch(uint32_t offset, const uint8_t *buf, uint32_t size) = 0;
+    };
+
+    class FileSink : public Sink {
+    public:
+        FileSink(FILE *file) : m_file(file) {};
+
+        uint32_t position() override;
+        bool write(const uint8_t *buf, uint32_t size) override;
+        bool patch(uint32_t offset, const uint8_t *buf, uint32_t size) override;
+
+    private:
+        FILE *m_file;
+    };
+
+    struct Stats {
+        uint32_t copied;        // Taken over from the old archive
+        uint32_t packed;        // Compressed contents of the new member
+        uint32_t written;       // Size of the new archive
+    };
+
+    ZipRepacker(ZipIndex::Source &archive, const ZipIndex &index) : m_archive(archive), m_index(index) {};
+
+    // Write the archive with member's contents replaced by data. Stored
+    // members stay stored, everything else is deflated.
+    bool repack(const ZipIndex::Entry &member, ZipIndex::Source &data, Sink &out);
+
+    const Stats &stats() const { return m_stats; }
+
+private:
+    bool copy(uint32_t offset, uint32_t size, Sink &out);
+    bool store(ZipIndex::Source &data, Sink &out, uint32_t &crc, uint32_t &packed);
+    bool pack(ZipIndex::Source &data, Sink &out, uint32_t &crc, uint32_t &packed);
+
+    ZipIndex::Source &m_archive;
+    const ZipIndex &m_index;
+    Stats m_stats = { 0, 0, 0 };
+};
+
+#endif // MEATLOAF_ARCHIVE_ZIP_REPACK
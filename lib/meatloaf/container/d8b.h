@@ -38,30 +38,7 @@ class D8BMStream : public D64MStream {
 public:
     D8BMStream(std::shared_ptr<MStream> is) : D64MStream(is)
     {
-        // D8B Partition Info
-        std::vector<BlockAllocationMap> b = { 
-            {
-                1,      // track
-                1,      // sector
-                0x00,   // offset
-                1,      // start_track
-                40,     // end_track
-                18      // byte_count
-            } 
-        };
-
-        Partition p = {
-            1,     // track
-            0,     // sector
-            0x04,  // header_offset
-            1,     // directory_track
-            4,     // directory_sector
-            0x00,  // directory_offset
-            b      // block_allocation_map
-        };
-        partitions.clear();
-        partitions.push_back(p);
-        sectorsPerTrack = { 136 };
+        setGeometry( Geometry::D8B_136 );
 
         uint32_t size = containerStream->size();
         switch (size + media_header_size) 
@@ -70,7 +47,7 @@ public:
                 break;
 
             case 1474560: // 144 sectors per track
-                sectorsPerTrack = { 144 };
+                setGeometry( Geometry::D8B_144 );
                 break;
         }
     };
@@ -104,6 +81,7 @@ class D8BMFile: public D64MFile {
 public:
     D8BMFile(std::string path) : D64MFile(path) 
     {
+        isWritable = false; // No native write path
         size = 1474560; // Default - 144 sectors per track
     };
 
@@ -124,10 +102,12 @@ public:
 class D8BMFileSystem: public MFileSystem
 {
 public:
-    D8BMFileSystem(): MFileSystem("d8b") {};
+    D8BMFileSystem(): MFileSystem("d8b") {
+        extensions = { ".d8b" };
+    };
 
     bool handles(std::string fileName) override {
-        return byExtension(".d8b", fileName);
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
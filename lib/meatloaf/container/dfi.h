@@ -128,30 +128,7 @@ class DFIMStream : public D64MStream {
 public:
     DFIMStream(std::shared_ptr<MStream> is) : D64MStream(is)
     {
-        // DFI Partition Info
-        std::vector<BlockAllocationMap> b = { 
-            {
-                1,      // track
-                0,      // sector
-                0x00,   // offset
-                1,      // start_track
-                40,    // end_track
-                4       // byte_count
-            } 
-        };
-
-        Partition p = {
-            1,     // track
-            0,     // sector
-            0x90,  // header_offset
-            1,     // directory_track
-            4,     // directory_sector
-            0x00,  // directory_offset
-            b      // block_allocation_map
-        };
-        partitions.clear();
-        partitions.push_back(p);
-        sectorsPerTrack = { 256 };
+        setGeometry( Geometry::DFI );
 
         // // The header's size is 256 bytes, that's exactly one sector. The header is
         // // always the first sector in the image (track 1, sector 0).
@@ -195,7 +172,10 @@ private:
 
 class DFIMFile: public D64MFile {
 public:
-    DFIMFile(std::string path) : D64MFile(path) {};
+    DFIMFile(std::string path) : D64MFile(path)
+    {
+        isWritable = false; // No native write path
+    };
 
     std::shared_ptr<MStream> getDecodedStream(std::shared_ptr<MStream> is) override
     {
@@ -214,10 +194,12 @@ public:
 class DFIMFileSystem: public MFileSystem
 {
 public:
-    DFIMFileSystem(): MFileSystem("dfi") {};
+    DFIMFileSystem(): MFileSystem("dfi") {
+        extensions = { ".dfi" };
+    };
 
     bool handles(std::string fileName) override {
-        return byExtension(".dfi", fileName);
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
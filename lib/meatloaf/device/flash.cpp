@@ -262,6 +262,57 @@ MFile* FlashMFile::getNextFileInDir()
 }
 
 
+bool FlashMFile::getNextEntry(DirEntry &entry)
+{
+    if(!dirOpened)
+        openDir(std::string(basepath + path).c_str());
+
+    if(dir == nullptr)
+        return false;
+
+    bool root = ( path.empty() || path == "/" );
+    do
+    {
+        struct dirent* dirent = NULL;
+        do
+        {
+            dirent = readdir( dir );
+        } while ( dirent != NULL && (dirent->d_name[0] == '.' || !dir_filter.matchName(dirent->d_name)) ); // Skip hidden files, and unwanted ones before the stat
+
+        if ( dirent == NULL )
+        {
+            closeDir();
+            return false;
+        }
+
+        entry.clear();
+
+        size_t length = strlen(dirent->d_name);
+        entry.setName(dirent->d_name, length);
+
+        const char *dot = strrchr(dirent->d_name, '.');
+        if ( dot != NULL && dot != dirent->d_name )
+            entry.setType(dot + 1, dirent->d_name + length - dot - 1);
+
+        // Stat through a stack buffer, no strings built per entry
+        char entry_path[256 + DIR_ENTRY_NAME_SIZE];
+        snprintf(entry_path, sizeof(entry_path), "%s%s/%s", basepath.c_str(), root ? "" : path.c_str(), dirent->d_name);
+
+        struct stat info;
+        if ( stat( entry_path, &info ) == 0 )
+        {
+            if ( S_ISDIR(info.st_mode) )
+                entry.flags |= DirEntry::DIRECTORY;
+            else
+                entry.size = info.st_size;
+        }
+        entry.setBlocks(media_block_size);
+    } while ( !dir_filter.matchType(entry.type, entry.flags) );
+
+    return true;
+}
+
+
 bool FlashMFile::readEntry( std::string filename )
 {
     std::string apath = (basepath + pathToFile()).c_str();
@@ -375,9 +426,18 @@ bool FlashMStream::open(std::ios_base::openmode mode) {
 };
 
 void FlashMStream::close() {
+    dropView();
     if(isOpen()) handle->dispose();
 };
 
+std::unordered_map<std::string, std::string> FlashMStream::info() {
+    struct stat st;
+    if ( stat(localPath.c_str(), &st) != 0 )
+        return {};
+
+    return { { "mtime", std::to_string(st.st_mtime) }, { "path", localPath } };
+}
+
 uint32_t FlashMStream::read(uint8_t* buf, uint32_t size) {
     if (!isOpen() || !buf) {
         Debug_printv("Not open");
@@ -391,16 +451,63 @@ uint32_t FlashMStream::read(uint8_t* buf, uint32_t size) {
         if ( size > available() )
             size = available();
 
-        count = fread((void*) buf, 1, size, handle->file_h );
+        // Hand out read-ahead data left over from peekView() first
+        if ( view_pos < view_len )
+        {
+            count = std::min(size, view_len - view_pos);
+            memcpy(buf, view_buffer.get() + view_pos, count);
+            view_pos += count;
+            _position += count;
+            buf += count;
+            size -= count;
+        }
+
+        uint32_t n = ( size > 0 ) ? fread((void*) buf, 1, size, handle->file_h ) : 0;
+        _position += n;
+        count += n;
         // Debug_printv("count[%d]", count);
         // auto hex = mstr::toHex(buf, count);
         // Debug_printv("[%s]", hex.c_str());
-        _position += count;
     }
 
     return count;
 };
 
+uint32_t FlashMStream::peekView(const uint8_t **view) {
+    *view = nullptr;
+    if (!isOpen() || available() == 0)
+        return 0;
+
+    if ( view_pos >= view_len )
+    {
+        if ( view_buffer == nullptr )
+            view_buffer.reset(new uint8_t[FLASH_VIEW_SIZE]);
+
+        // Reads this large skip the stdio buffer and land here directly
+        view_pos = 0;
+        view_len = fread((void*) view_buffer.get(), 1, std::min(available(), (uint32_t)FLASH_VIEW_SIZE), handle->file_h );
+        if ( view_len == 0 )
+            return 0;
+    }
+
+    *view = view_buffer.get() + view_pos;
+    return view_len - view_pos;
+};
+
+uint32_t FlashMStream::consume(uint32_t size) {
+    size = std::min(size, view_len - view_pos);
+    view_pos += size;
+    _position += size;
+    return size;
+};
+
+void FlashMStream::dropView() {
+    // Put the file position back where the reader is
+    if ( view_pos < view_len && isOpen() )
+        fseek( handle->file_h, _position, SEEK_SET );
+    view_pos = view_len = 0;
+};
+
 uint32_t FlashMStream::write(const uint8_t *buf, uint32_t size) {
     if (!isOpen() || !buf) {
         Debug_printv("Not open");
@@ -408,6 +515,7 @@ uint32_t FlashMStream::write(const uint8_t *buf, uint32_t size) {
     }
 
     //Debug_printv("buf[%02X] size[%lu]", buf[0], size);
+    dropView();
 
     // buffer, element size, count, handle
     uint32_t count = fwrite((void*) buf, 1, size, handle->file_h );
@@ -424,6 +532,7 @@ bool FlashMStream::seek(uint32_t pos) {
         Debug_printv("Not open");
         return false;
     }
+    view_pos = view_len = 0;
     _position = pos;
     return ( fseek( handle->file_h, pos, SEEK_SET ) ) ? false : true;
 };
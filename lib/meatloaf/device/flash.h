@@ -29,6 +29,10 @@
 
 #include "../../include/debug.h"
 
+#ifndef FLASH_VIEW_SIZE
+#define FLASH_VIEW_SIZE 512 // peekView() read-ahead buffer
+#endif
+
 
 /********************************************************
  * MFile
@@ -79,6 +83,7 @@ public:
 
     bool rewindDirectory() override;
     MFile* getNextFileInDir() override;
+    bool getNextEntry(DirEntry &entry) override;
     bool mkDir() override;
     bool rmDir() override;
     bool exists() override;
@@ -145,9 +150,12 @@ public:
     }
 
     // MStream methods
+    std::unordered_map<std::string, std::string> info() override;
+
     bool isOpen() override;
     bool isBrowsable() override { return false; };
     bool isRandomAccess() override { return true; };
+    bool isReadAhead() override { return true; };
 
     bool open(std::ios_base::openmode mode) override;
     void close() override;
@@ -155,6 +163,9 @@ public:
     uint32_t read(uint8_t* buf, uint32_t size) override;
     uint32_t write(const uint8_t *buf, uint32_t size) override;
 
+    uint32_t peekView(const uint8_t **view) override;
+    uint32_t consume(uint32_t size) override;
+
     virtual bool seek(uint32_t pos) override;
 
     virtual bool seekPath(std::string path) override {
@@ -166,6 +177,12 @@ public:
 protected:
     std::string localPath;
     std::unique_ptr<FlashHandle> handle;
+
+    // Data read ahead for peekView(), the file position is past it
+    std::unique_ptr<uint8_t[]> view_buffer;
+    uint32_t view_pos = 0;
+    uint32_t view_len = 0;
+    void dropView();
 };
 
 /********************************************************
@@ -43,11 +43,12 @@
 class SDFileSystem: public MFileSystem 
 {
 public:
-    SDFileSystem(): MFileSystem("sd") {};
+    SDFileSystem(): MFileSystem("sd") {
+        schemes = { "sd:" };
+    };
 
     bool handles(std::string name) {
-        std::string pattern = "sd:";
-        return mstr::equals(name, pattern, false);
+        return byScheme(name);
     }
 
     MFile* getFile(std::string path) override {
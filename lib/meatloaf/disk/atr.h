@@ -38,30 +38,7 @@ class ATRMStream : public D64MStream {
 public:
     ATRMStream(std::shared_ptr<MStream> is) : D64MStream(is) 
     {
-        // ATR Partition Info
-        std::vector<BlockAllocationMap> b = { 
-            {
-                1,      // track
-                0,      // sector
-                0x00,   // offset
-                1,      // start_track
-                40,     // end_track
-                4       // byte_count
-            }
-        };
-
-        Partition p = {
-            1,     // track
-            0,     // sector
-            0x04,  // header_offset
-            1,     // directory_track
-            4,     // directory_sector
-            0x00,  // directory_offset
-            b      // block_allocation_map
-        };
-        partitions.clear();
-        partitions.push_back(p);
-        sectorsPerTrack = { 18 };
+        setGeometry( Geometry::ATR_SD );
         
         block_size = 128;
         media_header_size = 0x0F; // 16 byte .atr header
@@ -76,7 +53,7 @@ public:
                 break;   // 16 byte .atr header + 40 tracks * 18 sectors per track * 128 bytes per sector
 
             case 133136: // DOS 2.5 enhanced density
-                sectorsPerTrack = { 26 };
+                setGeometry( Geometry::ATR_ED );
                 break;   // 16 byte .atr header + 40 tracks * 26 sectors per track * 128 bytes per sector
 
             case 183952: // DOS 2.0d double density
@@ -103,6 +80,7 @@ public:
     ATRMFile(std::string path, bool is_dir = true) : D64MFile(path, is_dir) 
     {
         media_block_size = 128;
+        isWritable = false; // Not CBM DOS, no native write path
         size = 92176; // Default - 16 byte .atr header + 40 tracks * 18 sectors per track * 128 bytes per sector
     };
 
@@ -0,0 +1,280 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "bam.h"
+
+#include <algorithm>
+
+void BlockBitmap::reset( const DiskGeometry *g )
+{
+    geometry = g;
+    words.clear();
+    track_free.clear();
+    dirty.reset();
+    total_free = 0;
+
+    if ( geometry == nullptr )
+        return;
+
+    words.assign( ( geometry->blockCount() + 31 ) / 32, 0 );
+    track_free.assign( geometry->tracks + 1, 0 );
+}
+
+void BlockBitmap::loadTrack( uint8_t track, const uint8_t *bits, uint8_t size )
+{
+    uint16_t sectors = geometry->sectorCount( track );
+    if ( !sectors )
+        return;
+
+    uint32_t begin = geometry->lba( track, 0 );
+    for ( uint16_t s = 0; s < sectors; s++ )
+    {
+        uint32_t lba = begin + s;
+        bool free = ( ( s >> 3 ) < size ) && ( bits[s >> 3] & ( 1 << ( s & 7 ) ) );
+        if ( free )
+            words[lba >> 5] |= ( 1u << ( lba & 31 ) );
+        else
+            words[lba >> 5] &= ~( 1u << ( lba & 31 ) );
+    }
+
+    total_free -= track_free[track];
+    track_free[track] = count( begin, begin + sectors );
+    total_free += track_free[track];
+}
+
+void BlockBitmap::storeTrack( uint8_t track, uint8_t *bits, uint8_t size ) const
+{
+    uint16_t sectors = geometry->sectorCount( track );
+    uint32_t begin = geometry->lba( track, 0 );
+
+    for ( uint8_t i = 0; i < size; i++ )
+        bits[i] = 0x00;
+
+    for ( uint16_t s = 0; s < sectors && ( s >> 3 ) < size; s++ )
+    {
+        uint32_t lba = begin + s;
+        if ( words[lba >> 5] & ( 1u << ( lba & 31 ) ) )
+            bits[s >> 3] |= ( 1 << ( s & 7 ) );
+    }
+}
+
+bool BlockBitmap::loadMap( const DiskGeometry *g, const Partition &p, uint16_t block_size, const ImageAccess &read )
+{
+    reset( g );
+
+    for ( uint8_t x = 0; x < p.bam_count; x++ )
+    {
+        auto &map = p.block_allocation_map[x];
+        uint8_t count_size = ( map.byte_count > 3 ) ? 1 : 0;
+        uint32_t size = ( map.end_track - map.start_track + 1 ) * map.byte_count;
+        std::vector<uint8_t> entries( size );
+
+        uint32_t position = ( g->lba( map.track, map.sector ) * block_size ) + map.offset;
+        if ( !read( position, entries.data(), size ) )
+            return false;
+
+        for ( uint16_t t = map.start_track; t <= map.end_track; t++ )
+            loadTrack( t, &entries[( ( t - map.start_track ) * map.byte_count ) + count_size], map.byte_count - count_size );
+    }
+
+    clearDirty();
+    return true;
+}
+
+bool BlockBitmap::storeMap( const Partition &p, uint16_t block_size, const ImageAccess &write )
+{
+    bool ok = true;
+
+    for ( uint8_t x = 0; x < p.bam_count; x++ )
+    {
+        auto &map = p.block_allocation_map[x];
+        uint8_t count_size = ( map.byte_count > 3 ) ? 1 : 0;
+        uint32_t base = ( geometry->lba( map.track, map.sector ) * block_size ) + map.offset;
+
+        for ( uint16_t t = map.start_track; t <= map.end_track; t++ )
+        {
+            if ( !isDirty( t ) )
+                continue;
+
+            // A count byte tops out at 255, a track of 256 free sectors says 255
+            uint8_t free = std::min<uint16_t>( trackFree( t ), UINT8_MAX );
+            uint8_t data[UINT8_MAX];
+            data[0] = free;
+            storeTrack( t, data + count_size, map.byte_count - count_size );
+
+            uint32_t position = base + ( ( t - map.start_track ) * map.byte_count );
+            ok &= write( position, data, map.byte_count );
+
+            if ( !count_size )
+            {
+                position = ( geometry->lba( p.header_track, p.header_sector ) * block_size ) + 0xDD + ( t - map.start_track );
+                ok &= write( position, &free, 1 );
+            }
+        }
+    }
+
+    clearDirty();
+    return ok;
+}
+
+bool BlockBitmap::isFree( uint8_t track, uint8_t sector ) const
+{
+    if ( !geometry || !geometry->valid( track, sector ) )
+        return false;
+
+    uint32_t lba = geometry->lba( track, sector );
+    return words[lba >> 5] & ( 1u << ( lba & 31 ) );
+}
+
+bool BlockBitmap::allocate( uint8_t track, uint8_t sector )
+{
+    if ( !isFree( track, sector ) )
+        return false;
+
+    uint32_t lba = geometry->lba( track, sector );
+    words[lba >> 5] &= ~( 1u << ( lba & 31 ) );
+    track_free[track]--;
+    total_free--;
+    dirty.set( track );
+    return true;
+}
+
+bool BlockBitmap::release( uint8_t track, uint8_t sector )
+{
+    if ( !geometry || !geometry->valid( track, sector ) || isFree( track, sector ) )
+        return false;
+
+    uint32_t lba = geometry->lba( track, sector );
+    words[lba >> 5] |= ( 1u << ( lba & 31 ) );
+    track_free[track]++;
+    total_free++;
+    dirty.set( track );
+    return true;
+}
+
+// First free LBA in [from, to), -1 if there is none
+int32_t BlockBitmap::scan( uint32_t from, uint32_t to ) const
+{
+    while ( from < to )
+    {
+        uint32_t word = words[from >> 5] >> ( from & 31 );
+        if ( word )
+        {
+            uint32_t lba = from + __builtin_ctz( word );
+            return ( lba < to ) ? lba : -1;
+        }
+        from = ( from | 31 ) + 1;
+    }
+    return -1;
+}
+
+// Free blocks in [from, to)
+uint32_t BlockBitmap::count( uint32_t from, uint32_t to ) const
+{
+    uint32_t total = 0;
+    while ( from < to )
+    {
+        uint32_t word = words[from >> 5] >> ( from & 31 );
+        uint32_t bits = 32 - ( from & 31 );
+        if ( to - from < bits )
+        {
+            bits = to - from;
+            word &= ( 1u << bits ) - 1;
+        }
+        total += __builtin_popcount( word );
+        from += bits;
+    }
+    return total;
+}
+
+int BlockBitmap::findFree( uint8_t track, uint16_t sector ) const
+{
+    if ( !trackFree( track ) )
+        return -1;
+
+    uint16_t sectors = geometry->sectorCount( track );
+    if ( sector >= sectors )
+        sector = 0;
+
+    uint32_t begin = geometry->lba( track, 0 );
+    int32_t lba = scan( begin + sector, begin + sectors );
+    if ( lba < 0 )
+        lba = scan( begin, begin + sector );
+
+    return ( lba < 0 ) ? -1 : lba - begin;
+}
+
+bool BlockBitmap::nextFree( uint8_t first_track, uint8_t last_track, uint8_t dir_track, uint8_t interleave, uint8_t &track, uint8_t &sector ) const
+{
+    if ( !geometry )
+        return false;
+
+    last_track = std::min( last_track, geometry->tracks );
+
+    auto take = [&]( int t ) {
+        if ( t == dir_track || !trackFree( t ) )
+            return false;
+
+        // A new track is filled from sector 0
+        track = t;
+        sector = findFree( t, 0 );
+        return true;
+    };
+
+    if ( track )
+    {
+        // Same track, one interleave further. Wrapping past the end of the
+        // track steps back a sector like the 1541 ROM does.
+        if ( track != dir_track && trackFree( track ) )
+        {
+            uint16_t sectors = geometry->sectorCount( track );
+            uint16_t s = sector + interleave;
+            if ( s >= sectors )
+            {
+                s -= sectors;
+                if ( s > 0 )
+                    s--;
+            }
+
+            int found = findFree( track, s % sectors );
+            if ( found >= 0 )
+            {
+                sector = found;
+                return true;
+            }
+        }
+
+        // Then on away from the directory track
+        int step = ( track < dir_track ) ? -1 : 1;
+        for ( int t = track + step; t >= first_track && t <= last_track; t += step )
+        {
+            if ( take( t ) )
+                return true;
+        }
+    }
+
+    // Closest to the directory track, below it first
+    for ( int distance = 1; dir_track - distance >= first_track || dir_track + distance <= last_track; distance++ )
+    {
+        if ( dir_track - distance >= first_track && take( dir_track - distance ) )
+            return true;
+        if ( dir_track + distance <= last_track && take( dir_track + distance ) )
+            return true;
+    }
+
+    return false;
+}
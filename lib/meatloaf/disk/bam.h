@@ -0,0 +1,90 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// Packed block availability map
+//
+// The BAM of an image is read once into one bit per block (1 = free),
+// indexed by LBA, with the free count of every track kept alongside.
+// Counting free blocks is a lookup, and finding the next free block scans
+// a word at a time with ctz instead of testing sector by sector.
+//
+
+#ifndef MEATLOAF_MEDIA_BAM
+#define MEATLOAF_MEDIA_BAM
+
+#include <bitset>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include "geometry.h"
+
+
+class BlockBitmap {
+public:
+    // Size the map for a geometry with every block allocated
+    void reset( const DiskGeometry *g );
+    bool valid() const { return geometry != nullptr; };
+
+    // Bitmap bytes of a track as stored in the BAM, bit n of byte n/8 is
+    // sector n. Sectors the bytes don't cover stay allocated.
+    void loadTrack( uint8_t track, const uint8_t *bits, uint8_t size );
+    void storeTrack( uint8_t track, uint8_t *bits, uint8_t size ) const;
+
+    // Moves bytes at an offset of the image, the container stream on the device
+    using ImageAccess = std::function<bool( uint32_t offset, uint8_t *data, uint32_t size )>;
+
+    // Every BAM entry of a partition. Entries of more than 3 bytes start with
+    // the free count, the 1571 keeps the counts of its second side in the
+    // header sector at $DD instead. Only tracks that changed are stored.
+    bool loadMap( const DiskGeometry *g, const Partition &p, uint16_t block_size, const ImageAccess &read );
+    bool storeMap( const Partition &p, uint16_t block_size, const ImageAccess &write );
+
+    bool isFree( uint8_t track, uint8_t sector ) const;
+    bool allocate( uint8_t track, uint8_t sector );     // false if it wasn't free
+    bool release( uint8_t track, uint8_t sector );      // false if it was free
+
+    uint16_t trackFree( uint8_t track ) const { return ( geometry && track <= geometry->tracks ) ? track_free[track] : 0; };
+    uint32_t blocksFree() const { return total_free; };
+
+    // First free sector of a track at or after sector, wrapping around. -1 if the track is full.
+    int findFree( uint8_t track, uint16_t sector ) const;
+
+    // Next block for a file the way CBM DOS places them, track/sector are
+    // the previous block on the way in (track 0 = first block of a file)
+    bool nextFree( uint8_t first_track, uint8_t last_track, uint8_t dir_track, uint8_t interleave, uint8_t &track, uint8_t &sector ) const;
+
+    // Tracks changed since the map was loaded or last written back
+    bool isDirty() const { return dirty.any(); };
+    bool isDirty( uint8_t track ) const { return dirty.test(track); };
+    void clearDirty() { dirty.reset(); };
+
+    size_t footprint() const { return sizeof(BlockBitmap) + ( words.capacity() * sizeof(uint32_t) ) + ( track_free.capacity() * sizeof(uint16_t) ); };
+
+private:
+    int32_t scan( uint32_t from, uint32_t to ) const;
+    uint32_t count( uint32_t from, uint32_t to ) const;
+
+    const DiskGeometry *geometry = nullptr;
+    std::vector<uint32_t> words;        // bit per LBA, 1 = free
+    std::vector<uint16_t> track_free;
+    std::bitset<256> dirty;
+    uint32_t total_free = 0;
+};
+
+#endif // MEATLOAF_MEDIA_BAM
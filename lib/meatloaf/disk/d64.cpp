@@ -17,6 +17,7 @@
 
 #include "d64.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 
@@ -28,55 +29,43 @@
 
 bool D64MStream::seekBlock(uint64_t index, uint8_t offset)
 {
-    uint16_t sectorOffset = 0;
     uint8_t track = 0;
-
-    // Debug_printv("track[%d] sector[%d] offset[%d]", track, sector, offset);
+    uint8_t sector = 0;
 
     // Determine actual track & sector from index
-    do
+    if (!geometry->locate(index, track, sector))
     {
-        track++;
-        uint8_t count = getSectorCount(track);
-        if (sectorOffset + count < index)
-            sectorOffset += count;
-        else
-            break;
-
-        // Debug_printv("track[%d] speedZone[%d] secotorsPerTrack[%d] sectorOffset[%d]", track, speedZone(track), count, sectorOffset);
-    } while (true);
-    uint8_t sector = index - sectorOffset;
+        Debug_printv("Invalid Block: index[%llu] blocks[%lu]", index, geometry->blockCount());
+        return false;
+    }
 
     this->block = index;
     this->track = track;
     this->sector = sector;
 
-    // Debug_printv("track[%d] sector[%d] speedZone[%d] sectorOffset[%d]", track, sector, speedZone(track), sectorOffset);
+    // Debug_printv("track[%d] sector[%d] index[%llu]", track, sector, index);
 
-    return containerStream->seek((index * block_size) + offset);
+    return seekContainer((index * block_size) + offset);
 }
 
 bool D64MStream::seekSector(uint8_t track, uint8_t sector, uint8_t offset)
 {
-    uint16_t sectorOffset = 0;
-
     //Debug_printv("track[%d] sector[%d] offset[%d]", track, sector, offset);
 
     // Is this a valid track?
-    uint16_t c = partitions[partition].block_allocation_map.size() - 1;
-    uint8_t start_track = partitions[partition].block_allocation_map[0].start_track;
-    uint8_t end_track = partitions[partition].block_allocation_map[c].end_track;
-    if (track < start_track || track > end_track)
+    auto &p = partitions[partition];
+    uint8_t start_track = p.block_allocation_map[0].start_track;
+    uint8_t end_track = p.block_allocation_map[p.bam_count - 1].end_track;
+    if (track < start_track || track > end_track || track > geometry->tracks)
     {
         Debug_printv("Invalid Track: track[%d] start_track[%d] end_track[%d]", track, start_track, end_track);
         return false;
     }
 
     // Is this a valid sector?
-    c = getSectorCount(track);
-    if (sector > c)
+    if (!geometry->valid(track, sector))
     {
-        Debug_printv("Invalid Sector: sector[%d] sectorsPerTrack[%d]", sector, c);
+        Debug_printv("Invalid Sector: sector[%d] sectorsPerTrack[%d]", sector, geometry->sectorCount(track));
         return false;
     }
 
@@ -86,22 +75,15 @@ bool D64MStream::seekSector(uint8_t track, uint8_t sector, uint8_t offset)
         // Look up error for this track/sector
     }
 
-    track--;
-    for (uint8_t index = 0; index < track; ++index)
-    {
-        sectorOffset += getSectorCount(index + 1);
-        //Debug_printv("track[%d] speedZone[%d] secotorsPerTrack[%d] sectorOffset[%d]", (index + 1), speedZone(index), getSectorCount(index + 1), sectorOffset);
-    }
-    track++;
-    sectorOffset += sector;
+    uint32_t sectorOffset = geometry->lba(track, sector);
 
     this->block = sectorOffset;
     this->track = track;
     this->sector = sector;
 
-    //Debug_printv("track[%d] sector[%d] speedZone[%d] sectorOffset[%d]", track, sector, speedZone(track), sectorOffset);
+    //Debug_printv("track[%d] sector[%d] sectorOffset[%d]", track, sector, sectorOffset);
 
-    return containerStream->seek((sectorOffset * block_size) + offset);
+    return seekContainer((sectorOffset * block_size) + offset);
 }
 
 bool D64MStream::seekSector(std::vector<uint8_t> trackSectorOffset)
@@ -111,237 +93,303 @@ bool D64MStream::seekSector(std::vector<uint8_t> trackSectorOffset)
 
 std::string D64MStream::readBlock(uint8_t track, uint8_t sector)
 {
-    return "";
+    std::string data(block_size, '\0');
+    if (!seekSector(track, sector))
+        return "";
+
+    data.resize(readContainer((uint8_t *)data.data(), block_size));
+    return data;
 }
 
 bool D64MStream::writeBlock(uint8_t track, uint8_t sector, std::string data)
 {
-    return true;
+    uint32_t size = std::min((uint32_t)data.size(), (uint32_t)block_size);
+    return seekSector(track, sector) && writeContainer((uint8_t *)data.data(), size) == size;
+}
+
+// Read every BAM entry of the partition into the bitmap
+bool D64MStream::loadBam()
+{
+    bool ok = bam.loadMap(geometry, partitions[partition], block_size, [this](uint32_t offset, uint8_t *data, uint32_t size) {
+        return seekContainer(offset) && readContainer(data, size) == size;
+    });
+
+    if (!ok)
+        Debug_printv("Unable to read BAM");
+    return ok;
+}
+
+// Write the tracks that changed back into their BAM entries
+bool D64MStream::storeBam()
+{
+    return bam.storeMap(partitions[partition], block_size, [this](uint32_t offset, uint8_t *data, uint32_t size) {
+        return seekContainer(offset) && writeContainer(data, size) == size;
+    });
 }
 
 bool D64MStream::allocateBlock(uint8_t track, uint8_t sector)
 {
-    // int offset;
-    // byte bitmask;
-
-    // offset = (track-1) * 4 + 4;							// offset to correct Track-Info
-    // if (bam->GetRawSector()[offset] > 0)
-    // {
-    // 	bam->GetRawSector()[offset] -= 1;				// reduce free Sectors
-    // }
-    // offset++;											// Move to Bitmask
-    // offset += (sector >> 3);							// move to the correct byte (sector div 8)
-    // bitmask = (byte)(1 << (sector % 8));				// generate Bitmask for Sector
-    // if ((bam->GetRawSector()[offset] & bitmask) == 0)	// was already set to 'used' ?
-    // {
-    // 	return false;
-    // }
-    // bitmask ^= 255;										// invert bitmask (0 means "Sector is used")
-    // bam->GetRawSector()[offset] &= bitmask;				// clear bit in BAM
-    // WriteSector(bam);									// Write back to Image
-    return true;
+    if (read_only)
+        return false;
+
+    if (!bam.valid())
+        loadBam();
+
+    return bam.allocate(track, sector);
 }
 
 bool D64MStream::deallocateBlock(uint8_t track, uint8_t sector)
 {
-    // int offset;
-    // byte bitmask;
-
-    // offset = (track - 1) * 4 + 4;						// offset to correct Track-Info
-    // bam->GetRawSector()[offset] += 1;					// increase free Sectors
-    // offset++;											// Move to Bitmask
-    // offset += (sector >> 3);							// move to the correct byte (sector div 8)
-    // bitmask = (byte)(1 << (sector % 8));				// generate Bitmask for Sector
-    // if ((bam->GetRawSector()[offset] & bitmask) == 1)	// Sector already free ?
-    // {
-    // 	return false;
-    // }
-    // bam->GetRawSector()[offset] |= bitmask;				// clear bit in BAM (1 means "Sector is free")
-    // WriteSector(bam);									// Write back to Image
-    return true;
+    if (read_only)
+        return false;
+
+    if (!bam.valid())
+        loadBam();
+
+    return bam.release(track, sector);
 }
 
+// Pick the next data block the way CBM DOS does: same track one interleave
+// further, then the tracks further away from the directory, then whatever is
+// closest to the directory track. startTrack 0 picks the first block of a file.
 bool D64MStream::getNextFreeBlock(uint8_t startTrack, uint8_t startSector, uint8_t *foundTrack, uint8_t *foundSector)
 {
-    uint8_t track, sector;
-    bool found = false;
-    bool wrapped = false;
-    track = startTrack;
+    if (!bam.valid())
+        loadBam();
 
-    sector = startSector;
-    while (!found)
-    {
-        if (!isBlockFree(track, sector))
-        {
-            if (sector == startSector && track == startTrack)
-            {
-                sector++; // Skip StartSector
-                if (wrapped)
-                {
-                    break; // already wrapped, exit (no free sector found)
-                }
-            }
-            else
-            {
-                sector++;
-            }
+    auto &p = partitions[partition];
+    uint8_t t = startTrack;
+    uint8_t s = startSector;
+    if (!bam.nextFree(p.block_allocation_map[0].start_track, getTrackCount(), p.directory_track, geometry->interleave[1], t, s))
+        return false;
 
-            if (sector > getSectorCount(track))
-            {
-                track++;
-                sector = 0;
-                if (track > getTrackCount())
-                {
-                    track = 1; // Start from the beginning
-                    wrapped = true;
-                }
-            }
-        }
-        else
-        {
-            found = true;
-        }
-    }
-    *foundTrack = track;
-    *foundSector = sector;
-    return found;
+    *foundTrack = t;
+    *foundSector = s;
+    return true;
 }
 
 bool D64MStream::isBlockFree(uint8_t track, uint8_t sector)
 {
-    // int offset;
-    // byte bitmask;
+    if (!bam.valid())
+        loadBam();
 
-    // offset = (track-1) * 4 + 4;                 // offset to correct Track-Info
-    // offset++;									// Move to Bitmask
-    // offset += (sector >> 3);                    // move to the correct byte (sector div 8)
-    // bitmask = (byte)(1 << (sector % 8));        // generate Bitmask for Sector
-    // return (bam->GetRawSector()[offset] & bitmask) == bitmask;
-    return true;
+    return bam.isFree(track, sector);
 }
 
-bool D64MStream::seekEntry( std::string filename )
+std::string D64MStream::entryName( const Entry &e )
 {
-    // Read Directory Entries
-    if (filename.size())
+    std::string name(e.filename, sizeof(e.filename));
+    name = name.substr(0, name.find_first_of(std::string("\xA0\0", 2)));
+    return mstr::toUTF8(name);
+}
+
+bool D64MStream::buildDirectoryIndex()
+{
+    invalidateDirectoryIndex();
+
+    uint8_t t = partitions[partition].directory_track;
+    uint8_t s = partitions[partition].directory_sector;
+    uint32_t sectors = 0;
+    Entry entries[8]; // 8 Entries Per Sector, 32 bytes Per Entry
+
+    // Walk the directory chain once
+    while (t)
     {
-        uint16_t index = 1;
-        mstr::replaceAll(filename, "\\", "/");
-        bool wildcard = (mstr::contains(filename, "*") || mstr::contains(filename, "?"));
-        while (seekEntry(index))
+        // Guard against circular chains
+        if (sectors++ >= geometry->blockCount())
         {
-            std::string entryFilename = entry.filename;
-            uint8_t i = entryFilename.find_first_of(0xA0);
-            entryFilename = entryFilename.substr(0, i);
-            //mstr::rtrimA0(entryFilename);
-            entryFilename = mstr::toUTF8(entryFilename);
+            Debug_printv("Directory chain loops at track[%d] sector[%d]", t, s);
+            break;
+        }
 
-            //Debug_printv("index[%d] track[%d] sector[%d] filename[%s] entry.filename[%.16s]", index, track, sector, filename.c_str(), entryFilename.c_str());
+        if (!seekSector(t, s) || readContainer((uint8_t *)entries, sizeof(entries)) != sizeof(entries))
+            break;
 
-            //Debug_printv("filename[%s] entry[%s]", filename.c_str(), entryFilename.c_str());
+        for (uint8_t i = 0; i < 8; i++)
+        {
+            uint16_t index = directory.slots.size() + 1;
+            DirectorySlot slot = { t, s, (uint8_t)(i * sizeof(Entry)), entries[0].next_track, entries[0].next_sector, entries[i].file_type, entryName(entries[i]) };
 
-            if (filename == entryFilename) // Match exact
-            {
-                return true;
-            }
-            else if (wildcard) // Wildcard Match
-            {
-                if (filename == "*") // Match first PRG
-                {
-                    if (entry.file_type & 0b00000111)
-                    {
-                        filename = entryFilename;
-                        return true;
-                    }
-                }
-                else if (mstr::compare(filename, entryFilename)) // X?XX?X* Wildcard match
-                {
-                    return true;
-                }
-            }
+            // First entry with a name wins, like the directory walk
+            if (slot.name.size() && slot.live())
+                directory.names.emplace(slot.name, index);
+            if (!directory.first_file && (slot.file_type & 0b00000111))
+                directory.first_file = index;
 
-            index++;
+            directory.slots.push_back(slot);
         }
 
-        Debug_printv("File not found!");
+        t = entries[0].next_track;
+        s = entries[0].next_sector;
     }
 
-    entry.next_track = 0;
-    entry.next_sector = 0;
-    entry.blocks = 0;
-    entry.filename[0] = '\0';
+    directory.valid = true;
 
-    return false;
+    Debug_printv("entries[%d] sectors[%d]", directory.slots.size(), sectors);
+    return !directory.slots.empty();
 }
 
-bool D64MStream::seekEntry( uint16_t index )
+// Refresh lookups after an entry (1 based index) changed
+void D64MStream::updateDirectoryIndex( uint16_t index, std::string old_name )
 {
-    // Calculate Sector offset & Entry offset
-    // 8 Entries Per Sector, 32 bytes Per Entry
-    index--;
-    uint16_t sectorOffset = index / 8;
-    uint16_t entryOffset = (index % 8) * 32;
+    auto &slot = directory.slots[index - 1];
 
-    //Debug_printv("----------");
-    //Debug_printv("index[%d] sectorOffset[%d] entryOffset[%d] entry_index[%d]", index, sectorOffset, entryOffset, entry_index);
+    // Hand the old name to the next live entry carrying it, a renamed or
+    // scratched entry doesn't answer to it any more
+    auto it = directory.names.find(old_name);
+    if (it != directory.names.end() && it->second == index && (old_name != slot.name || !slot.live()))
+    {
+        directory.names.erase(it);
+        for (uint16_t i = index + 1; i <= directory.slots.size(); i++)
+        {
+            if (directory.slots[i - 1].live() && directory.slots[i - 1].name == old_name)
+            {
+                directory.names[old_name] = i;
+                break;
+            }
+        }
+    }
 
-    if (index == 0 || index != entry_index)
+    if (slot.name.size() && slot.live())
     {
-        // Start at first sector of directory
-        next_track = 0;
-        if (!seekSector(
-                partitions[partition].directory_track,
-                partitions[partition].directory_sector,
-                partitions[partition].directory_offset))
-            return false;
+        it = directory.names.find(slot.name);
+        if (it == directory.names.end() || it->second > index)
+            directory.names[slot.name] = index;
+    }
 
-        // Find sector with requested entry
-        do
+    if (old_name != slot.name)
+        directory.sorted_valid = false;
+
+    if (slot.file_type & 0b00000111)
+    {
+        if (!directory.first_file || index < directory.first_file)
+            directory.first_file = index;
+    }
+    else if (directory.first_file == index)
+    {
+        directory.first_file = 0;
+        for (uint16_t i = index + 1; i <= directory.slots.size(); i++)
         {
-            if (next_track)
+            if (directory.slots[i - 1].file_type & 0b00000111)
             {
-                //Debug_printv("next_track[%d] next_sector[%d]", entry.next_track, entry.next_sector);
-                if (!seekSector(entry.next_track, entry.next_sector))
-                    return false;
+                directory.first_file = i;
+                break;
             }
+        }
+    }
+}
 
-            readContainer((uint8_t *)&entry, sizeof(entry));
-            next_track = entry.next_track;
-            next_sector = entry.next_sector;
+// Returns 1 based entry index, 0 if not found
+uint16_t D64MStream::findEntry( std::string filename )
+{
+    if (!directory.valid)
+        buildDirectoryIndex();
 
-            //Debug_printv("sectorOffset[%d] -> track[%d] sector[%d]", sectorOffset, track, sector);
+    uint16_t found = 0;
+    auto it = directory.names.find(filename);
+    if (it != directory.names.end()) // Match exact
+        found = it->second;
 
-        } while (sectorOffset-- > 0);
-        if (!seekSector(track, sector, entryOffset))
-            return false;
+    size_t wildcard = filename.find_first_of("*?");
+    if (wildcard == std::string::npos)
+        return found;
+
+    // Keep directory order, the first matching entry wins
+    auto match = [&](uint16_t index) {
+        if (found == 0 || index < found)
+            found = index;
+    };
+
+    if (filename == "*") // Match first PRG
+    {
+        if (directory.first_file)
+            match(directory.first_file);
+        return found;
     }
-    else
+
+    std::string prefix = filename.substr(0, wildcard);
+    if (prefix.empty())
     {
-        if (entryOffset == 0)
+        for (uint16_t i = 1; i <= directory.slots.size() && (found == 0 || i < found); i++)
         {
-            if (next_track == 0)
-                return false;
-
-            //Debug_printv("Follow link track[%d] sector[%d] entryOffset[%d]", next_track, next_sector, entryOffset);
-            if (!seekSector(next_track, next_sector, entryOffset))
-                return false;
+            if (directory.slots[i - 1].live() && mstr::compare(filename, directory.slots[i - 1].name)) // X?XX?X* Wildcard match
+                match(i);
         }
+        return found;
     }
 
-    readContainer((uint8_t *)&entry, sizeof(entry));
+    // Names sharing the literal prefix are adjacent in name order
+    if (!directory.sorted_valid)
+    {
+        directory.sorted.resize(directory.slots.size());
+        for (uint16_t i = 0; i < directory.sorted.size(); i++)
+            directory.sorted[i] = i + 1;
+        std::stable_sort(directory.sorted.begin(), directory.sorted.end(), [&](uint16_t a, uint16_t b) {
+            return directory.slots[a - 1].name < directory.slots[b - 1].name;
+        });
+        directory.sorted_valid = true;
+    }
+
+    auto first = std::lower_bound(directory.sorted.begin(), directory.sorted.end(), prefix, [&](uint16_t index, const std::string &p) {
+        return directory.slots[index - 1].name < p;
+    });
+    for (; first != directory.sorted.end(); ++first)
+    {
+        auto &slot = directory.slots[*first - 1];
+        if (slot.name.compare(0, prefix.size(), prefix) != 0)
+            break;
+        if (slot.live() && mstr::compare(filename, slot.name)) // X?XX?X* Wildcard match
+            match(*first);
+    }
+
+    return found;
+}
 
-    // If we are at the first entry in the sector then get next_track/next_sector
-    if (entryOffset == 0)
+bool D64MStream::seekEntry( std::string filename )
+{
+    // Read Directory Entries
+    if (filename.size())
     {
-        next_track = entry.next_track;
-        next_sector = entry.next_sector;
+        mstr::replaceAll(filename, "\\", "/");
+
+        uint16_t index = findEntry(filename);
+        if (index && seekEntry(index))
+        {
+            //Debug_printv("index[%d] track[%d] sector[%d] filename[%s] entry.filename[%.16s]", index, track, sector, filename.c_str(), entry.filename);
+            return true;
+        }
+
+        Debug_printv("File not found!");
     }
 
+    entry.next_track = 0;
+    entry.next_sector = 0;
+    entry.blocks = 0;
+    entry.filename[0] = '\0';
+
+    return false;
+}
+
+bool D64MStream::seekEntry( uint16_t index )
+{
+    if (!directory.valid)
+        buildDirectoryIndex();
+
+    if (index == 0 || index > directory.slots.size())
+        return false;
+
+    auto &slot = directory.slots[index - 1];
+    if (!seekSector(slot.track, slot.sector, slot.offset))
+        return false;
+
+    readContainer((uint8_t *)&entry, sizeof(entry));
+    next_track = slot.next_track;
+    next_sector = slot.next_sector;
+
     //std::string e = mstr::toHex((uint8_t *)&entry, sizeof(entry));
     //Debug_printv("file_type[%02X] file_name[%.16s] entry[%s]", entry.file_type, entry.filename, e.c_str());
 
-    // if ( next_track == 0 && next_sector == 0xFF )
-    entry_index = index + 1;
+    entry_index = index;
 
     // if (entry.file_type == 0x00 || entry.file_type == 0xFF)
     //     return false;
@@ -353,145 +401,409 @@ bool D64MStream::readEntry( uint16_t index ) {
     return seekEntry(index);
 }
 bool D64MStream::writeEntry( uint16_t index) {
-    if ( seekEntry(index - 1) ) {
-        return writeContainer((uint8_t*)&entry, sizeof(entry));
+    if (!directory.valid)
+        buildDirectoryIndex();
+
+    if (index == 0 || index > directory.slots.size())
+        return false;
+
+    auto &slot = directory.slots[index - 1];
+    if (!seekSector(slot.track, slot.sector, slot.offset))
+        return false;
+
+    if (!writeContainer((uint8_t*)&entry, sizeof(entry)))
+        return false;
+
+    // A new sector link changes the chain, everything after it moves
+    if (slot.offset == 0 && (entry.next_track != slot.next_track || entry.next_sector != slot.next_sector))
+    {
+        invalidateDirectoryIndex();
+        return true;
     }
-    return false;
+
+    std::string old_name = slot.name;
+    slot.name = entryName(entry);
+    slot.file_type = entry.file_type;
+    updateDirectoryIndex(index, old_name);
+
+    return true;
 }
 
 uint16_t D64MStream::blocksFree()
 {
-    uint16_t free_count = 0;
+    if (!bam.valid())
+        loadBam();
+
+    // The directory track doesn't count, like CBM DOS
+    return bam.blocksFree() - bam.trackFree(partitions[partition].directory_track);
+}
+
+// Load a sector that isn't cached yet together with the rest of its track,
+// file blocks on a track are read with one container read
+void D64MStream::prefetchSector(uint8_t track, uint8_t sector)
+{
+    if (!cache_id || !geometry->valid(track, sector))
+        return;
+
+    uint32_t lba = geometry->lba(track, sector);
+    if (!SectorCache::cached(cache_id, lba))
+        SectorCache::prefill(cache_id, lba, geometry->sectorCount(track) - sector);
+}
+
+// Walk the T/S chain once and remember every block, returns the file size
+uint32_t D64MStream::buildExtents(uint8_t track, uint8_t sector)
+{
+    extents.clear();
+
+    // A chain that links back into itself ends at the first block seen twice
+    std::vector<bool> visited(geometry->blockCount());
 
-    for (uint8_t x = 0; x < partitions[partition].block_allocation_map.size(); x++)
+    uint8_t link[2] = { 0, 0 };
+    bool complete = false;
+    while (geometry->valid(track, sector))
     {
-        uint8_t bam[partitions[partition].block_allocation_map[x].byte_count];
-        // Debug_printv("start_track[%d] end_track[%d]", block_allocation_map[x].start_track, block_allocation_map[x].end_track);
+        uint32_t lba = geometry->lba(track, sector);
+        if (visited[lba])
+            break;
+        visited[lba] = true;
 
-        if (!seekSector(
-                partitions[partition].block_allocation_map[x].track,
-                partitions[partition].block_allocation_map[x].sector,
-                partitions[partition].block_allocation_map[x].offset))
-            return 0;
+        prefetchSector(track, sector);
+        if (!seekSector(track, sector) || readContainer(link, 2) != 2)
+            break;
 
-        for (uint8_t i = partitions[partition].block_allocation_map[x].start_track; i <= partitions[partition].block_allocation_map[x].end_track; i++)
+        extents.push_back({ track, sector });
+        if (link[0] == 0)
         {
-            readContainer((uint8_t *)&bam, sizeof(bam));
-            if (sizeof(bam) > 3)
-            {
-                if (i != partitions[partition].directory_track)
-                {
-                    // Debug_printv("x[%d] track[%d] count[%d] size[%d]", x, i, bam[0], sizeof(bam));
-                    free_count += bam[0];
-                }
-            }
-            else
-            {
-                // D71 tracks 36 - 70 you have to count the 1 bits (0 is allocated)
-                uint8_t bit_count = 0;
-                bit_count += std::bitset<8>(bam[0]).count();
-                bit_count += std::bitset<8>(bam[1]).count();
-                bit_count += std::bitset<8>(bam[2]).count();
-
-                // Debug_printv("x[%d] track[%d] count[%d] size[%d] bam0[%d] bam1[%d] bam2[%d] (counting 1 bits)", x, i, bit_count, sizeof(bam), bam[0], bam[1], bam[2]);
-                free_count += bit_count;
-            }
+            complete = true;
+            break;
         }
+
+        track = link[0];
+        sector = link[1];
     }
 
-    return free_count;
+    if (extents.empty())
+        return 0;
+
+    // Last block: the sector byte of the link is the offset of its last data byte
+    uint32_t data_size = block_size - 2;
+    uint32_t last = data_size;
+    if (complete)
+        last = (link[1] > 1) ? std::min((uint32_t)(link[1] - 1), data_size) : 0;
+    else
+        Debug_printv("Broken chain after block[%d] track[%d] sector[%d]", extents.size(), track, sector);
+
+    return ((extents.size() - 1) * data_size) + last;
 }
 
 uint32_t D64MStream::readFile(uint8_t *buf, uint32_t size)
 {
-    //Debug_printv("readFile(%d)", size);
-    if (sector_offset % block_size == 0)
+    // GCR streams keep their sector offset in _position, put it back afterwards
+    uint32_t position = _position;
+    uint32_t data_size = block_size - 2;
+    uint32_t bytesRead = 0;
+
+    size = std::min(size, available());
+
+    // Keep going across blocks, one container read per track when cached
+    while (bytesRead < size)
     {
-        // We are at the beginning of the block
-        // Read track/sector link
-        readContainer((uint8_t *)&next_track, 1);
-        readContainer((uint8_t *)&next_sector, 1);
-        sector_offset += 2;
-        //Debug_printv("next_track[%d] next_sector[%d] sector_offset[%d]", next_track, next_sector, sector_offset);
+        uint32_t index = (position + bytesRead) / data_size;
+        uint32_t offset = (position + bytesRead) % data_size;
+        if (index >= extents.size())
+            break;
+
+        auto &b = extents[index];
+        prefetchSector(b.track, b.sector);
+
+        uint32_t n = std::min(size - bytesRead, data_size - offset);
+        if (!seekSector(b.track, b.sector, offset + 2))
+            break;
+
+        uint32_t r = readContainer(buf + bytesRead, n);
+        bytesRead += r;
+        if (r < n)
+            break;
     }
 
-    uint32_t bytesRead = 0;
+    _position = position;
+    return bytesRead;
+}
 
-    if (size > 0)
-    {
-        if (size > available())
-            size = available();
-        
-        // Only read up to the bytes remaining in this sector
-        size = std::min(size, (uint32_t) (block_size - sector_offset % block_size));
+// Lend the rest of the current data block straight from the sector cache
+uint32_t D64MStream::peekView(const uint8_t **view)
+{
+    if (!seekCalled)
+        return MMediaStream::peekView(view);
+
+    // GCR images have no cached sectors to lend
+    *view = nullptr;
+    if (!cache_id || writing || record_length || _position >= _size)
+        return 0;
+
+    uint32_t data_size = block_size - 2;
+    uint32_t index = _position / data_size;
+    uint32_t offset = _position % data_size;
+    if (index >= extents.size())
+        return 0;
+
+    auto &b = extents[index];
+    prefetchSector(b.track, b.sector);
+    if (!seekSector(b.track, b.sector, offset + 2))
+        return 0;
+
+    uint32_t size = std::min(available(), data_size - offset);
+    *view = viewContainer(size);
+    return (*view) ? size : 0;
+}
+
+uint32_t D64MStream::consume(uint32_t size)
+{
+    if (!seekCalled)
+        return MMediaStream::consume(size);
+
+    releaseView();
+    size = std::min(size, available());
+    _position += size;
+    return size;
+}
+
+bool D64MStream::seek(uint32_t pos)
+{
+    if (!seekCalled)
+        return MMediaStream::seek(pos);
+
+    // Files are only written front to back
+    if (writing || pos > _size)
+        return false;
+
+    _position = pos;
+    return true;
+}
+
+uint32_t D64MStream::writeFile(uint8_t *buf, uint32_t size)
+{
+    if (!writing)
+        return 0;
 
-        bytesRead += readContainer(buf, size);
-        sector_offset += bytesRead;
+    uint32_t bytesWritten = 0;
 
-        if (next_track && sector_offset % block_size == 0)
+    while (size > 0)
+    {
+        if (sector_offset % block_size == 0)
         {
-            // We are at the end of the block
-            // Follow track/sector link to move to next block
-            if (!seekSector(next_track, next_sector))
+            // Block is full, chain the next one
+            uint8_t t = 0, s = 0;
+            if (!getNextFreeBlock(write_track, write_sector, &t, &s) || !allocateBlock(t, s))
             {
-                return 0;
+                Debug_printv("Disk full! blocks[%d]", write_blocks);
+                break;
             }
-            //Debug_printv("track[%d] sector[%d] sector_offset[%d]", track, sector, sector_offset);
+
+            uint8_t link[2] = { t, s };
+            if (!seekSector(write_track, write_sector) || writeContainer(link, 2) != 2)
+                break;
+
+            write_track = t;
+            write_sector = s;
+            write_blocks++;
+            sector_offset += 2;
         }
+
+        uint32_t n = std::min(size, (uint32_t) (block_size - sector_offset % block_size));
+        if (!seekSector(write_track, write_sector, sector_offset))
+            break;
+
+        n = writeContainer(buf + bytesWritten, n);
+        if (n == 0)
+            break;
+
+        sector_offset += n;
+        bytesWritten += n;
+        size -= n;
     }
 
-    // if ( !bytesRead )
-    // {
-    //     sector_offset = 0;
-    // }
+    return bytesWritten;
+}
 
-    return bytesRead;
+// Directory entry (1 based) that nothing uses, 0 if the directory is full
+uint16_t D64MStream::findFreeSlot()
+{
+    if (!directory.valid)
+        buildDirectoryIndex();
+
+    for (uint16_t i = 1; i <= directory.slots.size(); i++)
+    {
+        if (!directory.slots[i - 1].live())
+            return i;
+    }
+    return 0;
 }
 
-uint32_t D64MStream::writeFile(uint8_t *buf, uint32_t size)
+// Chain one more sector onto the directory, on the directory track
+bool D64MStream::extendDirectory()
 {
-    Debug_printv("writeFile(%d)", size);
-    if (sector_offset % block_size == 0)
+    if (!directory.valid)
+        buildDirectoryIndex();
+
+    if (directory.slots.empty())
+        return false;
+
+    uint8_t last_track = directory.slots.back().track;
+    uint8_t last_sector = directory.slots.back().sector;
+    uint16_t count = getSectorCount(last_track);
+
+    for (uint16_t i = 0; i < count; i++)
     {
-        // We are at the beginning of the block
-        // Read track/sector link
-        readContainer((uint8_t *)&next_track, 1);
-        readContainer((uint8_t *)&next_sector, 1);
-        sector_offset += 2;
-        //Debug_printv("next_track[%d] next_sector[%d] sector_offset[%d]", next_track, next_sector, sector_offset);
+        uint8_t s = (last_sector + geometry->interleave[0] + i) % count;
+        if (!isBlockFree(last_track, s) || !allocateBlock(last_track, s))
+            continue;
+
+        // End of chain and eight empty entries
+        std::string block(block_size, '\0');
+        block[1] = '\xFF';
+        uint8_t link[2] = { last_track, s };
+        if (!writeBlock(last_track, s, block) || !seekSector(last_track, last_sector) || writeContainer(link, 2) != 2)
+            return false;
+
+        return buildDirectoryIndex();
     }
 
-    uint32_t bytesRead = 0;
+    Debug_printv("Directory track full");
+    return false;
+}
 
-    if (size > 0)
+// Give every block of a chain back to the BAM
+bool D64MStream::freeChain(uint8_t track, uint8_t sector)
+{
+    uint32_t blocks = 0;
+    while (track && blocks++ < geometry->blockCount())
     {
-        if (size > available())
-            size = available();
+        uint8_t link[2];
+        if (!seekSector(track, sector) || readContainer(link, 2) != 2)
+            return false;
 
-        // Only read up to the bytes remaining in this sector
-        size = std::min(size, (uint32_t) (block_size - sector_offset % block_size));
+        deallocateBlock(track, sector);
+        track = link[0];
+        sector = link[1];
+    }
+    return true;
+}
 
-        bytesRead += readContainer(buf, size);
-        sector_offset += bytesRead;
+// Claim a directory entry and the first data block. A file of the same name
+// is replaced. The entry stays open (splat) until closeFile().
+bool D64MStream::createFile(std::string filename, uint8_t file_type)
+{
+    mstr::replaceAll(filename, "\\", "/");
+    if (filename.empty() || filename.find_first_of("*?") != std::string::npos)
+        return false;
 
-        if (next_track && sector_offset % block_size == 0)
-        {
-            // We are at the end of the block
-            // Follow track/sector link to move to next block
-            if (!seekSector(next_track, next_sector))
-            {
-                return 0;
-            }
-            //Debug_printv("track[%d] sector[%d] sector_offset[%d]", track, sector, sector_offset);
-        }
+    if (!directory.valid)
+        buildDirectoryIndex();
+
+    uint16_t index = 0;
+    auto found = directory.names.find(filename);
+    if (found != directory.names.end())
+    {
+        index = found->second;
+        if (!seekEntry(index))
+            return false;
+
+        freeChain(entry.start_track, entry.start_sector);
+        if ((entry.file_type & 0b00000111) == 0x04) // REL side sectors
+            freeChain(entry.rel_start_track, entry.rel_start_sector);
+    }
+    else
+    {
+        index = findFreeSlot();
+        if (!index && extendDirectory())
+            index = findFreeSlot();
     }
 
-    // if ( !bytesRead )
-    // {
-    //     sector_offset = 0;
-    // }
+    if (!index)
+    {
+        Debug_printv("Directory full! [%s]", filename.c_str());
+        return false;
+    }
 
-    return bytesRead;
+    uint8_t t = 0, s = 0;
+    if (!getNextFreeBlock(0, 0, &t, &s) || !allocateBlock(t, s))
+    {
+        Debug_printv("Disk full! [%s]", filename.c_str());
+        return false;
+    }
+
+    // Reload, the first entry of a sector carries the directory link
+    if (!seekEntry(index))
+        return false;
+
+    std::string name = mstr::toPETSCII2(filename);
+    entry.file_type = file_type & 0x7F;
+    entry.start_track = t;
+    entry.start_sector = s;
+    memset(entry.filename, 0xA0, sizeof(entry.filename));
+    memcpy(entry.filename, name.data(), std::min(name.size(), sizeof(entry.filename)));
+    entry.rel_start_track = 0;
+    entry.rel_start_sector = 0;
+    entry.rel_record_length = 0;
+    entry.geos_file_type = 0;
+    entry.year = entry.month = entry.day = entry.hour = entry.minute = 0;
+    entry.blocks = 1;
+    if (!writeEntry(index))
+        return false;
+
+    writing = true;
+    write_index = index;
+    write_track = t;
+    write_sector = s;
+    write_blocks = 1;
+    sector_offset = 2;
+
+    _size = 0;
+    _position = 0;
+
+    Debug_printv("filename[%s] index[%d] track[%d] sector[%d]", filename.c_str(), index, t, s);
+    return seekSector(t, s, sector_offset);
+}
+
+// Terminate the chain and close the directory entry. The data and
+// directory sectors sit dirty in the sector cache and the BAM in the
+// bitmap until close() writes them back in one pass.
+bool D64MStream::closeFile()
+{
+    writing = false;
+
+    // Last block links to track 0, the sector byte is the offset of its last data byte
+    uint8_t link[2] = { 0, (uint8_t)(sector_offset - 1) };
+    if (!seekSector(write_track, write_sector) || writeContainer(link, 2) != 2)
+        return false;
+
+    if (!seekEntry(write_index))
+        return false;
+
+    entry.file_type |= 0x80;
+    entry.blocks = write_blocks;
+
+    Debug_printv("blocks[%d] size[%lu]", write_blocks, _size);
+    return writeEntry(write_index);
+}
+
+void D64MStream::close()
+{
+    bool wrote = writing || records_changed;
+    if (writing)
+        closeFile();
+    if (records_changed)
+        closeRecords();
+
+    if (bam.isDirty())
+        storeBam();
+
+    MMediaStream::close();
+
+    // Cached streams of this image hold a stale directory index and BAM
+    if (wrote)
+        ImageBroker::dispose(containerStream->url);
 }
 
 bool D64MStream::seekPath(std::string path)
@@ -505,6 +817,7 @@ bool D64MStream::seekPath(std::string path)
     sector_offset = 0;
 
     entry_index = 0;
+    extents.clear();
 
     // call image method to obtain file bytes here, return true on success:
     // return D64Image.seekFile(containerIStream, path);
@@ -515,23 +828,54 @@ bool D64MStream::seekPath(std::string path)
         _size = block_size;
         return seekSector(1, 0);
     }
+    else if (read_only && (mode & std::ios_base::out))
+    {
+        Debug_printv("Read only image [%s]", path.c_str());
+        return false;
+    }
+    else if (record_length && (mode & std::ios_base::out))
+    {
+        // REL file opened with ",L,", an existing one keeps its record length
+        if (!seekEntry(path))
+            return createRecords(path);
+
+        if ((entry.file_type & 0b00000111) == 0x04)
+        {
+            write_index = entry_index;
+            record_length = entry.rel_record_length;
+            if (openRecords())
+                return true;
+
+            // Unreadable side sectors, a bad record length falls through
+            if (record_length)
+                return false;
+        }
+
+        // Some other file, or a REL entry with a record length that can't
+        // be, opened as it is so the drive can report the mismatch
+        record_length = 0;
+        _size = buildExtents(entry.start_track, entry.start_sector);
+        _position = 0;
+        return !extents.empty();
+    }
+    else if (mode & std::ios_base::out)
+    {
+        // New file, or replacing an existing one
+        return createFile(path, 0x82); // PRG
+    }
     else if (seekEntry(path))
     {
         // auto entry = containerImage->entry;
         //auto type = decodeType(entry.file_type).c_str();
         //Debug_printv("filename[%.16s] type[%s] start_track[%d] start_sector[%d]", entry.filename, type, entry.start_track, entry.start_sector);
 
-        // Calculate file size
-        uint8_t t = entry.start_track;
-        uint8_t s = entry.start_sector;
-        _size = seekFileSize(t, s);
+        // Map the blocks of the file, this also gives its size
+        _size = buildExtents(entry.start_track, entry.start_sector);
+        _position = 0;
 
-        // Set position to beginning of file
-        bool r = seekSector(t, s);
+        //Debug_printv("blocks[%d] extents[%d] size[%d]", entry.blocks, extents.size(), _size);
 
-        //Debug_printv("blocks[%d] size[%d] available[%d] r[%d]", entry.blocks, _size, available(), r);
-
-        return r;
+        return !extents.empty();
     }
     else
     {
@@ -541,6 +885,365 @@ bool D64MStream::seekPath(std::string path)
     return false;
 };
 
+/********************************************************
+ * REL files
+ ********************************************************/
+
+// Side sector layout, the same on every CBM drive
+#define REL_SIDE_GROUP      6       // Side sectors in a group, each lists all six
+#define REL_SIDE_BLOCKS     120     // Data block pointers in a side sector
+#define REL_SIDE_POINTERS   16      // Offset of the first data block pointer
+#define REL_SUPER_GROUPS    126     // Groups a 1581 super side sector points at
+
+// Map the data blocks from the side sectors, one read per 120 blocks
+bool D64MStream::openRecords()
+{
+    // Damaged or hand made entries, the drive reports a file type mismatch
+    if (record_length == 0 || record_length > block_size - 2)
+    {
+        Debug_printv("Invalid record length[%d]", record_length);
+        record_length = 0;
+        return false;
+    }
+
+    side_sectors.clear();
+    extents.clear();
+    super_side_sector = { 0, 0 };
+
+    uint8_t track = entry.rel_start_track;
+    uint8_t sector = entry.rel_start_sector;
+    uint8_t ss[256];
+
+    while (track && side_sectors.size() < REL_SIDE_GROUP * REL_SUPER_GROUPS)
+    {
+        prefetchSector(track, sector);
+        if (!seekSector(track, sector) || readContainer(ss, block_size) != block_size)
+            return false;
+
+        // 1581 super side sector, the side sectors follow on from its link
+        if (ss[2] == 0xFE && side_sectors.empty() && !super_side_sector.track)
+        {
+            super_side_sector = { track, sector };
+            track = ss[0];
+            sector = ss[1];
+            continue;
+        }
+
+        side_sectors.push_back({ track, sector });
+
+        // The last side sector links to track 0, the sector byte is its last used byte
+        uint16_t end = ss[0] ? block_size : std::min((uint16_t)(ss[1] + 1), (uint16_t)block_size);
+        for (uint16_t i = REL_SIDE_POINTERS; i + 1 < end && ss[i]; i += 2)
+            extents.push_back({ ss[i], ss[i + 1] });
+
+        track = ss[0];
+        sector = ss[1];
+    }
+
+    if (extents.empty())
+    {
+        Debug_printv("No side sectors! track[%d] sector[%d]", entry.rel_start_track, entry.rel_start_sector);
+        return false;
+    }
+
+    // Only the last data block needs its link read, for its used bytes
+    uint8_t link[2];
+    Block last = extents.back();
+    if (!seekSector(last.track, last.sector) || readContainer(link, 2) != 2)
+        return false;
+
+    uint32_t data_size = block_size - 2;
+    uint32_t used = (link[0] == 0 && link[1] > 1) ? std::min((uint32_t)(link[1] - 1), data_size) : data_size;
+    _size = ((extents.size() - 1) * data_size) + used;
+    _size -= _size % record_length;
+    _position = 0;
+
+    Debug_printv("record_length[%d] records[%lu] side_sectors[%d]", record_length, _size / record_length, side_sectors.size());
+    return true;
+}
+
+// New REL file with its first side sector and a block of empty records
+bool D64MStream::createRecords(std::string filename)
+{
+    // 255 only opens existing files
+    if (record_length > block_size - 2)
+        return false;
+
+    if (!createFile(filename, 0x04))
+        return false;
+
+    // Written a record at a time, not as a chain
+    writing = false;
+
+    std::string block(block_size, '\0');
+    block[1] = '\xFF';
+    if (!writeBlock(write_track, write_sector, block))
+        return false;
+
+    extents.assign(1, { write_track, write_sector });
+    side_sectors.clear();
+    super_side_sector = { 0, 0 };
+
+    // 1581 REL files hang their side sector groups off a super side sector
+    if (geometry == &Geometry::D81)
+    {
+        uint8_t t = 0, s = 0;
+        if (!getNextFreeBlock(write_track, write_sector, &t, &s) || !allocateBlock(t, s))
+            return false;
+        super_side_sector = { t, s };
+    }
+
+    if (!addBlockPointer())
+        return false;
+
+    Block first = side_sectors.front();
+    if (super_side_sector.track)
+    {
+        std::string super(block_size, '\0');
+        super[0] = first.track;
+        super[1] = first.sector;
+        super[2] = '\xFE';
+        super[3] = first.track;
+        super[4] = first.sector;
+        if (!writeBlock(super_side_sector.track, super_side_sector.sector, super))
+            return false;
+        first = super_side_sector;
+    }
+
+    if (!seekEntry(write_index))
+        return false;
+
+    entry.rel_start_track = first.track;
+    entry.rel_start_sector = first.sector;
+    entry.rel_record_length = record_length;
+    if (!writeEntry(write_index))
+        return false;
+
+    _size = 0;
+    _position = 0;
+    return addRecords(1);
+}
+
+// Last data block link and block count, the file is in the directory from
+// creation on
+bool D64MStream::closeRecords()
+{
+    records_changed = false;
+    if (extents.empty())
+        return false;
+
+    uint32_t data_size = block_size - 2;
+    uint32_t used = _size - ((extents.size() - 1) * data_size);
+    uint8_t link[2] = { 0, (uint8_t)(used + 1) };
+    Block last = extents.back();
+    if (!seekSector(last.track, last.sector) || writeContainer(link, 2) != 2)
+        return false;
+
+    if (!seekEntry(write_index))
+        return false;
+
+    entry.file_type |= 0x80;
+    entry.blocks = extents.size() + side_sectors.size() + (super_side_sector.track ? 1 : 0);
+
+    Debug_printv("blocks[%d] records[%lu]", entry.blocks, _size / record_length);
+    return writeEntry(write_index);
+}
+
+// Grow to at least this many records. Like CBM DOS, new blocks are filled
+// up with empty records ($FF then zeros).
+bool D64MStream::addRecords(uint32_t count)
+{
+    uint32_t size = count * record_length;
+    if (size <= _size)
+        return true;
+
+    uint32_t data_size = block_size - 2;
+    while (extents.size() * data_size < size)
+    {
+        if (!addRecordBlock())
+        {
+            Debug_printv("Disk full! records[%lu]", _size / record_length);
+            return false;
+        }
+    }
+    size = ((extents.size() * data_size) / record_length) * record_length;
+
+    uint8_t empty[256] = { 0xFF };
+    for (uint32_t position = _size; position < size; position += record_length)
+    {
+        if (!writeRecordData(position, empty, record_length))
+            return false;
+    }
+
+    _size = size;
+    records_changed = true;
+    return true;
+}
+
+// Chain one more data block on and list it in the side sectors
+bool D64MStream::addRecordBlock()
+{
+    Block last = extents.back();
+    uint8_t t = 0, s = 0;
+    if (!getNextFreeBlock(last.track, last.sector, &t, &s) || !allocateBlock(t, s))
+        return false;
+
+    std::string block(block_size, '\0');
+    block[1] = '\xFF';
+    uint8_t link[2] = { t, s };
+    if (!writeBlock(t, s, block) || !seekSector(last.track, last.sector) || writeContainer(link, 2) != 2)
+        return false;
+
+    extents.push_back({ t, s });
+    return addBlockPointer();
+}
+
+// Pointer to the last data block in the side sectors, starting a new side
+// sector every 120 blocks
+bool D64MStream::addBlockPointer()
+{
+    uint32_t index = extents.size() - 1;
+    if (index / REL_SIDE_BLOCKS >= side_sectors.size() && !addSideSector())
+        return false;
+
+    Block ss = side_sectors[index / REL_SIDE_BLOCKS];
+    uint8_t slot = REL_SIDE_POINTERS + (index % REL_SIDE_BLOCKS) * 2;
+    uint8_t pointer[2] = { extents.back().track, extents.back().sector };
+    uint8_t link[2] = { 0, (uint8_t)(slot + 1) };
+    return seekSector(ss.track, ss.sector, slot) && writeContainer(pointer, 2) == 2 &&
+           seekSector(ss.track, ss.sector) && writeContainer(link, 2) == 2;
+}
+
+bool D64MStream::addSideSector()
+{
+    uint32_t number = side_sectors.size();
+    uint32_t group = number / REL_SIDE_GROUP;
+    if (group >= (super_side_sector.track ? REL_SUPER_GROUPS : 1))
+    {
+        Debug_printv("REL file full! side_sectors[%d]", number);
+        return false;
+    }
+
+    Block last = extents.back();
+    uint8_t t = 0, s = 0;
+    if (!getNextFreeBlock(last.track, last.sector, &t, &s) || !allocateBlock(t, s))
+        return false;
+
+    // Each side sector lists every side sector of its group, itself included
+    uint32_t first = group * REL_SIDE_GROUP;
+    uint8_t block[256] = {};
+    block[1] = REL_SIDE_POINTERS - 1;
+    block[2] = number % REL_SIDE_GROUP;
+    block[3] = record_length;
+    for (uint32_t i = first; i < number; i++)
+    {
+        block[4 + (i - first) * 2] = side_sectors[i].track;
+        block[5 + (i - first) * 2] = side_sectors[i].sector;
+    }
+    block[4 + (number - first) * 2] = t;
+    block[5 + (number - first) * 2] = s;
+    if (!seekSector(t, s) || writeContainer(block, block_size) != block_size)
+        return false;
+
+    uint8_t pointer[2] = { t, s };
+    if (number > 0)
+    {
+        Block previous = side_sectors.back();
+        if (!seekSector(previous.track, previous.sector) || writeContainer(pointer, 2) != 2)
+            return false;
+    }
+    for (uint32_t i = first; i < number; i++)
+    {
+        if (!seekSector(side_sectors[i].track, side_sectors[i].sector, 4 + (number - first) * 2) || writeContainer(pointer, 2) != 2)
+            return false;
+    }
+
+    // The super side sector points at the first side sector of every group
+    if (super_side_sector.track && number == first)
+    {
+        if (!seekSector(super_side_sector.track, super_side_sector.sector, 3 + group * 2) || writeContainer(pointer, 2) != 2)
+            return false;
+    }
+
+    side_sectors.push_back({ t, s });
+    return true;
+}
+
+bool D64MStream::writeRecordData(uint32_t position, const uint8_t *data, uint32_t size)
+{
+    uint32_t data_size = block_size - 2;
+    while (size > 0)
+    {
+        uint32_t index = position / data_size;
+        uint32_t offset = position % data_size;
+        if (index >= extents.size())
+            return false;
+
+        auto &b = extents[index];
+        uint32_t n = std::min(size, data_size - offset);
+        if (!seekSector(b.track, b.sector, offset + 2) || writeContainer((uint8_t *)data, n) != n)
+            return false;
+
+        position += n;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// The rest of the current record without its zero padding. The next read
+// starts at the next record, like INPUT# on a drive.
+uint32_t D64MStream::read(uint8_t *buf, uint32_t size)
+{
+    if (!seekCalled || !record_length)
+        return MMediaStream::read(buf, size);
+
+    if (_position >= _size)
+        return 0;
+
+    uint32_t next = ((_position / record_length) + 1) * record_length;
+    uint32_t n = readFile(buf, std::min(size, next - _position));
+    while (n > 1 && buf[n - 1] == 0x00)
+        n--;
+
+    _position = next;
+    return n;
+}
+
+// One write is one record, the rest of it is zeroed. Missing records up to
+// it are added first. Returns less than size when the data didn't fit.
+uint32_t D64MStream::write(const uint8_t *buf, uint32_t size)
+{
+    if (!seekCalled || !record_length)
+        return MMediaStream::write(buf, size);
+
+    uint32_t record = _position / record_length;
+    uint32_t offset = _position % record_length;
+    if (!addRecords(record + 1))
+        return 0;
+
+    uint8_t data[256] = {};
+    uint32_t n = std::min(size, (uint32_t)(record_length - offset));
+    memcpy(data, buf, n);
+    if (!writeRecordData(_position, data, record_length - offset))
+        return 0;
+
+    records_changed = true;
+    _position = (record + 1) * record_length;
+    return n;
+}
+
+bool D64MStream::seekRecord(uint32_t record, uint8_t offset)
+{
+    if (!seekCalled || !record_length || offset >= record_length)
+        return false;
+
+    // Past the end is fine, writing there adds the records
+    _position = (record * record_length) + offset;
+    return _position < _size;
+}
+
+
 /********************************************************
  * File implementations
  ********************************************************/
@@ -564,6 +1267,13 @@ bool D64MStream::seekPath(std::string path)
     // Initialize directory
     image->initializeDirectory();
 
+    // Header, BAM and first directory sector are in use
+    auto &p = image->partitions[image->partition];
+    image->allocateBlock(p.header_track, p.header_sector);
+    image->allocateBlock(p.directory_track, p.directory_sector);
+    for (uint8_t x = 0; x < p.bam_count; x++)
+        image->allocateBlock(p.block_allocation_map[x].track, p.block_allocation_map[x].sector);
+
     // Write the header to the file
     size_t comma = header_info.find(',');
     std::string diskname = header_info.substr(0,comma);
@@ -660,6 +1370,56 @@ exit:
     return nullptr;
 }
 
+bool D64MFile::getNextEntry(DirEntry &entry)
+{
+    bool r = false;
+
+    if (!dirIsOpen)
+        rewindDirectory();
+
+    // Held for the whole listing instead of looked up by url per entry
+    if (dir_image == nullptr)
+        dir_image = ImageBroker::obtain<D64MStream>(sourceFile->url);
+
+    if (dir_image != nullptr)
+    {
+        // Skip hidden files and the ones the filter doesn't want
+        do
+        {
+            r = dir_image->getNextImageEntry();
+            if (!r || (dir_image->entry.file_type & 0b00000111) == 0x00)
+                continue;
+
+            auto &e = dir_image->entry;
+            auto pad = (const char *)memchr(e.filename, 0xA0, sizeof(e.filename));
+            entry.clear();
+            entry.setName(e.filename, pad ? pad - e.filename : sizeof(e.filename));
+            entry.setType(dir_image->file_type_label[e.file_type & 0b00000111].data(), 3);
+            if (dir_filter.matches(entry, true))
+                break;
+        } while (r);
+    }
+
+    if (!r)
+    {
+        dirIsOpen = false;
+        dir_image = nullptr;
+        return false;
+    }
+
+    auto &e = dir_image->entry;
+    entry.blocks = e.blocks;
+    entry.size = e.blocks * dir_image->block_size;
+
+    // Bit 7: Closed flag, Bit 6: Locked flag
+    if (!(e.file_type & 0x80))
+        entry.flags |= DirEntry::SPLAT;
+    if (e.file_type & 0x40)
+        entry.flags |= DirEntry::LOCKED;
+
+    return true;
+}
+
 time_t D64MFile::getLastWrite()
 {
     return getCreationTime();
@@ -684,7 +1444,17 @@ time_t D64MFile::getCreationTime()
 
 bool D64MFile::exists()
 {
-    Debug_printv("exists[%d] url[%s] pathInStream[%s]", sourceFile->exists(), sourceFile->url.c_str(), sourceFile->pathInStream.c_str());
-    return sourceFile->exists();
+    Debug_printv("exists[%d] url[%s] pathInStream[%s]", sourceFile->exists(), sourceFile->url.c_str(), pathInStream.c_str());
+    if (pathInStream.empty())
+        return sourceFile->exists();
+
+    // Files inside the image exist when the directory lists them
+    auto image = ImageBroker::obtain<D64MStream>(sourceFile->url);
+    if (image == nullptr)
+        return false;
+
+    std::string filename = pathInStream;
+    mstr::replaceAll(filename, "\\", "/");
+    return image->findEntry(filename) != 0;
 }
 
@@ -34,12 +34,16 @@
 
 #include "../meatloaf.h"
 
+#include <array>
 #include <map>
+#include <unordered_map>
 #include <bitset>
 #include <ctime>
 #include <cstring>
 
 #include "../meat_media.h"
+#include "bam.h"
+#include "geometry.h"
 #include "string_utils.h"
 #include "utils.h"
 
@@ -52,25 +56,6 @@ class D64MStream : public MMediaStream {
 
 protected:
 
-    struct BlockAllocationMap {
-        uint8_t track;
-        uint8_t sector;
-        uint8_t offset;
-        uint8_t start_track;
-        uint8_t end_track;
-        uint8_t byte_count;
-    };
-
-    struct Partition {
-        uint8_t header_track;
-        uint8_t header_sector;
-        uint8_t header_offset;
-        uint8_t directory_track;
-        uint8_t directory_sector;
-        uint8_t directory_offset;
-        std::vector<BlockAllocationMap> block_allocation_map;
-    };
-
     struct Header {
         char name[16];
         char unused[2];
@@ -96,44 +81,46 @@ protected:
         uint16_t blocks;
     };
 
+    // Directory index, built once per opened image
+    struct DirectorySlot {
+        uint8_t track;          // Location of the entry
+        uint8_t sector;
+        uint8_t offset;
+        uint8_t next_track;     // Link of the directory sector holding the entry
+        uint8_t next_sector;
+        uint8_t file_type;
+        std::string name;       // UTF-8 name, $A0 padding removed
+
+        // Scratched entries keep their name but are free for the taking
+        bool live() const { return file_type != 0x00; }
+    };
+
+    struct DirectoryIndex {
+        bool valid = false;
+        bool sorted_valid = false;
+        uint16_t first_file = 0;                            // First non DEL entry (LOAD"*")
+        std::vector<DirectorySlot> slots;                   // entry index - 1 -> location
+        std::unordered_map<std::string, uint16_t> names;    // name -> first live entry index
+        std::vector<uint16_t> sorted;                       // entry indexes ordered by name (wildcard prefix lookup)
+    };
+
 public:
-    std::vector<Partition> partitions;
-    std::vector<uint16_t> sectorsPerTrack = { 17, 18, 19, 21 };
-    std::vector<uint8_t> interleave = { 3, 10 }; // Directory, File
+    const DiskGeometry *geometry = &Geometry::D64;
+    std::array<Partition, 1> partitions;
 
     uint8_t dos_version = 0x41;
     std::string dos_rom = "dos1541";
     std::string dos_name = "";
 
     bool error_info = false;
+    bool read_only = false;     // No BAM for the tracks past 35, see below
     std::string bam_message = "";
 
     D64MStream(std::shared_ptr<MStream> is) : MMediaStream(is)
     {
-        // D64 Partition Info
-        std::vector<BlockAllocationMap> b = { 
-            {
-                18,     // track
-                0,      // sector
-                0x04,   // offset
-                1,      // start_track
-                35,     // end_track
-                4       // byte_count
-            } 
-        };
-
-        Partition p = {
-            18,    // track
-            0,     // sector
-            0x90,  // header_offset
-            18,    // directory_track
-            1,     // directory_sector
-            0x00,  // directory_offset
-            b      // block_allocation_map
-        };
-        partitions.clear();
-        partitions.push_back(p);
-        sectorsPerTrack = { 17, 18, 19, 21 };
+        setGeometry( Geometry::D64 );
+
+        enableSectorCache();
 
         uint32_t size = containerStream->size();
         switch (size + media_header_size) 
@@ -147,19 +134,23 @@ public:
 
             case 196608: // 40 tracks no errors
                 partitions[partition].block_allocation_map[0].end_track = 40;
+                read_only = true;
                 break;
 
             case 197376: // 40 w/ errors
                 partitions[partition].block_allocation_map[0].end_track = 40;
+                read_only = true;
                 error_info = true;
                 break;
 
             case 205312: // 42 tracks no errors
                 partitions[partition].block_allocation_map[0].end_track = 42;
+                read_only = true;
                 break;
 
             case 206114: // 42 w/ errors
                 partitions[partition].block_allocation_map[0].end_track = 42;
+                read_only = true;
                 error_info = true;
                 break;
         }
@@ -174,6 +165,8 @@ public:
         // PrologicDOS also moves the disk label and ID forward from the standard location 
         // of $90 to $A4. 64COPY and Star Commander let you select from several different 
         // types of extended disk formats you want to create/work with. 
+        // Nothing in the image says which one it is, so 40 and 42 track
+        // images stay read only rather than allocate from the disk name.
 
         // // DOLPHIN DOS
         // partitions[0].block_allocation_map.push_back( 
@@ -216,6 +209,11 @@ public:
 
     };
 
+    ~D64MStream() {
+        // Finish a file still being written while the whole object is around
+        close();
+    }
+
 	// virtual std::unordered_map<std::string, std::string> info() override { 
     //     return {
     //         {"System", "Commodore"},
@@ -230,6 +228,14 @@ public:
     //     }; 
     // };
 
+    size_t footprint() override
+    {
+        size_t bytes = sizeof(D64MStream) + bam.footprint() + extents.capacity() * sizeof(Block);
+        for ( auto &slot : directory.slots )
+            bytes += sizeof(DirectorySlot) + slot.name.capacity() + sizeof(uint16_t) * 3;
+        return bytes;
+    }
+
     uint16_t blocksFree() override;
 
     uint8_t speedZone( uint8_t track) override
@@ -244,17 +250,44 @@ public:
 
     uint16_t getSectorCount( uint16_t track )
     {
-        return sectorsPerTrack[speedZone(track)];
+        return geometry->sectorCount(track);
     }
     uint16_t getTrackCount()
     {
-        return partitions[0].block_allocation_map[0].end_track;
+        auto &p = partitions[partition];
+        return p.block_allocation_map[p.bam_count - 1].end_track;
     }
 
+    // Select the track layout and default partition of this format
+    void setGeometry( const DiskGeometry &g )
+    {
+        geometry = &g;
+        partitions[0] = g.partition;
+    }
+
+    // Drop the directory index, it is rebuilt on the next lookup
+    void invalidateDirectoryIndex()
+    {
+        directory = DirectoryIndex();
+    }
+
+    void close() override;
+
     virtual bool seekPath(std::string path) override;
     uint32_t readFile(uint8_t* buf, uint32_t size) override;
     uint32_t writeFile(uint8_t* buf, uint32_t size) override;
 
+    uint32_t peekView(const uint8_t **view) override;
+    uint32_t consume(uint32_t size) override;
+
+    bool seek(uint32_t pos) override;
+
+    // REL files go a record at a time
+    using MMediaStream::read;
+    uint32_t read(uint8_t* buf, uint32_t size) override;
+    uint32_t write(const uint8_t *buf, uint32_t size) override;
+    bool seekRecord(uint32_t record, uint8_t offset = 0) override;
+
     Header header;      // Directory header data
     Entry entry;        // Directory entry data
 
@@ -269,6 +302,24 @@ public:
     uint8_t next_sector = 0;
     uint8_t sector_offset = 0;
 
+protected:
+    // Data blocks of the file selected by seekPath, in chain order. File
+    // position n is in block n / 254, so seeking is a lookup.
+    struct Block {
+        uint8_t track;
+        uint8_t sector;
+    };
+    std::vector<Block> extents;
+
+    uint32_t buildExtents( uint8_t track, uint8_t sector );
+    void prefetchSector( uint8_t track, uint8_t sector );
+
+    // REL files: extents come from the side sectors instead of the chain,
+    // so the P command finds a record without walking any blocks
+    std::vector<Block> side_sectors;
+    Block super_side_sector = { 0, 0 };     // 1581 only
+    bool records_changed = false;
+
 private:
     void sendListing();
 
@@ -287,7 +338,7 @@ private:
     // }
     bool readHeader() override
     {
-        if (partitions.empty() || partition >= partitions.size()) {
+        if (partition >= partitions.size()) {
             Debug_printv("Invalid partition index: %d", partition);
             return false;
         }
@@ -299,7 +350,7 @@ private:
 
     bool writeHeader(std::string name, std::string id) override
     {
-        if (partitions.empty() || partition >= partitions.size()) {
+        if (partition >= partitions.size()) {
             Debug_printv("Invalid partition index: %d", partition);
             return false;
         }
@@ -335,6 +386,13 @@ private:
     bool readEntry( uint16_t index = 0 ) override;
     bool writeEntry( uint16_t index = 0 ) override;
 
+    DirectoryIndex directory;
+
+    static std::string entryName( const Entry &e );
+    bool buildDirectoryIndex();
+    void updateDirectoryIndex( uint16_t index, std::string old_name );
+    uint16_t findEntry( std::string filename );
+
     std::string readBlock( uint8_t track, uint8_t sector );
     bool writeBlock( uint8_t track, uint8_t sector, std::string data );
     bool allocateBlock( uint8_t track, uint8_t sector );
@@ -342,6 +400,34 @@ private:
     bool getNextFreeBlock(uint8_t startTrack, uint8_t startSector, uint8_t *foundTrack, uint8_t *foundSector);
     bool isBlockFree(uint8_t track, uint8_t sector);
 
+    // BAM of the partition, read on first use and written back on close
+    BlockBitmap bam;
+    bool loadBam();
+    bool storeBam();
+
+    // Native write path
+    bool createFile( std::string filename, uint8_t file_type );
+    bool closeFile();
+    bool freeChain( uint8_t track, uint8_t sector );
+    uint16_t findFreeSlot();
+    bool extendDirectory();
+
+    // REL files
+    bool openRecords();
+    bool createRecords( std::string filename );
+    bool closeRecords();
+    bool addRecords( uint32_t count );
+    bool addRecordBlock();
+    bool addBlockPointer();
+    bool addSideSector();
+    bool writeRecordData( uint32_t position, const uint8_t *data, uint32_t size );
+
+    bool writing = false;
+    uint16_t write_index = 0;   // Directory entry of the file being written
+    uint8_t write_track = 0;    // Data block being filled
+    uint8_t write_sector = 0;
+    uint16_t write_blocks = 0;
+
     bool initializeBlocks()
     {
         Debug_printv("initialize blocks");
@@ -357,7 +443,7 @@ private:
     bool initializeBlockAllocationMap()
     {
         uint16_t bam_index = 0;
-        uint16_t bam_count = partitions[partition].block_allocation_map.size();
+        uint16_t bam_count = partitions[partition].bam_count;
 
         Debug_printv("initialize block allocation map");
 
@@ -498,6 +584,7 @@ public:
     {
         media_image = name;
         isPETSCII = true;
+        isWritable = true; // Native write path, as long as the container is writable too. Formats it doesn't fit turn this off.
         size = 174848; // Default - 35 tracks no errors
     };
     
@@ -517,6 +604,7 @@ public:
     bool isDirectory() override;
     bool rewindDirectory() override;
     MFile* getNextFileInDir() override;
+    bool getNextEntry(DirEntry &entry) override;
 
     bool exists() override;
     bool remove() override { return false; };
@@ -526,6 +614,9 @@ public:
 
     bool isDir = true;
     bool dirIsOpen = false;
+
+private:
+    std::shared_ptr<D64MStream> dir_image;
 };
 
 
@@ -538,18 +629,12 @@ class D64MFileSystem: public MFileSystem
 {
 public:
     D64MFileSystem(): MFileSystem("d64") {
+        extensions = { ".d64", ".d41" };
         vdrive_compatible = true;
     };
 
     bool handles(std::string fileName) override {
-        //printf("handles w dnp %s %d\r\n", fileName.rfind(".dnp"), fileName.length()-4);
-        return byExtension(
-            {
-                ".d64",
-                ".d41"
-            }, 
-            fileName
-        );
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
@@ -39,38 +39,7 @@ class D71MStream : public D64MStream {
 public:
     D71MStream(std::shared_ptr<MStream> is) : D64MStream(is) 
     {
-        // D71 Partition Info
-        std::vector<BlockAllocationMap> b = { 
-            {
-                18,     // track
-                0,      // sector
-                0x04,   // offset
-                1,      // start_track
-                35,     // end_track
-                4       // byte_count
-            },
-            {
-                53,     // track
-                0,      // sector
-                0x00,   // offset
-                36,     // start_track
-                70,     // end_track
-                3       // byte_count
-            } 
-        };
-
-        Partition p = {
-            1,     // track
-            0,     // sector
-            0x04,  // header_offset
-            1,     // directory_track
-            4,     // directory_sector
-            0x00,  // directory_offset
-            b      // block_allocation_map
-        };
-        partitions.clear();
-        partitions.push_back(p);
-        sectorsPerTrack = { 17, 18, 19, 21 };
+        setGeometry( Geometry::D71 );
 
         dos_rom = "dos1571";
 
@@ -88,7 +57,7 @@ public:
 
     virtual uint8_t speedZone( uint8_t track) override
     {
-        if ( track < 35 )
+        if ( track < 36 )
 		    return (track < 18) + (track < 25) + (track < 31);
         else
             return (track < 53) + (track < 60) + (track < 66);
@@ -130,11 +99,12 @@ class D71MFileSystem: public MFileSystem
 {
 public:
     D71MFileSystem(): MFileSystem("d71") {
+        extensions = { ".d71" };
         vdrive_compatible = true;
     };
 
     bool handles(std::string fileName) override {
-        return byExtension(".d71", fileName);
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
@@ -39,38 +39,7 @@ class D80MStream : public D64MStream {
 public:
     D80MStream(std::shared_ptr<MStream> is) : D64MStream(is)
     {
-        // D80 Partition Info
-        std::vector<BlockAllocationMap> b = { 
-            {
-                38,     // track
-                0,      // sector
-                0x06,   // offset
-                1,      // start_track
-                50,     // end_track
-                5       // byte_count
-            },
-            {
-                38,     // track
-                3,      // sector
-                0x06,   // offset
-                51,     // start_track
-                77,     // end_track
-                5       // byte_count
-            } 
-        };
-
-        Partition p = {
-            39,    // track
-            0,     // sector
-            0x06,  // header_offset
-            39,    // directory_track
-            1,     // directory_sector
-            0x00,  // directory_offset
-            b      // block_allocation_map
-        };
-        partitions.clear();
-        partitions.push_back(p);
-        sectorsPerTrack = { 23, 25, 27, 29 };
+        setGeometry( Geometry::D80 );
     };
 
     virtual uint8_t speedZone(uint8_t track) override
@@ -114,11 +83,12 @@ class D80MFileSystem: public MFileSystem
 {
 public:
     D80MFileSystem(): MFileSystem("d80") {
+        extensions = { ".d80" };
         vdrive_compatible = true;
     };
 
     bool handles(std::string fileName) override {
-        return byExtension(".d80", fileName);
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
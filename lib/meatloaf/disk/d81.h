@@ -39,38 +39,7 @@ class D81MStream : public D64MStream {
 public:
     D81MStream(std::shared_ptr<MStream> is) : D64MStream(is) 
     {
-        // D81 Partition Info
-        std::vector<BlockAllocationMap> b = { 
-            {
-                40,     // track
-                1,      // sector
-                0x10,   // offset
-                1,      // start_track
-                40,     // end_track
-                6       // byte_count
-            },
-            {
-                40,     // track
-                0,      // sector
-                0x10,   // offset
-                41,     // start_track
-                80,     // end_track
-                6       // byte_count
-            } 
-        };
-
-        Partition p = {
-            40,    // track
-            0,     // sector
-            0x04,  // header_offset
-            40,    // directory_track
-            3,     // directory_sector
-            0x00,  // directory_offset
-            b      // block_allocation_map
-        };
-        partitions.clear();
-        partitions.push_back(p);
-        sectorsPerTrack = { 40 };
+        setGeometry( Geometry::D81 );
         has_subdirs = true;
 
         dos_rom = "dos1581";
@@ -133,11 +102,12 @@ class D81MFileSystem: public MFileSystem
 {
 public:
     D81MFileSystem(): MFileSystem("d81") {
+        extensions = { ".d81" };
         vdrive_compatible = true;
     };
 
     bool handles(std::string fileName) override {
-        return byExtension(".d81", fileName);
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
@@ -39,54 +39,7 @@ class D82MStream : public D64MStream {
 public:
     D82MStream(std::shared_ptr<MStream> is) : D64MStream(is) 
     {
-        // D82 Partition Info
-        std::vector<BlockAllocationMap> b = { 
-            {
-                38,     // track
-                0,      // sector
-                0x06,   // offset
-                1,      // start_track
-                50,     // end_track
-                5       // byte_count
-            },
-            {
-                38,     // track
-                3,      // sector
-                0x06,   // offset
-                51,     // start_track
-                100,    // end_track
-                5       // byte_count
-            },
-            {
-                38,     // track
-                6,      // sector
-                0x06,   // offset
-                101,    // start_track
-                150,    // end_track
-                5       // byte_count
-            },
-            {
-                38,     // track
-                9,      // sector
-                0x06,   // offset
-                151,    // start_track
-                154,    // end_track
-                5       // byte_count
-            }
-        };
-
-        Partition p = {
-            39,    // track
-            0,     // sector
-            0x06,  // header_offset
-            39,    // directory_track
-            1,     // directory_sector
-            0x00,  // directory_offset
-            b      // block_allocation_map
-        };
-        partitions.clear();
-        partitions.push_back(p);
-        sectorsPerTrack = { 23, 25, 27, 29 };
+        setGeometry( Geometry::D82 );
     };
 
     virtual uint8_t speedZone(uint8_t track) override
@@ -133,11 +86,12 @@ class D82MFileSystem: public MFileSystem
 {
 public:
     D82MFileSystem(): MFileSystem("d82") {
+        extensions = { ".d82" };
         vdrive_compatible = true;
     };
 
     bool handles(std::string fileName) override {
-        return byExtension(".d82", fileName);
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
@@ -39,54 +39,7 @@ class D90MStream : public D64MStream {
 public:
     D90MStream(std::shared_ptr<MStream> is) : D64MStream(is)
     {
-        // D90 Partition Info
-        std::vector<BlockAllocationMap> b = { 
-            {
-                38,     // track
-                0,      // sector
-                0x06,   // offset
-                1,      // start_track
-                50,     // end_track
-                5       // byte_count
-            },
-            {
-                38,     // track
-                3,      // sector
-                0x06,   // offset
-                51,     // start_track
-                100,    // end_track
-                5       // byte_count
-            },
-            {
-                38,     // track
-                6,      // sector
-                0x06,   // offset
-                101,    // start_track
-                150,    // end_track
-                5       // byte_count
-            },
-            {
-                38,     // track
-                9,      // sector
-                0x06,   // offset
-                151,    // start_track
-                154,    // end_track
-                5       // byte_count
-            }
-        };
-
-        Partition p = {
-            39,    // track
-            0,     // sector
-            0x06,  // header_offset
-            39,    // directory_track
-            1,     // directory_sector
-            0x00,  // directory_offset
-            b      // block_allocation_map
-        };
-        partitions.clear();
-        partitions.push_back(p);
-        sectorsPerTrack = { 17, 18, 19, 21 };
+        setGeometry( Geometry::D9060 );
 
         // this.size = data.media_data.length;
         // switch (this.size + this.media_header_size) {
@@ -94,11 +47,10 @@ public:
         switch (size + media_header_size) 
         {
              case 5013504:  // D9060
-                 sectorsPerTrack = { (4 * 32) }; // Heads * Sectors
                  break;
 
              case 7520256:  // D9090
-                sectorsPerTrack = { (6 * 32) }; // Heads * Sectors
+                 setGeometry( Geometry::D9090 );
                  break;
         }
 
@@ -118,13 +70,7 @@ public:
         partitions[0].block_allocation_map[0].sector = read();
     };
 
-	virtual uint8_t speedZone(uint8_t track) override
-	{
-        if ( track < 78 )
-		    return (track < 39) + (track < 53) + (track < 64);
-        else
-            return (track < 116) + (track < 130) + (track < 141);
-	};
+	virtual uint8_t speedZone(uint8_t track) override { return 0; };
 
 protected:
 
@@ -139,7 +85,10 @@ private:
 
 class D90MFile: public D64MFile {
 public:
-    D90MFile(std::string path) : D64MFile(path) {};
+    D90MFile(std::string path) : D64MFile(path)
+    {
+        isWritable = false; // BAM layout unverified, no native write path
+    };
 
     std::shared_ptr<MStream> getDecodedStream(std::shared_ptr<MStream> is) override
     {
@@ -159,17 +108,12 @@ class D90MFileSystem: public MFileSystem
 {
 public:
     D90MFileSystem(): MFileSystem("d90") {
+        extensions = { ".d90", ".d60" };
         vdrive_compatible = true;
     };
 
     bool handles(std::string fileName) override {
-        return byExtension(
-            {
-                ".d90",
-                ".d60"
-            }, 
-            fileName
-        );
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
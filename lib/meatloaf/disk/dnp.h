@@ -37,30 +37,7 @@ class DNPMStream : public D64MStream {
 public:
     DNPMStream(std::shared_ptr<MStream> is) : D64MStream(is) 
     {
-        // DNP Partition Info
-        std::vector<BlockAllocationMap> b = { 
-            {
-                1,      // track
-                2,      // sector
-                0x10,   // offset
-                1,      // start_track
-                255,    // end_track
-                8       // byte_count
-            } 
-        };
-
-        Partition p = {
-            1,     // track
-            0,     // sector
-            0x04,  // header_offset
-            1,     // directory_track
-            0,     // directory_sector
-            0x20,  // directory_offset
-            b      // block_allocation_map
-        };
-        partitions.clear();
-        partitions.push_back(p);
-        sectorsPerTrack = { 256 };
+        setGeometry( Geometry::DNP );
         has_subdirs = true;
     };
 
@@ -79,7 +56,10 @@ private:
 
 class DNPMFile: public D64MFile {
 public:
-    DNPMFile(std::string path) : D64MFile(path) {};
+    DNPMFile(std::string path) : D64MFile(path)
+    {
+        isWritable = false; // CMD bitmap isn't handled by the native write path
+    };
 
     std::shared_ptr<MStream> getDecodedStream(std::shared_ptr<MStream> is) override
     {
@@ -99,11 +79,12 @@ class DNPMFileSystem: public MFileSystem
 {
 public:
     DNPMFileSystem(): MFileSystem("dnp") {
+        extensions = { ".dnp" };
         vdrive_compatible = true;
     };
 
     bool handles(std::string fileName) override {
-        return byExtension(".dnp", fileName);
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
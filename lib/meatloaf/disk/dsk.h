@@ -39,30 +39,7 @@ class DSKIStream : public D64MStream {
 public:
     DSKIStream(std::shared_ptr<MStream> is) : D64MStream(is) 
     {
-        // DSK Partition Info
-        std::vector<BlockAllocationMap> b = { 
-            {
-                40,     // track
-                1,      // sector
-                0x10,   // offset
-                1,      // start_track
-                40,     // end_track
-                6       // byte_count
-            }
-        };
-
-        Partition p = {
-            35,    // track
-            0,     // sector
-            0x04,  // header_offset
-            40,    // directory_track
-            3,     // directory_sector
-            0x00,  // directory_offset
-            b      // block_allocation_map
-        };
-        partitions.clear();
-        partitions.push_back(p);
-        sectorsPerTrack = { 16 };
+        setGeometry( Geometry::DSK );
         has_subdirs = false;
         error_info = false;
 
@@ -106,7 +83,10 @@ private:
 
 class DSKMFile: public D64MFile {
 public:
-    DSKMFile(std::string path, bool is_dir = true) : D64MFile(path, is_dir) {};
+    DSKMFile(std::string path, bool is_dir = true) : D64MFile(path, is_dir)
+    {
+        isWritable = false; // Not CBM DOS, no native write path
+    };
 
     std::shared_ptr<MStream> getDecodedStream(std::shared_ptr<MStream> is) override
     {
@@ -0,0 +1,374 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "format.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#ifndef TEST_NATIVE
+#include <esp_timer.h>
+
+#include "../meatloaf.h"
+#include "../../../include/debug.h"
+#endif
+
+// Sectors of the new image, zeros until something is put in them. No
+// layout needs more than 64, so pointers handed out stay valid.
+class TemplateBuilder {
+public:
+    TemplateBuilder(const ImageTemplate &t) : t(t)
+    {
+        sectors.reserve(64);
+    };
+
+    uint8_t *sector(uint8_t track, uint8_t sector)
+    {
+        uint32_t lba = t.geometry->lba(track, sector);
+        for (auto &s : sectors)
+        {
+            if (s.lba == lba)
+                return s.data.data();
+        }
+
+        sectors.push_back({ lba, {} });
+        return sectors.back().data.data();
+    }
+
+    void use(uint8_t track, uint8_t sector)
+    {
+        used.push_back(t.geometry->lba(track, sector));
+    }
+
+    void useTrack(uint8_t track)
+    {
+        for (uint16_t s = 0; s < t.geometry->sectorCount(track); s++)
+            use(track, s);
+    }
+
+    // Bitmap bytes of a track, 1 = free, returns the free count. CBM drives
+    // keep sector n in bit n % 8, CMD native in bit 7 - n % 8.
+    uint16_t bitmap(uint8_t track, uint8_t *bits, uint8_t size, bool msb_first = false)
+    {
+        memset(bits, 0, size);
+        uint16_t free = 0;
+        uint16_t count = std::min((uint16_t)t.geometry->sectorCount(track), (uint16_t)(size * 8));
+        for (uint16_t s = 0; s < count; s++)
+        {
+            if (std::find(used.begin(), used.end(), t.geometry->lba(track, s)) != used.end())
+                continue;
+
+            bits[s >> 3] |= msb_first ? (0x80 >> (s & 7)) : (1 << (s & 7));
+            free++;
+        }
+        return free;
+    }
+
+    // Disk name padded with $A0, the way every header stores it
+    void name(uint8_t *data, const std::string &name)
+    {
+        memset(data, 0xA0, 16);
+        memcpy(data, name.data(), std::min(name.size(), (size_t)16));
+    }
+
+    // ID, $A0, DOS type at the offset of the ID
+    void id(uint8_t *data, const std::string &id)
+    {
+        data[0] = id.size() > 0 ? id[0] : '0';
+        data[1] = id.size() > 1 ? id[1] : '0';
+        data[2] = 0xA0;
+        data[3] = t.dos_type[0];
+        data[4] = t.dos_type[1];
+    }
+
+    std::vector<ImageFormat::Sector> finish()
+    {
+        std::sort(sectors.begin(), sectors.end(), [](const ImageFormat::Sector &a, const ImageFormat::Sector &b) {
+            return a.lba < b.lba;
+        });
+        return std::move(sectors);
+    }
+
+private:
+    const ImageTemplate &t;
+    std::vector<ImageFormat::Sector> sectors;
+    std::vector<uint32_t> used;
+};
+
+
+const ImageTemplate *ImageFormat::find(std::string extension)
+{
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    for (auto &t : Templates::list)
+    {
+        if (extension == t.extension)
+            return &t;
+    }
+    return nullptr;
+}
+
+std::vector<ImageFormat::Sector> ImageFormat::build(const ImageTemplate &t, const std::string &name, const std::string &id)
+{
+    TemplateBuilder b(t);
+    auto &p = t.geometry->partition;
+
+    switch (t.layout)
+    {
+        case ImageLayout::CBM1541:
+        case ImageLayout::CBM1571:
+        {
+            // 18/0 holds the header and the BAM, 18/1 is the first directory block
+            b.use(18, 0);
+            b.use(18, 1);
+            if (t.layout == ImageLayout::CBM1571)
+                b.useTrack(53);     // Second side BAM track, nothing else goes there
+
+            uint8_t *header = b.sector(18, 0);
+            header[0] = 18;
+            header[1] = 1;
+            header[2] = t.dos_version;
+            header[3] = (t.layout == ImageLayout::CBM1571) ? 0x80 : 0x00;  // Double sided
+            for (uint8_t track = 1; track <= 35; track++)
+                header[4 + (track - 1) * 4] = b.bitmap(track, header + 5 + (track - 1) * 4, 3);
+
+            b.name(header + 0x90, name);
+            header[0xA0] = header[0xA1] = 0xA0;
+            b.id(header + 0xA2, id);
+            memset(header + 0xA7, 0xA0, 4);
+
+            // Free counts of the second side in 18/0, their bitmaps in 53/0
+            if (t.layout == ImageLayout::CBM1571)
+            {
+                uint8_t *bam = b.sector(53, 0);
+                for (uint8_t track = 36; track <= 70; track++)
+                    header[0xDD + track - 36] = b.bitmap(track, bam + (track - 36) * 3, 3);
+            }
+
+            uint8_t *dir = b.sector(18, 1);
+            dir[1] = 0xFF;
+        }
+        break;
+
+        case ImageLayout::CBM1581:
+        {
+            // Header, two BAM sectors and the first directory block on track 40
+            for (uint8_t s = 0; s < 4; s++)
+                b.use(40, s);
+
+            uint8_t *header = b.sector(40, 0);
+            header[0] = 40;
+            header[1] = 3;
+            header[2] = t.dos_version;
+            b.name(header + 0x04, name);
+            header[0x14] = header[0x15] = 0xA0;
+            b.id(header + 0x16, id);
+            header[0x1B] = header[0x1C] = 0xA0;
+
+            for (uint8_t i = 0; i < 2; i++)
+            {
+                auto &map = p.block_allocation_map[i];
+                uint8_t *bam = b.sector(map.track, map.sector);
+                bam[0] = (i == 0) ? 40 : 0;
+                bam[1] = (i == 0) ? 2 : 0xFF;
+                bam[2] = t.dos_version;
+                bam[3] = ~t.dos_version;
+                bam[4] = header[0x16];
+                bam[5] = header[0x17];
+                bam[6] = 0xC0;      // Verify on, check header CRC
+                for (uint8_t track = map.start_track; track <= map.end_track && track <= t.tracks; track++)
+                {
+                    uint8_t *entry = bam + map.offset + (track - map.start_track) * map.byte_count;
+                    entry[0] = b.bitmap(track, entry + 1, map.byte_count - 1);
+                }
+            }
+
+            uint8_t *dir = b.sector(40, 3);
+            dir[1] = 0xFF;
+        }
+        break;
+
+        case ImageLayout::CBM8050:
+        {
+            // Header and first directory block on 39, the BAM sectors on 38
+            // chained in front of the directory
+            b.use(p.header_track, p.header_sector);
+            b.use(p.directory_track, p.directory_sector);
+            for (uint8_t i = 0; i < p.bam_count; i++)
+                b.use(p.block_allocation_map[i].track, p.block_allocation_map[i].sector);
+
+            uint8_t *header = b.sector(p.header_track, p.header_sector);
+            header[0] = p.block_allocation_map[0].track;
+            header[1] = p.block_allocation_map[0].sector;
+            header[2] = t.dos_version;
+            b.name(header + p.header_offset, name);
+            header[0x16] = header[0x17] = 0xA0;
+            b.id(header + 0x18, id);
+            memset(header + 0x1D, 0xA0, 4);
+
+            for (uint8_t i = 0; i < p.bam_count; i++)
+            {
+                auto &map = p.block_allocation_map[i];
+                uint8_t *bam = b.sector(map.track, map.sector);
+                bool last = (i + 1 == p.bam_count);
+                bam[0] = last ? p.directory_track : p.block_allocation_map[i + 1].track;
+                bam[1] = last ? p.directory_sector : p.block_allocation_map[i + 1].sector;
+                bam[2] = t.dos_version;
+                bam[4] = map.start_track;
+                bam[5] = map.end_track + 1;
+                for (uint8_t track = map.start_track; track <= map.end_track; track++)
+                {
+                    uint8_t *entry = bam + map.offset + (track - map.start_track) * map.byte_count;
+                    entry[0] = b.bitmap(track, entry + 1, map.byte_count - 1);
+                }
+            }
+
+            uint8_t *dir = b.sector(p.directory_track, p.directory_sector);
+            dir[1] = 0xFF;
+        }
+        break;
+
+        case ImageLayout::CMD_NATIVE:
+        {
+            // Track 1: boot block, header, 32 BAM sectors, first directory block
+            for (uint8_t s = 0; s <= 34; s++)
+                b.use(1, s);
+
+            uint8_t *header = b.sector(1, 1);
+            header[0] = 1;
+            header[1] = 34;
+            header[2] = t.dos_version;
+            b.name(header + 0x04, name);
+            header[0x14] = header[0x15] = 0xA0;
+            b.id(header + 0x16, id);
+            header[0x1B] = header[0x1C] = 0xA0;
+            header[0x20] = 1;       // This header, the root of the partition
+            header[0x21] = 1;
+
+            uint8_t *bam = b.sector(1, 2);
+            bam[2] = t.dos_version;
+            bam[3] = ~t.dos_version;
+            bam[4] = header[0x16];
+            bam[5] = header[0x17];
+            bam[6] = 0xC0;
+            bam[8] = t.tracks;
+
+            // 32 bytes per track counted from the start of 1/2, track 1 at $20
+            for (uint16_t track = 1; track <= t.tracks; track++)
+            {
+                uint32_t offset = track * 32;
+                uint8_t *bits = b.sector(1, 2 + offset / 256) + offset % 256;
+                b.bitmap(track, bits, 32, true);
+            }
+
+            uint8_t *dir = b.sector(1, 34);
+            dir[1] = 0xFF;
+        }
+        break;
+    }
+
+    return b.finish();
+}
+
+bool ImageFormat::write(Output &out, const ImageTemplate &t, const std::vector<Sector> &sectors, bool sparse)
+{
+    uint32_t size = t.size();
+    uint32_t position = 0;
+    std::vector<uint8_t> zeros(sparse ? 1 : FORMAT_CHUNK_SIZE, 0);
+
+    // Zeros up to offset, or a seek that leaves the gap to the filesystem
+    auto fill = [&](uint32_t offset) {
+        if (sparse && offset > position)
+        {
+            if (!out.seek(offset))
+                return false;
+            position = offset;
+        }
+
+        while (position < offset)
+        {
+            uint32_t n = std::min(offset - position, (uint32_t)zeros.size());
+            if (!out.write(zeros.data(), n))
+                return false;
+            position += n;
+        }
+        return true;
+    };
+
+    for (auto &s : sectors)
+    {
+        if (!fill(s.lba * 256) || !out.write(s.data.data(), s.data.size()))
+            return false;
+        position += s.data.size();
+    }
+
+    // A sparse image still ends with a written byte, so the file has its size
+    if (sparse && position < size)
+        return fill(size - 1) && out.write(zeros.data(), 1);
+
+    return fill(size);
+}
+
+#ifndef TEST_NATIVE
+
+// New file stream as the output
+class StreamOutput : public ImageFormat::Output {
+public:
+    StreamOutput(std::shared_ptr<MStream> stream) : stream(stream) {};
+
+    bool write(const uint8_t *data, uint32_t size) override
+    {
+        return stream->write(data, size) == size;
+    }
+
+    bool seek(uint32_t offset) override
+    {
+        return stream->seek(offset);
+    }
+
+private:
+    std::shared_ptr<MStream> stream;
+};
+
+bool ImageFormat::create(MFile *file, std::string header_info)
+{
+    auto t = find(file->extension);
+    if (t == nullptr)
+    {
+        Debug_printv("No template for [%s]", file->extension.c_str());
+        return false;
+    }
+
+    size_t comma = header_info.find(',');
+    std::string name = header_info.substr(0, comma);
+    std::string id = (comma != std::string::npos) ? header_info.substr(comma + 1) : "";
+
+    auto stream = file->getSourceStream(std::ios_base::out);
+    if (stream == nullptr || !stream->isOpen())
+        return false;
+
+    uint64_t start = esp_timer_get_time();
+    bool sparse = t->size() >= FORMAT_SPARSE_SIZE;
+    StreamOutput out(stream);
+    bool ok = write(out, *t, build(*t, name, id), sparse);
+    stream->close();
+
+    Debug_printv("url[%s] size[%lu] sparse[%d] ok[%d] in %llums", file->url.c_str(), t->size(), sparse, ok, (esp_timer_get_time() - start) / 1000);
+    return ok;
+}
+
+#endif
@@ -0,0 +1,138 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// Blank disk images from constexpr templates
+//
+// A freshly formatted disk only uses a handful of sectors: the header, the
+// BAM and the first directory block. Those are built in memory, everything
+// else is zeros and goes out in large sequential writes. Big images (D82,
+// DNP) skip even that and seek past the end, so the filesystem extends the
+// file without writing its data.
+//
+// https://ist.uwaterloo.ca/~schepers/formats/D64.TXT
+// https://ist.uwaterloo.ca/~schepers/formats/D71.TXT
+// https://ist.uwaterloo.ca/~schepers/formats/D81.TXT
+// https://ist.uwaterloo.ca/~schepers/formats/D80-D82.TXT
+// https://ist.uwaterloo.ca/~schepers/formats/DNP.TXT
+//
+
+#ifndef MEATLOAF_MEDIA_FORMAT
+#define MEATLOAF_MEDIA_FORMAT
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "geometry.h"
+
+// Zeros written per call between the used sectors
+#ifndef FORMAT_CHUNK_SIZE
+#ifdef BOARD_HAS_PSRAM
+#define FORMAT_CHUNK_SIZE 16384
+#else
+#define FORMAT_CHUNK_SIZE 4096
+#endif
+#endif
+
+// Images at least this big are extended by seeking instead of writing zeros
+#ifndef FORMAT_SPARSE_SIZE
+#define FORMAT_SPARSE_SIZE (1024 * 1024)
+#endif
+
+// Tracks of a new DNP, 255 = 16 MB
+#ifndef FORMAT_DNP_TRACKS
+#define FORMAT_DNP_TRACKS 255
+#endif
+
+
+enum class ImageLayout : uint8_t {
+    CBM1541,    // D64, BAM in the header sector
+    CBM1571,    // D71, second side bitmaps on track 53
+    CBM1581,    // D81, header and two BAM sectors on track 40
+    CBM8050,    // D80/D82, chained BAM sectors on track 38
+    CMD_NATIVE, // DNP, one bit per sector MSB first, BAM from 1/2 on
+};
+
+struct ImageTemplate {
+    const char *extension;
+    const DiskGeometry *geometry;
+    ImageLayout layout;
+    uint8_t tracks;         // Tracks of a new image
+    char dos_version;
+    char dos_type[3];
+
+    constexpr uint32_t blocks() const { return geometry->offsets[tracks + 1]; }
+    constexpr uint32_t size() const { return blocks() * 256; }
+};
+
+namespace Templates
+{
+    inline constexpr ImageTemplate list[] = {
+        { "d64", &Geometry::D64, ImageLayout::CBM1541, 35, 'A', "2A" },
+        { "d41", &Geometry::D64, ImageLayout::CBM1541, 35, 'A', "2A" },
+        { "d71", &Geometry::D71, ImageLayout::CBM1571, 70, 'A', "2A" },
+        { "d81", &Geometry::D81, ImageLayout::CBM1581, 80, 'D', "3D" },
+        { "d80", &Geometry::D80, ImageLayout::CBM8050, 77, 'C', "2C" },
+        { "d82", &Geometry::D82, ImageLayout::CBM8050, 154, 'C', "2C" },
+        { "dnp", &Geometry::DNP, ImageLayout::CMD_NATIVE, FORMAT_DNP_TRACKS, 'H', "1H" },
+    };
+
+    static_assert( list[0].size() == 174848, "D64 size" );
+    static_assert( list[2].size() == 349696, "D71 size" );
+    static_assert( list[3].size() == 819200, "D81 size" );
+    static_assert( list[4].size() == 533248, "D80 size" );
+    static_assert( list[5].size() == 1066496, "D82 size" );
+}
+
+#ifndef TEST_NATIVE
+class MFile;
+#endif
+
+class ImageFormat {
+public:
+    struct Sector {
+        uint32_t lba;
+        std::array<uint8_t, 256> data;
+    };
+
+    // Where the image goes: the MStream of the new file, a FILE in the tests
+    class Output {
+    public:
+        virtual ~Output() {};
+        virtual bool write(const uint8_t *data, uint32_t size) = 0;
+        virtual bool seek(uint32_t offset) = 0;     // Past the end extends the file
+    };
+
+    // Template for a file extension (no dot, any case), nullptr if there is none
+    static const ImageTemplate *find(std::string extension);
+
+    // Header, BAM and directory sectors of a blank disk, ordered by LBA.
+    // Name and ID are PETSCII, the ID defaults to "00".
+    static std::vector<Sector> build(const ImageTemplate &t, const std::string &name, const std::string &id = "");
+
+    // The whole image: the sectors above and zeros everywhere else
+    static bool write(Output &out, const ImageTemplate &t, const std::vector<Sector> &sectors, bool sparse);
+
+#ifndef TEST_NATIVE
+    // Create a blank image for the extension of file. header_info is
+    // "NAME,ID" in PETSCII, like the N: command.
+    static bool create(MFile *file, std::string header_info);
+#endif
+};
+
+#endif // MEATLOAF_MEDIA_FORMAT
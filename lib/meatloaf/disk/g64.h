@@ -30,6 +30,7 @@
 
 #include "../meatloaf.h"
 #include "d64.h"
+#include "gcr/track_cache.h"
 
 #include "endianness.h"
 
@@ -85,15 +86,6 @@ protected:
         uint16_t track_size;
     };
 
-    struct SectorHeader {
-        uint8_t code; // 0x08
-        uint8_t checksum;
-        uint8_t sector;
-        uint8_t track;
-        uint8_t id1;
-        uint8_t id0;
-    };
-
 public:
     G64MStream(std::shared_ptr<MStream> is) : D64MStream(is) 
     {
@@ -103,25 +95,31 @@ public:
         //block_allocation_map = { {18, 0, 0x04, 1, 35, 4}, {53, 0, 0x00, 36, 70, 3} };
         //sectorsPerTrack = { 17, 18, 19, 21 };
 
+        // GCR images are not sector addressable, read the container directly
+        disableSectorCache();
         containerStream->read((uint8_t*)&gcr_header, sizeof(gcr_header));
 
         Debug_printv("signature[%s] version[%d] track_count[%d] track_size[%d]", gcr_header.signature, gcr_header.version, gcr_header.track_count, gcr_header.track_size);
+
+        // Track offsets for every half track, read once
+        track_offsets.resize(gcr_header.track_count);
+        containerStream->seek(TRACK_TABLE_OFFSET);
+        containerStream->read((uint8_t*)track_offsets.data(), track_offsets.size() * sizeof(uint32_t));
     };
 
     MediaHeader gcr_header;
-    SectorHeader gcr_sector_header;
 
     bool seekSector( uint8_t track, uint8_t sector, uint8_t offset = 0 ) override;
 
     uint32_t readContainer(uint8_t *buf, uint32_t size) override;
 
-    bool readSectorHeader();
-    bool readSector();
-    bool findSync(uint32_t gcr_end);
-    int convert4BytesFromGCR(uint8_t * gcr, uint8_t * plain);
-
 protected:
-    uint8_t sector_buffer[260];
+    const std::vector<GCRSector> *readTrack(uint8_t track);
+
+    std::vector<uint32_t> track_offsets;
+    std::vector<uint8_t> track_buffer;  // Raw GCR of the track being decoded
+    GCRTrackCache track_cache;
+    const GCRSector *gcr_sector = nullptr;
 
 private:
     friend class G64MFile;
@@ -134,7 +132,10 @@ private:
 
 class G64MFile: public D64MFile {
 public:
-    G64MFile(std::string path) : D64MFile(path) {};
+    G64MFile(std::string path) : D64MFile(path)
+    {
+        isWritable = false; // Sectors are GCR encoded in the tracks, no native write path
+    };
 
     std::shared_ptr<MStream> getDecodedStream(std::shared_ptr<MStream> is) override
     {
@@ -152,17 +153,12 @@ class G64MFileSystem: public MFileSystem
 {
 public:
     G64MFileSystem(): MFileSystem("g64") {
+        extensions = { ".g41", ".g64" };
         vdrive_compatible = true;
     };
 
     bool handles(std::string fileName) override {
-        return byExtension(
-            {
-                ".g41",
-                ".g64"
-             },
-            fileName
-        );
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
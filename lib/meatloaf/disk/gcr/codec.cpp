@@ -0,0 +1,278 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "codec.h"
+
+#include <cstring>
+
+namespace
+{
+    // GCR quintet to nibble, 0xff for codes the 1541 never writes
+    constexpr uint8_t decode_high[32] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0x80, 0x00, 0x10, 0xff, 0xc0, 0x40, 0x50,
+        0xff, 0xff, 0x20, 0x30, 0xff, 0xf0, 0x60, 0x70,
+        0xff, 0x90, 0xa0, 0xb0, 0xff, 0xd0, 0xe0, 0xff
+    };
+
+    constexpr uint8_t decode_low[32] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0x08, 0x00, 0x01, 0xff, 0x0c, 0x04, 0x05,
+        0xff, 0xff, 0x02, 0x03, 0xff, 0x0f, 0x06, 0x07,
+        0xff, 0x09, 0x0a, 0x0b, 0xff, 0x0d, 0x0e, 0xff
+    };
+
+    constexpr uint8_t encode_nibble[16] = {
+        0x0a, 0x0b, 0x12, 0x13,
+        0x0e, 0x0f, 0x16, 0x17,
+        0x09, 0x19, 0x1a, 0x1b,
+        0x0d, 0x1d, 0x1e, 0x15
+    };
+
+    // Ten GCR bits to a byte, bit 8 set for bad GCR. The low byte is what
+    // the nibble tables give, so damaged sectors read back the same.
+    struct DecodeTable {
+        uint16_t value[1024];
+
+        constexpr DecodeTable() : value()
+        {
+            for (uint16_t i = 0; i < 1024; i++)
+            {
+                uint8_t high = decode_high[i >> 5];
+                uint8_t low = decode_low[i & 0x1f];
+                value[i] = (high | low) | ((high == 0xff || low == 0xff) ? 0x100 : 0);
+            }
+        }
+    };
+
+    struct EncodeTable {
+        uint16_t value[256];
+
+        constexpr EncodeTable() : value()
+        {
+            for (uint16_t i = 0; i < 256; i++)
+                value[i] = (encode_nibble[i >> 4] << 5) | encode_nibble[i & 0x0f];
+        }
+    };
+
+    constexpr DecodeTable decode_table;
+    constexpr EncodeTable encode_table;
+
+    // 64 GCR bits starting at bit, first bit in the MSB. Both targets are
+    // little endian, the bytes are swapped into stream order.
+    inline uint64_t window(const uint8_t *gcr, uint32_t bit)
+    {
+        uint64_t w;
+        std::memcpy(&w, gcr + (bit >> 3), sizeof(w));
+        return __builtin_bswap64(w) << (bit & 7);
+    }
+}
+
+
+uint32_t GCRCodec::findSync(const uint8_t *gcr, uint32_t bit, uint32_t end)
+{
+    while (bit < end)
+    {
+        // Fold the window until each set bit starts a run of ten ones.
+        // The shifts pull in zeros, so runs past the window don't count.
+        uint64_t w = window(gcr, bit);
+        uint64_t pairs = w & (w << 1);
+        uint64_t runs = pairs & (pairs << 2);
+        runs &= runs << 4;
+        runs &= pairs << 8;
+        if (!runs)
+        {
+            // Every start up to bit 54 was checked
+            bit = (bit & ~7) + 48;
+            continue;
+        }
+
+        bit += __builtin_clzll(runs);
+        if (bit >= end)
+            break;
+
+        // The mark ends at the first zero, it may span several windows
+        while (bit < end)
+        {
+            uint32_t valid = 64 - (bit & 7);
+            uint64_t zeros = ~window(gcr, bit);
+            uint32_t ones = zeros ? __builtin_clzll(zeros) : 64;
+            if (ones < valid)
+                return (bit + ones < end) ? bit + ones : end;
+            bit += valid;
+        }
+        break;
+    }
+    return end;
+}
+
+bool GCRCodec::decode(const uint8_t *gcr, uint32_t bit, uint8_t *plain, uint32_t bytes)
+{
+    uint16_t bad = 0;
+    for (uint32_t i = 0; i < bytes; i += 4, bit += 40)
+    {
+        uint64_t w = window(gcr, bit);
+        uint16_t a = decode_table.value[w >> 54];
+        uint16_t b = decode_table.value[(w >> 44) & 0x3ff];
+        uint16_t c = decode_table.value[(w >> 34) & 0x3ff];
+        uint16_t d = decode_table.value[(w >> 24) & 0x3ff];
+        plain[i] = a;
+        plain[i + 1] = b;
+        plain[i + 2] = c;
+        plain[i + 3] = d;
+        bad |= a | b | c | d;
+    }
+    return !(bad & 0x100);
+}
+
+uint8_t GCRCodec::decodeGroup(const uint8_t *gcr, uint8_t *plain)
+{
+    uint64_t w = ((uint64_t)gcr[0] << 32) | ((uint32_t)gcr[1] << 24) | (gcr[2] << 16) | (gcr[3] << 8) | gcr[4];
+    uint8_t good = 4;
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        uint16_t v = decode_table.value[(w >> (30 - i * 10)) & 0x3ff];
+        plain[i] = v;
+        if ((v & 0x100) && good == 4)
+            good = i;
+    }
+    return good;
+}
+
+void GCRCodec::encode(const uint8_t *plain, uint8_t *gcr, uint32_t bytes)
+{
+    for (uint32_t i = 0; i < bytes; i += 4, plain += 4, gcr += 5)
+    {
+        uint64_t w = ((uint64_t)encode_table.value[plain[0]] << 30) |
+                     ((uint64_t)encode_table.value[plain[1]] << 20) |
+                     ((uint32_t)encode_table.value[plain[2]] << 10) |
+                     encode_table.value[plain[3]];
+        gcr[0] = w >> 32;
+        gcr[1] = w >> 24;
+        gcr[2] = w >> 16;
+        gcr[3] = w >> 8;
+        gcr[4] = w;
+    }
+}
+
+// Next header after bit and the data block that follows it. Headers with
+// bad GCR can't be trusted for their sector number and are skipped, as
+// are other sectors than want unless it is 0xFF.
+bool GCRCodec::next(const uint8_t *gcr, uint32_t size, uint8_t track, uint8_t want, uint32_t &bit, uint8_t &sector, GCRSector &out)
+{
+    uint32_t end = size * 8;
+
+    // A data block may start past the index hole, as long as all of it
+    // decodes from the copy in the slack
+    uint32_t data_end = (size + GCR_TRACK_SLACK - GCR_DATA_BYTES - 8) * 8;
+
+    while ((bit = findSync(gcr, bit, end)) < end)
+    {
+        uint8_t header[8];
+        if (!decode(gcr, bit, header, sizeof(header)) || header[0] != 0x08)
+            continue;
+        if ((track && header[3] != track) || (want != 0xFF && header[2] != want))
+            continue;
+
+        sector = header[2];
+        out.id[0] = header[5];
+        out.id[1] = header[4];
+        out.status = SECTOR_OK;
+        if (header[1] ^ header[2] ^ header[3] ^ header[4] ^ header[5])
+            out.status = BAD_HEADER_CHECKSUM;
+        bit += GCR_HEADER_BYTES * 8;
+
+        // Without a data block the next sync is another header, leave
+        // bit in front of it
+        uint8_t block[260];
+        uint32_t data = findSync(gcr, bit, data_end);
+        if (data >= data_end || !decode(gcr, data, block, 4) || block[0] != 0x07)
+        {
+            out.status = (out.status == SECTOR_OK) ? DATA_NOT_FOUND : out.status;
+            return true;
+        }
+
+        bool good = decode(gcr, data + 40, block + 4, sizeof(block) - 4);
+        std::memcpy(out.data, block + 1, sizeof(out.data));
+        bit = data + GCR_DATA_BYTES * 8;
+
+        uint8_t checksum = 0;
+        for (uint16_t i = 1; i <= 256; i++)
+            checksum ^= block[i];
+
+        if (!good)
+            out.status = (out.status == SECTOR_OK) ? BAD_GCR_CODE : out.status;
+        else if (checksum != block[257])
+            out.status = (out.status == SECTOR_OK) ? BAD_DATA_CHECKSUM : out.status;
+        return true;
+    }
+    return false;
+}
+
+static void wrapTrack(uint8_t *gcr, uint32_t size)
+{
+    uint32_t wrap = (size < GCR_TRACK_SLACK) ? size : GCR_TRACK_SLACK;
+    std::memcpy(gcr + size, gcr, wrap);
+    std::memset(gcr + size + wrap, 0x00, GCR_TRACK_SLACK - wrap);
+}
+
+uint8_t GCRCodec::decodeTrack(uint8_t *gcr, uint32_t size, uint8_t track, GCRSector *sectors, uint8_t count)
+{
+    for (uint8_t i = 0; i < count; i++)
+        sectors[i].status = HEADER_NOT_FOUND;
+    if (!size)
+        return 0;
+
+    wrapTrack(gcr, size);
+
+    uint8_t good = 0;
+    uint32_t bit = 0;
+    uint8_t sector;
+    GCRSector found;
+    while (next(gcr, size, track, 0xFF, bit, sector, found))
+    {
+        if (sector >= count || sectors[sector].status == SECTOR_OK)
+            continue;
+
+        if (found.status == SECTOR_OK)
+            good++;
+        if (found.status == SECTOR_OK || sectors[sector].status == HEADER_NOT_FOUND)
+            sectors[sector] = found;
+    }
+    return good;
+}
+
+uint8_t GCRCodec::decodeSector(uint8_t *gcr, uint32_t size, uint8_t track, uint8_t sector, GCRSector &out)
+{
+    out.status = HEADER_NOT_FOUND;
+    if (!size)
+        return out.status;
+
+    wrapTrack(gcr, size);
+
+    uint32_t bit = 0;
+    uint8_t found_sector;
+    GCRSector found;
+    while (next(gcr, size, track, sector, bit, found_sector, found))
+    {
+        if (found.status == SECTOR_OK || out.status == HEADER_NOT_FOUND)
+            out = found;
+        if (out.status == SECTOR_OK)
+            break;
+    }
+    return out.status;
+}
@@ -0,0 +1,81 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// Bulk GCR decoding of whole in-memory tracks
+//
+// Sync marks are found a 64 bit window at a time: ten set bits in a row
+// show up as a set bit after folding the window onto itself, and count
+// leading zeros gives its position. Data is decoded ten bits (two GCR
+// quintets) at a time through one combined table, so a group of five
+// GCR bytes is one load and four lookups. Positions are in bits, so
+// sectors don't have to be byte aligned on the track.
+//
+// http://www.linusakesson.net/programming/gcr-decoding/index.php
+// https://www.pagetable.com/?p=1356
+//
+
+#ifndef MEATLOAF_MEDIA_GCR_CODEC
+#define MEATLOAF_MEDIA_GCR_CODEC
+
+#include <cstddef>
+#include <cstdint>
+
+#include "gcr.h"
+
+// Extra bytes after a track buffer. The start of the track is copied
+// there so sectors crossing the index hole decode in one go.
+#define GCR_TRACK_SLACK 512
+
+#define GCR_HEADER_BYTES 10     // 8 bytes decoded
+#define GCR_DATA_BYTES   325    // 260 bytes decoded
+
+struct GCRSector {
+    uint8_t status = HEADER_NOT_FOUND;  // SECTOR_OK or a disk controller error code
+    uint8_t id[2] = { 0 };              // Disk ID from the header, as stored in the BAM
+    uint8_t data[256] = { 0 };
+};
+
+class GCRCodec {
+public:
+    // Bit position right after the next sync mark at or after bit, end if
+    // there is none. Buffers must be readable 8 bytes past end / 8.
+    static uint32_t findSync(const uint8_t *gcr, uint32_t bit, uint32_t end);
+
+    // Decode bytes (a multiple of 4) starting at bit. Returns false on
+    // bad GCR, the affected bytes hold the old nibble table result.
+    static bool decode(const uint8_t *gcr, uint32_t bit, uint8_t *plain, uint32_t bytes);
+
+    // Byte aligned group of 5 GCR bytes into 4 bytes, for the nibtools
+    // helpers. Returns the number of bytes decoded before the first bad one.
+    static uint8_t decodeGroup(const uint8_t *gcr, uint8_t *plain);
+    static void encode(const uint8_t *plain, uint8_t *gcr, uint32_t bytes);
+
+    // Decode a whole track of size bytes. The buffer needs GCR_TRACK_SLACK
+    // bytes after size, they are overwritten. sectors[n] receives sector n
+    // for n < count; a sector that decodes cleanly wins over a damaged copy.
+    // Headers for another track are skipped unless track is 0.
+    // Returns the number of sectors that decoded with SECTOR_OK.
+    static uint8_t decodeTrack(uint8_t *gcr, uint32_t size, uint8_t track, GCRSector *sectors, uint8_t count);
+
+    // Same for a single sector, stops at the first clean copy
+    static uint8_t decodeSector(uint8_t *gcr, uint32_t size, uint8_t track, uint8_t sector, GCRSector &out);
+
+private:
+    static bool next(const uint8_t *gcr, uint32_t size, uint8_t track, uint8_t want, uint32_t &bit, uint8_t &sector, GCRSector &out);
+};
+
+#endif // MEATLOAF_MEDIA_GCR_CODEC
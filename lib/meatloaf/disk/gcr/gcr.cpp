@@ -25,6 +25,7 @@
 #include <stdint.h>
 
 #include "gcr.h"
+#include "codec.h"
 #include "prot.h"
 
 char sector_map_1541[MAX_TRACKS_1541 + 1] = {
@@ -57,117 +58,72 @@ int capacity_min[] =		{ (int) (DENSITY0 / 303), (int) (DENSITY1 / 303), (int) (D
 int capacity[] = 				{ (int) (DENSITY0 / 300), (int) (DENSITY1 / 300), (int) (DENSITY2 / 300), (int) (DENSITY3 / 300) };
 int capacity_max[] =		{ (int) (DENSITY0 / 296), (int) (DENSITY1 / 296), (int) (DENSITY2 / 296), (int) (DENSITY3 / 296) };
 
-/* Nibble-to-GCR conversion table */
-static uint8_t GCR_conv_data[16] = {
-	0x0a, 0x0b, 0x12, 0x13,
-	0x0e, 0x0f, 0x16, 0x17,
-	0x09, 0x19, 0x1a, 0x1b,
-	0x0d, 0x1d, 0x1e, 0x15
-};
-
-/* GCR-to-Nibble conversion tables */
-static uint8_t GCR_decode_high[32] = {
-	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	0xff, 0x80, 0x00, 0x10, 0xff, 0xc0, 0x40, 0x50,
-	0xff, 0xff, 0x20, 0x30, 0xff, 0xf0, 0x60, 0x70,
-	0xff, 0x90, 0xa0, 0xb0, 0xff, 0xd0, 0xe0, 0xff
-};
-
-static uint8_t GCR_decode_low[32] = {
-	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	0xff, 0x08, 0x00, 0x01, 0xff, 0x0c, 0x04, 0x05,
-	0xff, 0xff, 0x02, 0x03, 0xff, 0x0f, 0x06, 0x07,
-	0xff, 0x09, 0x0a, 0x0b, 0xff, 0x0d, 0x0e, 0xff
-};
+/* GCR tables and bulk decoding live in codec.cpp */
 
+/* Sync flag goes up after the 10th bit: a 0xff byte following a byte
+   that ends in two set bits. Look for 0xff bytes a word at a time. */
+static inline int
+has_ff_byte(uint32_t w)
+{
+	w = ~w;
+	return ((w - 0x01010101) & ~w & 0x80808080) != 0;
+}
 
 int
 find_sync(uint8_t ** gcr_pptr, uint8_t * gcr_end)
 {
+	uint8_t *p = *gcr_pptr;
+	uint32_t w;
+
 	while (1)
 	{
-		if ((*gcr_pptr) + 1 >= gcr_end)
+		if (p + 5 < gcr_end)
+		{
+			memcpy(&w, p + 1, sizeof(w));
+			if (!has_ff_byte(w))
+			{
+				p += 4;
+				continue;
+			}
+		}
+
+		if (p + 1 >= gcr_end)
 		{
 			*gcr_pptr = gcr_end;
 			return 0;	/* not found */
 		}
 
-		// sync flag goes up after the 10th bit
-		if ( ((*gcr_pptr)[0] & 0x03) == 0x03 && (*gcr_pptr)[1] == 0xff)
+		if ((p[0] & 0x03) == 0x03 && p[1] == 0xff)
 			break;
 
-		(*gcr_pptr)++;
+		p++;
+	}
+
+	p++;
+	while (p + 4 <= gcr_end)
+	{
+		memcpy(&w, p, sizeof(w));
+		if (w != 0xffffffff)
+			break;
+		p += 4;
 	}
+	while (p < gcr_end && *p == 0xff)
+		p++;
 
-	(*gcr_pptr)++;
-	while (*gcr_pptr < gcr_end && **gcr_pptr == 0xff)
-		(*gcr_pptr)++;
-	return (*gcr_pptr < gcr_end);
+	*gcr_pptr = p;
+	return (p < gcr_end);
 }
 
 void
 convert_4bytes_to_GCR(uint8_t * buffer, uint8_t * ptr)
 {
-	*ptr = GCR_conv_data[(*buffer) >> 4] << 3;
-	*ptr |= GCR_conv_data[(*buffer) & 0x0f] >> 2;
-	ptr++;
-
-	*ptr = GCR_conv_data[(*buffer) & 0x0f] << 6;
-	buffer++;
-	*ptr |= GCR_conv_data[(*buffer) >> 4] << 1;
-	*ptr |= GCR_conv_data[(*buffer) & 0x0f] >> 4;
-	ptr++;
-
-	*ptr = GCR_conv_data[(*buffer) & 0x0f] << 4;
-	buffer++;
-	*ptr |= GCR_conv_data[(*buffer) >> 4] >> 1;
-	ptr++;
-
-	*ptr = GCR_conv_data[(*buffer) >> 4] << 7;
-	*ptr |= GCR_conv_data[(*buffer) & 0x0f] << 2;
-	buffer++;
-	*ptr |= GCR_conv_data[(*buffer) >> 4] >> 3;
-	ptr++;
-
-	*ptr = GCR_conv_data[(*buffer) >> 4] << 5;
-	*ptr |= GCR_conv_data[(*buffer) & 0x0f];
+	GCRCodec::encode(buffer, ptr, 4);
 }
 
 int
 convert_4bytes_from_GCR(uint8_t * gcr, uint8_t * plain)
 {
-	uint8_t hnibble, lnibble;
-	int badGCR, nConverted;
-
-	badGCR = 0;
-
-	hnibble = GCR_decode_high[gcr[0] >> 3];
-	lnibble = GCR_decode_low[((gcr[0] << 2) | (gcr[1] >> 6)) & 0x1f];
-	if ((hnibble == 0xff || lnibble == 0xff) && !badGCR)
-		badGCR = 1;
-	*plain++ = hnibble | lnibble;
-
-	hnibble = GCR_decode_high[(gcr[1] >> 1) & 0x1f];
-	lnibble = GCR_decode_low[((gcr[1] << 4) | (gcr[2] >> 4)) & 0x1f];
-	if ((hnibble == 0xff || lnibble == 0xff) && !badGCR)
-		badGCR = 2;
-	*plain++ = hnibble | lnibble;
-
-	hnibble = GCR_decode_high[((gcr[2] << 1) | (gcr[3] >> 7)) & 0x1f];
-	lnibble = GCR_decode_low[(gcr[3] >> 2) & 0x1f];
-	if ((hnibble == 0xff || lnibble == 0xff) && !badGCR)
-		badGCR = 3;
-	*plain++ = hnibble | lnibble;
-
-	hnibble = GCR_decode_high[((gcr[3] << 3) | (gcr[4] >> 5)) & 0x1f];
-	lnibble = GCR_decode_low[gcr[4] & 0x1f];
-	if ((hnibble == 0xff || lnibble == 0xff) && !badGCR)
-		badGCR = 4;
-	*plain++ = hnibble | lnibble;
-
-	nConverted = (badGCR == 0) ? 4 : (badGCR - 1);
-
-	return (nConverted);
+	return GCRCodec::decodeGroup(gcr, plain);
 }
 
 int
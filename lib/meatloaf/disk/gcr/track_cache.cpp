@@ -0,0 +1,68 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "track_cache.h"
+
+const std::vector<GCRSector> *GCRTrackCache::find(uint8_t track)
+{
+    for (auto &t : tracks)
+    {
+        if (t.track == track)
+        {
+            t.used = ++clock;
+            return &t.sectors;
+        }
+    }
+    return nullptr;
+}
+
+const std::vector<GCRSector> &GCRTrackCache::insert(uint8_t track, uint8_t *gcr, uint32_t size, uint8_t count)
+{
+    Track *slot = nullptr;
+    for (auto &t : tracks)
+    {
+        if (t.track == track)
+        {
+            slot = &t;
+            break;
+        }
+    }
+
+    if (!slot && tracks.size() < GCR_TRACK_CACHE_SIZE)
+    {
+        // Tracks never move, a stream keeps pointing at its sector
+        tracks.reserve(GCR_TRACK_CACHE_SIZE);
+        tracks.push_back({ track, 0, {} });
+        slot = &tracks.back();
+    }
+
+    if (!slot)
+    {
+        slot = &tracks[0];
+        for (auto &t : tracks)
+        {
+            if (t.used < slot->used)
+                slot = &t;
+        }
+    }
+
+    slot->track = track;
+    slot->used = ++clock;
+    slot->sectors.resize(count);
+    GCRCodec::decodeTrack(gcr, size, track, slot->sectors.data(), count);
+    return slot->sectors;
+}
@@ -0,0 +1,66 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// Decoded tracks of a GCR image
+//
+// The first sector read on a track decodes all of it, the rest of the
+// track is then a lookup by sector number. Directory listings and file
+// loads stay on a track for many sectors, so each raw track is read and
+// decoded once instead of once per sector.
+//
+
+#ifndef MEATLOAF_MEDIA_GCR_TRACK_CACHE
+#define MEATLOAF_MEDIA_GCR_TRACK_CACHE
+
+#include <cstdint>
+#include <vector>
+
+#include "codec.h"
+
+// Decoded tracks kept per image, about 5.5KB each
+#ifndef GCR_TRACK_CACHE_SIZE
+#ifdef BOARD_HAS_PSRAM
+#define GCR_TRACK_CACHE_SIZE 42
+#else
+#define GCR_TRACK_CACHE_SIZE 2
+#endif
+#endif
+
+class GCRTrackCache {
+public:
+    // Sectors of a cached track, indexed by sector number. nullptr if the
+    // track hasn't been decoded yet.
+    const std::vector<GCRSector> *find(uint8_t track);
+
+    // Decode a raw track, see GCRCodec::decodeTrack for the buffer, and
+    // keep it in place of the track used longest ago
+    const std::vector<GCRSector> &insert(uint8_t track, uint8_t *gcr, uint32_t size, uint8_t count);
+
+    void clear() { tracks.clear(); };
+
+private:
+    struct Track {
+        uint8_t track;
+        uint32_t used;
+        std::vector<GCRSector> sectors;
+    };
+
+    std::vector<Track> tracks;
+    uint32_t clock = 0;
+};
+
+#endif // MEATLOAF_MEDIA_GCR_TRACK_CACHE
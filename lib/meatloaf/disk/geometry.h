@@ -0,0 +1,259 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// Disk geometry descriptors for sector based images (D64, D71, D81, DNP, etc)
+//
+// Track layouts are built at compile time from the speed zones of each
+// drive, so track/sector -> LBA is a single table lookup and nothing is
+// allocated when an image is opened.
+//
+
+#ifndef MEATLOAF_MEDIA_GEOMETRY
+#define MEATLOAF_MEDIA_GEOMETRY
+
+#include <cstdint>
+#include <cstddef>
+#include <initializer_list>
+
+#define MAX_BAM_ENTRIES 4
+
+
+struct BlockAllocationMap {
+    uint8_t track;
+    uint8_t sector;
+    uint8_t offset;
+    uint8_t start_track;
+    uint8_t end_track;
+    uint8_t byte_count;
+};
+
+struct Partition {
+    uint8_t header_track;
+    uint8_t header_sector;
+    uint8_t header_offset;
+    uint8_t directory_track;
+    uint8_t directory_sector;
+    uint8_t directory_offset;
+    uint8_t bam_count;
+    BlockAllocationMap block_allocation_map[MAX_BAM_ENTRIES];
+};
+
+// Tracks [first_track, last_track] all have the same number of sectors
+struct SpeedZone {
+    uint8_t first_track;
+    uint8_t last_track;
+    uint16_t sectors;
+};
+
+struct DiskGeometry {
+    uint8_t tracks;             // Highest track number
+    const uint16_t *sectors;    // Sectors on each track (index 0 unused)
+    const uint32_t *offsets;    // LBA of sector 0 on each track, offsets[tracks + 1] is the block count
+    Partition partition;        // Default header, directory and BAM locations
+    uint8_t interleave[2];      // Directory, File
+
+    constexpr uint16_t sectorCount( uint8_t track ) const
+    {
+        return ( track && track <= tracks ) ? sectors[track] : 0;
+    }
+
+    constexpr uint32_t blockCount() const
+    {
+        return offsets[tracks + 1];
+    }
+
+    constexpr bool valid( uint8_t track, uint8_t sector ) const
+    {
+        return track && track <= tracks && sector < sectors[track];
+    }
+
+    constexpr uint32_t lba( uint8_t track, uint8_t sector ) const
+    {
+        return offsets[track] + sector;
+    }
+
+    // LBA -> track/sector
+    constexpr bool locate( uint32_t lba, uint8_t &track, uint8_t &sector ) const
+    {
+        if ( lba >= blockCount() )
+            return false;
+
+        // Last track whose first LBA is <= lba
+        uint16_t lo = 1, hi = tracks;
+        while ( lo < hi )
+        {
+            uint16_t mid = ( lo + hi + 1 ) / 2;
+            if ( offsets[mid] <= lba )
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        track = lo;
+        sector = lba - offsets[lo];
+        return true;
+    }
+};
+
+template <uint8_t TRACKS>
+struct TrackLayout {
+    uint16_t sectors[TRACKS + 2] = {};
+    uint32_t offsets[TRACKS + 2] = {};
+
+    constexpr TrackLayout( std::initializer_list<SpeedZone> zones )
+    {
+        for ( const SpeedZone &z : zones )
+        {
+            for ( uint16_t t = z.first_track; t <= z.last_track && t <= TRACKS; t++ )
+                sectors[t] = z.sectors;
+        }
+
+        uint32_t lba = 0;
+        for ( uint16_t t = 1; t <= TRACKS + 1; t++ )
+        {
+            offsets[t] = lba;
+            lba += sectors[t];
+        }
+    }
+
+    constexpr DiskGeometry geometry( const Partition &partition, uint8_t dir_interleave = 3, uint8_t file_interleave = 10 ) const
+    {
+        return { TRACKS, sectors, offsets, partition, { dir_interleave, file_interleave } };
+    }
+};
+
+
+namespace Geometry
+{
+    // Track layouts
+
+    inline constexpr TrackLayout<42> CBM1541 = {
+        { 1, 17, 21 }, { 18, 24, 19 }, { 25, 30, 18 }, { 31, 42, 17 }
+    };
+
+    inline constexpr TrackLayout<70> CBM1571 = {
+        { 1, 17, 21 }, { 18, 24, 19 }, { 25, 30, 18 }, { 31, 35, 17 },
+        { 36, 52, 21 }, { 53, 59, 19 }, { 60, 65, 18 }, { 66, 70, 17 }
+    };
+
+    inline constexpr TrackLayout<81> CBM1581 = {
+        { 1, 81, 40 }
+    };
+
+    inline constexpr TrackLayout<77> CBM8050 = {
+        { 1, 39, 29 }, { 40, 53, 27 }, { 54, 64, 25 }, { 65, 77, 23 }
+    };
+
+    inline constexpr TrackLayout<154> CBM8250 = {
+        { 1, 39, 29 }, { 40, 53, 27 }, { 54, 64, 25 }, { 65, 77, 23 },
+        { 78, 116, 29 }, { 117, 130, 27 }, { 131, 141, 25 }, { 142, 154, 23 }
+    };
+
+    inline constexpr TrackLayout<153> CBM9060 = {
+        { 1, 153, 4 * 32 }   // Heads * Sectors
+    };
+
+    inline constexpr TrackLayout<153> CBM9090 = {
+        { 1, 153, 6 * 32 }   // Heads * Sectors
+    };
+
+    inline constexpr TrackLayout<40> BACKBIT_136 = {
+        { 1, 40, 136 }
+    };
+
+    inline constexpr TrackLayout<40> BACKBIT_144 = {
+        { 1, 40, 144 }
+    };
+
+    inline constexpr TrackLayout<255> NATIVE = {
+        { 1, 255, 256 }
+    };
+
+    inline constexpr TrackLayout<40> ATARI_SD = {
+        { 1, 40, 18 }
+    };
+
+    inline constexpr TrackLayout<40> ATARI_ED = {
+        { 1, 40, 26 }
+    };
+
+    inline constexpr TrackLayout<40> DSK16 = {
+        { 1, 40, 16 }
+    };
+
+    // Formats
+
+    inline constexpr DiskGeometry D64 = CBM1541.geometry(
+        //  header      directory       BAM: track, sector, offset, start_track, end_track, byte_count
+        { 18, 0, 0x90, 18, 1, 0x00, 1, { { 18, 0, 0x04, 1, 35, 4 } } }
+    );
+
+    inline constexpr DiskGeometry D71 = CBM1571.geometry(
+        { 18, 0, 0x90, 18, 1, 0x00, 2, { { 18, 0, 0x04, 1, 35, 4 }, { 53, 0, 0x00, 36, 70, 3 } } }
+    );
+
+    inline constexpr DiskGeometry D81 = CBM1581.geometry(
+        { 40, 0, 0x04, 40, 3, 0x00, 2, { { 40, 1, 0x10, 1, 40, 6 }, { 40, 2, 0x10, 41, 80, 6 } } }, 1, 1
+    );
+
+    inline constexpr DiskGeometry D80 = CBM8050.geometry(
+        { 39, 0, 0x06, 39, 1, 0x00, 2, { { 38, 0, 0x06, 1, 50, 5 }, { 38, 3, 0x06, 51, 77, 5 } } }
+    );
+
+    inline constexpr DiskGeometry D82 = CBM8250.geometry(
+        { 39, 0, 0x06, 39, 1, 0x00, 4, { { 38, 0, 0x06, 1, 50, 5 }, { 38, 3, 0x06, 51, 100, 5 },
+                                         { 38, 6, 0x06, 101, 150, 5 }, { 38, 9, 0x06, 151, 154, 5 } } }
+    );
+
+    // D90 header, directory and BAM locations are read from the image
+    inline constexpr Partition D90_PARTITION =
+        { 39, 0, 0x06, 39, 1, 0x00, 4, { { 38, 0, 0x06, 1, 50, 5 }, { 38, 3, 0x06, 51, 100, 5 },
+                                         { 38, 6, 0x06, 101, 150, 5 }, { 38, 9, 0x06, 151, 153, 5 } } };
+    inline constexpr DiskGeometry D9060 = CBM9060.geometry( D90_PARTITION );
+    inline constexpr DiskGeometry D9090 = CBM9090.geometry( D90_PARTITION );
+
+    inline constexpr Partition D8B_PARTITION =
+        { 1, 0, 0x04, 1, 4, 0x00, 1, { { 1, 1, 0x00, 1, 40, 18 } } };
+    inline constexpr DiskGeometry D8B_136 = BACKBIT_136.geometry( D8B_PARTITION );
+    inline constexpr DiskGeometry D8B_144 = BACKBIT_144.geometry( D8B_PARTITION );
+
+    inline constexpr DiskGeometry DFI = NATIVE.geometry(
+        { 1, 0, 0x90, 1, 4, 0x00, 1, { { 1, 0, 0x00, 1, 40, 4 } } }
+    );
+
+    inline constexpr DiskGeometry DNP = NATIVE.geometry(
+        { 1, 0, 0x04, 1, 0, 0x20, 1, { { 1, 2, 0x10, 1, 255, 8 } } }, 1, 1
+    );
+
+    inline constexpr Partition ATR_PARTITION =
+        { 1, 0, 0x04, 1, 4, 0x00, 1, { { 1, 0, 0x00, 1, 40, 4 } } };
+    inline constexpr DiskGeometry ATR_SD = ATARI_SD.geometry( ATR_PARTITION );
+    inline constexpr DiskGeometry ATR_ED = ATARI_ED.geometry( ATR_PARTITION );
+
+    inline constexpr DiskGeometry DSK = DSK16.geometry(
+        { 35, 0, 0x04, 40, 3, 0x00, 1, { { 40, 1, 0x10, 1, 40, 6 } } }
+    );
+
+    static_assert( D64.blockCount() == 683 + 5 * 17 + 2 * 17, "D64 layout" );
+    static_assert( D64.lba( 18, 0 ) == 357, "D64 directory track" );
+    static_assert( D71.lba( 36, 0 ) == 683, "D71 second side" );
+    static_assert( D81.lba( 40, 0 ) == 1560, "D81 directory track" );
+    static_assert( D80.lba( 78, 0 ) == 2083, "D80 layout" );
+    static_assert( D82.blockCount() == 4166, "D82 layout" );
+    static_assert( DNP.blockCount() == 255 * 256, "DNP layout" );
+}
+
+#endif // MEATLOAF_MEDIA_GEOMETRY
@@ -23,14 +23,14 @@
 #ifndef MEATLOAF_MEDIA_NIB
 #define MEATLOAF_MEDIA_NIB
 
+#include <array>
+
 #include "../meatloaf.h"
 #include "d64.h"
+#include "gcr/track_cache.h"
 
 #include "endianness.h"
 
-#define NIB_TRACK_LENGTH 0x2000
-#define NIB_HEADER_SIZE 0xFF
-
 
 /********************************************************
  * Streams
@@ -47,15 +47,6 @@ protected:
         uint16_t track_size;
     };
 
-    struct SectorHeader {
-        uint8_t code; // 0x08
-        uint8_t checksum;
-        uint8_t sector;
-        uint8_t track;
-        uint8_t id1;
-        uint8_t id0;
-    };
-
 public:
     NIBMStream(std::shared_ptr<MStream> is) : D64MStream(is) 
     {
@@ -65,25 +56,36 @@ public:
         //block_allocation_map = { {18, 0, 0x04, 1, 35, 4}, {53, 0, 0x00, 36, 70, 3} };
         //sectorsPerTrack = { 17, 18, 19, 21 };
 
+        // GCR images are not sector addressable, read the container directly
+        disableSectorCache();
         containerStream->read((uint8_t*)&gcr_header, sizeof(gcr_header));
 
         Debug_printv("signature[%s] version[%d] track_count[%d] track_size[%d]", gcr_header.signature, gcr_header.version, gcr_header.track_count, gcr_header.track_size);
+
+        // Half track and density pairs from 0x10 in the order the tracks
+        // are stored, a zero half track ends the list
+        uint8_t index[NIB_HEADER_SIZE + 1 - 0x10] = { 0x00 };
+        containerStream->seek(0x10);
+        containerStream->read(index, sizeof(index));
+
+        track_index.fill(0xFF);
+        for (uint8_t i = 0; i < sizeof(index) / 2 && index[i * 2]; i++)
+            track_index[index[i * 2]] = i;
     };
 
     MediaHeader gcr_header;
-    SectorHeader gcr_sector_header;
 
     bool seekSector( uint8_t track, uint8_t sector, uint8_t offset = 0 ) override;
 
     uint32_t readContainer(uint8_t *buf, uint32_t size) override;
 
-    bool readSectorHeader();
-    bool readSector();
-    bool findSync(uint32_t gcr_end);
-    int convert4BytesFromGCR(uint8_t * gcr, uint8_t * plain);
-
 protected:
-    uint8_t sector_buffer[260];
+    const std::vector<GCRSector> *readTrack(uint8_t track);
+
+    std::array<uint8_t, 256> track_index;   // Half track to track number in the file, 0xFF if missing
+    std::vector<uint8_t> track_buffer;      // Raw GCR of the track being decoded
+    GCRTrackCache track_cache;
+    const GCRSector *gcr_sector = nullptr;
 
 private:
     friend class NIBMFile;
@@ -96,7 +98,10 @@ private:
 
 class NIBMFile: public D64MFile {
 public:
-    NIBMFile(std::string path) : D64MFile(path) {};
+    NIBMFile(std::string path) : D64MFile(path)
+    {
+        isWritable = false; // Raw GCR track dumps, no native write path
+    };
 
     std::shared_ptr<MStream> getDecodedStream(std::shared_ptr<MStream> is) override
     {
@@ -113,17 +118,12 @@ public:
 class NIBMFileSystem: public MFileSystem
 {
 public:
-    NIBMFileSystem(): MFileSystem("nib") {};
+    NIBMFileSystem(): MFileSystem("nib") {
+        extensions = { ".nib", ".nb2", ".nbz" };
+    };
 
     bool handles(std::string fileName) override {
-        return byExtension(
-            {
-                ".nib",
-                ".nb2",
-                ".nbz"
-             },
-            fileName
-        );
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
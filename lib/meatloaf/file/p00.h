@@ -130,10 +130,12 @@ public:
 class P00MFileSystem: public MFileSystem
 {
 public:
-    P00MFileSystem(): MFileSystem("p00") {};
+    P00MFileSystem(): MFileSystem("p00") {
+        extensions = { ".p00" };
+    };
 
     bool handles(std::string fileName) override {
-        return byExtension(".p00", fileName);
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
@@ -0,0 +1,380 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "meat_broker.h"
+
+#include <vector>
+
+#include <esp_timer.h>
+
+#include "../../include/debug.h"
+
+std::unordered_map<StreamBroker::CacheKey, std::shared_ptr<StreamBroker::Shared>, StreamBroker::PairHash> StreamBroker::stream_repo;
+std::mutex StreamBroker::lock;
+std::vector<StreamBroker::Retired> StreamBroker::retired;
+
+uint32_t StreamBroker::hits = 0;
+uint32_t StreamBroker::misses = 0;
+uint32_t StreamBroker::expired = 0;
+
+static uint64_t now_ms()
+{
+    return esp_timer_get_time() / 1000;
+}
+
+
+/********************************************************
+ * StreamBroker
+ ********************************************************/
+
+std::shared_ptr<MStream> StreamBroker::obtain(MFile *sourceFile, std::ios_base::openmode mode)
+{
+    // Writers get their own stream so data hits the medium when they close
+    if ( mode != std::ios_base::in )
+    {
+        auto stream = sourceFile->getSourceStream(mode);
+        if ( stream != nullptr && stream->url.empty() )
+            stream->url = sourceFile->url;
+
+        return stream;
+    }
+
+    flushInactiveStreams();
+
+    CacheKey key(sourceFile->url, mode);
+    std::shared_ptr<Shared> shared;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto found = stream_repo.find(key);
+        if ( found != stream_repo.end() )
+        {
+            if ( found->second->stream->isOpen() )
+            {
+                hits++;
+                shared = found->second;
+                Debug_printv("Reusing container stream url[%s] consumers[%d]", key.first.c_str(), shared.use_count() - 1);
+            }
+            else
+            {
+                stream_repo.erase(found);
+            }
+        }
+    }
+
+    if ( shared == nullptr )
+    {
+        // Opened outside the lock, nested containers come back through here
+        auto stream = sourceFile->getSourceStream(mode);
+        if ( stream == nullptr )
+            return nullptr;
+
+        if ( stream->url.empty() )
+            stream->url = sourceFile->url; // identifies the container in the sector cache
+
+        shared = std::make_shared<Shared>();
+        shared->stream = stream;
+        shared->last_used = now_ms();
+
+        std::lock_guard<std::mutex> guard(lock);
+        misses++;
+
+        // Somebody else opened it meanwhile, use theirs
+        auto inserted = stream_repo.emplace(key, shared);
+        if ( !inserted.second )
+            shared = inserted.first->second;
+
+        Debug_printv("Opened container stream url[%s] streams[%d]", key.first.c_str(), stream_repo.size());
+    }
+
+    return std::make_shared<SharedMStream>(shared);
+}
+
+void StreamBroker::flushInactiveStreams()
+{
+    std::vector<std::shared_ptr<Shared>> inactive;
+    std::vector<std::function<void()>> released;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        uint64_t now = now_ms();
+
+        for ( auto it = stream_repo.begin(); it != stream_repo.end(); )
+        {
+            auto &shared = it->second;
+
+            // Only the broker holds it, nobody can be touching last_used
+            if ( shared.use_count() == 1 && ( now - shared->last_used >= STREAM_BROKER_IDLE_MS || !shared->stream->isOpen() ) )
+            {
+                Debug_printv("Closing idle container stream url[%s]", it->first.first.c_str());
+                inactive.push_back(shared);
+                it = stream_repo.erase(it);
+                expired++;
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        for ( auto it = retired.begin(); it != retired.end(); )
+        {
+            bool held = false;
+            for ( auto &shared : it->streams )
+                held |= ( shared.use_count() > 1 );
+
+            if ( held )
+            {
+                ++it;
+                continue;
+            }
+
+            inactive.insert(inactive.end(), it->streams.begin(), it->streams.end());
+            released.push_back(std::move(it->released));
+            it = retired.erase(it);
+        }
+    }
+
+    // Close outside the lock, closing may tear down nested media streams
+    for ( auto &shared : inactive )
+        shared->stream->close();
+
+    for ( auto &callback : released )
+        callback();
+}
+
+void StreamBroker::dispose(std::string url, std::function<void()> released)
+{
+    std::vector<std::shared_ptr<Shared>> disposed;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for ( auto it = stream_repo.begin(); it != stream_repo.end(); )
+        {
+            if ( it->first.first == url )
+            {
+                disposed.push_back(it->second);
+                it = stream_repo.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    // Consumers still holding it keep it open until they let go
+    std::vector<std::shared_ptr<Shared>> held;
+    for ( auto &shared : disposed )
+    {
+        if ( shared.use_count() == 1 )
+            shared->stream->close();
+        else
+            held.push_back(shared);
+    }
+
+    if ( released == nullptr )
+        return;
+
+    if ( held.empty() )
+    {
+        released();
+        return;
+    }
+
+    Debug_printv("url[%s] still held by consumers[%d]", url.c_str(), held.size());
+    std::lock_guard<std::mutex> guard(lock);
+    retired.push_back({ std::move(held), std::move(released) });
+}
+
+void StreamBroker::clear()
+{
+    std::unordered_map<CacheKey, std::shared_ptr<Shared>, PairHash> streams;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        streams.swap(stream_repo);
+    }
+
+    for ( auto &entry : streams )
+    {
+        if ( entry.second.use_count() == 1 )
+            entry.second->stream->close();
+    }
+}
+
+StreamBroker::Stats StreamBroker::stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return { hits, misses, expired, stream_repo.size() };
+}
+
+
+/********************************************************
+ * SharedMStream
+ ********************************************************/
+
+SharedMStream::SharedMStream(std::shared_ptr<StreamBroker::Shared> shared) : shared(shared)
+{
+    url = shared->stream->url;
+    mode = shared->stream->mode;
+    _position = 0;
+}
+
+SharedMStream::~SharedMStream()
+{
+    // Idle timeout counts from the last consumer letting go
+    std::lock_guard<std::recursive_mutex> guard(shared->lock);
+    shared->last_used = now_ms();
+}
+
+std::unordered_map<std::string, std::string> SharedMStream::info()
+{
+    return shared->stream->info();
+}
+
+uint32_t SharedMStream::size()
+{
+    return shared->stream->size();
+}
+
+uint32_t SharedMStream::available()
+{
+    uint32_t size = shared->stream->size();
+    if ( _position > size )
+        return 0;
+
+    return size - _position;
+}
+
+size_t SharedMStream::error()
+{
+    return shared->stream->error();
+}
+
+bool SharedMStream::eos()
+{
+    std::lock_guard<std::recursive_mutex> guard(shared->lock);
+    if ( !sync() )
+        return true;
+
+    return shared->stream->eos();
+}
+
+bool SharedMStream::isOpen()
+{
+    return !closed && shared->stream->isOpen();
+}
+
+bool SharedMStream::isBrowsable()
+{
+    return shared->stream->isBrowsable();
+}
+
+bool SharedMStream::isRandomAccess()
+{
+    return shared->stream->isRandomAccess();
+}
+
+bool SharedMStream::isReadAhead()
+{
+    std::lock_guard<std::recursive_mutex> guard(shared->lock);
+    return shared->stream->isReadAhead();
+}
+
+bool SharedMStream::open(std::ios_base::openmode mode)
+{
+    closed = false;
+    return shared->stream->isOpen();
+}
+
+void SharedMStream::close()
+{
+    // The shared stream stays open for the other consumers, StreamBroker closes it
+    closed = true;
+}
+
+bool SharedMStream::flush()
+{
+    std::lock_guard<std::recursive_mutex> guard(shared->lock);
+    return shared->stream->flush();
+}
+
+uint32_t SharedMStream::read(uint8_t* buf, uint32_t size)
+{
+    std::lock_guard<std::recursive_mutex> guard(shared->lock);
+    if ( closed || !sync() )
+        return 0;
+
+    uint32_t bytes = shared->stream->read(buf, size);
+    _position += bytes;
+    shared->last_used = now_ms();
+    return bytes;
+}
+
+uint32_t SharedMStream::write(const uint8_t *buf, uint32_t size)
+{
+    std::lock_guard<std::recursive_mutex> guard(shared->lock);
+    if ( closed || !sync() )
+        return 0;
+
+    uint32_t bytes = shared->stream->write(buf, size);
+    _position += bytes;
+    shared->last_used = now_ms();
+    return bytes;
+}
+
+// The view is the shared stream's, another consumer's next call ends it too
+uint32_t SharedMStream::peekView(const uint8_t **view)
+{
+    std::lock_guard<std::recursive_mutex> guard(shared->lock);
+    if ( closed || !sync() )
+    {
+        *view = nullptr;
+        return 0;
+    }
+
+    shared->last_used = now_ms();
+    return shared->stream->peekView(view);
+}
+
+uint32_t SharedMStream::consume(uint32_t size)
+{
+    std::lock_guard<std::recursive_mutex> guard(shared->lock);
+    if ( closed || !sync() )
+        return 0;
+
+    uint32_t bytes = shared->stream->consume(size);
+    _position += bytes;
+    shared->last_used = now_ms();
+    return bytes;
+}
+
+bool SharedMStream::seek(uint32_t pos)
+{
+    std::lock_guard<std::recursive_mutex> guard(shared->lock);
+    if ( !shared->stream->seek(pos) )
+        return false;
+
+    _position = pos;
+    return true;
+}
+
+// Move the shared stream to this consumer's position, lock must be held
+bool SharedMStream::sync()
+{
+    if ( shared->stream->position() == _position )
+        return true;
+
+    return shared->stream->seek(_position);
+}
@@ -15,71 +15,126 @@
 // You should have received a copy of the GNU General Public License
 // along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
 
-// #ifndef MEATLOAF_STREAM_BROKER
-// #define MEATLOAF_STREAM_BROKER
-
-// #include <memory>
-// #include <unordered_map>
-// #include <string>
-// #include <functional>
-// #include "meatloaf.h"
-// #include "iec_pipe_broker.h"
-// #include "../device/disk.h"
-
-// // Custom hash function for std::pair<std::string, std::ios_base::openmode>
-// struct PairHash {
-//     template <typename T1, typename T2>
-//     std::size_t operator()(const std::pair<T1, T2>& p) const {
-//         std::size_t h1 = std::hash<T1>{}(p.first);
-//         std::size_t h2 = std::hash<T2>{}(p.second);
-//         return h1 ^ (h2 << 1); // Combine the two hash values
-//     }
-// };
-
-// class StreamBroker {
-// private:
-//     // Define the key type for the cache
-//     using CacheKey = std::pair<std::string, std::ios_base::openmode>;
-
-//     // Define the type for storing cached MStream instances
-//     std::unordered_map<CacheKey, std::shared_ptr<MStream>, PairHash> streamCache;
-
-// public:
-//     // Method to retrieve MStream instance from cache or create a new one if not found
-//     std::shared_ptr<MStream> getSourceStream(MFile* sourceFile, std::ios_base::openmode mode) {
-//         CacheKey key = std::make_pair(sourceFile->path, mode);
-//         auto it = streamCache.find(key);
-//         if (it != streamCache.end()) {
-//             return it->second; // Found in cache, return the cached instance
-//         } else {
-//             // Not found, create a new instance and cache it
-//             std::shared_ptr<MStream> newStream(sourceFile->getSourceStream(mode));
-//             streamCache[key] = newStream;
-//             return newStream;
-//         }
-//     }
-
-//     // Function to remove streamCache entries without matching iecPipe instances
-//     void flushInactiveStreams(iecPipeBroker& broker) {
-//         const auto& deviceChannelMap = broker.getDeviceChannelMap();
-
-//         for (auto keyStreamPair = streamCache.begin(); keyStreamPair != streamCache.end();) {
-//             bool inUse = false;
-//             for (const auto& keyPipePair : deviceChannelMap) {
-//                 if (keyPipePair.second->getFilename().find(keyStreamPair->first.first) != std::string::npos) {
-//                     inUse = true;
-//                     break;
-//                 }
-//             }
-
-//             if (!inUse) {
-//                 keyStreamPair->second->close(); // Close the stream before removing
-//                 keyStreamPair = streamCache.erase(keyStreamPair); // Remove the entry if no matching iecPipe found
-//             } else {
-//                 ++keyStreamPair;
-//             }
-//         }
-//     }
-// };
-
-// #endif /* MEATLOAF_STREAM_BROKER */
+// Shared container streams
+//
+// Every file opened inside the same D64/ZIP/HTTP resource used to open its
+// own container stream (and its own HTTP/TNFS session). StreamBroker keeps
+// one container stream per (url, mode) and hands each consumer a
+// SharedMStream with its own position, so channels don't clobber each
+// other's seeks. Containers nobody uses are closed after an idle timeout.
+//
+
+#ifndef MEATLOAF_STREAM_BROKER
+#define MEATLOAF_STREAM_BROKER
+
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <string>
+#include <mutex>
+#include <vector>
+
+#include "meatloaf.h"
+
+#ifndef STREAM_BROKER_IDLE_MS
+#define STREAM_BROKER_IDLE_MS 30000
+#endif
+
+
+class StreamBroker {
+public:
+    struct Shared {
+        std::shared_ptr<MStream> stream;
+        std::recursive_mutex lock;
+        uint64_t last_used;
+    };
+
+    struct Stats {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t expired;
+        size_t entries;
+    };
+
+    // Container stream of sourceFile, opened once and shared by every consumer
+    static std::shared_ptr<MStream> obtain(MFile *sourceFile, std::ios_base::openmode mode);
+
+    // Close containers that no consumer has used for STREAM_BROKER_IDLE_MS
+    static void flushInactiveStreams();
+
+    // Drop the containers of url. Consumers still holding one keep it open
+    // until they let go, released runs after that (right away if nobody
+    // holds it).
+    static void dispose(std::string url, std::function<void()> released = nullptr);
+    static void clear();
+
+    static Stats stats();
+
+private:
+    // Custom hash function for std::pair<std::string, std::ios_base::openmode>
+    struct PairHash {
+        template <typename T1, typename T2>
+        std::size_t operator()(const std::pair<T1, T2>& p) const {
+            std::size_t h1 = std::hash<T1>{}(p.first);
+            std::size_t h2 = std::hash<int>{}(p.second);
+            return h1 ^ (h2 << 1); // Combine the two hash values
+        }
+    };
+
+    using CacheKey = std::pair<std::string, std::ios_base::openmode>;
+
+    static std::unordered_map<CacheKey, std::shared_ptr<Shared>, PairHash> stream_repo;
+    static std::mutex lock;
+
+    // Disposed containers that are still held, checked with the idle ones
+    struct Retired {
+        std::vector<std::shared_ptr<Shared>> streams;
+        std::function<void()> released;
+    };
+    static std::vector<Retired> retired;
+
+    static uint32_t hits;
+    static uint32_t misses;
+    static uint32_t expired;
+};
+
+
+// One consumer's view of a shared container stream. Keeps its own position
+// and moves the shared stream there before every access.
+class SharedMStream : public MStream {
+public:
+    SharedMStream(std::shared_ptr<StreamBroker::Shared> shared);
+    ~SharedMStream() override;
+
+    std::unordered_map<std::string, std::string> info() override;
+
+    uint32_t size() override;
+    uint32_t available() override;
+    size_t error() override;
+    bool eos() override;
+
+    bool isOpen() override;
+    bool isBrowsable() override;
+    bool isRandomAccess() override;
+    bool isReadAhead() override;
+
+    bool open(std::ios_base::openmode mode) override;
+    void close() override;
+    bool flush() override;
+
+    uint32_t read(uint8_t* buf, uint32_t size) override;
+    uint32_t write(const uint8_t *buf, uint32_t size) override;
+
+    uint32_t peekView(const uint8_t **view) override;
+    uint32_t consume(uint32_t size) override;
+
+    bool seek(uint32_t pos) override;
+
+private:
+    bool sync();
+
+    std::shared_ptr<StreamBroker::Shared> shared;
+    bool closed = false;
+};
+
+#endif /* MEATLOAF_STREAM_BROKER */
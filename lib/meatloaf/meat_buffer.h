@@ -22,6 +22,7 @@
 #include <fstream>
 
 #include "meatloaf.h"
+#include "buffer_pool.h"
 
 #include "../../include/debug.h"
 
@@ -49,12 +50,27 @@ namespace Meat
 
         static const size_t gbuffer_size = 2048;
         static const size_t pbuffer_size = 512;
+        BufferPool::Buffer gpool;
+        BufferPool::Buffer ppool;
         char *gbuffer;
         char *pbuffer;
 
         std::streampos currBuffStart = 0;
         std::streampos currBuffEnd;
 
+        // bytes of a view lent by mstream that back the get area
+        uint32_t viewLen = 0;
+
+        void releaseView()
+        {
+            if (viewLen > 0)
+            {
+                mstream->consume(0);
+                viewLen = 0;
+                this->setg(gbuffer, gbuffer, gbuffer);
+            }
+        }
+
     public:
         typedef charT char_type; // 1
         typedef traits traits_type;
@@ -64,18 +80,15 @@ namespace Meat
 
         mfilebuf()
         {
-            gbuffer = new char[gbuffer_size+1];
-            pbuffer = new char[pbuffer_size+1];
+            gpool = BufferPool::acquire(gbuffer_size);
+            ppool = BufferPool::acquire(pbuffer_size);
+            gbuffer = (char *)gpool.data();
+            pbuffer = (char *)ppool.data();
         };
 
         ~mfilebuf()
         {
-            if (pbuffer != nullptr)
-                delete[] pbuffer;
-
-            if (gbuffer != nullptr)
-                delete[] gbuffer;
-
+            // Flushes through pbuffer, the pooled buffers go after it
             close();
         }
 
@@ -127,6 +140,7 @@ namespace Meat
             {
                 // Debug_printv("closing in filebuf\n");
                 sync();
+                releaseView();
                 mstream->close();
                 return true;
             }
@@ -200,6 +214,24 @@ namespace Meat
                 // no more characters are available, size == 0.
                 // auto buffer = reader->read();
 
+                // done with the previous view, then try to borrow the next one
+                if (viewLen > 0)
+                {
+                    mstream->consume(viewLen);
+                    viewLen = 0;
+                }
+
+                const uint8_t *view;
+                if ((viewLen = mstream->peekView(&view)) > 0)
+                {
+                    currBuffStart = mstream->position();
+                    currBuffEnd = currBuffStart + (std::streamoff)viewLen;
+
+                    // get area is only read from, the view stays untouched
+                    this->setg((char *)view, (char *)view, (char *)view + viewLen);
+                    return std::char_traits<char>::to_int_type(*this->gptr());
+                }
+
                 int readCount = mstream->read((uint8_t *)gbuffer, gbuffer_size);
 
                 //Debug_printv("meat buffer underflow, readCount=%d", readCount);
@@ -309,6 +341,7 @@ namespace Meat
         {
             std::streampos __ret = std::streampos(off_type(-1));
 
+            releaseView();
             if (mstream->seek(__pos))
             {
                 __ret = std::streampos(off_type(__pos));
@@ -346,30 +379,36 @@ namespace Meat
                 std::streampos delta = __pos - currBuffStart;
                 // TODO - check if eback == gbuffer!!!
                 // TODO - check if pbase == pbuffer!!!
-                this->setg(this->eback(), gbuffer + delta, this->egptr());
+                this->setg(this->eback(), this->eback() + delta, this->egptr());
                 this->setp(this->pbase(), pbuffer + delta);
             }
-            else if (mstream->seek(__pos))
+            else
             {
-                Debug_printv("Seek missed the cache, read required!");
-                // the seek op isn't within existing buffer, so we need to actually
-                // call seek on stream and force underflow/overflow
+                // a lent view can't outlive the seek
+                releaseView();
 
-                //__ret.state(_M_state_cur);
-                __ret = std::streampos(off_type(__pos));
+                if (mstream->seek(__pos))
+                {
+                    Debug_printv("Seek missed the cache, read required!");
+                    // the seek op isn't within existing buffer, so we need to actually
+                    // call seek on stream and force underflow/overflow
 
-                // not sure if this is ok, but is supposed to cause underflow
-                // underflow will set it to:
-                // setg(gbuffer, gbuffer, gbuffer + readCount);
-                //         begin    next     end
-                this->setg(gbuffer, gbuffer, gbuffer);
+                    //__ret.state(_M_state_cur);
+                    __ret = std::streampos(off_type(__pos));
 
-                // not sure if this is ok, but is supposed to cause overflow and prepare a clean buffer for writing
-                // that's how overflow does it after writing all:
-                // write(pbase, pptr-pbase)
-                // setp(pbuffer, pbuffer+pbuffer_size);
-                //         begin    end
-                this->setp(pbuffer, pbuffer + pbuffer_size);
+                    // not sure if this is ok, but is supposed to cause underflow
+                    // underflow will set it to:
+                    // setg(gbuffer, gbuffer, gbuffer + readCount);
+                    //         begin    next     end
+                    this->setg(gbuffer, gbuffer, gbuffer);
+
+                    // not sure if this is ok, but is supposed to cause overflow and prepare a clean buffer for writing
+                    // that's how overflow does it after writing all:
+                    // write(pbase, pptr-pbase)
+                    // setp(pbuffer, pbuffer+pbuffer_size);
+                    //         begin    end
+                    this->setp(pbuffer, pbuffer + pbuffer_size);
+                }
             }
 
             return __ret;
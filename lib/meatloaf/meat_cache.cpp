@@ -0,0 +1,563 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "meat_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#ifdef BOARD_HAS_PSRAM
+#include <esp_heap_caps.h>
+#endif
+
+#include "../../include/debug.h"
+#include "string_utils.h"
+
+uint8_t *SectorCache::data = nullptr;
+SectorCache::Slot *SectorCache::slots = nullptr;
+size_t SectorCache::slot_count = SECTOR_CACHE_SECTORS;
+uint16_t SectorCache::lru_head = SectorCache::NONE;
+uint16_t SectorCache::lru_tail = SectorCache::NONE;
+uint16_t SectorCache::free_head = SectorCache::NONE;
+
+std::unordered_map<uint64_t, uint16_t> SectorCache::index;
+std::unordered_map<uint32_t, SectorCache::Container> SectorCache::containers;
+std::unordered_map<std::string, uint32_t> SectorCache::identities;
+uint32_t SectorCache::next_id = 1;
+SectorCache::Stats SectorCache::totals = { 0 };
+
+std::recursive_mutex SectorCache::lock;
+
+
+bool SectorCache::allocate()
+{
+    if ( data != nullptr )
+        return true;
+
+    if ( slot_count == 0 || slot_count >= NONE )
+        return false;
+
+#ifdef BOARD_HAS_PSRAM
+    data = (uint8_t *)heap_caps_malloc(slot_count * SECTOR_CACHE_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#else
+    data = (uint8_t *)malloc(slot_count * SECTOR_CACHE_BLOCK_SIZE);
+#endif
+    slots = new Slot[slot_count];
+    if ( data == nullptr || slots == nullptr )
+    {
+        Debug_printv("Unable to allocate sector cache sectors[%d]", slot_count);
+        release();
+        return false;
+    }
+
+    // All slots start on the free list
+    for ( uint16_t i = 0; i < slot_count; i++ )
+    {
+        slots[i] = { 0, 0, 0, false, 0, NONE, (uint16_t)(i + 1) };
+    }
+    slots[slot_count - 1].next = NONE;
+    free_head = 0;
+    lru_head = lru_tail = NONE;
+
+    Debug_printv("sector cache allocated sectors[%d] bytes[%d]", slot_count, slot_count * SECTOR_CACHE_BLOCK_SIZE);
+    return true;
+}
+
+void SectorCache::release()
+{
+#ifdef BOARD_HAS_PSRAM
+    if ( data ) heap_caps_free(data);
+#else
+    if ( data ) free(data);
+#endif
+    if ( slots ) delete[] slots;
+
+    data = nullptr;
+    slots = nullptr;
+    index.clear();
+    lru_head = lru_tail = free_head = NONE;
+}
+
+void SectorCache::setCapacity(size_t sectors)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    // Write back everything before the slab goes away
+    for ( auto &c : containers )
+        flush(c.first);
+
+    release();
+    slot_count = sectors;
+}
+
+
+/********************************************************
+ * Containers
+ ********************************************************/
+
+uint32_t SectorCache::attach(std::shared_ptr<MStream> container)
+{
+    if ( container == nullptr )
+        return 0;
+
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    if ( !allocate() )
+        return 0;
+
+    std::string identity = container->url;
+    if ( identity.empty() )
+        identity = mstr::format("%p", container.get());
+
+    auto found = identities.find(identity);
+    if ( found != identities.end() )
+    {
+        auto &c = containers.at(found->second);
+        c.refs++;
+
+        // Write back through a stream that can take it
+        if ( (container->mode & std::ios_base::out) && !(c.stream->mode & std::ios_base::out) )
+            c.stream = container;
+
+        return found->second;
+    }
+
+    uint32_t id = next_id++;
+    if ( next_id == 0 ) next_id = 1;
+
+    containers.insert(std::make_pair(id, Container{ container, identity, 1, { 0 } }));
+    identities.insert(std::make_pair(identity, id));
+
+    //Debug_printv("id[%lu] identity[%s]", id, identity.c_str());
+    return id;
+}
+
+void SectorCache::detach(uint32_t id)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    auto c = containers.find(id);
+    if ( c == containers.end() )
+        return;
+
+    if ( --c->second.refs > 0 )
+        return;
+
+    flush(id);
+    invalidate(id);
+
+    auto &s = c->second.stats;
+    Debug_printv("identity[%s] hits[%lu] misses[%lu] writes[%lu] writebacks[%lu] evictions[%lu]",
+                 c->second.identity.c_str(), s.hits, s.misses, s.writes, s.writebacks, s.evictions);
+
+    identities.erase(c->second.identity);
+    containers.erase(c);
+}
+
+
+/********************************************************
+ * LRU list
+ ********************************************************/
+
+void SectorCache::unlink(uint16_t slot)
+{
+    Slot &s = slots[slot];
+    if ( s.prev != NONE ) slots[s.prev].next = s.next; else lru_head = s.next;
+    if ( s.next != NONE ) slots[s.next].prev = s.prev; else lru_tail = s.prev;
+    s.prev = s.next = NONE;
+}
+
+void SectorCache::linkFront(uint16_t slot)
+{
+    Slot &s = slots[slot];
+    s.prev = NONE;
+    s.next = lru_head;
+    if ( lru_head != NONE ) slots[lru_head].prev = slot;
+    lru_head = slot;
+    if ( lru_tail == NONE ) lru_tail = slot;
+}
+
+void SectorCache::drop(uint16_t slot)
+{
+    index.erase(key(slots[slot].id, slots[slot].lba));
+    unlink(slot);
+    slots[slot].dirty = false;
+    slots[slot].pins = 0;
+    slots[slot].next = free_head;
+    free_head = slot;
+}
+
+uint16_t SectorCache::victim()
+{
+    if ( free_head != NONE )
+    {
+        uint16_t slot = free_head;
+        free_head = slots[slot].next;
+        return slot;
+    }
+
+    // Least recently used sector nobody holds a view of
+    uint16_t slot = lru_tail;
+    while ( slot != NONE && slots[slot].pins )
+        slot = slots[slot].prev;
+    if ( slot == NONE )
+        return NONE;
+
+    if ( slots[slot].dirty )
+        writeBack(slot);
+
+    auto c = containers.find(slots[slot].id);
+    if ( c != containers.end() ) c->second.stats.evictions++;
+    totals.evictions++;
+
+    drop(slot);
+    free_head = slots[slot].next;
+    return slot;
+}
+
+uint16_t SectorCache::lookup(uint32_t id, uint32_t lba)
+{
+    auto found = index.find(key(id, lba));
+    if ( found == index.end() )
+        return NONE;
+
+    uint16_t slot = found->second;
+    if ( slot != lru_head )
+    {
+        unlink(slot);
+        linkFront(slot);
+    }
+    return slot;
+}
+
+
+/********************************************************
+ * Sector I/O
+ ********************************************************/
+
+uint16_t SectorCache::load(uint32_t id, uint32_t lba, bool fill)
+{
+    auto c = containers.find(id);
+    if ( c == containers.end() )
+        return NONE;
+
+    uint16_t slot = victim();
+    if ( slot == NONE )
+        return NONE;
+
+    uint8_t *buf = data + (slot * SECTOR_CACHE_BLOCK_SIZE);
+    uint16_t length = 0;
+    if ( fill )
+    {
+        c->second.stats.misses++;
+        totals.misses++;
+
+        auto stream = c->second.stream;
+        if ( stream->seek(lba * SECTOR_CACHE_BLOCK_SIZE) )
+            length = stream->read(buf, SECTOR_CACHE_BLOCK_SIZE);
+
+        if ( length == 0 )
+        {
+            // Nothing there, don't remember the failure
+            slots[slot].next = free_head;
+            free_head = slot;
+            return NONE;
+        }
+    }
+
+    if ( length < SECTOR_CACHE_BLOCK_SIZE )
+        memset(buf + length, 0x00, SECTOR_CACHE_BLOCK_SIZE - length);
+
+    slots[slot].id = id;
+    slots[slot].lba = lba;
+    slots[slot].length = length;
+    slots[slot].dirty = false;
+    slots[slot].pins = 0;
+    linkFront(slot);
+    index[key(id, lba)] = slot;
+
+    return slot;
+}
+
+bool SectorCache::writeBack(uint16_t slot)
+{
+    Slot &s = slots[slot];
+    auto c = containers.find(s.id);
+    if ( c == containers.end() )
+        return false;
+
+    auto stream = c->second.stream;
+    bool ok = stream->seek(s.lba * SECTOR_CACHE_BLOCK_SIZE) &&
+              (stream->write(data + (slot * SECTOR_CACHE_BLOCK_SIZE), s.length) == s.length);
+    if ( !ok )
+        Debug_printv("write back failed id[%lu] lba[%lu]", s.id, s.lba);
+
+    s.dirty = false;
+    c->second.stats.writebacks++;
+    totals.writebacks++;
+    return ok;
+}
+
+uint32_t SectorCache::read(uint32_t id, uint32_t position, uint8_t *buf, uint32_t size)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    uint32_t total = 0;
+    while ( size > 0 )
+    {
+        uint32_t lba = position / SECTOR_CACHE_BLOCK_SIZE;
+        uint16_t offset = position % SECTOR_CACHE_BLOCK_SIZE;
+
+        uint16_t slot = lookup(id, lba);
+        if ( slot != NONE )
+        {
+            containers.at(id).stats.hits++;
+            totals.hits++;
+        }
+        else
+        {
+            slot = load(id, lba, true);
+            if ( slot == NONE )
+                break;
+        }
+
+        if ( offset >= slots[slot].length )
+            break;
+
+        uint32_t n = std::min(size, (uint32_t)(slots[slot].length - offset));
+        memcpy(buf + total, data + (slot * SECTOR_CACHE_BLOCK_SIZE) + offset, n);
+
+        total += n;
+        position += n;
+        size -= n;
+
+        // Short sector means end of container
+        if ( slots[slot].length < SECTOR_CACHE_BLOCK_SIZE && size > 0 )
+            break;
+    }
+
+    return total;
+}
+
+uint32_t SectorCache::write(uint32_t id, uint32_t position, const uint8_t *buf, uint32_t size)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    auto c = containers.find(id);
+    if ( c == containers.end() )
+        return 0;
+
+    uint32_t total = 0;
+    while ( size > 0 )
+    {
+        uint32_t lba = position / SECTOR_CACHE_BLOCK_SIZE;
+        uint16_t offset = position % SECTOR_CACHE_BLOCK_SIZE;
+        uint32_t n = std::min(size, (uint32_t)(SECTOR_CACHE_BLOCK_SIZE - offset));
+
+        uint16_t slot = lookup(id, lba);
+        if ( slot == NONE )
+        {
+            // Partial writes need the rest of the sector first
+            if ( n < SECTOR_CACHE_BLOCK_SIZE )
+                slot = load(id, lba, true);
+
+            // Whole sector or past the end of the container
+            if ( slot == NONE )
+                slot = load(id, lba, false);
+
+            if ( slot == NONE )
+                break;
+        }
+
+        memcpy(data + (slot * SECTOR_CACHE_BLOCK_SIZE) + offset, buf + total, n);
+        slots[slot].length = std::max(slots[slot].length, (uint16_t)(offset + n));
+        slots[slot].dirty = true;
+
+        c->second.stats.writes++;
+        totals.writes++;
+
+        total += n;
+        position += n;
+        size -= n;
+    }
+
+    return total;
+}
+
+const uint8_t *SectorCache::sector(uint32_t id, uint32_t lba, uint16_t *length)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    uint16_t slot = lookup(id, lba);
+    if ( slot != NONE )
+    {
+        containers.at(id).stats.hits++;
+        totals.hits++;
+    }
+    else
+    {
+        slot = load(id, lba, true);
+        if ( slot == NONE )
+            return nullptr;
+    }
+
+    if ( length != nullptr )
+        *length = slots[slot].length;
+
+    return data + (slot * SECTOR_CACHE_BLOCK_SIZE);
+}
+
+const uint8_t *SectorCache::pin(uint32_t id, uint32_t lba, uint16_t *length)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    const uint8_t *p = sector(id, lba, length);
+    if ( p != nullptr )
+        slots[(p - data) / SECTOR_CACHE_BLOCK_SIZE].pins++;
+
+    return p;
+}
+
+void SectorCache::unpin(const uint8_t *sector)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    if ( data == nullptr || sector < data || sector >= data + (slot_count * SECTOR_CACHE_BLOCK_SIZE) )
+        return;
+
+    Slot &s = slots[(sector - data) / SECTOR_CACHE_BLOCK_SIZE];
+    if ( s.pins )
+        s.pins--;
+}
+
+bool SectorCache::cached(uint32_t id, uint32_t lba)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return index.count(key(id, lba)) > 0;
+}
+
+uint32_t SectorCache::prefill(uint32_t id, uint32_t lba, uint32_t count)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    auto c = containers.find(id);
+    if ( c == containers.end() || !allocate() )
+        return 0;
+
+    // Never claim more than half the cache for one run
+    count = std::min(count, (uint32_t)(slot_count / 2));
+    if ( count == 0 )
+        return 0;
+
+    std::unique_ptr<uint8_t[]> run(new uint8_t[count * SECTOR_CACHE_BLOCK_SIZE]);
+    auto stream = c->second.stream;
+    if ( !stream->seek(lba * SECTOR_CACHE_BLOCK_SIZE) )
+        return 0;
+
+    uint32_t length = stream->read(run.get(), count * SECTOR_CACHE_BLOCK_SIZE);
+    c->second.stats.misses++;
+    totals.misses++;
+
+    uint32_t loaded = 0;
+    for ( uint32_t i = 0; i * SECTOR_CACHE_BLOCK_SIZE < length; i++ )
+    {
+        // Cached copy might be dirty, keep it
+        if ( lookup(id, lba + i) != NONE )
+            continue;
+
+        uint16_t slot = load(id, lba + i, false);
+        if ( slot == NONE )
+            break;
+
+        uint16_t n = std::min(length - (i * SECTOR_CACHE_BLOCK_SIZE), (uint32_t)SECTOR_CACHE_BLOCK_SIZE);
+        memcpy(data + (slot * SECTOR_CACHE_BLOCK_SIZE), run.get() + (i * SECTOR_CACHE_BLOCK_SIZE), n);
+        slots[slot].length = n;
+        loaded++;
+    }
+
+    return loaded;
+}
+
+bool SectorCache::flush(uint32_t id)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    auto c = containers.find(id);
+    if ( slots == nullptr || c == containers.end() )
+        return true;
+
+    // Committing can drop other streams of this image, keep the container
+    std::shared_ptr<MStream> stream = c->second.stream;
+
+    std::vector<uint16_t> dirty;
+    for ( uint16_t i = 0; i < slot_count; i++ )
+    {
+        if ( slots[i].dirty && slots[i].id == id )
+            dirty.push_back(i);
+    }
+
+    // Write back in LBA order so the container sees sequential writes
+    std::sort(dirty.begin(), dirty.end(), [](uint16_t a, uint16_t b) {
+        return slots[a].lba < slots[b].lba;
+    });
+
+    bool ok = true;
+    for ( auto slot : dirty )
+        ok &= writeBack(slot);
+
+    if ( !dirty.empty() )
+        Debug_printv("id[%lu] sectors[%d] ok[%d]", id, dirty.size(), ok);
+
+    // Evicted sectors went to the container earlier, it commits those too
+    return stream->flush() && ok;
+}
+
+void SectorCache::invalidate(uint32_t id)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    if ( slots == nullptr )
+        return;
+
+    for ( uint16_t i = 0; i < slot_count; i++ )
+    {
+        if ( slots[i].id == id && index.count(key(id, slots[i].lba)) && index.at(key(id, slots[i].lba)) == i )
+            drop(i);
+    }
+}
+
+
+/********************************************************
+ * Statistics
+ ********************************************************/
+
+SectorCache::Stats SectorCache::stats(uint32_t id)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    auto c = containers.find(id);
+    if ( c == containers.end() )
+        return { 0 };
+
+    return c->second.stats;
+}
+
+SectorCache::Stats SectorCache::stats()
+{
+    return totals;
+}
@@ -0,0 +1,140 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// Shared sector cache for block based media (D64, D71, D81, DNP, etc)
+//
+// Sectors are keyed by (container, LBA). Containers are identified by their
+// url so every media stream opened on the same image shares the cached
+// sectors. Writes are cached too and written back when the sector is
+// evicted or the container is flushed (on close).
+//
+
+#ifndef MEATLOAF_CACHE
+#define MEATLOAF_CACHE
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+
+#include "meatloaf.h"
+
+#ifndef SECTOR_CACHE_SECTORS
+#ifdef BOARD_HAS_PSRAM
+#define SECTOR_CACHE_SECTORS 1024 // 256KB in PSRAM
+#else
+#define SECTOR_CACHE_SECTORS 64   // 16KB
+#endif
+#endif
+
+#define SECTOR_CACHE_BLOCK_SIZE 256
+
+
+class SectorCache {
+public:
+    struct Stats {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t writes;
+        uint32_t writebacks;
+        uint32_t evictions;
+    };
+
+    // Register a container stream, returns the cache id (0 = not cached)
+    static uint32_t attach(std::shared_ptr<MStream> container);
+    // Flush and release a container, cached sectors are dropped with the last reference
+    static void detach(uint32_t id);
+
+    static uint32_t read(uint32_t id, uint32_t position, uint8_t *buf, uint32_t size);
+    static uint32_t write(uint32_t id, uint32_t position, const uint8_t *buf, uint32_t size);
+
+    // Borrow a pointer to a cached sector. Valid until the next cache call.
+    static const uint8_t *sector(uint32_t id, uint32_t lba, uint16_t *length = nullptr);
+
+    // Borrow a cached sector that stays put until unpin(), for zero-copy views
+    static const uint8_t *pin(uint32_t id, uint32_t lba, uint16_t *length = nullptr);
+    static void unpin(const uint8_t *sector);
+
+    // Is the sector cached, doesn't load it
+    static bool cached(uint32_t id, uint32_t lba);
+
+    // Load a run of sectors with a single container read
+    static uint32_t prefill(uint32_t id, uint32_t lba, uint32_t count);
+
+    // Write all dirty sectors of this container back in LBA order, then
+    // have the container commit them
+    static bool flush(uint32_t id);
+    static void invalidate(uint32_t id);
+
+    static void setCapacity(size_t sectors);
+    static size_t capacity() { return slot_count; };
+
+    static Stats stats(uint32_t id);
+    static Stats stats();
+
+private:
+    struct Slot {
+        uint32_t id;
+        uint32_t lba;
+        uint16_t length;
+        bool dirty;
+        uint8_t pins;
+        uint16_t prev;
+        uint16_t next;
+    };
+
+    struct Container {
+        std::shared_ptr<MStream> stream;
+        std::string identity;
+        uint16_t refs;
+        Stats stats;
+    };
+
+    static const uint16_t NONE = 0xFFFF;
+
+    static uint64_t key(uint32_t id, uint32_t lba) {
+        return ((uint64_t)id << 32) | lba;
+    }
+
+    static bool allocate();
+    static void release();
+
+    static uint16_t lookup(uint32_t id, uint32_t lba);
+    static uint16_t load(uint32_t id, uint32_t lba, bool fill);
+    static uint16_t victim();
+    static bool writeBack(uint16_t slot);
+    static void unlink(uint16_t slot);
+    static void linkFront(uint16_t slot);
+    static void drop(uint16_t slot);
+
+    static uint8_t *data;
+    static Slot *slots;
+    static size_t slot_count;
+    static uint16_t lru_head;
+    static uint16_t lru_tail;
+    static uint16_t free_head;
+
+    static std::unordered_map<uint64_t, uint16_t> index;
+    static std::unordered_map<uint32_t, Container> containers;
+    static std::unordered_map<std::string, uint32_t> identities;
+    static uint32_t next_id;
+    static Stats totals;
+
+    static std::recursive_mutex lock;
+};
+
+#endif // MEATLOAF_CACHE
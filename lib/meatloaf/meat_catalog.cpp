@@ -0,0 +1,569 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "meat_catalog.h"
+
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include <esp_timer.h>
+
+#include "meat_media.h"
+#include "fnFsSD.h"
+
+#include "../../include/global_defines.h"
+#include "../../include/debug.h"
+
+#include "string_utils.h"
+
+#define CATALOG_VERSION 1
+
+static const char *catalog_extensions[] = { ".d64", ".d71", ".d81", ".t64", ".tcrt", ".zip" };
+
+TaskHandle_t CatalogIndex::handle = nullptr;
+CatalogIndex::Stats CatalogIndex::totals = {};
+std::mutex CatalogIndex::lock;
+
+static uint64_t now_ms()
+{
+    return esp_timer_get_time() / 1000;
+}
+
+static bool isImage(const char *name)
+{
+    for ( auto extension : catalog_extensions )
+    {
+        if ( mstr::endsWith(name, extension, false) )
+            return true;
+    }
+    return false;
+}
+
+
+/********************************************************
+ * Scan
+ ********************************************************/
+
+// One pass over flash and SD, writes catalog.dat.new
+class CatalogIndex::Scan {
+public:
+    Scan(const std::string &base) : base(base) {}
+    ~Scan() { close(); }
+
+    bool begin();
+    void walk(const std::string &dir, uint8_t depth);
+    bool finish();
+    void close();
+
+    std::string skip;       // Mount point that gets its own walk
+    Header header = {};
+    FILE *dat = nullptr;
+    uint32_t opened = 0;
+    bool changed = false;
+
+private:
+    void add(const std::string &path, const struct stat &info);
+    bool copy(const std::string &path, const struct stat &info);
+    void index(const std::string &path, const struct stat &info);
+    void write(const std::string &path, const ImageRecord &record, const std::vector<Entry> &entries);
+
+    std::string base;
+    FILE *previous = nullptr;
+    Header previous_header = {};
+    std::vector<Known> known;
+    bool failed = false;
+};
+
+bool CatalogIndex::Scan::begin()
+{
+    previous = fopen((base + ".dat").c_str(), "rb");
+    if ( previous != nullptr && readHeader(previous, previous_header, "MLCD") )
+    {
+        // Remember where each image record starts, by path hash
+        uint32_t offset = sizeof(Header);
+        ImageRecord record;
+        std::string path;
+        for ( uint32_t i = 0; i < previous_header.images && known.size() < CATALOG_MAX_IMAGES; i++ )
+        {
+            if ( fread(&record, sizeof(record), 1, previous) != 1 )
+                break;
+
+            path.resize(record.path_length);
+            if ( fread(&path[0], 1, record.path_length, previous) != record.path_length )
+                break;
+
+            known.push_back({ hash(path.data(), path.size(), false), offset });
+
+            uint32_t entries = record.count * sizeof(Entry);
+            if ( fseek(previous, entries, SEEK_CUR) != 0 )
+                break;
+            offset += sizeof(record) + record.path_length + entries;
+        }
+        std::sort(known.begin(), known.end());
+    }
+    else if ( previous != nullptr )
+    {
+        fclose(previous);
+        previous = nullptr;
+    }
+
+    dat = fopen((base + ".dat.new").c_str(), "w+b");
+    if ( dat == nullptr )
+        return false;
+
+    memcpy(header.magic, "MLCD", sizeof(header.magic));
+    header.version = CATALOG_VERSION;
+    header.fanout_bits = CATALOG_FANOUT_BITS;
+    return fwrite(&header, sizeof(header), 1, dat) == 1;
+}
+
+void CatalogIndex::Scan::walk(const std::string &dir, uint8_t depth)
+{
+    DIR *d = opendir(dir.empty() ? "/" : dir.c_str());
+    if ( d == nullptr )
+        return;
+
+    struct dirent *dirent;
+    while ( (dirent = readdir(d)) != nullptr )
+    {
+        // Hidden files and SYSTEM_DIR, the catalog doesn't index itself
+        if ( dirent->d_name[0] == '.' )
+            continue;
+
+        std::string path = dir + "/" + dirent->d_name;
+        if ( dirent->d_type == DT_DIR )
+        {
+            if ( depth < CATALOG_MAX_DEPTH && path != skip )
+                walk(path, depth + 1);
+            continue;
+        }
+
+        if ( !isImage(dirent->d_name) )
+            continue;
+
+        struct stat info;
+        if ( stat(path.c_str(), &info) == 0 )
+            add(path, info);
+    }
+
+    closedir(d);
+}
+
+bool CatalogIndex::Scan::finish()
+{
+    // Images that went away change the catalog too
+    if ( header.images != previous_header.images )
+        changed = true;
+
+    if ( fseek(dat, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, dat) != 1 )
+        failed = true;
+
+    return !failed;
+}
+
+void CatalogIndex::Scan::close()
+{
+    if ( previous != nullptr )
+    {
+        fclose(previous);
+        previous = nullptr;
+    }
+    if ( dat != nullptr )
+    {
+        fclose(dat);
+        dat = nullptr;
+    }
+}
+
+void CatalogIndex::Scan::add(const std::string &path, const struct stat &info)
+{
+    if ( copy(path, info) )
+        return;
+
+    changed = true;
+    index(path, info);
+
+    // Give the card back to the bus between images
+    vTaskDelay(1);
+}
+
+// Reuse the previous record if the image hasn't changed since
+bool CatalogIndex::Scan::copy(const std::string &path, const struct stat &info)
+{
+    if ( previous == nullptr )
+        return false;
+
+    auto range = std::equal_range(known.begin(), known.end(), Known{ hash(path.data(), path.size(), false), 0 });
+    for ( auto it = range.first; it != range.second; ++it )
+    {
+        ImageRecord record;
+        if ( fseek(previous, it->offset, SEEK_SET) != 0 || fread(&record, sizeof(record), 1, previous) != 1 )
+            continue;
+        if ( record.path_length != path.size() )
+            continue;
+
+        std::string name(record.path_length, '\0');
+        if ( fread(&name[0], 1, record.path_length, previous) != record.path_length || name != path )
+            continue;
+
+        if ( record.mtime != (uint32_t)info.st_mtime || record.size != (uint32_t)info.st_size )
+            return false;
+
+        std::vector<Entry> entries(record.count);
+        if ( record.count && fread(entries.data(), sizeof(Entry), record.count, previous) != record.count )
+            return false;
+
+        write(path, record, entries);
+        return true;
+    }
+
+    return false;
+}
+
+void CatalogIndex::Scan::index(const std::string &path, const struct stat &info)
+{
+    std::vector<Entry> entries;
+    {
+        // Private streams, so the scan never shares or evicts an image the bus has open
+        ImageBroker::Scope scope;
+
+        std::unique_ptr<MFile> image(MFSOwner::File(path));
+        if ( image != nullptr && image->rewindDirectory() )
+        {
+            DirEntry entry;
+            while ( entries.size() < UINT16_MAX && image->getNextEntry(entry) )
+            {
+                if ( entry.flags & DirEntry::DIRECTORY )
+                    continue;
+
+                // Longer names can't be typed in a LOAD anyway
+                std::string name = image->isPETSCII ? mstr::toUTF8(entry.name) : std::string(entry.name);
+                if ( name.empty() || name.size() > sizeof(Entry::name) )
+                    continue;
+
+                Entry e = {};
+                e.hash = hash(name.data(), name.size(), true);
+                e.blocks = entry.blocks;
+                e.length = name.size();
+                e.flags = entry.flags;
+                memcpy(e.type, entry.type, sizeof(e.type));
+                memcpy(e.name, name.data(), name.size());
+                entries.push_back(e);
+            }
+        }
+    }
+    opened++;
+
+    ImageRecord record = { (uint32_t)info.st_mtime, (uint32_t)info.st_size, (uint16_t)path.size(), (uint16_t)entries.size() };
+    write(path, record, entries);
+}
+
+void CatalogIndex::Scan::write(const std::string &path, const ImageRecord &record, const std::vector<Entry> &entries)
+{
+    if ( fwrite(&record, sizeof(record), 1, dat) != 1 ||
+         fwrite(path.data(), 1, path.size(), dat) != path.size() ||
+         fwrite(entries.data(), sizeof(Entry), entries.size(), dat) != entries.size() )
+    {
+        failed = true;
+        return;
+    }
+
+    header.images++;
+    header.entries += entries.size();
+}
+
+
+/********************************************************
+ * CatalogIndex
+ ********************************************************/
+
+void CatalogIndex::start()
+{
+    if ( handle != nullptr )
+        return;
+
+    if ( xTaskCreatePinnedToCore(task, "ml_catalog", CATALOG_STACKSIZE, nullptr, CATALOG_PRIORITY, &handle, CATALOG_CPUAFFINITY) != pdPASS )
+    {
+        Debug_printv("Unable to start catalog scanner");
+        handle = nullptr;
+    }
+}
+
+void CatalogIndex::task(void *arg)
+{
+    while ( true )
+    {
+        scan();
+        vTaskDelay(pdMS_TO_TICKS(CATALOG_RESCAN_MS));
+    }
+}
+
+bool CatalogIndex::scan()
+{
+    uint64_t started = now_ms();
+    std::string base = location();
+
+    Scan scan(base);
+    if ( !scan.begin() )
+    {
+        Debug_printv("Unable to create catalog[%s]", base.c_str());
+        return false;
+    }
+
+#ifdef SD_CARD
+    if ( fnSDFAT.running() )
+    {
+        scan.skip = fnSDFAT.basepath();
+        scan.walk(scan.skip, 0);
+    }
+#endif
+    scan.walk("", 0);
+
+    bool ok = scan.finish();
+    if ( ok && scan.changed )
+        ok = buildIndex(scan.dat, scan.header, base + ".idx.new");
+    scan.close();
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    if ( ok && scan.changed )
+    {
+        remove((base + ".dat").c_str());
+        rename((base + ".dat.new").c_str(), (base + ".dat").c_str());
+        remove((base + ".idx").c_str());
+        rename((base + ".idx.new").c_str(), (base + ".idx").c_str());
+    }
+    else
+    {
+        remove((base + ".dat.new").c_str());
+        remove((base + ".idx.new").c_str());
+    }
+
+    if ( ok )
+    {
+        totals.images = scan.header.images;
+        totals.entries = scan.header.entries;
+        totals.opened = scan.opened;
+        totals.scan_ms = now_ms() - started;
+        Debug_printv("images[%lu] entries[%lu] opened[%lu] ms[%lu]", totals.images, totals.entries, totals.opened, totals.scan_ms);
+    }
+
+    return ok;
+}
+
+// Two passes over catalog.dat: count the entries of each bucket, then
+// drop every entry into its slot
+bool CatalogIndex::buildIndex(FILE *dat, const Header &header, const std::string &path)
+{
+    const uint32_t buckets = 1 << CATALOG_FANOUT_BITS;
+    std::vector<uint32_t> fanout(buckets + 1, 0);
+
+    bool ok = forEachEntry(dat, header, [&](uint32_t offset, Entry &entry) {
+        fanout[(entry.hash >> (32 - CATALOG_FANOUT_BITS)) + 1]++;
+        return true;
+    });
+    if ( !ok )
+        return false;
+
+    for ( uint32_t b = 0; b < buckets; b++ )
+        fanout[b + 1] += fanout[b];
+
+    FILE *idx = fopen(path.c_str(), "wb");
+    if ( idx == nullptr )
+        return false;
+
+    Header idx_header = header;
+    memcpy(idx_header.magic, "MLCI", sizeof(idx_header.magic));
+    ok = fwrite(&idx_header, sizeof(idx_header), 1, idx) == 1 &&
+         fwrite(fanout.data(), sizeof(uint32_t), fanout.size(), idx) == fanout.size();
+
+    // Lay the entry area out first, slots get filled out of order
+    Entry blank[16] = {};
+    for ( uint32_t left = header.entries; ok && left > 0; )
+    {
+        uint32_t count = std::min(left, (uint32_t)(sizeof(blank) / sizeof(Entry)));
+        ok = fwrite(blank, sizeof(Entry), count, idx) == count;
+        left -= count;
+    }
+
+    const uint32_t entries = sizeof(Header) + fanout.size() * sizeof(uint32_t);
+    std::vector<uint32_t> next(fanout.begin(), fanout.end() - 1);
+    if ( ok )
+    {
+        ok = forEachEntry(dat, header, [&](uint32_t offset, Entry &entry) {
+            entry.image = offset;
+            uint32_t slot = next[entry.hash >> (32 - CATALOG_FANOUT_BITS)]++;
+            return fseek(idx, entries + slot * sizeof(Entry), SEEK_SET) == 0 &&
+                   fwrite(&entry, sizeof(entry), 1, idx) == 1;
+        });
+    }
+
+    fclose(idx);
+    return ok;
+}
+
+bool CatalogIndex::forEachEntry(FILE *dat, const Header &header, const std::function<bool(uint32_t, Entry &)> &visit)
+{
+    uint32_t offset = sizeof(Header);
+    if ( fseek(dat, offset, SEEK_SET) != 0 )
+        return false;
+
+    ImageRecord record;
+    Entry entry;
+    for ( uint32_t i = 0; i < header.images; i++ )
+    {
+        if ( fseek(dat, offset, SEEK_SET) != 0 || fread(&record, sizeof(record), 1, dat) != 1 )
+            return false;
+        if ( fseek(dat, record.path_length, SEEK_CUR) != 0 )
+            return false;
+
+        for ( uint16_t e = 0; e < record.count; e++ )
+        {
+            if ( fread(&entry, sizeof(entry), 1, dat) != 1 || !visit(offset, entry) )
+                return false;
+        }
+
+        offset += sizeof(record) + record.path_length + record.count * sizeof(Entry);
+    }
+
+    return true;
+}
+
+bool CatalogIndex::find(const std::string &name, Match &match)
+{
+    if ( name.empty() || name.size() > sizeof(Entry::name) )
+        return false;
+
+    uint32_t name_hash = hash(name.data(), name.size(), true);
+    std::string base = location();
+
+    std::lock_guard<std::mutex> guard(lock);
+    totals.lookups++;
+
+    FILE *idx = fopen((base + ".idx").c_str(), "rb");
+    if ( idx == nullptr )
+        return false;
+
+    // Slot of the fan-out table, then the bucket it points at
+    Header header;
+    Entry entry;
+    bool found = false;
+    if ( readHeader(idx, header, "MLCI") )
+    {
+        uint32_t range[2];
+        uint32_t slot = name_hash >> (32 - header.fanout_bits);
+        uint32_t entries = sizeof(Header) + ((1 << header.fanout_bits) + 1) * sizeof(uint32_t);
+        if ( fseek(idx, sizeof(Header) + slot * sizeof(uint32_t), SEEK_SET) == 0 &&
+             fread(range, sizeof(uint32_t), 2, idx) == 2 &&
+             fseek(idx, entries + range[0] * sizeof(Entry), SEEK_SET) == 0 )
+        {
+            for ( uint32_t i = range[0]; i < range[1] && !found; i++ )
+            {
+                if ( fread(&entry, sizeof(entry), 1, idx) != 1 )
+                    break;
+
+                found = entry.hash == name_hash && entry.length == name.size() &&
+                        strncasecmp(entry.name, name.data(), name.size()) == 0;
+            }
+        }
+    }
+    fclose(idx);
+
+    if ( !found )
+        return false;
+
+    FILE *dat = fopen((base + ".dat").c_str(), "rb");
+    if ( dat == nullptr )
+        return false;
+
+    ImageRecord record;
+    found = fseek(dat, entry.image, SEEK_SET) == 0 && fread(&record, sizeof(record), 1, dat) == 1;
+    if ( found )
+    {
+        match.image.resize(record.path_length);
+        found = fread(&match.image[0], 1, record.path_length, dat) == record.path_length;
+    }
+    fclose(dat);
+
+    if ( !found )
+        return false;
+
+    match.name.assign(entry.name, entry.length);
+    match.blocks = entry.blocks;
+    memcpy(match.type, entry.type, sizeof(match.type));
+    match.type[sizeof(match.type) - 1] = '\0';
+
+    totals.found++;
+    return true;
+}
+
+bool CatalogIndex::handles(const std::string &url)
+{
+    return mstr::startsWith(url, "find:", false);
+}
+
+std::string CatalogIndex::resolve(const std::string &url)
+{
+    Match match;
+    if ( !find(url.substr(5), match) )
+    {
+        Debug_printv("not in catalog url[%s]", url.c_str());
+        return "";
+    }
+
+    Debug_printv("found image[%s] name[%s]", match.image.c_str(), match.name.c_str());
+    return match.image + "/" + match.name;
+}
+
+CatalogIndex::Stats CatalogIndex::stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return totals;
+}
+
+std::string CatalogIndex::location()
+{
+#ifdef SD_CARD
+    if ( fnSDFAT.running() )
+        return std::string(fnSDFAT.basepath()) + SYSTEM_DIR "/catalog";
+#endif
+    return SYSTEM_DIR "/catalog";
+}
+
+bool CatalogIndex::readHeader(FILE *file, Header &header, const char *magic)
+{
+    return fread(&header, sizeof(header), 1, file) == 1 &&
+           memcmp(header.magic, magic, sizeof(header.magic)) == 0 &&
+           header.version == CATALOG_VERSION;
+}
+
+// FNV-1a, names fold case so FIND:ELITE finds "Elite" in a ZIP
+uint32_t CatalogIndex::hash(const char *data, size_t length, bool fold)
+{
+    uint32_t h = 2166136261u;
+    for ( size_t i = 0; i < length; i++ )
+    {
+        uint8_t c = data[i];
+        if ( fold )
+            c = tolower(c);
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
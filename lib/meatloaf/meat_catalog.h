@@ -0,0 +1,162 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// Catalog of the programs inside every image on flash and SD
+//
+// A low priority task walks the local filesystems, opens each disk, tape
+// and archive image with the regular MFile stack and writes down what is
+// inside. The catalog lives in two files in SYSTEM_DIR:
+//
+//   catalog.dat  one record per image (path, mtime, size) followed by its
+//                entries. A rescan copies the records of unchanged images
+//                and only opens the new or modified ones.
+//   catalog.idx  the same entries bucketed by name hash behind a fan-out
+//                table, so finding a name reads one table slot and one
+//                bucket instead of the whole card.
+//
+// LOAD"FIND:ELITE",8 loads the first program called ELITE from whatever
+// image holds it, the FIND:ELITE command changes into that image.
+//
+
+#ifndef MEATLOAF_CATALOG
+#define MEATLOAF_CATALOG
+
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "meatloaf.h"
+
+// Buckets of the name index = 1 << CATALOG_FANOUT_BITS
+#ifndef CATALOG_FANOUT_BITS
+#ifdef BOARD_HAS_PSRAM
+#define CATALOG_FANOUT_BITS 12
+#else
+#define CATALOG_FANOUT_BITS 10
+#endif
+#endif
+
+// Images remembered from the previous scan for the mtime check
+#ifndef CATALOG_MAX_IMAGES
+#ifdef BOARD_HAS_PSRAM
+#define CATALOG_MAX_IMAGES 32768
+#else
+#define CATALOG_MAX_IMAGES 4096
+#endif
+#endif
+
+#ifndef CATALOG_MAX_DEPTH
+#define CATALOG_MAX_DEPTH 8
+#endif
+
+#ifndef CATALOG_RESCAN_MS
+#define CATALOG_RESCAN_MS (10 * 60 * 1000)
+#endif
+
+#define CATALOG_STACKSIZE 8192
+#define CATALOG_PRIORITY 1
+#define CATALOG_CPUAFFINITY 0 // IEC service task runs on CPU1
+
+
+class CatalogIndex {
+public:
+    struct Match {
+        std::string image;  // Path of the image on flash or SD
+        std::string name;   // Program name inside it
+        uint16_t blocks;
+        char type[4];
+    };
+
+    struct Stats {
+        uint32_t images;
+        uint32_t entries;
+        uint32_t opened;        // Images read during the last scan, the rest were unchanged
+        uint32_t scan_ms;
+        uint32_t lookups;
+        uint32_t found;
+    };
+
+    // Start the background scanner, it rescans every CATALOG_RESCAN_MS
+    static void start();
+
+    // Image holding a program with this name (UTF-8, case doesn't matter)
+    static bool find(const std::string &name, Match &match);
+
+    // "find:NAME" urls
+    static bool handles(const std::string &url);
+    static std::string resolve(const std::string &url);
+
+    static Stats stats();
+
+private:
+    // Fixed size so the index can be read straight into it
+    struct Entry {
+        uint32_t hash;
+        uint32_t image;     // Offset of the image record in catalog.dat
+        uint16_t blocks;
+        uint8_t length;
+        uint8_t flags;
+        char type[4];
+        char name[16];
+    };
+
+    struct ImageRecord {
+        uint32_t mtime;
+        uint32_t size;
+        uint16_t path_length;
+        uint16_t count;
+    };
+
+    struct Header {
+        char magic[4];
+        uint16_t version;
+        uint8_t fanout_bits;
+        uint8_t reserved;
+        uint32_t images;
+        uint32_t entries;
+    };
+
+    struct Known {
+        uint32_t hash;      // Path hash
+        uint32_t offset;    // Record in the previous catalog.dat
+        bool operator<(const Known &other) const { return hash < other.hash; }
+    };
+
+    class Scan;
+
+    static void task(void *arg);
+    static bool scan();
+
+    static std::string location();
+    static uint32_t hash(const char *data, size_t length, bool fold);
+    static bool readHeader(FILE *file, Header &header, const char *magic);
+    static bool forEachEntry(FILE *dat, const Header &header, const std::function<bool(uint32_t, Entry &)> &visit);
+    static bool buildIndex(FILE *dat, const Header &header, const std::string &path);
+
+    static TaskHandle_t handle;
+    static Stats totals;
+    static std::mutex lock;  // Held while the files are read or swapped
+
+    friend class Scan;
+};
+
+#endif // MEATLOAF_CATALOG
@@ -0,0 +1,163 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "meat_listing.h"
+
+#include <esp_timer.h>
+
+#include "../../include/debug.h"
+
+std::unordered_map<std::string, ListingCache::CacheEntry> ListingCache::listings;
+std::list<std::string> ListingCache::lru_list;
+
+size_t ListingCache::budget = LISTING_CACHE_BYTES;
+size_t ListingCache::bytes = 0;
+
+uint32_t ListingCache::hits = 0;
+uint32_t ListingCache::misses = 0;
+uint32_t ListingCache::invalidations = 0;
+
+std::mutex ListingCache::lock;
+
+static uint64_t now_ms()
+{
+    return esp_timer_get_time() / 1000;
+}
+
+
+std::string ListingCache::key(const std::string &url, const std::string &pattern, uint8_t header_mode)
+{
+    std::string key = url;
+    key += '\x1F';
+    key += pattern;
+    key += '\x1F';
+    key += (char)header_mode;
+    return key;
+}
+
+ListingCache::Listing ListingCache::lookup(const std::string &key, time_t stamp)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = listings.find(key);
+    if ( found == listings.end() )
+    {
+        misses++;
+        return nullptr;
+    }
+
+    // Source changed, or we can't tell and it has been a while
+    auto &entry = found->second;
+    if ( entry.stamp != stamp || (stamp == 0 && now_ms() - entry.created > LISTING_CACHE_TTL_MS) )
+    {
+        Debug_printv("stale url[%s] stamp[%ld] now[%ld]", entry.url.c_str(), (long)entry.stamp, (long)stamp);
+        erase(found);
+        invalidations++;
+        misses++;
+        return nullptr;
+    }
+
+    lru_list.splice(lru_list.begin(), lru_list, entry.lru);
+    hits++;
+    return entry.listing;
+}
+
+void ListingCache::store(const std::string &key, time_t stamp, std::vector<uint8_t> &&listing)
+{
+    // Bigger than the whole budget, don't flush everything else for it
+    if ( listing.size() > budget )
+        return;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = listings.find(key);
+    if ( found != listings.end() )
+        erase(found);
+
+    listing.shrink_to_fit();
+    bytes += listing.size();
+
+    lru_list.push_front(key);
+    CacheEntry entry;
+    entry.url = key.substr(0, key.find('\x1F'));
+    entry.listing = std::make_shared<const std::vector<uint8_t>>(std::move(listing));
+    entry.stamp = stamp;
+    entry.created = now_ms();
+    entry.lru = lru_list.begin();
+    listings.emplace(key, std::move(entry));
+
+    validate();
+}
+
+void ListingCache::invalidate(const std::string &url)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    for ( auto it = listings.begin(); it != listings.end(); )
+    {
+        auto &entry_url = it->second.url;
+        bool related = (url.compare(0, entry_url.size(), entry_url) == 0) ||
+                       (entry_url.compare(0, url.size(), url) == 0);
+        if ( related )
+        {
+            auto next = std::next(it);
+            erase(it);
+            invalidations++;
+            it = next;
+        }
+        else
+            ++it;
+    }
+}
+
+void ListingCache::clear()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    listings.clear();
+    lru_list.clear();
+    bytes = 0;
+}
+
+void ListingCache::setBudget(size_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    budget = size;
+    validate();
+}
+
+ListingCache::Stats ListingCache::stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    return { hits, misses, invalidations, listings.size(), bytes, budget };
+}
+
+// Channels still sending a dropped listing keep their copy through the shared_ptr
+void ListingCache::erase(std::unordered_map<std::string, CacheEntry>::iterator it)
+{
+    bytes -= it->second.listing->size();
+    lru_list.erase(it->second.lru);
+    listings.erase(it);
+}
+
+void ListingCache::validate()
+{
+    while ( bytes > budget && !lru_list.empty() )
+        erase(listings.find(lru_list.back()));
+}
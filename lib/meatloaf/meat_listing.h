@@ -0,0 +1,106 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// Rendered directory listing cache
+//
+// Menu programs LOAD"$" the same directory over and over. ListingCache keeps
+// the finished BASIC listing (PETSCII bytes as sent on the bus) per
+// (directory url, filter pattern, header mode) so a repeat listing is a
+// plain copy. Entries are dropped when anything below their url is written,
+// when the stamp of their source (mtime) changes, or after a timeout when
+// the source has no stamp (remote directories).
+//
+
+#ifndef MEATLOAF_LISTING
+#define MEATLOAF_LISTING
+
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef LISTING_CACHE_BYTES
+#ifdef BOARD_HAS_PSRAM
+#define LISTING_CACHE_BYTES (128 * 1024)
+#else
+#define LISTING_CACHE_BYTES (8 * 1024)
+#endif
+#endif
+
+// How long a listing without a source stamp stays valid
+#ifndef LISTING_CACHE_TTL_MS
+#define LISTING_CACHE_TTL_MS 30000
+#endif
+
+
+class ListingCache {
+public:
+    using Listing = std::shared_ptr<const std::vector<uint8_t>>;
+
+    struct Stats {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t invalidations;
+        size_t entries;
+        size_t bytes;
+        size_t budget;
+    };
+
+    static std::string key(const std::string &url, const std::string &pattern, uint8_t header_mode);
+
+    // Cached listing, nullptr if there is none or it went stale
+    static Listing lookup(const std::string &key, time_t stamp);
+    static void store(const std::string &key, time_t stamp, std::vector<uint8_t> &&listing);
+
+    // Something at url changed, drop the listings of url, its parents and
+    // everything below it
+    static void invalidate(const std::string &url);
+    static void clear();
+
+    static void setBudget(size_t bytes);
+
+    static Stats stats();
+
+private:
+    struct CacheEntry {
+        std::string url;
+        Listing listing;
+        time_t stamp;
+        uint64_t created;
+        std::list<std::string>::iterator lru;
+    };
+
+    static void erase(std::unordered_map<std::string, CacheEntry>::iterator it);
+    static void validate();
+
+    static std::unordered_map<std::string, CacheEntry> listings;
+    static std::list<std::string> lru_list; // front = most recently used
+
+    static size_t budget;
+    static size_t bytes;
+
+    static uint32_t hits;
+    static uint32_t misses;
+    static uint32_t invalidations;
+
+    static std::mutex lock;
+};
+
+#endif // MEATLOAF_LISTING
@@ -17,7 +17,22 @@
 
 #include "meat_media.h"
 
-std::unordered_map<std::string, std::shared_ptr<MMediaStream>>ImageBroker::image_repo;
+std::unordered_map<std::string, ImageBroker::CacheEntry> ImageBroker::image_repo;
+std::list<std::string> ImageBroker::lru_list;
+
+size_t ImageBroker::budget = IMAGE_BROKER_BUDGET;
+size_t ImageBroker::hot_entries = IMAGE_BROKER_HOT_ENTRIES;
+#ifdef BOARD_HAS_PSRAM
+bool ImageBroker::psram_residency = true;
+#else
+bool ImageBroker::psram_residency = false;
+#endif
+
+uint32_t ImageBroker::hits = 0;
+uint32_t ImageBroker::misses = 0;
+uint32_t ImageBroker::evictions = 0;
+
+thread_local std::unordered_map<std::string, std::shared_ptr<MMediaStream>> *ImageBroker::scope = nullptr;
 
 // Utility Functions
 
@@ -172,24 +187,106 @@ bool MMediaStream::open(std::ios_base::openmode mode)
 void MMediaStream::close()
 {
     //Debug_printv("Heap[%lu]", esp_get_free_heap_size());
+    if ( cache_id )
+        SectorCache::flush(cache_id);
+    else if ( containerStream != nullptr )
+        containerStream->flush();
 }
 
 
+bool MMediaStream::seekContainer(uint32_t position)
+{
+    container_position = position;
+    if ( cache_id )
+    {
+        // Sectors are fetched on demand, just validate the position
+        uint32_t size = containerStream->size();
+        return ( size == 0 || position <= size );
+    }
+
+    return containerStream->seek(position);
+}
+
 uint32_t MMediaStream::readContainer(uint8_t *buf, uint32_t size)
 {
     //Debug_printv("readContainer[%lu]", size);
-    return containerStream->read(buf, size);
+    uint32_t bytesRead = 0;
+    if ( cache_id )
+        bytesRead = SectorCache::read(cache_id, container_position, buf, size);
+    else
+        bytesRead = containerStream->read(buf, size);
+
+    container_position += bytesRead;
+    return bytesRead;
 }
 uint32_t MMediaStream::writeContainer(uint8_t *buf, uint32_t size)
 {
     //Debug_printv("writeContainer[%lu]", size);
-    return containerStream->write(buf, size);
+    uint32_t bytesWritten = 0;
+    if ( cache_id )
+        bytesWritten = SectorCache::write(cache_id, container_position, buf, size);
+    else
+        bytesWritten = containerStream->write(buf, size);
+
+    container_position += bytesWritten;
+    return bytesWritten;
+}
+
+const uint8_t *MMediaStream::viewContainer(uint32_t &size)
+{
+    releaseView();
+    if ( !cache_id )
+        return nullptr;
+
+    uint16_t length = 0;
+    uint16_t offset = container_position % SECTOR_CACHE_BLOCK_SIZE;
+    const uint8_t *sector = SectorCache::pin(cache_id, container_position / SECTOR_CACHE_BLOCK_SIZE, &length);
+    if ( sector == nullptr )
+        return nullptr;
+
+    if ( offset >= length )
+    {
+        SectorCache::unpin(sector);
+        return nullptr;
+    }
+
+    container_view = sector;
+    size = std::min(size, (uint32_t)(length - offset));
+    return sector + offset;
+}
+
+void MMediaStream::releaseView()
+{
+    if ( container_view )
+        SectorCache::unpin(container_view);
+    container_view = nullptr;
+}
+
+uint32_t MMediaStream::peekView(const uint8_t **view)
+{
+    *view = nullptr;
+
+    // File data layout is format specific, only raw image bytes are handled here
+    if ( seekCalled || _position >= _size )
+        return 0;
+
+    uint32_t size = _size - _position;
+    *view = viewContainer(size);
+    return ( *view ) ? size : 0;
+}
+
+uint32_t MMediaStream::consume(uint32_t size)
+{
+    releaseView();
+    container_position += size;
+    _position += size;
+    return size;
 }
 
 uint8_t MMediaStream::read() 
 {
     uint8_t b = 0;
-    containerStream->read( &b, 1 );
+    readContainer( &b, 1 );
     _position++;
     return b;
 }
@@ -223,7 +320,7 @@ std::string MMediaStream::readUntil( uint8_t delimiter )
     std::string bytes = "";
     do
     {
-        s = containerStream->read( &b, 1 );
+        s = readContainer( &b, 1 );
         _position += s;
         if ( b != delimiter )
         {
@@ -239,7 +336,7 @@ std::string MMediaStream::readUntil( uint8_t delimiter )
 std::string MMediaStream::readString( uint8_t size )
 {
     uint8_t b[size];
-    if ( auto s = containerStream->read( b, size ) )
+    if ( auto s = readContainer( b, size ) )
     {
         _position += s;
         return std::string((char *)b);
@@ -251,7 +348,7 @@ std::string MMediaStream::readStringUntil( uint8_t delimiter )
 {
     uint8_t b = 0;
     std::stringstream ss;
-    while( containerStream->read( &b, 1 ) )
+    while( readContainer( &b, 1 ) )
     {
         _position++;
         if ( b == delimiter )
@@ -261,18 +358,33 @@ std::string MMediaStream::readStringUntil( uint8_t delimiter )
 }
 
 uint32_t MMediaStream::write(const uint8_t *buf, uint32_t size) {
-    return containerStream->write(buf, size);
+    uint32_t bytesWritten = 0;
+
+    if(seekCalled) {
+        // stream is set to a file via seekPath, let the format lay out the bytes
+        bytesWritten = writeFile((uint8_t *)buf, size);
+    }
+    else {
+        // raw image bytes
+        bytesWritten = writeContainer((uint8_t *)buf, size);
+    }
+
+    _position += bytesWritten;
+    if ( _position > _size )
+        _size = _position;
+
+    return bytesWritten;
 }
 
 // seek = (offset) => this.containerStream.seek(offset + this.media_header_size);
 bool MMediaStream::seek(uint32_t offset) {
     _position = media_data_offset + offset;
-    return containerStream->seek( _position ); 
+    return seekContainer( _position ); 
 }
 // seekCurrent = (offset) => this.containerStream.seekCurrent(offset);
 bool MMediaStream::seekCurrent(uint32_t offset) {
     _position += offset;
-    return containerStream->seek( _position );
+    return seekContainer( _position );
 }
 
 uint32_t MMediaStream::seekFileSize( uint8_t start_track, uint8_t start_sector )
@@ -296,4 +408,131 @@ uint32_t MMediaStream::seekFileSize( uint8_t start_track, uint8_t start_sector )
     uint32_t size = (blocks * (block_size - 2)) + start_sector - 1;
     printf("File size is [%lu] bytes...\r\n", size);
     return size;
-};
\ No newline at end of file
+};
+
+
+/********************************************************
+ * ImageBroker
+ ********************************************************/
+
+std::shared_ptr<MMediaStream> ImageBroker::lookup(const std::string &url)
+{
+    auto it = image_repo.find(url);
+    if ( it == image_repo.end() )
+    {
+        misses++;
+        return nullptr;
+    }
+
+    hits++;
+
+    // Move to front of LRU list
+    lru_list.splice(lru_list.begin(), lru_list, it->second.lru);
+    updateResidency();
+
+    return it->second.stream;
+}
+
+void ImageBroker::insert(const std::string &url, std::shared_ptr<MMediaStream> stream)
+{
+    auto it = image_repo.find(url);
+    if ( it != image_repo.end() )
+        erase(it);
+
+    lru_list.push_front(url);
+    image_repo.insert(std::make_pair(url, CacheEntry{ stream, lru_list.begin(), stream->footprint(), true }));
+
+    updateResidency();
+    validate();
+}
+
+void ImageBroker::erase(std::unordered_map<std::string, CacheEntry>::iterator it)
+{
+    lru_list.erase(it->second.lru);
+    image_repo.erase(it);
+}
+
+void ImageBroker::updateResidency()
+{
+    size_t index = 0;
+    for ( auto &url : lru_list )
+    {
+        auto &entry = image_repo.at(url);
+        bool hot = !psram_residency || (index < hot_entries);
+        if ( entry.hot != hot )
+        {
+            entry.hot = hot;
+            entry.stream->setResidency(hot);
+        }
+        index++;
+    }
+}
+
+void ImageBroker::validate()
+{
+    // Footprints change as streams fill their caches, so refresh them first
+    size_t used = 0;
+    for ( auto &pair : image_repo )
+    {
+        pair.second.footprint = pair.second.stream->footprint();
+        used += pair.second.footprint;
+    }
+
+    // Walk from least recently used towards the front
+    auto url = lru_list.end();
+    while ( used > budget && url != lru_list.begin() )
+    {
+        url--;
+        auto it = image_repo.find(*url);
+
+        // Still referenced by an open channel or a directory listing in progress
+        if ( it->second.stream.use_count() > 1 )
+            continue;
+
+        Debug_printv("evicting url[%s] footprint[%d]", url->c_str(), it->second.footprint);
+        used -= it->second.footprint;
+        url = lru_list.erase(url);
+        image_repo.erase(it);
+        evictions++;
+    }
+
+    if ( used > budget )
+        Debug_printv("over budget used[%d] budget[%d] (streams in use)", used, budget);
+}
+
+void ImageBroker::dispose(std::string url, bool contents)
+{
+    // Released after the loop, closing a stream can come back here
+    std::vector<std::shared_ptr<MMediaStream>> disposed;
+    std::string prefix = url + "/";
+    for ( auto it = image_repo.begin(); it != image_repo.end(); )
+    {
+        if ( it->first == url || ( contents && mstr::startsWith(it->first, prefix.c_str()) ) )
+        {
+            disposed.push_back(it->second.stream);
+            lru_list.erase(it->second.lru);
+            it = image_repo.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    Debug_printv("streams[%d] disposed[%d]", image_repo.size(), disposed.size());
+}
+
+void ImageBroker::clear()
+{
+    image_repo.clear();
+    lru_list.clear();
+}
+
+ImageBroker::Stats ImageBroker::stats()
+{
+    Stats s = { hits, misses, evictions, image_repo.size(), 0, budget };
+    for ( auto &pair : image_repo )
+        s.bytes += pair.second.footprint;
+
+    return s;
+}
@@ -19,10 +19,12 @@
 #define MEATLOAF_MEDIA
 
 #include "meatloaf.h"
+#include "meat_cache.h"
 
 #include <map>
 #include <bitset>
 #include <unordered_map>
+#include <list>
 #include <sstream>
 
 #include "../../include/debug.h"
@@ -39,6 +41,7 @@ class MMediaStream: public MStream {
 public:
     MMediaStream(std::shared_ptr<MStream> is) {
         containerStream = is;
+        mode = std::ios_base::in;
         _is_open = true;
         has_subdirs = false;
     }
@@ -46,6 +49,9 @@ public:
     ~MMediaStream() {
         //Debug_printv("close");
         close();
+        releaseView();
+        if ( cache_id )
+            SectorCache::detach(cache_id);
     }
 
     std::string url;
@@ -80,6 +86,9 @@ public:
 
     virtual uint32_t write(const uint8_t *buf, uint32_t size);
 
+    uint32_t peekView(const uint8_t **view) override;
+    uint32_t consume(uint32_t size) override;
+
     // seek = (offset) => this.containerStream.seek(offset + this.media_header_size);
     bool seek(uint32_t offset) override;
     // seekCurrent = (offset) => this.containerStream.seekCurrent(offset);
@@ -90,17 +99,50 @@ public:
 
     virtual uint32_t seekFileSize( uint8_t start_track, uint8_t start_sector );
 
+    // Approximate memory held by this stream, used by ImageBroker to stay within budget
+    virtual size_t footprint() { return sizeof(MMediaStream) + block_size; };
+
+    // Called by ImageBroker when this stream moves between the hot set (internal RAM)
+    // and the cold set (PSRAM). Streams owning pooled buffers move them here.
+    virtual void setResidency(bool hot) { is_hot = hot; };
+
+    // Sector cache statistics for this image
+    SectorCache::Stats cacheStats() { return SectorCache::stats(cache_id); };
+
 
 protected:
 
     bool seekCalled = false;
     std::shared_ptr<MStream> containerStream;
 
+    // All container access goes through readContainer/writeContainer at this position
+    uint32_t container_position = 0;
+    uint32_t cache_id = 0;
+
+    // Route container access through the shared sector cache
+    void enableSectorCache() {
+        if ( !cache_id && block_size == SECTOR_CACHE_BLOCK_SIZE )
+            cache_id = SectorCache::attach(containerStream);
+    }
+    void disableSectorCache() {
+        if ( cache_id )
+            SectorCache::detach(cache_id);
+        cache_id = 0;
+    }
+    bool seekContainer(uint32_t position);
+
+    // Pin the cached sector at container_position and lend it out, size is
+    // clamped to the end of that sector
+    const uint8_t *viewContainer(uint32_t &size);
+    void releaseView();
+    const uint8_t *container_view = nullptr;
+
     bool _is_open = false;
 
     MMediaStream* decodedStream;
 
     bool show_hidden = false;
+    bool is_hot = true;
 
     size_t media_header_size = 0x00;
     size_t media_data_offset = 0x00;
@@ -178,18 +220,94 @@ private:
 /********************************************************
  * Utility implementations
  ********************************************************/
+
+// Default memory budget for cached media streams. Boards with PSRAM can
+// afford to keep a lot more images around between directory listings.
+#ifndef IMAGE_BROKER_BUDGET
+#ifdef BOARD_HAS_PSRAM
+#define IMAGE_BROKER_BUDGET (512 * 1024)
+#else
+#define IMAGE_BROKER_BUDGET (48 * 1024)
+#endif
+#endif
+
+// Most recently used entries that are kept in internal RAM
+#ifndef IMAGE_BROKER_HOT_ENTRIES
+#define IMAGE_BROKER_HOT_ENTRIES 2
+#endif
+
 class ImageBroker {
-    static std::unordered_map<std::string, std::shared_ptr<MMediaStream>> image_repo;
+    struct CacheEntry {
+        std::shared_ptr<MMediaStream> stream;
+        std::list<std::string>::iterator lru;
+        size_t footprint;
+        bool hot;
+    };
+
+    static std::unordered_map<std::string, CacheEntry> image_repo;
+    static std::list<std::string> lru_list; // front = most recently used
+
+    static size_t budget;
+    static size_t hot_entries;
+    static bool psram_residency;
+
+    static uint32_t hits;
+    static uint32_t misses;
+    static uint32_t evictions;
+
+    static thread_local std::unordered_map<std::string, std::shared_ptr<MMediaStream>> *scope;
+
+    static std::shared_ptr<MMediaStream> lookup(const std::string &url);
+    static void insert(const std::string &url, std::shared_ptr<MMediaStream> stream);
+    static void erase(std::unordered_map<std::string, CacheEntry>::iterator it);
+    static void updateResidency();
+
 public:
+    struct Stats {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t evictions;
+        size_t entries;
+        size_t bytes;
+        size_t budget;
+    };
+
+    // Streams obtained on a task while a Scope is alive stay private to that
+    // Scope and close with it. Background work (the catalog scan) neither
+    // shares nor evicts the images the bus is using.
+    class Scope {
+    public:
+        Scope() : previous(scope) { scope = &streams; }
+        ~Scope() { scope = previous; }
+
+    private:
+        std::unordered_map<std::string, std::shared_ptr<MMediaStream>> streams;
+        std::unordered_map<std::string, std::shared_ptr<MMediaStream>> *previous;
+    };
+
     template<class T> static std::shared_ptr<T> obtain(std::string url) 
     {
+        if ( scope != nullptr )
+        {
+            auto found = scope->find(url);
+            if ( found != scope->end() )
+                return std::static_pointer_cast<T>(found->second);
+
+            std::unique_ptr<MFile> newFile(MFSOwner::File(url));
+            std::shared_ptr<T> newStream = std::static_pointer_cast<T>(newFile->getSourceStream());
+            if ( newStream != nullptr )
+                (*scope)[url] = newStream;
+            return newStream;
+        }
+
         Debug_printv("streams[%d] url[%s]", image_repo.size(), url.c_str());
 
         // obviously you have to supply sourceFile.url to this function!
-        if(image_repo.find(url)!=image_repo.end()) {
+        auto found = lookup(url);
+        if(found != nullptr) {
             Debug_printv("stream found!");
             Debug_memory();
-            return std::static_pointer_cast<T>(image_repo.at(url));
+            return std::static_pointer_cast<T>(found);
         }
 
         // create and add stream to image broker if not found
@@ -214,7 +332,7 @@ public:
                 Debug_printv("SINGLE FILE [%s]", url.c_str());
             }
 
-            image_repo.insert(std::make_pair(url, newStream));
+            insert(url, newStream);
             return newStream;
         }
 
@@ -226,25 +344,30 @@ public:
         return obtain<MMediaStream>(url);
     }
 
-    static void dispose(std::string url) {
-        if(image_repo.find(url)!=image_repo.end()) {
-            auto toDelete = image_repo.at(url);
-            image_repo.erase(url);
-            //delete toDelete;
-        }
-        Debug_printv("streams[%d]", image_repo.size());
-    }
+    // Drop the stream of url, with contents also the streams of everything
+    // inside it
+    static void dispose(std::string url, bool contents = false);
 
-    static void validate() {
-        
-    }
+    // Evict least recently used streams until we are back under budget.
+    // Streams still referenced by an open channel are never evicted.
+    static void validate();
+
+    static void clear();
 
-    static void clear() {
-        // std::for_each(image_repo.begin(), image_repo.end(), [](auto& pair) {
-        //     delete pair.second;
-        // });
-        image_repo.clear();
+    static void setBudget(size_t bytes) {
+        budget = bytes;
+        validate();
     }
+    static void setHotEntries(size_t count) {
+        hot_entries = count;
+        updateResidency();
+    }
+    static void setPsramResidency(bool enable) {
+        psram_residency = enable;
+        updateResidency();
+    }
+
+    static Stats stats();
 };
 
 #endif // MEATLOAF_MEDIA
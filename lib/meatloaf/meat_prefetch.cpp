@@ -0,0 +1,389 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "meat_prefetch.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <esp_timer.h>
+
+#include "../../include/debug.h"
+
+std::deque<std::weak_ptr<PrefetchMStream>> PrefetchWorker::jobs;
+TaskHandle_t PrefetchWorker::handle = nullptr;
+PrefetchWorker::Stats PrefetchWorker::totals = { 0 };
+std::mutex PrefetchWorker::lock;
+
+
+/********************************************************
+ * PrefetchMStream
+ ********************************************************/
+
+std::shared_ptr<MStream> PrefetchMStream::wrap(std::shared_ptr<MStream> source)
+{
+    if ( source == nullptr || source->mode != std::ios_base::in || !source->isReadAhead() )
+        return source;
+
+    // Small files come in with the first read anyway
+    if ( source->size() <= PREFETCH_BLOCK_SIZE )
+        return source;
+
+    return std::make_shared<PrefetchMStream>(source);
+}
+
+PrefetchMStream::PrefetchMStream(std::shared_ptr<MStream> source) : source(source)
+{
+    ring.reset(new uint8_t[PREFETCH_RING_SIZE]);
+
+    mode = source->mode;
+    url = source->url;
+    _position = source->position();
+    at_end = source->eos();
+}
+
+uint32_t PrefetchMStream::available()
+{
+    uint32_t size = source->size();
+    if ( _position > size )
+        return 0;
+
+    return size - _position;
+}
+
+bool PrefetchMStream::eos()
+{
+    std::lock_guard<std::mutex> guard(state);
+    return count == 0 && at_end;
+}
+
+bool PrefetchMStream::isOpen()
+{
+    return !closed && source->isOpen();
+}
+
+bool PrefetchMStream::open(std::ios_base::openmode mode)
+{
+    return source->isOpen();
+}
+
+void PrefetchMStream::close()
+{
+    std::lock_guard<std::mutex> io_guard(io);
+    std::lock_guard<std::mutex> guard(state);
+
+    if ( closed )
+        return;
+
+    closed = true;
+    count = 0;
+    source->close();
+}
+
+uint32_t PrefetchMStream::read(uint8_t* buf, uint32_t size)
+{
+    uint32_t total;
+    bool dry;
+    {
+        std::lock_guard<std::mutex> guard(state);
+        total = take(buf, size);
+        dry = ( total == 0 && size > 0 && !at_end && !closed );
+    }
+
+    if ( dry )
+    {
+        // Ring ran dry, wait for the block in flight or read straight from the source
+        uint64_t start = esp_timer_get_time();
+        {
+            std::lock_guard<std::mutex> io_guard(io);
+            std::unique_lock<std::mutex> guard(state);
+
+            total = take(buf, size);
+            if ( total == 0 && !at_end && !closed )
+            {
+                // Nothing buffered, so the source is sitting at _position
+                guard.unlock();
+                total = source->read(buf, size);
+                guard.lock();
+
+                _position += total;
+                if ( total == 0 || source->eos() )
+                    at_end = true;
+            }
+        }
+        PrefetchWorker::stall(esp_timer_get_time() - start);
+    }
+
+    schedule();
+    return total;
+}
+
+uint32_t PrefetchMStream::write(const uint8_t *buf, uint32_t size)
+{
+    // Read only, PrefetchMStream::wrap() never wraps streams opened for writing
+    return 0;
+}
+
+uint32_t PrefetchMStream::peekView(const uint8_t **view)
+{
+    uint32_t length;
+    {
+        std::lock_guard<std::mutex> guard(state);
+
+        // The buffered part of the ring is never touched by the worker
+        *view = ring.get() + head;
+        length = std::min(count, (uint32_t)PREFETCH_RING_SIZE - head);
+    }
+
+    if ( length == 0 )
+    {
+        *view = nullptr;
+        schedule();
+    }
+
+    return length;
+}
+
+uint32_t PrefetchMStream::consume(uint32_t size)
+{
+    {
+        std::lock_guard<std::mutex> guard(state);
+        size = std::min(size, count);
+        drop(size);
+    }
+
+    if ( size )
+        schedule();
+
+    return size;
+}
+
+bool PrefetchMStream::prefetch(uint32_t offset, uint32_t length)
+{
+    {
+        std::lock_guard<std::mutex> guard(state);
+
+        // Only sequential read ahead, the worker never seeks the source
+        if ( offset > _position + count )
+            return false;
+
+        limit = std::max(limit, offset + length);
+    }
+
+    schedule();
+    return true;
+}
+
+bool PrefetchMStream::seek(uint32_t pos)
+{
+    std::lock_guard<std::mutex> io_guard(io);
+    std::lock_guard<std::mutex> guard(state);
+
+    // Forward within the buffered data, just skip
+    if ( pos >= _position && pos <= _position + count )
+    {
+        drop(pos - _position);
+        return true;
+    }
+
+    count = 0;
+    head = 0;
+    at_end = false;
+    if ( !source->seek(pos) )
+        return false;
+
+    _position = pos;
+    at_end = source->eos();
+    return true;
+}
+
+bool PrefetchMStream::seekBlock( uint64_t index, uint8_t offset )
+{
+    std::lock_guard<std::mutex> io_guard(io);
+    std::lock_guard<std::mutex> guard(state);
+
+    count = 0;
+    head = 0;
+    bool ok = source->seekBlock(index, offset);
+    _position = source->position();
+    at_end = source->eos();
+    return ok;
+}
+
+bool PrefetchMStream::seekSector( uint8_t track, uint8_t sector, uint8_t offset )
+{
+    std::lock_guard<std::mutex> io_guard(io);
+    std::lock_guard<std::mutex> guard(state);
+
+    count = 0;
+    head = 0;
+    bool ok = source->seekSector(track, sector, offset);
+    _position = source->position();
+    at_end = source->eos();
+    return ok;
+}
+
+bool PrefetchMStream::fill(uint32_t &bytes)
+{
+    bytes = 0;
+
+    std::lock_guard<std::mutex> io_guard(io);
+    uint32_t tail, length;
+    {
+        std::lock_guard<std::mutex> guard(state);
+
+        // Stays queued while the read is in flight, so readers don't queue it twice
+        uint32_t end = _position + count;
+        if ( closed || at_end || count == PREFETCH_RING_SIZE || end >= limit )
+        {
+            queued = false;
+            return false;
+        }
+
+        // One contiguous block of the free part of the ring
+        tail = (head + count) % PREFETCH_RING_SIZE;
+        length = std::min((uint32_t)PREFETCH_RING_SIZE - count, (uint32_t)PREFETCH_RING_SIZE - tail);
+        length = std::min(length, (uint32_t)PREFETCH_BLOCK_SIZE);
+        length = std::min(length, limit - end);
+    }
+
+    bytes = source->read(ring.get() + tail, length);
+
+    std::lock_guard<std::mutex> guard(state);
+    count += bytes;
+    if ( bytes == 0 || source->eos() )
+        at_end = true;
+
+    queued = !at_end && count < PREFETCH_RING_SIZE && _position + count < limit;
+    return queued;
+}
+
+void PrefetchMStream::schedule()
+{
+    {
+        std::lock_guard<std::mutex> guard(state);
+        if ( queued || closed || at_end || count == PREFETCH_RING_SIZE || _position + count >= limit )
+            return;
+
+        queued = true;
+    }
+
+    PrefetchWorker::schedule(shared_from_this());
+}
+
+// Copy out of the buffered part of the ring, state must be held
+uint32_t PrefetchMStream::take(uint8_t *buf, uint32_t size)
+{
+    size = std::min(size, count);
+
+    uint32_t first = std::min(size, (uint32_t)PREFETCH_RING_SIZE - head);
+    memcpy(buf, ring.get() + head, first);
+    memcpy(buf + first, ring.get(), size - first);
+
+    drop(size);
+    return size;
+}
+
+// Advance past buffered bytes, state must be held
+void PrefetchMStream::drop(uint32_t size)
+{
+    head = (head + size) % PREFETCH_RING_SIZE;
+    count -= size;
+    _position += size;
+}
+
+
+/********************************************************
+ * PrefetchWorker
+ ********************************************************/
+
+void PrefetchWorker::schedule(std::shared_ptr<PrefetchMStream> stream)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if ( handle == nullptr )
+    {
+        if ( xTaskCreatePinnedToCore(task, "ml_prefetch", PREFETCH_STACKSIZE, nullptr, PREFETCH_PRIORITY, &handle, PREFETCH_CPUAFFINITY) != pdPASS )
+        {
+            Debug_printv("Unable to start prefetch worker");
+            handle = nullptr;
+
+            std::lock_guard<std::mutex> stream_guard(stream->state);
+            stream->queued = false;
+            return;
+        }
+    }
+
+    jobs.push_back(stream);
+    totals.depth = jobs.size();
+    totals.depth_peak = std::max(totals.depth_peak, totals.depth);
+
+    xTaskNotifyGive(handle);
+}
+
+void PrefetchWorker::stall(uint64_t us)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    totals.stalls++;
+    totals.stall_us += us;
+}
+
+PrefetchWorker::Stats PrefetchWorker::stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return totals;
+}
+
+void PrefetchWorker::task(void *arg)
+{
+    while ( true )
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while ( true )
+        {
+            std::shared_ptr<PrefetchMStream> stream;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if ( jobs.empty() )
+                    break;
+
+                stream = jobs.front().lock();
+                jobs.pop_front();
+                totals.depth = jobs.size();
+            }
+
+            // Stream went away while it was waiting
+            if ( stream == nullptr )
+                continue;
+
+            // One block per turn so streams take turns
+            uint32_t bytes;
+            bool more = stream->fill(bytes);
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                totals.fills++;
+                totals.bytes += bytes;
+                if ( more )
+                {
+                    jobs.push_back(stream);
+                    totals.depth = jobs.size();
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,140 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// Background read-ahead for streams backed by SD, flash or the network
+//
+// PrefetchMStream sits in front of a source stream and keeps a ring of
+// blocks filled ahead of the reader. The filling is done by a single I/O
+// worker task on the other core, so the IEC service task only copies out
+// of RAM while the worker waits on the device.
+//
+
+#ifndef MEATLOAF_PREFETCH
+#define MEATLOAF_PREFETCH
+
+#include <memory>
+#include <deque>
+#include <mutex>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "meatloaf.h"
+
+#ifndef PREFETCH_BLOCK_SIZE
+#define PREFETCH_BLOCK_SIZE 512
+#endif
+
+#ifndef PREFETCH_BLOCKS
+#ifdef BOARD_HAS_PSRAM
+#define PREFETCH_BLOCKS 32 // 16KB per stream
+#else
+#define PREFETCH_BLOCKS 8  // 4KB per stream
+#endif
+#endif
+
+#define PREFETCH_RING_SIZE (PREFETCH_BLOCK_SIZE * PREFETCH_BLOCKS)
+
+#define PREFETCH_STACKSIZE 4096
+#define PREFETCH_PRIORITY 5
+#define PREFETCH_CPUAFFINITY 0 // IEC service task runs on CPU1
+
+
+class PrefetchMStream : public MStream, public std::enable_shared_from_this<PrefetchMStream> {
+public:
+    // Put a read-ahead ring in front of the stream if it is worth it, otherwise hand it back
+    static std::shared_ptr<MStream> wrap(std::shared_ptr<MStream> source);
+
+    PrefetchMStream(std::shared_ptr<MStream> source);
+
+    uint32_t size() override { return source->size(); };
+    uint32_t available() override;
+    size_t error() override { return source->error(); };
+    bool eos() override;
+
+    bool isOpen() override;
+    bool isRandomAccess() override { return source->isRandomAccess(); };
+
+    bool open(std::ios_base::openmode mode) override;
+    void close() override;
+
+    uint32_t read(uint8_t* buf, uint32_t size) override;
+    uint32_t write(const uint8_t *buf, uint32_t size) override;
+
+    uint32_t peekView(const uint8_t **view) override;
+    uint32_t consume(uint32_t size) override;
+
+    bool prefetch(uint32_t offset, uint32_t length) override;
+
+    bool seek(uint32_t pos) override;
+    bool seekBlock( uint64_t index, uint8_t offset = 0 ) override;
+    bool seekSector( uint8_t track, uint8_t sector, uint8_t offset = 0 ) override;
+
+private:
+    // Worker side, read the next block into the ring. Returns true if there's more to do.
+    bool fill(uint32_t &bytes);
+
+    void schedule();
+    uint32_t take(uint8_t *buf, uint32_t size);
+    void drop(uint32_t size);
+
+    std::shared_ptr<MStream> source;
+    std::unique_ptr<uint8_t[]> ring;
+
+    uint32_t head = 0;      // Ring offset of _position
+    uint32_t count = 0;     // Bytes buffered from _position on
+    uint32_t limit = 0;     // Read ahead up to this stream offset (from prefetch hints)
+    bool at_end = false;
+    bool closed = false;
+    bool queued = false;
+
+    // io serializes access to the source, state guards the ring indices.
+    // The worker only ever writes the free part of the ring, so readers
+    // copy out of the buffered part while a fill is in flight.
+    std::mutex io;
+    std::mutex state;
+
+    friend class PrefetchWorker;
+};
+
+
+class PrefetchWorker {
+public:
+    struct Stats {
+        uint32_t depth;         // Streams waiting for the worker
+        uint32_t depth_peak;
+        uint32_t fills;
+        uint64_t bytes;
+        uint32_t stalls;        // Reads that found the ring empty
+        uint64_t stall_us;      // Time readers spent waiting on the source
+    };
+
+    static void schedule(std::shared_ptr<PrefetchMStream> stream);
+    static void stall(uint64_t us);
+
+    static Stats stats();
+
+private:
+    static void task(void *arg);
+
+    static std::deque<std::weak_ptr<PrefetchMStream>> jobs;
+    static TaskHandle_t handle;
+    static Stats totals;
+    static std::mutex lock;
+};
+
+#endif // MEATLOAF_PREFETCH
@@ -20,6 +20,7 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <cctype>
 #include <algorithm>
 #include <vector>
 #include <sstream>
@@ -37,6 +38,8 @@
 
 #include "meat_broker.h"
 #include "meat_buffer.h"
+#include "meat_catalog.h"
+#include "meat_listing.h"
 //#include "wrappers/directory_stream.h"
 
 #include "string_utils.h"
@@ -95,7 +98,6 @@
 #include "tape/tcrt.h"
 
 //std::unordered_map<std::string, MFile*> FileBroker::file_repo;
-//std::unordered_map<std::string, std::shared_ptr<MStream>> StreamBroker::stream_repo;
 
 /********************************************************
  * MFSOwner implementations
@@ -221,6 +223,14 @@ MFile* MFSOwner::File(std::shared_ptr<MFile> file) {
 }
 
 
+std::vector<MFSOwner::TrieNode> MFSOwner::trie;
+std::vector<uint8_t> MFSOwner::opaque;
+std::unordered_map<std::string, MFSOwner::CacheEntry> MFSOwner::resolve_cache;
+std::list<std::string> MFSOwner::resolve_lru;
+uint32_t MFSOwner::hits = 0;
+uint32_t MFSOwner::misses = 0;
+std::mutex MFSOwner::lock;
+
 MFile* MFSOwner::File(std::string path, bool default_fs) {
 
     if ( path.empty() )
@@ -233,6 +243,13 @@ MFile* MFSOwner::File(std::string path, bool default_fs) {
             path = mlFS.resolve(path);
         }
 
+        if ( CatalogIndex::handles(path) )
+        {
+            path = CatalogIndex::resolve(path);
+            if ( path.empty() )
+                return nullptr;
+        }
+
         if ( csipFS.handles(path) )
         {
             return csipFS.getFile(path);
@@ -242,53 +259,64 @@ MFile* MFSOwner::File(std::string path, bool default_fs) {
     Debug_println("vvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvv");
     Debug_printv("targetPath[%s]", path.c_str());
 
-    std::vector<std::string> paths = mstr::split(path,'/');
-    auto pathIterator = paths.end();
-    auto begin = paths.begin();
-    auto end = paths.end();
-
-    MFileSystem *targetFileSystem = &defaultFS;
-    if ( !default_fs )
+    Resolution resolution;
+    if ( default_fs )
     {
-        targetFileSystem = findParentFS(begin, end, pathIterator);
+        resolution = resolve(path, true);
     }
+    else
+    {
+        // vdrive changes which filesystems may claim a segment
+        std::string key = path;
+        key.push_back(Meatloaf.use_vdrive ? '\x01' : '\x00');
 
-    auto targetFile = targetFileSystem->getFile(path);
+        std::unique_lock<std::mutex> guard(lock);
+        auto found = resolve_cache.find(key);
+        if ( found != resolve_cache.end() )
+        {
+            hits++;
+            resolve_lru.splice(resolve_lru.begin(), resolve_lru, found->second.lru);
+            resolution = found->second.resolution;
+        }
+        else
+        {
+            misses++;
+            guard.unlock();
+            resolution = resolve(path);
+            guard.lock();
 
-    // Set path to file in filesystem stream
-    targetFile->pathInStream = mstr::joinToString(&pathIterator, &end, "/");
+            if ( resolve_cache.find(key) == resolve_cache.end() )
+            {
+                while ( resolve_cache.size() >= MFS_RESOLVE_CACHE_SIZE )
+                {
+                    resolve_cache.erase(resolve_lru.back());
+                    resolve_lru.pop_back();
+                }
 
-    end = pathIterator;
-    pathIterator--;
-    Debug_printv("targetFile[%s] in targetFileSystem[%s][%s]", targetFile->pathInStream.c_str(), targetFile->url.c_str(), targetFileSystem->symbol);
+                resolve_lru.push_front(key);
+                resolve_cache[key] = { resolution, resolve_lru.begin() };
+            }
+        }
+    }
 
-    auto sourcePath = mstr::joinToString(&begin, &pathIterator, "/");
-    Debug_printv("sourcePath[%s]", sourcePath.c_str());
+    auto targetFile = resolution.target->getFile(path);
 
-    if( begin == pathIterator )
+    // Set path to file in filesystem stream
+    targetFile->pathInStream = resolution.pathInStream;
+    Debug_printv("targetFile[%s] in targetFileSystem[%s][%s]", targetFile->pathInStream.c_str(), targetFile->url.c_str(), resolution.target->symbol);
+
+    if ( resolution.source == nullptr )
     {
-        Debug_printv("** LOOK UP PATH NOT NEEDED   path[%s] sourcePath[%s]", path.c_str(), sourcePath.c_str());
-        targetFile->sourceFile = targetFileSystem->getFile(sourcePath);
-    } 
-    else 
+        Debug_printv("** LOOK UP PATH NOT NEEDED   path[%s] sourcePath[%s]", path.c_str(), resolution.sourcePath.c_str());
+        targetFile->sourceFile = resolution.target->getFile(resolution.sourcePath);
+    }
+    else
     {
-        //Debug_printv("** LOOK UP PATH: %s", sourcePath.c_str());
-
-        // Find the container filesystem
-        MFileSystem *sourceFileSystem = &defaultFS;
-        if ( !default_fs )
-        {
-            sourceFileSystem = findParentFS(begin, end, pathIterator);
-        }
-
-        auto wholePath = mstr::joinToString(&begin, &end, "/");
-        Debug_printv("wholePath[%s]", wholePath.c_str());
-
         // sourceFile is for raw access to the container stream
-        targetFile->sourceFile = sourceFileSystem->getFile(wholePath);
+        targetFile->sourceFile = resolution.source->getFile(resolution.sourcePath);
 
-        targetFile->isWritable = targetFile->sourceFile->isWritable;   // This stream is writable if the container is writable
-        Debug_printv("sourceFile[%s] is in [%s][%s]", targetFile->sourceFile->pathInStream.c_str(), sourcePath.c_str(), sourceFileSystem->symbol);
+        targetFile->isWritable = targetFile->isWritable && targetFile->sourceFile->isWritable;   // Writable if the format can write and the container is writable
+        Debug_printv("sourceFile[%s] is in [%s][%s]", targetFile->sourceFile->pathInStream.c_str(), resolution.sourcePath.c_str(), resolution.source->symbol);
     }
 
     if (targetFile != nullptr)
@@ -310,6 +338,55 @@ MFile* MFSOwner::File(std::string path, bool default_fs) {
     return targetFile;
 }
 
+MFSOwner::Resolution MFSOwner::resolve(std::string path, bool default_fs) {
+    Resolution resolution = { &defaultFS, nullptr, "", "" };
+
+    std::vector<std::string> paths = mstr::split(path,'/');
+    auto pathIterator = paths.end();
+    auto begin = paths.begin();
+    auto end = paths.end();
+
+    if ( !default_fs )
+    {
+        resolution.target = findParentFS(begin, end, pathIterator);
+    }
+
+    resolution.pathInStream = mstr::joinToString(&pathIterator, &end, "/");
+
+    end = pathIterator;
+    pathIterator--;
+
+    if( begin == pathIterator )
+    {
+        resolution.sourcePath = mstr::joinToString(&begin, &pathIterator, "/");
+    }
+    else
+    {
+        // Find the container filesystem
+        resolution.source = &defaultFS;
+        if ( !default_fs )
+        {
+            resolution.source = findParentFS(begin, end, pathIterator);
+        }
+
+        resolution.sourcePath = mstr::joinToString(&begin, &end, "/");
+        Debug_printv("wholePath[%s]", resolution.sourcePath.c_str());
+    }
+
+    return resolution;
+}
+
+void MFSOwner::clearCache() {
+    std::lock_guard<std::mutex> guard(lock);
+    resolve_cache.clear();
+    resolve_lru.clear();
+}
+
+MFSOwner::Stats MFSOwner::stats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return { hits, misses, resolve_cache.size() };
+}
+
 MFile* MFSOwner::NewFile(std::string path) {
 
     auto newFile = File(path);
@@ -370,30 +447,15 @@ MFileSystem* MFSOwner::findParentFS(std::vector<std::string>::iterator &begin, s
     {
         pathIterator--;
 
-        auto part = *pathIterator;
-        mstr::toLower(part);
+        const auto &part = *pathIterator;
         //Debug_printv("part[%s]", part.c_str());
         if ( part.size() )
         {
-            auto foundFS=std::find_if(availableFS.begin() + 1, availableFS.end(), [&part](MFileSystem* fs){ 
-                //Debug_printv("symbol[%s]", fs->symbol);
-                bool found = fs->handles(part);
-                if ( !found )
-                    return false;
-
-                //Debug_printv("found[%d] part[%s] use_vdrive[%d] vdrive_compatible[%d]", found, part.c_str(), Meatloaf.use_vdrive, fs->vdrive_compatible);
-
-                // If we're using vdrive, and this filesystem is vdrive compatible, skip it
-                if (Meatloaf.use_vdrive && fs->vdrive_compatible)
-                    return false;
-                else
-                    return true;
-            });
-
-            if(foundFS != availableFS.end()) {
-                //Debug_printv("matched[%s] foundFS[%s]", part.c_str(), (*foundFS)->symbol);
+            auto foundFS = matchFS(part);
+            if(foundFS != nullptr) {
+                //Debug_printv("matched[%s] foundFS[%s]", part.c_str(), foundFS->symbol);
                 pathIterator++;
-                return (*foundFS);
+                return foundFS;
             }
         }
     };
@@ -404,6 +466,103 @@ MFileSystem* MFSOwner::findParentFS(std::vector<std::string>::iterator &begin, s
     return fs;
 }
 
+// First filesystem in availableFS order that claims this path segment
+MFileSystem* MFSOwner::matchFS(const std::string &part) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if ( trie.empty() )
+            buildTrie();
+    }
+
+    size_t best = availableFS.size();
+    auto consider = [&best](uint8_t i) {
+        // If we're using vdrive, and this filesystem is vdrive compatible, skip it
+        if ( i < best && !(Meatloaf.use_vdrive && availableFS[i]->vdrive_compatible) )
+            best = i;
+    };
+
+    // Walk the segment backwards, every suffix node passed is a match
+    uint16_t node = 0;
+    for ( auto c = part.rbegin(); c != part.rend() && node != NO_NODE; c++ )
+    {
+        char lc = tolower(*c);
+        node = trie[node].child;
+        while ( node != NO_NODE && trie[node].c != lc )
+            node = trie[node].sibling;
+
+        if ( node != NO_NODE && trie[node].suffix != NO_FS )
+            consider(trie[node].suffix);
+    }
+
+    if ( node != NO_NODE && trie[node].exact != NO_FS )
+        consider(trie[node].exact);
+
+    if ( opaque.size() && opaque.front() < best )
+    {
+        std::string lower = part;
+        mstr::toLower(lower);
+        for ( auto i : opaque )
+        {
+            if ( i >= best )
+                break;
+
+            if ( availableFS[i]->handles(lower) )
+                consider(i);
+        }
+    }
+
+    return ( best < availableFS.size() ) ? availableFS[best] : nullptr;
+}
+
+void MFSOwner::buildTrie() {
+    trie.clear();
+    opaque.clear();
+    trie.push_back({ 0, NO_FS, NO_FS, NO_NODE, NO_NODE });
+
+    // The default filesystem handles everything and is never matched
+    for ( size_t i = 1; i < availableFS.size() && i < NO_FS; i++ )
+    {
+        auto fs = availableFS[i];
+        if ( fs->extensions.empty() && fs->schemes.empty() )
+        {
+            opaque.push_back(i);
+            continue;
+        }
+
+        for ( const auto &e : fs->extensions )
+            insertTrie(e, i, false);
+
+        for ( const auto &s : fs->schemes )
+            insertTrie(s, i, true);
+    }
+
+    Debug_printv("filesystems[%d] trie nodes[%d] opaque[%d]", availableFS.size(), trie.size(), opaque.size());
+}
+
+void MFSOwner::insertTrie(const std::string &key, uint8_t fs, bool exact) {
+    uint16_t node = 0;
+    for ( auto c = key.rbegin(); c != key.rend(); c++ )
+    {
+        char lc = tolower(*c);
+        uint16_t child = trie[node].child;
+        while ( child != NO_NODE && trie[child].c != lc )
+            child = trie[child].sibling;
+
+        if ( child == NO_NODE )
+        {
+            child = trie.size();
+            trie.push_back({ lc, NO_FS, NO_FS, NO_NODE, trie[node].child });
+            trie[node].child = child;
+        }
+        node = child;
+    }
+
+    // First filesystem in the list wins
+    uint8_t &slot = exact ? trie[node].exact : trie[node].suffix;
+    if ( slot == NO_FS )
+        slot = fs;
+}
+
 /********************************************************
  * MFileSystem implementations
  ********************************************************/
@@ -460,21 +619,31 @@ std::shared_ptr<MStream> MFile::getSourceStream(std::ios_base::openmode mode) {
     // has to return OPENED stream
     Debug_printv("pathInStream[%s] sourceFile[%s]", pathInStream.c_str(), sourceFile->url.c_str());
 
-    auto sourceStream = sourceFile->getSourceStream(mode);
-    if ( sourceStream == nullptr )
+    // Cached listings of this file's directory are about to go stale
+    if ( mode & std::ios_base::out )
+        ListingCache::invalidate(url);
+
+    // Files inside a container are written in place, opening the container
+    // for output alone would truncate it
+    std::ios_base::openmode container_mode = mode;
+    if ( pathInStream != "" && (mode & std::ios_base::out) )
+        container_mode = std::ios_base::in | std::ios_base::out;
+
+    // get its base stream, i.e. zip raw file contents, shared with other files in the same container
+    std::shared_ptr<MStream> containerStream = StreamBroker::obtain(sourceFile, container_mode);
+    if ( containerStream == nullptr )
     {
         Debug_printv("null sourceStream for path[%s]", path.c_str());
         return nullptr;
     }
 
-    // will be replaced by streamBroker->getSourceStream(sourceFile, mode)
-    std::shared_ptr<MStream> containerStream(sourceStream); // get its base stream, i.e. zip raw file contents
-
     Debug_printv("containerStream isRandomAccess[%d] isBrowsable[%d] null[%d]", containerStream->isRandomAccess(), containerStream->isBrowsable(), (containerStream == nullptr));
 
     // will be replaced by streamBroker->getDecodedStream(this, mode, containerStream)
     std::shared_ptr<MStream> decodedStream(getDecodedStream(containerStream)); // wrap this stream into decoded stream, i.e. unpacked zip files
     decodedStream->url = this->url;
+    decodedStream->mode = mode;
+    decodedStream->record_length = record_length;
     Debug_printv("decodedStream isRandomAccess[%d] isBrowsable[%d] null[%d]", decodedStream->isRandomAccess(), decodedStream->isBrowsable(), (decodedStream == nullptr));
 
     if(decodedStream->isRandomAccess() && pathInStream != "")
@@ -718,6 +887,94 @@ bool MFile::exists() {
     return _exists; 
 };
 
+bool MFile::getNextEntry(DirEntry &entry)
+{
+    do
+    {
+        std::unique_ptr<MFile> file(getNextFileInDir());
+        if ( file == nullptr )
+            return false;
+
+        std::string ext = file->extension;
+        mstr::ltrim(ext);
+
+        entry.clear();
+        entry.setName(file->name.data(), file->name.size());
+        entry.setType(ext.data(), ext.size());
+        entry.size = file->size;
+        entry.blocks = std::min(file->blocks(), (uint32_t)UINT16_MAX);
+        if ( file->isDirectory() )
+            entry.flags |= DirEntry::DIRECTORY;
+    } while ( !dir_filter.matches(entry, isPETSCII) );
+
+    return true;
+}
+
+
+/********************************************************
+ * Directory filter
+ ********************************************************/
+
+DirFilter DirFilter::parse(std::string spec)
+{
+    DirFilter filter;
+
+    size_t equals = spec.rfind('=');
+    if ( equals != std::string::npos )
+    {
+        std::string type = mstr::toUTF8(spec.substr(equals + 1, 1));
+        if ( type.size() )
+            filter.type = std::toupper((unsigned char)type[0]);
+        spec.erase(equals);
+    }
+
+    // "*" alone lists everything, no need to match it
+    if ( spec != "*" )
+    {
+        filter.petscii = spec;
+        filter.pattern = mstr::toUTF8(spec);
+    }
+
+    return filter;
+}
+
+bool DirFilter::matchName(const char *name, bool is_petscii) const
+{
+    const std::string &match = is_petscii ? petscii : pattern;
+
+    size_t i = 0;
+    for ( ; i < match.size(); i++ )
+    {
+        char p = match[i];
+        if ( p == '*' )
+            return true;    // rest doesn't matter
+        if ( name[i] == '\0' )
+            return false;   // name is too short
+        if ( p == '?' || p == name[i] )
+            continue;
+        if ( is_petscii || std::toupper((unsigned char)p) != std::toupper((unsigned char)name[i]) )
+            return false;
+    }
+
+    // Without a trailing * the whole name has to match
+    return match.empty() || name[i] == '\0';
+}
+
+bool DirFilter::matchType(const char *entry_type, uint8_t flags) const
+{
+    if ( !type )
+        return true;
+
+    // Same columns the listing shows: DIR for directories, PRG when there is no type
+    char first = 'P';
+    if ( flags & DirEntry::DIRECTORY )
+        first = 'D';
+    else if ( entry_type[0] )
+        first = std::toupper((unsigned char)entry_type[0]);
+
+    return first == type;
+}
+
 uint64_t MFile::getAvailableSpace()
 {
     if ( mstr::startsWith(path, (char *)"/sd") )
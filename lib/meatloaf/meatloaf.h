@@ -20,7 +20,12 @@
 
 #include <memory>
 #include <string>
+#include <algorithm>
+#include <cstring>
 #include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
 #include <fstream>
 #include <ctime>
 //#include <unordered_map>
@@ -84,6 +89,10 @@ public:
     std::ios_base::openmode mode;
     std::string url = "";
 
+    // Relative files: record length, 0 for every other file. Set before
+    // seekPath() to open one, or to create one with records this long.
+    uint8_t record_length = 0;
+
     bool has_subdirs = true;
     size_t block_size = 256;
 
@@ -131,12 +140,31 @@ public:
     virtual bool isBrowsable() { return false; };
     virtual bool isRandomAccess() { return false; };
 
+    // Streams that talk to a device or the network themselves, worth reading
+    // ahead of the consumer on the I/O worker (see meat_prefetch.h)
+    virtual bool isReadAhead() { return false; };
+
     virtual bool open(std::ios_base::openmode mode) = 0;
     virtual void close() = 0;
 
     virtual uint32_t read(uint8_t* buf, uint32_t size) = 0;
     virtual uint32_t write(const uint8_t *buf, uint32_t size) = 0;
 
+    // Commit changes held in memory without closing. Containers can stay
+    // open long after the writer is done with them.
+    virtual bool flush() { return true; };
+
+    // Zero-copy reads. peekView() lends a read-only view of the next bytes from the
+    // stream's own buffers and returns its length (0 = not supported, use read()).
+    // The view stays valid until the next call on this stream. consume(n) advances
+    // past n bytes of the view, consume(0) just hands the view back.
+    virtual uint32_t peekView(const uint8_t **view) { *view = nullptr; return 0; };
+    virtual uint32_t consume(uint32_t size) { return 0; };
+
+    // Read-ahead hint, the caller is about to read [offset, offset + length).
+    // Returns false if the stream ignores it.
+    virtual bool prefetch(uint32_t offset, uint32_t length) { return false; };
+
     virtual bool seek(uint32_t pos, int mode) {
         if(mode == SEEK_SET) {
             _position = pos;
@@ -167,6 +195,10 @@ public:
     virtual bool seekSector( uint8_t track, uint8_t sector, uint8_t offset = 0 ) { return false; };
     virtual bool seekSector( std::vector<uint8_t> trackSectorOffset ) { return false; };
 
+    // Relative files, the P command. Record and offset count from 0, false
+    // if the record isn't there yet (writing it adds it).
+    virtual bool seekRecord( uint32_t record, uint8_t offset = 0 ) { return false; };
+
 private:
 
     // DEVICE
@@ -182,6 +214,79 @@ private:
 };
 
 
+/********************************************************
+ * Directory entry
+ ********************************************************/
+
+#ifndef DIR_ENTRY_NAME_SIZE
+#define DIR_ENTRY_NAME_SIZE 128
+#endif
+
+// Filled in place by MFile::getNextEntry(), so listing a directory doesn't
+// construct an MFile (and its url/path strings) for every entry
+struct DirEntry {
+    enum : uint8_t {
+        DIRECTORY = 0x01,
+        SPLAT     = 0x02,   // CBM "*", file was not closed
+        LOCKED    = 0x04,   // CBM "<"
+    };
+
+    char name[DIR_ENTRY_NAME_SIZE + 1]; // Truncated, always terminated
+    char type[4];                       // Extension or CBM type, "d64", "PRG", "" if none
+    uint32_t size;
+    uint16_t blocks;
+    uint8_t flags;
+
+    void clear() {
+        name[0] = '\0';
+        type[0] = '\0';
+        size = 0;
+        blocks = 0;
+        flags = 0;
+    }
+
+    void setName(const char *src, size_t length) {
+        length = std::min(length, (size_t)DIR_ENTRY_NAME_SIZE);
+        memcpy(name, src, length);
+        name[length] = '\0';
+    }
+
+    void setType(const char *src, size_t length) {
+        length = std::min(length, sizeof(type) - 1);
+        memcpy(type, src, length);
+        type[length] = '\0';
+    }
+
+    void setBlocks(uint32_t block_size) {
+        if ( size > 0 && size < block_size )
+            blocks = 1;
+        else
+            blocks = std::min(size / block_size, (uint32_t)UINT16_MAX);
+    }
+};
+
+
+// Listing filter, the "A*=P" of LOAD"$:A*=P". Handed to MFile::rewindDirectory()
+// so filesystems can skip entries at the source instead of after the fact.
+struct DirFilter {
+    std::string pattern;    // CBM wildcards: * matches the rest, ? one character. Empty = all
+    std::string petscii;    // Same pattern as sent, for media listing raw CBM names
+    char type = 0;          // First letter of the type column (P, S, U, R, D = DIR), 0 = all
+
+    bool empty() const { return pattern.empty() && !type; }
+
+    // PETSCII names match exactly like CBM DOS, other names ignore case
+    bool matchName(const char *name, bool is_petscii = false) const;
+    bool matchType(const char *type, uint8_t flags) const;
+    bool matches(const DirEntry &entry, bool is_petscii = false) const {
+        return matchName(entry.name, is_petscii) && matchType(entry.type, entry.flags);
+    }
+
+    // PETSCII spec as sent by the computer: "A*=P", "=S", "*.D64"
+    static DirFilter parse(std::string spec);
+};
+
+
 /********************************************************
  * Universal file
  ********************************************************/
@@ -209,6 +314,7 @@ public:
 
     bool isPETSCII = false;
     bool isWritable = false;
+    uint8_t record_length = 0;  // ",L," on open, see MStream::record_length
     std::string media_header;
     std::string media_id;
     std::string media_archive;
@@ -235,8 +341,19 @@ public:
 
     virtual bool isDirectory() = 0;
     virtual bool rewindDirectory() = 0 ;
+
+    // Rewind and only list entries matching filter from now on
+    bool rewindDirectory(const DirFilter &filter) {
+        dir_filter = filter;
+        return rewindDirectory();
+    }
+    DirFilter dir_filter;
     virtual MFile* getNextFileInDir() = 0 ;
 
+    // Allocation-free listing, fills entry with the next directory entry.
+    // Falls back to getNextFileInDir() for filesystems that don't have their own.
+    virtual bool getNextEntry(DirEntry &entry);
+
     virtual bool mkDir() { return false; };
     virtual bool rmDir() { return false; };
     virtual bool exists();
@@ -283,6 +400,12 @@ public:
 
     bool vdrive_compatible = false;
 
+    // Extensions (".d64") and schemes ("http:") this filesystem claims.
+    // MFSOwner builds its dispatch trie from these, filesystems that leave
+    // both empty are asked through handles() instead.
+    std::vector<std::string> extensions;
+    std::vector<std::string> schemes;
+
     virtual bool handles(std::string path) = 0;
     virtual MFile* getFile(std::string path) = 0;
 
@@ -437,6 +560,16 @@ public:
         return false;
     }
 
+    bool byScheme(std::string name) {
+        for ( auto &s : schemes )
+        {
+            if ( mstr::equals(name, s, false) )
+                return true;
+        }
+
+        return false;
+    }
+
 protected:
     const char* symbol = nullptr;
     bool _is_mounted = false;
@@ -449,10 +582,28 @@ protected:
  * MFile factory
  ********************************************************/
 
+#ifndef MFS_RESOLVE_CACHE_SIZE
+#define MFS_RESOLVE_CACHE_SIZE 32
+#endif
+
 class MFSOwner {
 public:
     static std::vector<MFileSystem*> availableFS;
 
+    // Filesystem chain a url resolves to, memoized by File()
+    struct Resolution {
+        MFileSystem *target;
+        MFileSystem *source;        // Container filesystem, nullptr when target opens it too
+        std::string pathInStream;
+        std::string sourcePath;
+    };
+
+    struct Stats {
+        uint32_t hits;
+        uint32_t misses;
+        size_t entries;
+    };
+
     static MFile* File(std::string name, bool default_fs = false);
     static MFile* File(std::shared_ptr<MFile> file);
     static MFile* File(MFile* file);
@@ -466,6 +617,42 @@ public:
 
     static bool mount(std::string name);
     static bool umount(std::string name);
+
+    static Resolution resolve(std::string path, bool default_fs = false);
+    static MFileSystem* matchFS(const std::string &part);
+    static void clearCache();
+    static Stats stats();
+
+private:
+    // Reversed suffix trie over extensions and schemes (first child / next sibling)
+    struct TrieNode {
+        char c;
+        uint8_t suffix;             // availableFS index claiming this suffix
+        uint8_t exact;              // availableFS index claiming the whole segment (scheme)
+        uint16_t child;
+        uint16_t sibling;
+    };
+
+    struct CacheEntry {
+        Resolution resolution;
+        std::list<std::string>::iterator lru;
+    };
+
+    static const uint8_t NO_FS = 0xFF;
+    static const uint16_t NO_NODE = 0xFFFF;
+
+    static void buildTrie();
+    static void insertTrie(const std::string &key, uint8_t fs, bool exact);
+
+    static std::vector<TrieNode> trie;
+    static std::vector<uint8_t> opaque;     // filesystems only reachable through handles()
+
+    static std::unordered_map<std::string, CacheEntry> resolve_cache;
+    static std::list<std::string> resolve_lru;    // front = most recently used
+    static uint32_t hits;
+    static uint32_t misses;
+
+    static std::mutex lock;
 };
 
 /********************************************************
@@ -569,69 +756,5 @@ namespace Meat {
 //     }
 // };
 
-// class StreamBroker {
-//     static std::unordered_map<std::string, std::shared_ptr<MStream>> stream_repo;
-// public:
-//     template<class T> static std::shared_ptr<T> obtain(std::string url, std::ios_base::openmode mode) 
-//     {
-//         //Debug_printv("streams[%d] url[%s]", stream_repo.size(), url.c_str());
-
-//         // obviously you have to supply sourceFile.url to this function!
-//         if(stream_repo.find(url)!=stream_repo.end())
-//         {
-//             Debug_printv("Reusing Existing Stream url[%s]", url.c_str());
-//             return stream_repo.at(url);
-//         }
-
-//         // create and add stream to broker if not found
-//         Debug_printv("Creating New Stream url[%s]", url.c_str());
-//         auto newFile = MFSOwner::File(url);
-
-//         std::shared_ptr<T> newStream = newFile->createStream(mode);
-
-//         if ( newStream != nullptr )
-//         {
-//             // Are we at the root of the filesystem?
-//             if ( newFile->pathInStream == "")
-//             {
-//                 Debug_printv("ROOT FILESYSTEM... CACHING [%s]", url.c_str());
-//                 stream_repo.insert(std::make_pair(url, newStream));
-//             }
-//             else
-//             {
-//                 Debug_printv("SINGLE FILE... DON'T CACHE [%s]", url.c_str());
-//             }
-            
-//             return newStream;
-//         }
-
-//         delete newFile;
-//         return nullptr;
-//     }
-
-//     static std::shared_ptr<MStream> obtain(std::string url, std::ios_base::openmode mode) {
-//         return obtain<MStream>(url, mode);
-//     }
-
-//     static void dispose(std::string url) {
-//         if(stream_repo.find(url)!=stream_repo.end()) {
-//             auto toDelete = stream_repo.at(url);
-//             stream_repo.erase(url);
-//             //delete toDelete;
-//         }
-//         Debug_printv("streams[%d]", stream_repo.size());
-//     }
-
-//     static void validate() {
-        
-//     }
-
-//     static void clear() {
-//         // std::for_each(file_repo.begin(), file_repo.end(), [](auto& pair) {
-//         //     delete pair.second;
-//         // });
-//         stream_repo.clear();
-//     }
-// };
 
 #endif // MEATLOAF_FILE
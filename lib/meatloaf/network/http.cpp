@@ -21,6 +21,7 @@
 #include <algorithm>
 
 #include "meatloaf.h"
+#include "buffer_pool.h"
 
 #include "../../../include/debug.h"
 //#include "../../../include/global_defines.h"
@@ -156,6 +157,12 @@ MFile* HTTPMFile::getNextFileInDir() {
     return nullptr; 
 };
 
+bool HTTPMFile::getNextEntry(DirEntry &entry) {
+    // Same as getNextFileInDir(), nothing to list until PROPFIND is in
+    // (and don't go through the MFile fallback to find that out)
+    return false;
+};
+
 
 bool HTTPMFile::isText() {
     return fromHeader()->isText;
@@ -183,6 +190,15 @@ bool HTTPMStream::open(std::ios_base::openmode mode) {
     return r;
 }
 
+std::unordered_map<std::string, std::string> HTTPMStream::info() {
+    std::unordered_map<std::string, std::string> values;
+    if ( _http.etag.size() )
+        values["etag"] = _http.etag;
+    if ( _http.last_modified.size() )
+        values["last-modified"] = _http.last_modified;
+    return values;
+}
+
 void HTTPMStream::close() {
     //Debug_printv("CLOSE called explicitly on this HTTP stream!");
     _http.close();
@@ -329,13 +345,7 @@ bool MeatHttpClient::seek(uint32_t pos) {
         if (_is_open) {
             // Read to end of the stream
             //Debug_printv("Skipping to end!");
-            while(1)
-            {
-                        char c[HTTP_BLOCK_SIZE];
-            int bytes = esp_http_client_read(_http, c, HTTP_BLOCK_SIZE);
-            if ( bytes < HTTP_BLOCK_SIZE )
-                    break;
-            }
+            discard(HTTP_DISCARD_ALL);
 
             // esp_err_t err;
             // int *len = 0;
@@ -358,13 +368,8 @@ bool MeatHttpClient::seek(uint32_t pos) {
             // flush the rest
             //Debug_printv("_position[%lu] pos[%lu] available[%lu]", _position, pos, available());
 
-            int rc = 0;
-            do {
-                char c;
-                rc = esp_http_client_read(_http, &c, 1);
-                if(rc == -1)
-                    return false;
-            } while(rc);
+            if ( !discard(HTTP_DISCARD_ALL) )
+                return false;
 
             // esp_err_t err;
             // int *len = 0;
@@ -397,23 +402,14 @@ bool MeatHttpClient::seek(uint32_t pos) {
             if ( !open(url, lastMethod) )
                 return false;
 
-            // and read pos bytes - requires some buffer
-            for(int i = 0; i<pos; i++) {
-                char c;
-                int rc = esp_http_client_read(_http, &c, 1);
-                if(rc == -1)
-                    return false;
-            }
+            // and read pos bytes
+            if ( !discard(pos) )
+                return false;
         }
         else {
-            auto delta = pos-_position;
-            // skipping forward let's skip a proper amount of bytes - requires some buffer
-            for(int i = 0; i<delta; i++) {
-                char c;
-                int rc = esp_http_client_read(_http, &c, 1);
-                if(rc == -1)
+            // skipping forward let's skip a proper amount of bytes
+            if ( !discard(pos - _position) )
                 return false;
-            }
         }
 
         _position = pos;
@@ -425,6 +421,29 @@ bool MeatHttpClient::seek(uint32_t pos) {
         return false;
 }
 
+bool MeatHttpClient::discard(uint32_t length) {
+    // Block sized reads through a pooled buffer instead of a byte at a time
+    auto buffer = BufferPool::acquire(HTTP_BLOCK_SIZE);
+    if ( !buffer )
+        return false;
+
+    while ( length > 0 ) {
+        uint32_t size = std::min(length, (uint32_t)buffer.size());
+        int bytes = esp_http_client_read(_http, (char *)buffer.data(), size);
+        if ( bytes < 0 )
+            return false;
+
+        // End of the response
+        if ( bytes == 0 )
+            return ( length == HTTP_DISCARD_ALL );
+
+        if ( length != HTTP_DISCARD_ALL )
+            length -= bytes;
+    }
+
+    return true;
+}
+
 uint32_t MeatHttpClient::read(uint8_t* buf, uint32_t size) {
 
     if (!_is_open) {
@@ -575,6 +594,11 @@ esp_err_t MeatHttpClient::_http_event_handler(esp_http_client_event_t *evt)
             else if(mstr::equals("Last-Modified", evt->header_key, false))
             {
                 // Last-Modified, value=Thu, 03 Dec 1992 08:37:20 - may be used to get file date
+                meatClient->last_modified = evt->header_value;
+            }
+            else if(mstr::equals("ETag", evt->header_key, false))
+            {
+                meatClient->etag = evt->header_value;
             }
             else if(mstr::equals("Content-Disposition", evt->header_key, false))
             {
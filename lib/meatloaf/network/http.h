@@ -37,6 +37,7 @@
 #include "utils.h"
 
 #define HTTP_BLOCK_SIZE 256
+#define HTTP_DISCARD_ALL UINT32_MAX
 
 //#define PRODUCT_ID "MEATLOAF CBM"
 //#define PLATFORM_DETAILS "C64; 6510; 2; NTSC; EN;" // Make configurable. This will help server side to select appropriate content.
@@ -54,6 +55,9 @@ class MeatHttpClient {
 
     std::map<std::string, std::string> headers;
 
+    // Read past length bytes of the response, HTTP_DISCARD_ALL to its end
+    bool discard(uint32_t length);
+
 public:
 
     MeatHttpClient() {
@@ -136,6 +140,10 @@ public:
     bool wasRedirected = false;
     std::string url;
 
+    // Tell versions of the same url apart
+    std::string etag;
+    std::string last_modified;
+
     int lastRC = 0;
 };
 
@@ -171,6 +179,7 @@ public:
     time_t getCreationTime() override ;
     bool rewindDirectory() override ;
     MFile* getNextFileInDir() override ;
+    bool getNextEntry(DirEntry &entry) override ;
     bool mkDir() override ;
     bool exists() override ;
 
@@ -203,9 +212,12 @@ public:
 
 protected:
     // MStream methods
+    std::unordered_map<std::string, std::string> info() override;
+
     bool isOpen() override;
     bool isBrowsable() override { return false; };
     bool isRandomAccess() override { return true; };
+    bool isReadAhead() override { return true; };
 
     bool open(std::ios_base::openmode mode) override;
     void close() override;
@@ -240,16 +252,12 @@ private:
 class HTTPMFileSystem: public MFileSystem 
 {
 public:
-    HTTPMFileSystem(): MFileSystem("http") {};
+    HTTPMFileSystem(): MFileSystem("http") {
+        schemes = { "http:", "https:" };
+    };
 
     bool handles(std::string name) {
-        if ( mstr::equals(name, (char *)"http:", false) )
-            return true;
-
-        if ( mstr::equals(name, (char *)"https:", false) )
-            return true;
-            
-        return false;
+        return byScheme(name);
     }
 
     MFile* getFile(std::string path) override {
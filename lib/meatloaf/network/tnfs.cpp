@@ -60,9 +60,17 @@ bool TNFSMFile::isDirectory()
     if(path=="/" || path.empty())
         return true;
 
-    struct stat info;
-    stat( std::string(basepath + path).c_str(), &info);
-    return S_ISDIR(info.st_mode);
+    if ( !mount() )
+        return false;
+
+    std::lock_guard<std::recursive_mutex> guard(_session->lock);
+    auto known = _session->is_dir.find(path);
+    if ( known != _session->is_dir.end() )
+        return known->second;
+
+    bool dir = _session->fs.is_dir(path.c_str());
+    _session->remember(path, dir);
+    return dir;
 }
 
 std::shared_ptr<MStream> TNFSMFile::getSourceStream(std::ios_base::openmode mode)
@@ -112,6 +120,10 @@ bool TNFSMFile::mkDir()
         return false;
     }
     int rc = mkdir(std::string(basepath + path).c_str(), ALLPERMS);
+    if ( _session != nullptr ) {
+        std::lock_guard<std::recursive_mutex> guard(_session->lock);
+        _session->is_dir.erase(path);
+    }
     return (rc==0);
 }
 
@@ -160,59 +172,112 @@ bool TNFSMFile::rename(std::string pathTo) {
     if (rc != 0) {
         return false;
     }
+    if ( _session != nullptr ) {
+        std::lock_guard<std::recursive_mutex> guard(_session->lock);
+        _session->is_dir.erase(path);
+        _session->is_dir.erase(pathTo);
+    }
+    return true;
+}
+
+
+std::unordered_map<std::string, std::shared_ptr<TNFSSession>> TNFSMFile::sessions;
+std::mutex TNFSMFile::sessions_lock;
+
+void TNFSSession::remember(const std::string &path, bool dir)
+{
+    if ( is_dir.size() >= TNFS_KNOWN_TYPES )
+        is_dir.clear();
+    is_dir[path] = dir;
+}
+
+bool TNFSMFile::mount()
+{
+    if ( _session != nullptr )
+        return true;
+
+    uint16_t tnfs_port = std::atoi(port.c_str());
+    if ( tnfs_port == 0 )
+        tnfs_port = TNFS_DEFAULT_PORT;
+
+    // Mounted once per server and user, every file after that reuses it
+    std::string key = user + "@" + host + ":" + std::to_string(tnfs_port);
+    std::lock_guard<std::mutex> guard(sessions_lock);
+    auto found = sessions.find(key);
+    if ( found != sessions.end() )
+    {
+        _session = found->second;
+        return true;
+    }
+
+    auto session = std::make_shared<TNFSSession>();
+    if ( !session->fs.start(host.c_str(), tnfs_port, nullptr, user.empty() ? nullptr : user.c_str(), password.empty() ? nullptr : password.c_str()) )
+    {
+        Debug_printv("Unable to mount host[%s] port[%d]", host.c_str(), tnfs_port);
+        return false;
+    }
+
+    Debug_printv("mounted host[%s] port[%d]", host.c_str(), tnfs_port);
+    sessions[key] = session;
+    _session = session;
     return true;
 }
 
 
 void TNFSMFile::openDir(std::string apath) 
 {
-    if (!isDirectory()) { 
-        dirOpened = false;
+    closeDir();
+    if ( !mount() )
         return;
-    }
-    
-    // Debug_printv("path[%s]", apath.c_str());
-    // if(apath.empty()) {
-    //     dir = opendir( "/" );
-    // }
-    // else {
-    //     dir = opendir( apath.c_str() );
-    // }
 
-    dirOpened = true;
-    if ( dir == NULL ) {
-        dirOpened = false;
+    std::lock_guard<std::recursive_mutex> guard(_session->lock);
+
+    // Only names matching the pattern come over the network
+    const char *pattern = _pattern.empty() ? nullptr : _pattern.c_str();
+    dirOpened = _session->fs.dir_open(apath.empty() ? "/" : apath.c_str(), pattern, 0);
+    _session->dir_owner = dirOpened ? this : nullptr;
+    _dirRead = 0;
+}
+
+
+// Another listing took the session's directory, open ours again where we were
+bool TNFSMFile::reopenDir()
+{
+    const char *pattern = _pattern.empty() ? nullptr : _pattern.c_str();
+    if ( !_session->fs.dir_open(path.empty() ? "/" : path.c_str(), pattern, 0) )
+        return false;
+
+    _session->dir_owner = this;
+    for ( uint16_t i = 0; i < _dirRead; i++ )
+    {
+        if ( _session->fs.dir_read() == nullptr )
+            return false;
     }
-    // else {
-    //     // Skip the . and .. entries
-    //     struct dirent* dirent = NULL;
-    //     dirent = readdir( dir );
-    //     dirent = readdir( dir );
-    // }
+    return true;
 }
 
 
 void TNFSMFile::closeDir() 
 {
-    // if(dirOpened) {
-    //     closedir( dir );
-    //     dirOpened = false;
-    // }
+    if(dirOpened) {
+        std::lock_guard<std::recursive_mutex> guard(_session->lock);
+        if ( _session->dir_owner == this )
+        {
+            _session->fs.dir_close();
+            _session->dir_owner = nullptr;
+        }
+        dirOpened = false;
+    }
 }
 
 
 bool TNFSMFile::rewindDirectory()
 {
-    // _valid = false;
-    // rewinddir( dir );
-
-    // // // Skip the . and .. entries
-    // // struct dirent* dirent = NULL;
-    // // dirent = readdir( dir );
-    // // dirent = readdir( dir );
+    _valid = false;
+    _pattern = dir_filter.pattern;
+    openDir(path);
 
-    // return (dir != NULL) ? true: false;
-    return true;
+    return dirOpened;
 }
 
 
@@ -259,6 +324,60 @@ MFile* TNFSMFile::getNextFileInDir()
 }
 
 
+bool TNFSMFile::getNextEntry(DirEntry &entry)
+{
+    if(!dirOpened)
+        rewindDirectory();
+
+    if(!dirOpened)
+        return false;
+
+    std::lock_guard<std::recursive_mutex> guard(_session->lock);
+    if ( _session->dir_owner != this && !reopenDir() )
+    {
+        closeDir();
+        return false;
+    }
+
+    std::string base = (path == "/" || path.empty()) ? "/" : path + "/";
+    fsdir_entry *dirent = nullptr;
+    do
+    {
+        dirent = _session->fs.dir_read();
+        if ( dirent == nullptr )
+        {
+            closeDir();
+            return false;
+        }
+        _dirRead++;
+
+        size_t length = strlen(dirent->filename);
+        if ( length > 0 && dirent->filename[length - 1] == '/' )
+            length--;
+
+        entry.clear();
+        entry.setName(dirent->filename, length);
+
+        size_t dot = length;
+        while ( dot > 1 && dirent->filename[dot - 1] != '.' )
+            dot--;
+        if ( dot > 1 )
+            entry.setType(dirent->filename + dot, length - dot);
+
+        if ( dirent->isDir )
+            entry.flags |= DirEntry::DIRECTORY;
+        else
+            entry.size = dirent->size;
+        entry.setBlocks(media_block_size);
+
+        // Opening what was listed doesn't have to ask the server again
+        _session->remember(base + std::string(dirent->filename, length), dirent->isDir);
+    } while ( entry.name[0] == '.' || !dir_filter.matches(entry) ); // Skip hidden files, type isn't known to the server
+
+    return true;
+}
+
+
 bool TNFSMFile::readEntry( std::string filename )
 {
     // DIR* d;
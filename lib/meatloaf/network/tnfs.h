@@ -21,6 +21,7 @@
 #include "meatloaf.h"
 
 #include "fnFS.h"
+#include "fnFsTNFS.h"
 
 #include "../../../include/debug.h"
 
@@ -29,6 +30,31 @@
 #include <dirent.h>
 #include <string.h>
 
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// Paths a session remembers as file or directory
+#ifndef TNFS_KNOWN_TYPES
+#define TNFS_KNOWN_TYPES 128
+#endif
+
+
+/********************************************************
+ * Session
+ ********************************************************/
+
+// One mount per server, shared by every TNFSMFile on it. The protocol has
+// one open directory per mount, the file listing owns it.
+struct TNFSSession {
+    FileSystemTNFS fs;
+    std::recursive_mutex lock;
+    const void *dir_owner = nullptr;
+    std::unordered_map<std::string, bool> is_dir;   // From listings and earlier lookups
+
+    void remember(const std::string &path, bool dir);
+};
+
 
 /********************************************************
  * MFile
@@ -40,7 +66,7 @@ class TNFSMFile: public MFile
 public:
     std::string basepath = "";
     
-    TNFSMFile(std::string path) {
+    TNFSMFile(std::string path): MFile(path) {
 
         // Find full filename for wildcard
         if (mstr::contains(name, "?") || mstr::contains(name, "*"))
@@ -68,6 +94,7 @@ public:
     time_t getCreationTime() override ;
     bool rewindDirectory() override ;
     MFile* getNextFileInDir() override ;
+    bool getNextEntry(DirEntry &entry) override ;
     bool mkDir() override ;
     bool exists() override ;
 
@@ -82,7 +109,14 @@ protected:
     bool dirOpened = false;
 
 private:
-    FileSystem *_fs = nullptr;
+    // Session for directory listings, the server matches the names
+    std::shared_ptr<TNFSSession> _session;
+    uint16_t _dirRead = 0;      // Entries read, to pick up again after another listing
+    bool mount();
+    bool reopenDir();
+
+    static std::unordered_map<std::string, std::shared_ptr<TNFSSession>> sessions;
+    static std::mutex sessions_lock;
 
     virtual void openDir(std::string path);
     virtual void closeDir();
@@ -137,6 +171,7 @@ public:
     bool isOpen();
     bool isBrowsable() override { return false; };
     bool isRandomAccess() override { return true; };
+    bool isReadAhead() override { return true; };
 
     bool open(std::ios_base::openmode mode) override;
     void close() override;
@@ -167,13 +202,12 @@ protected:
 class TNFSMFileSystem: public MFileSystem 
 {
 public:
-    TNFSMFileSystem(): MFileSystem("tnfs") {};
+    TNFSMFileSystem(): MFileSystem("tnfs") {
+        schemes = { "tnfs:" };
+    };
 
     bool handles(std::string name) {
-        if ( mstr::equals(name, (char *)"tnfs:", false) )
-            return true;
-
-        return false;
+        return byScheme(name);
     }
 
     MFile* getFile(std::string path) override {
@@ -240,3 +240,54 @@ exit:
     return nullptr;
 }
 
+bool T64MFile::getNextEntry(DirEntry &entry) {
+
+    if(!dirIsOpen)
+        rewindDirectory();
+
+    // Held for the whole listing instead of looked up by url per entry
+    if ( dir_image == nullptr )
+        dir_image = ImageBroker::obtain<T64MStream>(sourceFile->url);
+
+    bool r = false;
+    if ( dir_image != nullptr )
+    {
+        // Skip the ones the filter doesn't want
+        do
+        {
+            r = dir_image->getNextImageEntry();
+            if ( !r )
+                break;
+
+            auto &e = dir_image->entry;
+
+            // (in PETASCII, padded with $20, not $A0)
+            size_t length = sizeof(e.filename);
+            while ( length > 0 && ( e.filename[length - 1] == 0x20 || e.filename[length - 1] == (char)0xA0 ) )
+                length--;
+
+            entry.clear();
+            entry.setName(e.filename, length);
+            entry.setType(dir_image->file_type_label[e.file_type & 0b00000111].data(), 3);
+        } while ( !dir_filter.matches(entry, true) );
+    }
+
+    if ( !r )
+    {
+        dirIsOpen = false;
+        dir_image = nullptr;
+        return false;
+    }
+
+    auto &e = dir_image->entry;
+    entry.size = ( e.end_address - e.start_address ) + 2; // 2 bytes for load address
+    entry.setBlocks(media_block_size);
+
+    if ( !(e.file_type & 0x80) )
+        entry.flags |= DirEntry::SPLAT;
+    if ( e.file_type & 0x40 )
+        entry.flags |= DirEntry::LOCKED;
+
+    return true;
+}
+
@@ -107,6 +107,7 @@ public:
     bool isDirectory() override;
     bool rewindDirectory() override;
     MFile* getNextFileInDir() override;
+    bool getNextEntry(DirEntry &entry) override;
     bool mkDir() override { return false; };
 
     bool exists() override { return true; };
@@ -117,6 +118,9 @@ public:
 
     bool isDir = true;
     bool dirIsOpen = false;
+
+private:
+    std::shared_ptr<T64MStream> dir_image;
 };
 
 
@@ -128,10 +132,12 @@ public:
 class T64MFileSystem: public MFileSystem
 {
 public:
-    T64MFileSystem(): MFileSystem("t64") {};
+    T64MFileSystem(): MFileSystem("t64") {
+        extensions = { ".t64" };
+    };
 
     bool handles(std::string fileName) override {
-        return byExtension(".t64", fileName);
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
@@ -129,10 +129,12 @@ public:
 class TCRTMFileSystem: public MFileSystem
 {
 public:
-    TCRTMFileSystem(): MFileSystem("tcrt") {};
+    TCRTMFileSystem(): MFileSystem("tcrt") {
+        extensions = { ".tcrt" };
+    };
 
     bool handles(std::string fileName) override {
-        return byExtension(".tcrt", fileName);
+        return byExtension(extensions, fileName);
     }
 
     MFile* getFile(std::string path) override {
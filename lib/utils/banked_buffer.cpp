@@ -0,0 +1,207 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "banked_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#ifndef TEST_NATIVE
+#include "../../include/debug.h"
+#else
+#define Debug_printv(...)
+#endif
+
+bool BankedBuffer::allocate(uint32_t size)
+{
+    release();
+
+#ifdef BANKED_BUFFER_HIMEM
+    // Himem comes in whole banks
+    uint32_t banks = std::max((size + BANKED_BUFFER_BANK_SIZE - 1) / BANKED_BUFFER_BANK_SIZE, (uint32_t)1);
+    esp_err_t status = esp_himem_alloc(banks * BANKED_BUFFER_BANK_SIZE, &m_handle);
+    if ( status != ESP_OK )
+    {
+        Debug_printv("Unable to allocate HIMEM memory: %s", esp_err_to_name(status));
+        return false;
+    }
+
+    uint8_t slots = BANKED_BUFFER_SLOTS;
+    while ( slots > 0 && esp_himem_alloc_map_range(slots * BANKED_BUFFER_BANK_SIZE, &m_range) != ESP_OK )
+        slots--;
+
+    if ( slots == 0 )
+    {
+        Debug_printv("Unable to allocate mapped range for HIMEM");
+        esp_himem_free(m_handle);
+        return false;
+    }
+    Debug_printv("banks[%lu] slots[%d] HIMEM available[%lu]", banks, slots, (uint32_t)esp_himem_get_free_size());
+#else
+    uint8_t slots = BANKED_BUFFER_SLOTS;
+    m_memory = new (std::nothrow) uint8_t[std::max(size, (uint32_t)1)];
+    if ( m_memory == nullptr )
+    {
+        Debug_printv("Unable to allocate %lu bytes", size);
+        return false;
+    }
+#endif
+
+    for ( auto &slot : m_slots )
+        slot = { NONE, 0, nullptr };
+
+    m_slotCount = slots;
+    m_size = size;
+    m_clock = 0;
+    m_stats = { 0, 0 };
+    return true;
+}
+
+void BankedBuffer::release()
+{
+    if ( m_slotCount == 0 )
+        return;
+
+#ifdef BANKED_BUFFER_HIMEM
+    for ( uint8_t i = 0; i < m_slotCount; i++ )
+    {
+        if ( m_slots[i].data != nullptr )
+            esp_himem_unmap(m_range, m_slots[i].data, BANKED_BUFFER_BANK_SIZE);
+    }
+    esp_himem_free_map_range(m_range);
+    esp_himem_free(m_handle);
+#else
+    delete[] m_memory;
+    m_memory = nullptr;
+#endif
+
+    m_slotCount = 0;
+    m_size = 0;
+}
+
+size_t BankedBuffer::footprint() const
+{
+#ifdef BANKED_BUFFER_HIMEM
+    return 0;
+#else
+    return m_size;
+#endif
+}
+
+uint8_t *BankedBuffer::map(uint32_t bank)
+{
+    Slot *victim = &m_slots[0];
+    for ( uint8_t i = 0; i < m_slotCount; i++ )
+    {
+        Slot &slot = m_slots[i];
+        if ( slot.bank == bank )
+        {
+            slot.used = ++m_clock;
+            m_stats.hits++;
+            return slot.data;
+        }
+        if ( slot.used < victim->used )
+            victim = &slot;
+    }
+
+#ifdef BANKED_BUFFER_HIMEM
+    if ( victim->data != nullptr )
+        esp_himem_unmap(m_range, victim->data, BANKED_BUFFER_BANK_SIZE);
+    victim->bank = NONE;
+    victim->data = nullptr;
+
+    // Every slot has its own bank sized part of the window
+    uint32_t window = (victim - m_slots) * BANKED_BUFFER_BANK_SIZE;
+    esp_err_t status = esp_himem_map(m_handle, m_range, bank * BANKED_BUFFER_BANK_SIZE, window, BANKED_BUFFER_BANK_SIZE, 0, (void **)&victim->data);
+    if ( status != ESP_OK )
+    {
+        Debug_printv("Unable to map bank[%lu]: %s", bank, esp_err_to_name(status));
+        victim->data = nullptr;
+        return nullptr;
+    }
+#else
+    victim->data = m_memory + bank * BANKED_BUFFER_BANK_SIZE;
+#endif
+
+    victim->bank = bank;
+    victim->used = ++m_clock;
+    m_stats.maps++;
+    return victim->data;
+}
+
+uint32_t BankedBuffer::view(uint32_t offset, uint8_t **data)
+{
+    *data = nullptr;
+    if ( offset >= m_size )
+        return 0;
+
+    uint32_t bank = offset / BANKED_BUFFER_BANK_SIZE;
+    uint8_t *memory = map(bank);
+    if ( memory == nullptr )
+        return 0;
+
+    uint32_t start = offset - bank * BANKED_BUFFER_BANK_SIZE;
+    *data = memory + start;
+    return std::min(BANKED_BUFFER_BANK_SIZE - start, m_size - offset);
+}
+
+uint32_t BankedBuffer::read(uint32_t offset, uint8_t *buf, uint32_t size)
+{
+    uint32_t done = 0;
+    while ( done < size )
+    {
+        uint8_t *data;
+        uint32_t n = std::min(view(offset + done, &data), size - done);
+        if ( n == 0 )
+            break;
+
+        memcpy(buf + done, data, n);
+        done += n;
+    }
+    return done;
+}
+
+uint32_t BankedBuffer::write(uint32_t offset, const uint8_t *buf, uint32_t size)
+{
+    uint32_t done = 0;
+    while ( done < size )
+    {
+        uint8_t *data;
+        uint32_t n = std::min(view(offset + done, &data), size - done);
+        if ( n == 0 )
+            break;
+
+        memcpy(data, buf + done, n);
+        done += n;
+    }
+    return done;
+}
+
+bool BankedBuffer::fill(const std::function<bool(uint8_t *data, uint32_t size)> &produce)
+{
+    for ( uint32_t offset = 0; offset < m_size; )
+    {
+        uint8_t *data;
+        uint32_t n = view(offset, &data);
+        if ( n == 0 || !produce(data, n) )
+            return false;
+
+        offset += n;
+    }
+    return true;
+}
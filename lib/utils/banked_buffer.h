@@ -0,0 +1,111 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// Large buffers in banks
+//
+// The ESP32 can only address 4MB of its PSRAM, the rest is reached through
+// the himem API one 32K bank at a time. A bank has to be mapped into a
+// window of the address space before it can be touched, and mapping flushes
+// the cache. BankedBuffer keeps the last few banks mapped in slots of its
+// own window and replaces the least recently used one, so sector sized
+// accesses to the same bank don't remap.
+//
+// Everywhere else the banks are plain heap memory and mapping is pointer
+// arithmetic. The slot bookkeeping is the same, which lets the native tests
+// count how often the device would have to map.
+//
+
+#ifndef MEATLOAF_BANKED_BUFFER
+#define MEATLOAF_BANKED_BUFFER
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#if defined(CONFIG_IDF_TARGET_ESP32) && defined(BOARD_HAS_PSRAM) && !defined(TEST_NATIVE)
+#define BANKED_BUFFER_HIMEM 1
+#include <esp32/himem.h>
+#endif
+
+// Banks mapped at once per buffer. Himem address space is scarce, a buffer
+// takes fewer slots if that is all there is.
+#ifndef BANKED_BUFFER_SLOTS
+#define BANKED_BUFFER_SLOTS 4
+#endif
+
+#define BANKED_BUFFER_BANK_SIZE 32768 // ESP_HIMEM_BLKSZ
+
+
+class BankedBuffer {
+public:
+    struct Stats {
+        uint32_t maps;      // Bank mapped into a slot
+        uint32_t hits;      // Bank was still mapped
+    };
+
+    BankedBuffer() = default;
+    BankedBuffer(const BankedBuffer &) = delete;
+    BankedBuffer &operator=(const BankedBuffer &) = delete;
+    ~BankedBuffer() { release(); };
+
+    bool allocate(uint32_t size);
+    void release();
+
+    uint32_t size() const { return m_size; };
+    explicit operator bool() const { return m_slotCount > 0; };
+
+    // Bytes taken from the heap, himem doesn't count
+    size_t footprint() const;
+
+    // The rest of the bank holding offset, valid until the next call
+    uint32_t view(uint32_t offset, uint8_t **data);
+
+    uint32_t read(uint32_t offset, uint8_t *buf, uint32_t size);
+    uint32_t write(uint32_t offset, const uint8_t *buf, uint32_t size);
+
+    // Fill the whole buffer front to back, a bank at a time. produce gets
+    // the memory to fill and returns false to give up.
+    bool fill(const std::function<bool(uint8_t *data, uint32_t size)> &produce);
+
+    Stats stats() const { return m_stats; };
+
+private:
+    struct Slot {
+        uint32_t bank;
+        uint32_t used;
+        uint8_t *data;
+    };
+
+    static const uint32_t NONE = UINT32_MAX;
+
+    uint8_t *map(uint32_t bank);
+
+    Slot m_slots[BANKED_BUFFER_SLOTS];
+    uint8_t m_slotCount = 0;
+    uint32_t m_clock = 0;
+    uint32_t m_size = 0;
+    Stats m_stats = { 0, 0 };
+
+#ifdef BANKED_BUFFER_HIMEM
+    esp_himem_handle_t m_handle;
+    esp_himem_rangehandle_t m_range;
+#else
+    uint8_t *m_memory = nullptr;
+#endif
+};
+
+#endif // MEATLOAF_BANKED_BUFFER
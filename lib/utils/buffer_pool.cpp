@@ -0,0 +1,277 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <esp_heap_caps.h>
+
+#include "../../include/debug.h"
+
+const uint32_t BufferPool::class_size[BUFFER_POOL_CLASSES] = { 256, 512, 1024, 2048, 4096, 8192 };
+
+void *BufferPool::free_list[BUFFER_POOL_CLASSES][PLACEMENTS] = { { nullptr } };
+uint32_t BufferPool::idle[BUFFER_POOL_CLASSES][PLACEMENTS] = { { 0 } };
+BufferPool::Stats BufferPool::totals[BUFFER_POOL_CLASSES + 1] = { { 0 } };
+
+size_t BufferPool::bytes_in_use = 0;
+size_t BufferPool::bytes_high_water = 0;
+
+std::mutex BufferPool::lock;
+
+
+/********************************************************
+ * Buffer
+ ********************************************************/
+
+BufferPool::Buffer &BufferPool::Buffer::operator=(Buffer &&other) noexcept
+{
+    if ( this != &other )
+    {
+        reset();
+
+        ptr = other.ptr;
+        length = other.length;
+        size_class = other.size_class;
+        placement = other.placement;
+
+        other.ptr = nullptr;
+        other.length = 0;
+    }
+    return *this;
+}
+
+void BufferPool::Buffer::reset()
+{
+    if ( ptr != nullptr )
+        BufferPool::release(*this);
+
+    ptr = nullptr;
+    length = 0;
+}
+
+
+/********************************************************
+ * BufferPool
+ ********************************************************/
+
+uint8_t BufferPool::sizeClass(size_t size)
+{
+    for ( uint8_t i = 0; i < BUFFER_POOL_CLASSES; i++ )
+    {
+        if ( size <= class_size[i] )
+            return i;
+    }
+    return OVERSIZE;
+}
+
+void *BufferPool::allocate(size_t size, Placement placement)
+{
+    if ( placement == DMA )
+        return heap_caps_malloc(size, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+
+#ifdef BOARD_HAS_PSRAM
+    void *ptr = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if ( ptr != nullptr )
+        return ptr;
+#endif
+
+    return heap_caps_malloc(size, MALLOC_CAP_8BIT);
+}
+
+BufferPool::Buffer BufferPool::acquire(size_t size, Placement placement)
+{
+    Buffer buffer;
+    uint8_t size_class = sizeClass(size);
+    uint32_t length = ( size_class == OVERSIZE ) ? size : class_size[size_class];
+
+    void *ptr = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if ( size_class != OVERSIZE && free_list[size_class][placement] != nullptr )
+        {
+            ptr = free_list[size_class][placement];
+            free_list[size_class][placement] = *(void **)ptr;
+            idle[size_class][placement]--;
+            totals[size_class].reuses++;
+        }
+    }
+
+    // Heap calls stay outside the lock
+    bool fresh = ( ptr == nullptr );
+    if ( fresh )
+        ptr = allocate(length, placement);
+
+    std::lock_guard<std::mutex> guard(lock);
+    Stats &stats = totals[size_class];
+    if ( ptr == nullptr )
+    {
+        stats.failures++;
+        Debug_printv("Out of memory size[%d] placement[%d]", length, placement);
+        return buffer;
+    }
+
+    if ( fresh )
+        stats.allocs++;
+
+    stats.in_use++;
+    stats.high_water = std::max(stats.high_water, stats.in_use);
+    bytes_in_use += length;
+    bytes_high_water = std::max(bytes_high_water, bytes_in_use);
+
+    buffer.ptr = (uint8_t *)ptr;
+    buffer.length = length;
+    buffer.size_class = size_class;
+    buffer.placement = placement;
+    return buffer;
+}
+
+bool BufferPool::move(Buffer &buffer, Placement placement)
+{
+    if ( !buffer || buffer.placement == placement )
+        return true;
+
+    Buffer moved = acquire(buffer.length, placement);
+    if ( !moved )
+        return false;
+
+    memcpy(moved.ptr, buffer.ptr, buffer.length);
+    buffer = std::move(moved);
+    return true;
+}
+
+void BufferPool::release(Buffer &buffer)
+{
+    void *ptr = buffer.ptr;
+    uint8_t size_class = buffer.size_class;
+    Placement placement = buffer.placement;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        totals[size_class].in_use--;
+        bytes_in_use -= buffer.length;
+
+        if ( size_class != OVERSIZE && idle[size_class][placement] < BUFFER_POOL_KEEP )
+        {
+            *(void **)ptr = free_list[size_class][placement];
+            free_list[size_class][placement] = ptr;
+            idle[size_class][placement]++;
+            return;
+        }
+    }
+
+    heap_caps_free(ptr);
+}
+
+void BufferPool::reserve(size_t size, Placement placement, uint32_t count)
+{
+    uint8_t size_class = sizeClass(size);
+    if ( size_class == OVERSIZE )
+        return;
+
+    while ( true )
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if ( idle[size_class][placement] >= count )
+                return;
+        }
+
+        void *ptr = allocate(class_size[size_class], placement);
+
+        std::lock_guard<std::mutex> guard(lock);
+        if ( ptr == nullptr )
+        {
+            totals[size_class].failures++;
+            return;
+        }
+
+        totals[size_class].allocs++;
+        *(void **)ptr = free_list[size_class][placement];
+        free_list[size_class][placement] = ptr;
+        idle[size_class][placement]++;
+    }
+}
+
+void BufferPool::trim()
+{
+    void *lists[BUFFER_POOL_CLASSES][PLACEMENTS];
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for ( int i = 0; i < BUFFER_POOL_CLASSES; i++ )
+        {
+            for ( int p = 0; p < PLACEMENTS; p++ )
+            {
+                lists[i][p] = free_list[i][p];
+                free_list[i][p] = nullptr;
+                idle[i][p] = 0;
+            }
+        }
+    }
+
+    for ( int i = 0; i < BUFFER_POOL_CLASSES; i++ )
+    {
+        for ( int p = 0; p < PLACEMENTS; p++ )
+        {
+            void *ptr = lists[i][p];
+            while ( ptr != nullptr )
+            {
+                void *next = *(void **)ptr;
+                heap_caps_free(ptr);
+                ptr = next;
+            }
+        }
+    }
+}
+
+BufferPool::Stats BufferPool::stats(uint8_t size_class)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if ( size_class > OVERSIZE )
+        size_class = OVERSIZE;
+
+    Stats stats = totals[size_class];
+    stats.size = ( size_class == OVERSIZE ) ? 0 : class_size[size_class];
+    stats.idle = 0;
+    if ( size_class != OVERSIZE )
+    {
+        for ( int p = 0; p < PLACEMENTS; p++ )
+            stats.idle += idle[size_class][p];
+    }
+    return stats;
+}
+
+size_t BufferPool::highWaterBytes()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return bytes_high_water;
+}
+
+void BufferPool::report()
+{
+    for ( uint8_t i = 0; i <= OVERSIZE; i++ )
+    {
+        Stats s = stats(i);
+        if ( s.allocs == 0 && s.reuses == 0 && s.failures == 0 )
+            continue;
+
+        Debug_printv("BufferPool size[%lu] in_use[%lu] high_water[%lu] idle[%lu] allocs[%lu] reuses[%lu] failures[%lu]",
+                     s.size, s.in_use, s.high_water, s.idle, s.allocs, s.reuses, s.failures);
+    }
+    Debug_printv("BufferPool high_water_bytes[%d]", highWaterBytes());
+}
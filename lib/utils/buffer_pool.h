@@ -0,0 +1,132 @@
+// Meatloaf - A Commodore 64/128 multi-device emulator
+// https://github.com/idolpx/meatloaf
+// Copyright(C) 2020 James Johnston
+//
+// Meatloaf is free software : you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Meatloaf is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Meatloaf. If not, see <http://www.gnu.org/licenses/>.
+
+// Pooled I/O buffers
+//
+// Channel, stream and transfer buffers come and go with every file that is
+// opened. Allocating them ad hoc leaves the heap fragmented after a long
+// uptime and puts malloc() latency in the middle of bus transactions.
+// BufferPool hands out buffers from a few fixed size classes and keeps
+// released ones on a free list for the next user. The caller says where
+// the buffer should live: internal DMA capable RAM for anything the bus or
+// a peripheral touches, PSRAM (when there is some) for bulk data.
+//
+
+#ifndef MEATLOAF_BUFFER_POOL
+#define MEATLOAF_BUFFER_POOL
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+
+// Idle buffers kept per size class and placement, the rest go back to the heap
+#ifndef BUFFER_POOL_KEEP
+#ifdef BOARD_HAS_PSRAM
+#define BUFFER_POOL_KEEP 8
+#else
+#define BUFFER_POOL_KEEP 4
+#endif
+#endif
+
+#define BUFFER_POOL_CLASSES 6 // 256, 512, 1K, 2K, 4K, 8K
+
+
+class BufferPool {
+public:
+    enum Placement : uint8_t {
+        DMA,    // Internal, DMA capable
+        PSRAM,  // External if available, internal otherwise
+        PLACEMENTS
+    };
+
+    // Owns one pooled buffer, gives it back when it goes away
+    class Buffer {
+    public:
+        Buffer() = default;
+        Buffer(Buffer &&other) noexcept { *this = std::move(other); };
+        Buffer &operator=(Buffer &&other) noexcept;
+        Buffer(const Buffer &) = delete;
+        Buffer &operator=(const Buffer &) = delete;
+        ~Buffer() { reset(); };
+
+        uint8_t *data() const { return ptr; };
+        size_t size() const { return length; };
+        explicit operator bool() const { return ptr != nullptr; };
+        Placement where() const { return placement; };
+
+        void reset();
+
+    private:
+        uint8_t *ptr = nullptr;
+        uint32_t length = 0;
+        uint8_t size_class = 0;
+        Placement placement = PSRAM;
+
+        friend class BufferPool;
+    };
+
+    struct Stats {
+        uint32_t size;          // Size class, 0 = larger than the largest class
+        uint32_t in_use;
+        uint32_t high_water;    // Most buffers of this class in use at once
+        uint32_t idle;          // On the free lists
+        uint32_t allocs;        // Came from the heap
+        uint32_t reuses;        // Came from a free list
+        uint32_t failures;
+    };
+
+    // At least size bytes, rounded up to the size class. Check the result,
+    // it is empty if the heap is out of memory.
+    static Buffer acquire(size_t size, Placement placement = PSRAM);
+
+    // Copy the contents to a buffer of the same size at placement and
+    // release the old one. The buffer stays where it was if there is no
+    // memory there.
+    static bool move(Buffer &buffer, Placement placement);
+
+    // Top the free list of the size class up to count idle buffers, so the
+    // next acquire() doesn't have to go to the heap
+    static void reserve(size_t size, Placement placement, uint32_t count);
+
+    // Give all idle buffers back to the heap
+    static void trim();
+
+    static Stats stats(uint8_t size_class);
+    static size_t highWaterBytes();
+    static void report();
+
+private:
+    static const uint32_t class_size[BUFFER_POOL_CLASSES];
+    static const uint8_t OVERSIZE = BUFFER_POOL_CLASSES;
+
+    static uint8_t sizeClass(size_t size);
+    static void *allocate(size_t size, Placement placement);
+    static void release(Buffer &buffer);
+
+    // Free lists are threaded through the idle buffers themselves
+    static void *free_list[BUFFER_POOL_CLASSES][PLACEMENTS];
+    static uint32_t idle[BUFFER_POOL_CLASSES][PLACEMENTS];
+    static Stats totals[BUFFER_POOL_CLASSES + 1];
+
+    static size_t bytes_in_use;
+    static size_t bytes_high_water;
+
+    static std::mutex lock;
+};
+
+#endif // MEATLOAF_BUFFER_POOL
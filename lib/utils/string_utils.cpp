@@ -319,6 +319,27 @@ namespace mstr {
         return petsciiString;
     }
 
+    // Same into a caller supplied buffer, returns the number of PETSCII chars written
+    size_t toPETSCII2(const char *utfInput, size_t length, char *petsciiOutput, size_t size)
+    {
+        char* input = (char*)utfInput;
+        auto end = input + length;
+        size_t count = 0;
+
+        while(input<end && count<size) {
+            uint8_t lead = *input;
+            size_t skip = ((lead & 0b11110000) == 0b11100000) ? 3 : ((lead & 0b11100000) == 0b11000000) ? 2 : 1;
+            if(input+skip > end)
+                break; // Truncated sequence
+
+            U8Char u8char(' ');
+            u8char.fromCharArray(input);
+            petsciiOutput[count++] = u8char.toPetscii();
+            input+=skip;
+        }
+        return count;
+    }
+
     // convert bytes to hex
     std::string toHex(const uint8_t *input, size_t size)
     {
@@ -79,6 +79,7 @@ namespace mstr {
     // void toPETSCII(std::string &s);
     std::string toUTF8(const std::string &petsciiInput);
     std::string toPETSCII2(const std::string &utfInputString);
+    size_t toPETSCII2(const char *utfInput, size_t length, char *petsciiOutput, size_t size);
     std::string toHex(const uint8_t *input, size_t size);
     std::string toHex(const std::string &input);
 
@@ -16,6 +16,7 @@
 
 #include "file-utils.h"
 #include "string_utils.h"
+#include "buffer_pool.h"
 
 using namespace WebDav;
 
@@ -262,7 +263,13 @@ int Server::doGet(Request &req, Response &resp)
     ret = 0;
 
     const int chunkSize = 8192;
-    char *chunk = (char *)malloc(chunkSize);
+    auto buffer = BufferPool::acquire(chunkSize);
+    char *chunk = (char *)buffer.data();
+    if (!chunk)
+    {
+        fclose(f);
+        return 500;
+    }
 
     for (;;)
     {
@@ -277,7 +284,6 @@ int Server::doGet(Request &req, Response &resp)
         }
     }
 
-    free(chunk);
     fclose(f);
     resp.closeChunk();
 
@@ -81,6 +81,7 @@ ps2dev::PS2Keyboard keyboard(PIN_KB_CLK, PIN_KB_DATA);
 
 
 #include "bus.h"
+#include "meat_catalog.h"
 //#include "ml_tests.h"
 
 std::string statusMessage;
@@ -190,6 +191,9 @@ void main_setup()
     printf(ANSI_GREEN_BOLD "IEC Bus Initialized" ANSI_RESET "\r\n");
 
     Meatloaf.setup(&IEC);
+
+    // Index the images on flash and SD in the background
+    CatalogIndex::start();
     // {
     //     // Add devices to bus
     //     FileSystem *ptrfs = fnSDFAT.running() ? (FileSystem *)&fnSDFAT : (FileSystem *)&fsFlash;
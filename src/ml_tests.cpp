@@ -1,6 +1,7 @@
 
 
 #include <string>
+#include <algorithm>
 
 #include <dirent.h>
 #include <sys/stat.h>
@@ -727,6 +728,62 @@ void testFileOutput() {
     writer << "Let's write some text to a file!";
 }
 
+void testPathResolution() {
+    testHeader("Path resolution benchmark");
+
+    const char *urls[] = {
+        "/games/arcade7.d64/GORF",
+        "http://c64.meatloaf.cc/roms/1541.zip/dos1541.bin",
+        "/sd/collections/demos/party.d81/intro",
+        "/.sys/README"
+    };
+    const uint32_t rounds = 1000;
+
+    // Before: ask every filesystem about every segment, right to left
+    uint64_t start = fnSystem.micros();
+    for ( uint32_t r = 0; r < rounds; r++ )
+    {
+        for ( auto url : urls )
+        {
+            auto paths = mstr::split(url, '/');
+            for ( auto part = paths.rbegin(); part != paths.rend(); part++ )
+            {
+                std::string lower = *part;
+                mstr::toLower(lower);
+                auto found = std::find_if(MFSOwner::availableFS.begin() + 1, MFSOwner::availableFS.end(), [&lower](MFileSystem* fs){ return fs->handles(lower); });
+                if ( found != MFSOwner::availableFS.end() )
+                    break;
+            }
+        }
+    }
+    uint64_t linear = fnSystem.micros() - start;
+
+    // After: trie dispatch
+    start = fnSystem.micros();
+    for ( uint32_t r = 0; r < rounds; r++ )
+    {
+        for ( auto url : urls )
+            MFSOwner::resolve(url);
+    }
+    uint64_t trie = fnSystem.micros() - start;
+
+    // After: memoized, File() builds the MFile objects on top of the cached chain
+    MFSOwner::clearCache();
+    start = fnSystem.micros();
+    for ( uint32_t r = 0; r < rounds; r++ )
+    {
+        for ( auto url : urls )
+            delete MFSOwner::File(url);
+    }
+    uint64_t cached = fnSystem.micros() - start;
+
+    uint32_t count = rounds * (sizeof(urls) / sizeof(urls[0]));
+    auto stats = MFSOwner::stats();
+    Debug_printf("linear dispatch : %llu resolutions/s\r\n", (uint64_t)count * 1000000 / (linear ? linear : 1));
+    Debug_printf("trie resolve    : %llu resolutions/s\r\n", (uint64_t)count * 1000000 / (trie ? trie : 1));
+    Debug_printf("File() cached   : %llu files/s hits[%d] misses[%d]\r\n", (uint64_t)count * 1000000 / (cached ? cached : 1), stats.hits, stats.misses);
+}
+
 #if 0
 template <typename T>
 void trig_function()
@@ -840,6 +897,7 @@ void runTestsSuite() {
 
     //testRedirect();
     //testStrings();
+    //testPathResolution();
 
     //trig_function<double>();
     //test_tinyexpr();
@@ -0,0 +1,388 @@
+#include "unity.h"
+
+#include <bitset>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "../lib/meatloaf/disk/bam.cpp"
+
+// Raw BAM bytes per track, the way the images store them (1 = free)
+struct RawBam {
+    const DiskGeometry *geometry;
+    std::vector<std::vector<uint8_t>> tracks;
+
+    RawBam(const DiskGeometry &g, uint32_t seed, int percent_free) : geometry(&g), tracks(g.tracks + 1)
+    {
+        std::mt19937 rng(seed);
+        for (uint16_t t = 1; t <= g.tracks; t++)
+        {
+            tracks[t].assign((g.sectorCount(t) + 7) / 8, 0x00);
+            for (uint16_t s = 0; s < g.sectorCount(t); s++)
+            {
+                if ((int)(rng() % 100) < percent_free)
+                    tracks[t][s >> 3] |= (1 << (s & 7));
+            }
+        }
+    }
+
+    void load(BlockBitmap &bam) const
+    {
+        bam.reset(geometry);
+        for (uint16_t t = 1; t <= geometry->tracks; t++)
+            bam.loadTrack(t, tracks[t].data(), tracks[t].size());
+    }
+
+    bool isFree(uint8_t t, uint8_t s) const
+    {
+        return tracks[t][s >> 3] & (1 << (s & 7));
+    }
+
+    // Byte by byte, like blocksFree() used to
+    uint32_t blocksFree() const
+    {
+        uint32_t total = 0;
+        for (uint16_t t = 1; t <= geometry->tracks; t++)
+        {
+            for (auto b : tracks[t])
+                total += std::bitset<8>(b).count();
+        }
+        return total;
+    }
+
+    // Sector by sector first free block with the same placement rules
+    bool nextFree(uint8_t dir, uint8_t interleave, uint8_t &track, uint8_t &sector) const
+    {
+        auto search = [&](int t, uint16_t s) {
+            uint16_t count = geometry->sectorCount(t);
+            for (uint16_t i = 0; i < count && t != dir; i++)
+            {
+                if (isFree(t, (s + i) % count))
+                {
+                    track = t;
+                    sector = (s + i) % count;
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        if (track)
+        {
+            uint16_t count = geometry->sectorCount(track);
+            uint16_t s = sector + interleave;
+            if (s >= count)
+            {
+                s -= count;
+                if (s > 0)
+                    s--;
+            }
+            if (search(track, s % count))
+                return true;
+
+            int step = (track < dir) ? -1 : 1;
+            for (int t = track + step; t >= 1 && t <= geometry->tracks; t += step)
+            {
+                if (search(t, 0))
+                    return true;
+            }
+        }
+
+        for (int d = 1; dir - d >= 1 || dir + d <= geometry->tracks; d++)
+        {
+            if (dir - d >= 1 && search(dir - d, 0))
+                return true;
+            if (dir + d <= geometry->tracks && search(dir + d, 0))
+                return true;
+        }
+        return false;
+    }
+
+    void allocate(uint8_t t, uint8_t s)
+    {
+        tracks[t][s >> 3] &= ~(1 << (s & 7));
+    }
+};
+
+struct Format {
+    const char *name;
+    const DiskGeometry *geometry;
+};
+
+static const Format formats[] = {
+    { "D64", &Geometry::D64 },
+    { "D71", &Geometry::D71 },
+    { "D81", &Geometry::D81 },
+    { "D90", &Geometry::D9060 },
+};
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_bam_load_store(void)
+{
+    for (auto &f : formats)
+    {
+        RawBam raw(*f.geometry, 1, 50);
+        BlockBitmap bam;
+        raw.load(bam);
+
+        TEST_ASSERT_EQUAL_UINT32(raw.blocksFree(), bam.blocksFree());
+        TEST_ASSERT_FALSE(bam.isDirty());
+
+        for (uint16_t t = 1; t <= f.geometry->tracks; t++)
+        {
+            std::vector<uint8_t> bits(raw.tracks[t].size());
+            bam.storeTrack(t, bits.data(), bits.size());
+            TEST_ASSERT_TRUE(bits == raw.tracks[t]);
+        }
+    }
+}
+
+// A D71 image through loadMap/storeMap: side one entries at 18/0 with
+// their counts, side two bitmaps on 53/0 with the counts at 18/0 $DD
+void test_bam_d71_map(void)
+{
+    const DiskGeometry &g = Geometry::D71;
+    const Partition &p = g.partition;
+    RawBam raw(g, 7, 60);
+    std::vector<uint8_t> image(g.blockCount() * 256, 0);
+
+    uint8_t *header = &image[g.lba(18, 0) * 256];
+    uint8_t *side_two = &image[g.lba(53, 0) * 256];
+    for (uint16_t t = 1; t <= 35; t++)
+    {
+        uint8_t *entry = header + 4 + (t - 1) * 4;
+        entry[0] = std::bitset<24>(raw.tracks[t][0] | (raw.tracks[t][1] << 8) | (raw.tracks[t][2] << 16)).count();
+        memcpy(entry + 1, raw.tracks[t].data(), 3);
+    }
+    for (uint16_t t = 36; t <= 70; t++)
+    {
+        header[0xDD + t - 36] = std::bitset<24>(raw.tracks[t][0] | (raw.tracks[t][1] << 8) | (raw.tracks[t][2] << 16)).count();
+        memcpy(side_two + (t - 36) * 3, raw.tracks[t].data(), 3);
+    }
+
+    auto access = [&](bool write) {
+        return [&image, write](uint32_t offset, uint8_t *data, uint32_t size) {
+            if (offset + size > image.size())
+                return false;
+            if (write)
+                memcpy(&image[offset], data, size);
+            else
+                memcpy(data, &image[offset], size);
+            return true;
+        };
+    };
+
+    BlockBitmap bam;
+    TEST_ASSERT_TRUE(bam.loadMap(&g, p, 256, access(false)));
+    TEST_ASSERT_EQUAL_UINT32(raw.blocksFree(), bam.blocksFree());
+
+    // A SAVE on both sides, and a scratch freeing a block on 53
+    for (uint8_t s = 0; s < 10; s++)
+    {
+        bam.allocate(1, s);
+        bam.allocate(40, s);
+    }
+    uint8_t scratched = 0;
+    while (raw.isFree(53, scratched))
+        scratched++;
+    TEST_ASSERT_TRUE(bam.release(53, scratched));
+    uint8_t before = header[0xDD + 53 - 36];
+
+    std::vector<uint8_t> saved = image;
+    TEST_ASSERT_TRUE(bam.storeMap(p, 256, access(true)));
+    TEST_ASSERT_FALSE(bam.isDirty());
+
+    // Free counts are counts, not bitmap bytes
+    TEST_ASSERT_TRUE(bam.trackFree(40) > 0);
+    TEST_ASSERT_EQUAL_UINT8(bam.trackFree(40), header[0xDD + 40 - 36]);
+    TEST_ASSERT_EQUAL_UINT8(before + 1, header[0xDD + 53 - 36]);
+    TEST_ASSERT_EQUAL_UINT8(bam.trackFree(1), header[4]);
+    TEST_ASSERT_EQUAL_UINT8(0, side_two[(40 - 36) * 3]);
+
+    // Untouched tracks weren't written
+    TEST_ASSERT_EQUAL_MEMORY(&saved[g.lba(18, 0) * 256 + 0xDD + 1], header + 0xDD + 1, 3);
+
+    BlockBitmap back;
+    TEST_ASSERT_TRUE(back.loadMap(&g, p, 256, access(false)));
+    TEST_ASSERT_EQUAL_UINT32(bam.blocksFree(), back.blocksFree());
+    for (uint16_t t = 1; t <= 70; t++)
+    {
+        TEST_ASSERT_EQUAL_UINT16(bam.trackFree(t), back.trackFree(t));
+        uint8_t count = (t <= 35) ? header[4 + (t - 1) * 4] : header[0xDD + t - 36];
+        TEST_ASSERT_EQUAL_UINT8(back.trackFree(t), count);
+    }
+}
+
+// 256 sector tracks, the count byte can't hold a whole free track
+void test_bam_count_byte(void)
+{
+    const DiskGeometry &g = Geometry::DNP;
+    const Partition p = { 1, 0, 0x04, 1, 0, 0x20, 1, { { 1, 2, 0x00, 1, 2, 33 } } };
+    std::vector<uint8_t> image(g.lba(1, 3) * 256, 0);
+
+    BlockBitmap bam;
+    bam.reset(&g);
+    for (uint16_t s = 0; s < 256; s++)
+        bam.release(1, s);
+    for (uint16_t s = 1; s < 256; s++)
+        bam.release(2, s);
+    TEST_ASSERT_EQUAL_UINT16(256, bam.trackFree(1));
+    TEST_ASSERT_EQUAL_UINT16(255, bam.trackFree(2));
+
+    TEST_ASSERT_TRUE(bam.storeMap(p, 256, [&image](uint32_t offset, uint8_t *data, uint32_t size) {
+        memcpy(&image[offset], data, size);
+        return true;
+    }));
+
+    uint8_t *entries = &image[g.lba(1, 2) * 256];
+    TEST_ASSERT_EQUAL_UINT8(255, entries[0]);
+    TEST_ASSERT_EQUAL_UINT8(255, entries[33]);
+    for (uint8_t i = 1; i < 33; i++)
+        TEST_ASSERT_EQUAL_UINT8(0xFF, entries[i]);
+    TEST_ASSERT_EQUAL_UINT8(0xFE, entries[34]);
+}
+
+void test_bam_allocate_release(void)
+{
+    RawBam raw(Geometry::D64, 2, 100);
+    BlockBitmap bam;
+    raw.load(bam);
+
+    uint32_t free = bam.blocksFree();
+    TEST_ASSERT_TRUE(bam.allocate(17, 3));
+    TEST_ASSERT_FALSE(bam.allocate(17, 3));
+    TEST_ASSERT_FALSE(bam.isFree(17, 3));
+    TEST_ASSERT_EQUAL_UINT32(free - 1, bam.blocksFree());
+    TEST_ASSERT_EQUAL_UINT16(20, bam.trackFree(17));
+    TEST_ASSERT_TRUE(bam.isDirty(17));
+    TEST_ASSERT_FALSE(bam.isDirty(16));
+
+    TEST_ASSERT_TRUE(bam.release(17, 3));
+    TEST_ASSERT_FALSE(bam.release(17, 3));
+    TEST_ASSERT_EQUAL_UINT32(free, bam.blocksFree());
+
+    // Out of range
+    TEST_ASSERT_FALSE(bam.allocate(17, 21));
+    TEST_ASSERT_FALSE(bam.allocate(0, 0));
+}
+
+void test_bam_dos_interleave(void)
+{
+    RawBam raw(Geometry::D64, 3, 100);
+    BlockBitmap bam;
+    raw.load(bam);
+
+    // First blocks of a file on an empty 1541 disk
+    const uint8_t expected[][2] = { { 17, 0 }, { 17, 10 }, { 17, 20 }, { 17, 8 }, { 17, 18 }, { 17, 6 } };
+    uint8_t t = 0, s = 0;
+    for (auto &e : expected)
+    {
+        TEST_ASSERT_TRUE(bam.nextFree(1, 35, 18, 10, t, s));
+        TEST_ASSERT_EQUAL_UINT8(e[0], t);
+        TEST_ASSERT_EQUAL_UINT8(e[1], s);
+        bam.allocate(t, s);
+    }
+}
+
+// Fill the disk with one file, the bitmap has to pick the same blocks as the
+// sector by sector search and never touch the directory track
+void test_bam_fill_matches_reference(void)
+{
+    for (auto &f : formats)
+    {
+        auto &p = f.geometry->partition;
+        RawBam raw(*f.geometry, 4, 30);
+        BlockBitmap bam;
+        raw.load(bam);
+
+        uint8_t t = 0, s = 0, rt = 0, rs = 0;
+        uint32_t blocks = 0;
+        uint32_t expected = bam.blocksFree() - bam.trackFree(p.directory_track);
+        while (bam.nextFree(1, f.geometry->tracks, p.directory_track, f.geometry->interleave[1], t, s))
+        {
+            TEST_ASSERT_TRUE(raw.nextFree(p.directory_track, f.geometry->interleave[1], rt, rs));
+            TEST_ASSERT_EQUAL_UINT8(rt, t);
+            TEST_ASSERT_EQUAL_UINT8(rs, s);
+            TEST_ASSERT_NOT_EQUAL(p.directory_track, t);
+            TEST_ASSERT_TRUE(bam.allocate(t, s));
+            raw.allocate(rt, rs);
+            blocks++;
+        }
+        TEST_ASSERT_EQUAL_UINT32(expected, blocks);
+    }
+}
+
+template <typename F>
+static double nsPerOp(uint32_t iterations, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < iterations; i++)
+        f();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+void test_bam_benchmark(void)
+{
+    volatile uint32_t sink = 0;
+
+    printf("\n%-4s %14s %14s %16s %16s\n", "fmt", "count raw ns", "count bam ns", "fill raw ns/blk", "fill bam ns/blk");
+    for (auto &f : formats)
+    {
+        auto &p = f.geometry->partition;
+        RawBam raw(*f.geometry, 5, 50);
+        BlockBitmap bam;
+        raw.load(bam);
+
+        double count_raw = nsPerOp(10000, [&] { sink = sink + raw.blocksFree(); });
+        double count_bam = nsPerOp(10000, [&] { sink = sink + bam.blocksFree(); });
+
+        // Allocate every free block of the disk, one file
+        uint32_t blocks = bam.blocksFree();
+        double fill_raw = nsPerOp(1, [&] {
+            RawBam r = raw;
+            uint8_t t = 0, s = 0;
+            while (r.nextFree(p.directory_track, f.geometry->interleave[1], t, s))
+                r.allocate(t, s);
+        }) / blocks;
+        double fill_bam = nsPerOp(1, [&] {
+            BlockBitmap b = bam;
+            uint8_t t = 0, s = 0;
+            while (b.nextFree(1, f.geometry->tracks, p.directory_track, f.geometry->interleave[1], t, s))
+                b.allocate(t, s);
+        }) / blocks;
+
+        printf("%-4s %14.1f %14.1f %16.1f %16.1f\n", f.name, count_raw, count_bam, fill_raw, fill_bam);
+    }
+
+    TEST_ASSERT_TRUE(sink != 1);
+}
+
+void process()
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_bam_load_store);
+    RUN_TEST(test_bam_d71_map);
+    RUN_TEST(test_bam_count_byte);
+    RUN_TEST(test_bam_allocate_release);
+    RUN_TEST(test_bam_dos_interleave);
+    RUN_TEST(test_bam_fill_matches_reference);
+    RUN_TEST(test_bam_benchmark);
+
+    UNITY_END();
+}
+
+int main()
+{
+    process();
+}
@@ -0,0 +1,177 @@
+#include "unity.h"
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "../lib/utils/banked_buffer.cpp"
+
+#define BANK BANKED_BUFFER_BANK_SIZE
+
+static std::vector<uint8_t> pattern(uint32_t size)
+{
+    std::vector<uint8_t> data(size);
+    for (uint32_t i = 0; i < size; i++)
+        data[i] = (uint8_t)(i * 7 + (i >> 11));
+    return data;
+}
+
+void test_banked_buffer_copy(void)
+{
+    BankedBuffer buffer;
+    TEST_ASSERT_FALSE((bool)buffer);
+
+    const uint32_t size = 3 * BANK + 100;
+    TEST_ASSERT_TRUE(buffer.allocate(size));
+    TEST_ASSERT_EQUAL_UINT32(size, buffer.size());
+    TEST_ASSERT_EQUAL_UINT32(size, buffer.footprint());
+
+    // One write across all banks, then reads that straddle them
+    auto data = pattern(size);
+    TEST_ASSERT_EQUAL_UINT32(size, buffer.write(0, data.data(), size));
+
+    std::vector<uint8_t> back(size);
+    TEST_ASSERT_EQUAL_UINT32(size, buffer.read(0, back.data(), size));
+    TEST_ASSERT_TRUE(back == data);
+
+    uint8_t sector[256];
+    TEST_ASSERT_EQUAL_UINT32(256, buffer.read(BANK - 100, sector, 256));
+    TEST_ASSERT_EQUAL_MEMORY(data.data() + BANK - 100, sector, 256);
+
+    // Clipped at the end
+    TEST_ASSERT_EQUAL_UINT32(100, buffer.read(size - 100, sector, 256));
+    TEST_ASSERT_EQUAL_UINT32(0, buffer.read(size, sector, 256));
+    TEST_ASSERT_EQUAL_UINT32(50, buffer.write(size - 50, sector, 256));
+
+    // Views end with their bank
+    uint8_t *view;
+    TEST_ASSERT_EQUAL_UINT32(10, buffer.view(2 * BANK - 10, &view));
+    TEST_ASSERT_EQUAL_MEMORY(data.data() + 2 * BANK - 10, view, 10);
+    TEST_ASSERT_EQUAL_UINT32(100, buffer.view(3 * BANK, &view));
+
+    buffer.release();
+    TEST_ASSERT_FALSE((bool)buffer);
+    TEST_ASSERT_EQUAL_UINT32(0, buffer.size());
+}
+
+void test_banked_buffer_fill(void)
+{
+    BankedBuffer buffer;
+    const uint32_t size = 2 * BANK + 5000;
+    TEST_ASSERT_TRUE(buffer.allocate(size));
+
+    auto data = pattern(size);
+    uint32_t offset = 0;
+    uint32_t calls = 0;
+    TEST_ASSERT_TRUE(buffer.fill([&](uint8_t *target, uint32_t length) {
+        memcpy(target, data.data() + offset, length);
+        offset += length;
+        calls++;
+        return true;
+    }));
+    TEST_ASSERT_EQUAL_UINT32(3, calls);
+
+    std::vector<uint8_t> back(size);
+    buffer.read(0, back.data(), size);
+    TEST_ASSERT_TRUE(back == data);
+
+    // The producer giving up stops the fill
+    calls = 0;
+    TEST_ASSERT_FALSE(buffer.fill([&](uint8_t *, uint32_t) { return ++calls < 2; }));
+    TEST_ASSERT_EQUAL_UINT32(2, calls);
+}
+
+void test_banked_buffer_slots(void)
+{
+    BankedBuffer buffer;
+    TEST_ASSERT_TRUE(buffer.allocate(8 * BANK));
+
+    // A whole bank sector by sector maps it once
+    uint8_t sector[256];
+    for (uint32_t i = 0; i < BANK; i += 256)
+        buffer.read(i, sector, 256);
+    TEST_ASSERT_EQUAL_UINT32(1, buffer.stats().maps);
+    TEST_ASSERT_EQUAL_UINT32(BANK / 256 - 1, buffer.stats().hits);
+
+    // As many banks as slots stay mapped
+    for (int round = 0; round < 3; round++)
+        for (uint32_t bank = 0; bank < BANKED_BUFFER_SLOTS; bank++)
+            buffer.read(bank * BANK, sector, 256);
+    TEST_ASSERT_EQUAL_UINT32(BANKED_BUFFER_SLOTS, buffer.stats().maps);
+
+    // The least recently used bank goes, bank 0 was just used
+    buffer.read(0, sector, 1);
+    buffer.read(BANKED_BUFFER_SLOTS * BANK, sector, 1);
+    uint32_t maps = buffer.stats().maps;
+    buffer.read(0, sector, 1);
+    TEST_ASSERT_EQUAL_UINT32(maps, buffer.stats().maps);
+    buffer.read(1 * BANK, sector, 1);
+    TEST_ASSERT_EQUAL_UINT32(maps + 1, buffer.stats().maps);
+}
+
+// A D81 in banks, read the way a directory listing and a file load do:
+// the header and directory track in the middle, file sectors elsewhere
+void test_banked_buffer_benchmark(void)
+{
+    using clock = std::chrono::steady_clock;
+
+    const uint32_t size = 819200;
+    BankedBuffer buffer;
+    TEST_ASSERT_TRUE(buffer.allocate(size));
+    auto data = pattern(size);
+    buffer.write(0, data.data(), size);
+
+    const uint32_t directory = 40 * 40 * 256;
+    std::vector<uint32_t> accesses;
+    for (int file = 0; file < 50; file++)
+    {
+        for (uint32_t s = 0; s < 4; s++)
+            accesses.push_back(directory + s * 256);
+        uint32_t start = ((file * 7919) % 3000) * 256;
+        for (uint32_t s = 0; s < 40; s++)
+            accesses.push_back((start + s * 256) % size);
+    }
+
+    auto t0 = clock::now();
+    uint32_t sum = 0;
+    uint8_t sector[256];
+    const int rounds = 20;
+    for (int round = 0; round < rounds; round++)
+        for (uint32_t offset : accesses)
+        {
+            buffer.read(offset, sector, 256);
+            sum += sector[0];
+        }
+    auto t1 = clock::now();
+
+    // Every access mapped and unmapped its bank before
+    uint32_t calls = accesses.size() * rounds;
+    uint32_t straddling = 0;
+    for (uint32_t offset : accesses)
+        straddling += (offset / BANK != (offset + 255) / BANK);
+    uint32_t maps = buffer.stats().maps;
+    TEST_ASSERT_LESS_THAN_UINT32(calls / 10, maps);
+
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / calls;
+    printf("\n%-24s %10s %10s\n", "sector reads", "reads", "maps");
+    printf("%-24s %10u %10u\n", "map per call", calls, calls + straddling * rounds);
+    printf("%-24s %10u %10u\n", "slots", calls, maps);
+    printf("%-24s %10.1f ns/read (checksum %u)\n", "host", ns, sum);
+}
+
+void process()
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_banked_buffer_copy);
+    RUN_TEST(test_banked_buffer_fill);
+    RUN_TEST(test_banked_buffer_slots);
+    RUN_TEST(test_banked_buffer_benchmark);
+
+    UNITY_END();
+}
+
+int main()
+{
+    process();
+}
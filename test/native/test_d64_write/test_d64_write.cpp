@@ -0,0 +1,289 @@
+#include "unity.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "../lib/utils/string_utils.cpp"
+#include "../lib/utils/U8Char.cpp"
+#include "../lib/meatloaf/meat_cache.cpp"
+#include "../lib/meatloaf/meat_media.cpp"
+#include "../lib/meatloaf/disk/bam.cpp"
+#include "../lib/meatloaf/disk/format.cpp"
+#include "../lib/meatloaf/disk/d64.cpp"
+#include "../lib/utils/punycode.cpp"
+
+// punycode.cpp has them as macros
+#undef min
+#undef max
+
+// The stream side of D64 doesn't use these, they only complete D64MFile
+std::shared_ptr<MStream> MFile::getSourceStream(std::ios_base::openmode) { return nullptr; }
+bool MFile::getNextEntry(DirEntry &) { return false; }
+bool MFile::exists() { return false; }
+uint64_t MFile::getAvailableSpace() { return 0; }
+MFile *MFSOwner::File(std::string, bool) { return nullptr; }
+bool DirFilter::matchName(const char *, bool) const { return true; }
+bool DirFilter::matchType(const char *, uint8_t) const { return true; }
+
+// The image file
+class MemoryMStream : public MStream {
+public:
+    MemoryMStream(std::vector<uint8_t> &image) : image(image) { _size = image.size(); };
+
+    bool isOpen() override { return true; };
+    bool open(std::ios_base::openmode mode) override { return true; };
+    void close() override {};
+
+    uint32_t read(uint8_t *buf, uint32_t size) override
+    {
+        size = std::min(size, _size - _position);
+        memcpy(buf, image.data() + _position, size);
+        _position += size;
+        return size;
+    }
+
+    uint32_t write(const uint8_t *buf, uint32_t size) override
+    {
+        size = std::min(size, _size - _position);
+        memcpy(image.data() + _position, buf, size);
+        _position += size;
+        return size;
+    }
+
+    bool seek(uint32_t pos) override
+    {
+        if (pos > _size)
+            return false;
+        _position = pos;
+        return true;
+    }
+
+private:
+    std::vector<uint8_t> &image;
+};
+
+static const DiskGeometry &g = Geometry::D64;
+
+static std::vector<uint8_t> blank()
+{
+    struct Output : public ImageFormat::Output {
+        std::vector<uint8_t> image;
+        uint32_t position = 0;
+
+        bool write(const uint8_t *data, uint32_t size) override
+        {
+            if (image.size() < position + size)
+                image.resize(position + size);
+            memcpy(image.data() + position, data, size);
+            position += size;
+            return true;
+        }
+
+        bool seek(uint32_t offset) override
+        {
+            if (image.size() < offset)
+                image.resize(offset);
+            position = offset;
+            return true;
+        }
+    } out;
+
+    auto &t = *ImageFormat::find("d64");
+    ImageFormat::write(out, t, ImageFormat::build(t, "TEST DISK", "ML"), false);
+    out.image.resize(174848);
+    return out.image;
+}
+
+static uint8_t *sector(std::vector<uint8_t> &image, uint8_t track, uint8_t sector)
+{
+    return image.data() + g.lba(track, sector) * 256;
+}
+
+// Directory entry in the first directory sector
+static uint8_t *slot(std::vector<uint8_t> &image, uint8_t index)
+{
+    return sector(image, 18, 1) + index * 32;
+}
+
+static std::vector<uint8_t> pattern(uint32_t size, uint8_t seed)
+{
+    std::vector<uint8_t> data(size);
+    for (uint32_t i = 0; i < size; i++)
+        data[i] = (uint8_t)(i * seed + (i >> 8));
+    return data;
+}
+
+static std::vector<uint8_t> save(std::vector<uint8_t> &image, const char *name, uint32_t size, uint8_t seed)
+{
+    auto data = pattern(size, seed);
+    D64MStream d64(std::make_shared<MemoryMStream>(image));
+    d64.mode = std::ios_base::out;
+    TEST_ASSERT_TRUE(d64.seekPath(name));
+    TEST_ASSERT_EQUAL_UINT32(size, d64.write(data.data(), size));
+    d64.close();
+    return data;
+}
+
+static bool load(std::vector<uint8_t> &image, const char *name, std::vector<uint8_t> &data)
+{
+    D64MStream d64(std::make_shared<MemoryMStream>(image));
+    if (!d64.seekPath(name))
+        return false;
+
+    data.resize(d64.size());
+    return d64.read(data.data(), data.size()) == data.size();
+}
+
+// Blocks of the file in the directory slot, in chain order
+static std::vector<std::pair<uint8_t, uint8_t>> chain(std::vector<uint8_t> &image, uint8_t index)
+{
+    std::vector<std::pair<uint8_t, uint8_t>> blocks;
+    uint8_t t = slot(image, index)[3], s = slot(image, index)[4];
+    while (t && blocks.size() < g.blockCount())
+    {
+        blocks.push_back({ t, s });
+        uint8_t *data = sector(image, t, s);
+        t = data[0];
+        s = data[1];
+    }
+    return blocks;
+}
+
+static bool isFree(std::vector<uint8_t> &image, uint8_t t, uint8_t s)
+{
+    return sector(image, 18, 0)[4 + (t - 1) * 4 + 1 + s / 8] & (1 << (s % 8));
+}
+
+// What the drive does on S:, the name stays in the entry
+static void scratch(std::vector<uint8_t> &image, uint8_t index)
+{
+    for (auto &block : chain(image, index))
+    {
+        uint8_t *entry = sector(image, 18, 0) + 4 + (block.first - 1) * 4;
+        entry[0]++;
+        entry[1 + block.second / 8] |= (1 << (block.second % 8));
+    }
+    slot(image, index)[2] = 0x00;
+}
+
+static uint32_t blocksFree(std::vector<uint8_t> &image)
+{
+    uint32_t free = 0;
+    for (uint8_t t = 1; t <= 35; t++)
+        free += (t != 18) ? sector(image, 18, 0)[4 + (t - 1) * 4] : 0;
+    return free;
+}
+
+void test_d64_write_scratched_name(void)
+{
+    auto image = blank();
+    const uint32_t total = blocksFree(image);
+
+    save(image, "C", 200, 1);
+    save(image, "A", 1000, 3);
+    auto a_old = chain(image, 1);
+    TEST_ASSERT_EQUAL_UINT32(4, a_old.size());
+
+    scratch(image, 0);
+    scratch(image, 1);
+    TEST_ASSERT_EQUAL_UINT32(total, blocksFree(image));
+
+    // A scratched file isn't there any more
+    std::vector<uint8_t> back;
+    TEST_ASSERT_FALSE(load(image, "A", back));
+
+    // B takes C's entry, A's dead one stays, and B's blocks include A's old ones
+    auto b_data = save(image, "B", 25 * 254, 5);
+    auto b_chain = chain(image, 0);
+    TEST_ASSERT_EQUAL_UINT8(0x82, slot(image, 0)[2]);
+    TEST_ASSERT_EQUAL_UINT8(0x00, slot(image, 1)[2]);
+    for (auto &block : a_old)
+        TEST_ASSERT_TRUE(std::find(b_chain.begin(), b_chain.end(), block) != b_chain.end());
+
+    // @:A, the drive takes the @: off. Replacing A must not free B's
+    // blocks through the dead entry.
+    auto a_data = save(image, "A", 600, 7);
+    TEST_ASSERT_EQUAL_UINT8(0x82, slot(image, 1)[2]);
+    auto a_chain = chain(image, 1);
+    TEST_ASSERT_EQUAL_UINT32(3, a_chain.size());
+
+    for (auto &block : b_chain)
+    {
+        TEST_ASSERT_FALSE(isFree(image, block.first, block.second));
+        for (auto &other : a_chain)
+            TEST_ASSERT_TRUE(block != other);
+    }
+    for (auto &block : a_chain)
+        TEST_ASSERT_FALSE(isFree(image, block.first, block.second));
+
+    TEST_ASSERT_EQUAL_UINT32(total - b_chain.size() - a_chain.size(), blocksFree(image));
+
+    TEST_ASSERT_TRUE(load(image, "B", back));
+    TEST_ASSERT_TRUE(back == b_data);
+    TEST_ASSERT_TRUE(load(image, "A", back));
+    TEST_ASSERT_TRUE(back == a_data);
+}
+
+// 40 track image, the BAM for tracks 36-40 would be the disk name
+void test_d64_write_extended_read_only(void)
+{
+    auto image = blank();
+    save(image, "A", 600, 3);
+    image.resize(196608);
+    const auto before = image;
+
+    {
+        D64MStream d64(std::make_shared<MemoryMStream>(image));
+        d64.mode = std::ios_base::out;
+        TEST_ASSERT_FALSE(d64.seekPath("B"));
+        TEST_ASSERT_FALSE(d64.seekPath("A"));
+        d64.close();
+    }
+    TEST_ASSERT_TRUE(image == before);
+
+    // Reading still works
+    std::vector<uint8_t> back;
+    TEST_ASSERT_TRUE(load(image, "A", back));
+    TEST_ASSERT_TRUE(back == pattern(600, 3));
+}
+
+// Second block links back to the first
+void test_d64_write_cyclic_chain(void)
+{
+    auto image = blank();
+    save(image, "A", 1000, 3);
+    auto blocks = chain(image, 0);
+    TEST_ASSERT_EQUAL_UINT32(4, blocks.size());
+
+    uint8_t *second = sector(image, blocks[1].first, blocks[1].second);
+    second[0] = blocks[0].first;
+    second[1] = blocks[0].second;
+
+    D64MStream d64(std::make_shared<MemoryMStream>(image));
+    TEST_ASSERT_TRUE(d64.seekPath("A"));
+    TEST_ASSERT_EQUAL_UINT32(2 * 254, d64.size());
+
+    std::vector<uint8_t> back(d64.size());
+    TEST_ASSERT_EQUAL_UINT32(back.size(), d64.read(back.data(), back.size()));
+    auto data = pattern(1000, 3);
+    TEST_ASSERT_TRUE(std::equal(back.begin(), back.end(), data.begin()));
+}
+
+void process()
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_d64_write_scratched_name);
+    RUN_TEST(test_d64_write_extended_read_only);
+    RUN_TEST(test_d64_write_cyclic_chain);
+
+    UNITY_END();
+}
+
+int main()
+{
+    process();
+}
@@ -0,0 +1,274 @@
+#include "unity.h"
+
+#include <bitset>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "../lib/meatloaf/disk/format.cpp"
+
+// Image in memory, seeking past the end zero fills like LittleFS
+struct MemoryOutput : public ImageFormat::Output {
+    std::vector<uint8_t> image;
+    uint32_t position = 0;
+    uint32_t writes = 0;
+
+    bool write(const uint8_t *data, uint32_t size) override
+    {
+        if (image.size() < position + size)
+            image.resize(position + size);
+        memcpy(image.data() + position, data, size);
+        position += size;
+        writes++;
+        return true;
+    }
+
+    bool seek(uint32_t offset) override
+    {
+        if (image.size() < offset)
+            image.resize(offset);
+        position = offset;
+        return true;
+    }
+
+    const uint8_t *sector(const ImageTemplate &t, uint8_t track, uint8_t sector) const
+    {
+        return image.data() + t.geometry->lba(track, sector) * 256;
+    }
+};
+
+struct FileOutput : public ImageFormat::Output {
+    FILE *file;
+
+    FileOutput(FILE *file) : file(file) {};
+
+    bool write(const uint8_t *data, uint32_t size) override
+    {
+        return fwrite(data, 1, size, file) == size;
+    }
+
+    bool seek(uint32_t offset) override
+    {
+        return fseek(file, offset, SEEK_SET) == 0;
+    }
+};
+
+static const ImageTemplate &tmpl(const char *extension)
+{
+    return *ImageFormat::find(extension);
+}
+
+static MemoryOutput create(const ImageTemplate &t, bool sparse = false)
+{
+    MemoryOutput out;
+    ImageFormat::write(out, t, ImageFormat::build(t, "TEST DISK", "ML"), sparse);
+    return out;
+}
+
+// Free count byte and bitmap bytes of a CBM BAM entry have to agree
+static uint32_t entryFree(const uint8_t *entry, uint8_t bytes)
+{
+    uint32_t bits = 0;
+    for (uint8_t i = 0; i < bytes; i++)
+        bits += std::bitset<8>(entry[1 + i]).count();
+    TEST_ASSERT_EQUAL_UINT32(entry[0], bits);
+    return entry[0];
+}
+
+// Blocks free the way the drive reports them, the directory track doesn't count
+static uint32_t blocksFree(const ImageTemplate &t, const MemoryOutput &out)
+{
+    uint32_t free = 0;
+    switch (t.layout)
+    {
+        case ImageLayout::CBM1541:
+        case ImageLayout::CBM1571:
+        {
+            const uint8_t *header = out.sector(t, 18, 0);
+            for (uint8_t track = 1; track <= 35; track++)
+                free += (track != 18) ? entryFree(header + 4 + (track - 1) * 4, 3) : 0;
+
+            if (t.layout == ImageLayout::CBM1571)
+            {
+                const uint8_t *bam = out.sector(t, 53, 0);
+                for (uint8_t track = 36; track <= 70; track++)
+                {
+                    uint8_t entry[4] = { header[0xDD + track - 36], bam[(track - 36) * 3], bam[(track - 36) * 3 + 1], bam[(track - 36) * 3 + 2] };
+                    free += entryFree(entry, 3);
+                }
+            }
+        }
+        break;
+
+        case ImageLayout::CBM1581:
+        {
+            for (uint8_t s = 1; s <= 2; s++)
+            {
+                const uint8_t *bam = out.sector(t, 40, s);
+                for (uint8_t i = 0; i < 40; i++)
+                    free += (s != 1 || i != 39) ? entryFree(bam + 0x10 + i * 6, 5) : 0;
+            }
+        }
+        break;
+
+        case ImageLayout::CBM8050:
+        {
+            // Follow the BAM chain from the header to the directory
+            const uint8_t *header = out.sector(t, 39, 0);
+            uint8_t track = header[0], sector = header[1];
+            while (track == 38)
+            {
+                const uint8_t *bam = out.sector(t, track, sector);
+                for (uint8_t tr = bam[4]; tr < bam[5]; tr++)
+                    free += (tr != 39) ? entryFree(bam + 6 + (tr - bam[4]) * 5, 4) : 0;
+                track = bam[0];
+                sector = bam[1];
+            }
+            TEST_ASSERT_EQUAL_UINT8(39, track);
+            TEST_ASSERT_EQUAL_UINT8(1, sector);
+        }
+        break;
+
+        case ImageLayout::CMD_NATIVE:
+        {
+            const uint8_t *bam = out.sector(t, 1, 2);
+            for (uint32_t i = 32; i < (uint32_t)(t.tracks + 1) * 32; i++)
+                free += std::bitset<8>(bam[i]).count();
+        }
+        break;
+    }
+    return free;
+}
+
+void test_format_find(void)
+{
+    TEST_ASSERT_NOT_NULL(ImageFormat::find("D64"));
+    TEST_ASSERT_NOT_NULL(ImageFormat::find("dnp"));
+    TEST_ASSERT_NULL(ImageFormat::find("g64"));
+    TEST_ASSERT_NULL(ImageFormat::find(""));
+}
+
+void test_format_blocks_free(void)
+{
+    struct { const char *extension; uint32_t free; } expected[] = {
+        { "d64", 664 }, { "d71", 1328 }, { "d81", 3160 }, { "d80", 2052 }, { "d82", 4133 },
+        { "dnp", FORMAT_DNP_TRACKS * 256 - 35 },
+    };
+
+    for (auto &e : expected)
+    {
+        auto &t = tmpl(e.extension);
+        auto out = create(t);
+        TEST_ASSERT_EQUAL_UINT32(t.size(), out.image.size());
+        TEST_ASSERT_EQUAL_UINT32(e.free, blocksFree(t, out));
+    }
+}
+
+void test_format_header(void)
+{
+    auto &t = tmpl("d64");
+    auto out = create(t);
+
+    const uint8_t *header = out.sector(t, 18, 0);
+    TEST_ASSERT_EQUAL_UINT8(18, header[0]);
+    TEST_ASSERT_EQUAL_UINT8(1, header[1]);
+    TEST_ASSERT_EQUAL_UINT8('A', header[2]);
+    TEST_ASSERT_EQUAL_MEMORY("TEST DISK\xA0\xA0\xA0\xA0\xA0\xA0\xA0", header + 0x90, 16);
+    TEST_ASSERT_EQUAL_MEMORY("ML\xA0" "2A", header + 0xA2, 5);
+
+    // Empty directory, end of chain
+    const uint8_t *dir = out.sector(t, 18, 1);
+    TEST_ASSERT_EQUAL_UINT8(0x00, dir[0]);
+    TEST_ASSERT_EQUAL_UINT8(0xFF, dir[1]);
+
+    auto &d81 = tmpl("d81");
+    out = create(d81);
+    header = out.sector(d81, 40, 0);
+    TEST_ASSERT_EQUAL_MEMORY("ML\xA0" "3D", header + 0x16, 5);
+    TEST_ASSERT_EQUAL_UINT8(0xBB, out.sector(d81, 40, 1)[3]);
+    TEST_ASSERT_EQUAL_UINT8(0xFF, out.sector(d81, 40, 2)[1]);
+}
+
+void test_format_sparse_matches(void)
+{
+    for (auto &t : Templates::list)
+    {
+        auto written = create(t, false);
+        auto sparse = create(t, true);
+        TEST_ASSERT_TRUE(written.image == sparse.image);
+
+        // Only the sectors in use are written, plus the last byte
+        TEST_ASSERT_EQUAL_UINT32(ImageFormat::build(t, "", "").size() + 1, sparse.writes);
+    }
+}
+
+template <typename F>
+static double msFor(F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+void test_format_benchmark(void)
+{
+    printf("\n%-4s %10s %14s %14s %14s\n", "fmt", "bytes", "per sector ms", "chunked ms", "sparse ms");
+    for (auto &t : Templates::list)
+    {
+        if (t.geometry == Templates::list[0].geometry && &t != &Templates::list[0])
+            continue;
+
+        auto sectors = ImageFormat::build(t, "BENCH", "00");
+
+        // Every sector written on its own, the way the old path formats
+        double per_sector = msFor([&] {
+            FILE *file = tmpfile();
+            std::vector<uint8_t> block(256, 0);
+            size_t next = 0;
+            for (uint32_t lba = 0; lba < t.blocks(); lba++)
+            {
+                const uint8_t *data = block.data();
+                if (next < sectors.size() && sectors[next].lba == lba)
+                    data = sectors[next++].data.data();
+                fwrite(data, 1, 256, file);
+                fflush(file);
+            }
+            fclose(file);
+        });
+
+        double chunked = msFor([&] {
+            FILE *file = tmpfile();
+            FileOutput out(file);
+            TEST_ASSERT_TRUE(ImageFormat::write(out, t, sectors, false));
+            fclose(file);
+        });
+
+        double sparse = msFor([&] {
+            FILE *file = tmpfile();
+            FileOutput out(file);
+            TEST_ASSERT_TRUE(ImageFormat::write(out, t, sectors, true));
+            fclose(file);
+        });
+
+        printf("%-4s %10u %14.2f %14.2f %14.2f\n", t.extension, t.size(), per_sector, chunked, sparse);
+    }
+}
+
+void process()
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_format_find);
+    RUN_TEST(test_format_blocks_free);
+    RUN_TEST(test_format_header);
+    RUN_TEST(test_format_sparse_matches);
+    RUN_TEST(test_format_benchmark);
+
+    UNITY_END();
+}
+
+int main()
+{
+    process();
+}
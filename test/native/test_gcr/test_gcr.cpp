@@ -0,0 +1,374 @@
+#include "unity.h"
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "../lib/meatloaf/disk/gcr/codec.cpp"
+#include "../lib/meatloaf/disk/gcr/track_cache.cpp"
+
+// A 1541 track the way the DOS formats it: sync, header, gap, sync, data, gap
+struct TrackWriter {
+    std::vector<uint8_t> gcr;
+
+    void bytes(uint8_t value, uint32_t count)
+    {
+        gcr.insert(gcr.end(), count, value);
+    }
+
+    void block(const uint8_t *plain, uint32_t size)
+    {
+        size_t at = gcr.size();
+        gcr.resize(at + size / 4 * 5);
+        GCRCodec::encode(plain, gcr.data() + at, size);
+    }
+
+    void sector(uint8_t track, uint8_t sector, const uint8_t *id, const uint8_t *data, uint8_t damage = 0)
+    {
+        uint8_t header[8] = { 0x08, 0, sector, track, id[1], id[0], 0x0f, 0x0f };
+        header[1] = header[2] ^ header[3] ^ header[4] ^ header[5];
+        if (damage == BAD_HEADER_CHECKSUM)
+            header[1] ^= 0xff;
+
+        uint8_t block[260] = { 0x07 };
+        memcpy(block + 1, data, 256);
+        for (uint16_t i = 1; i <= 256; i++)
+            block[257] ^= block[i];
+        if (damage == BAD_DATA_CHECKSUM)
+            block[257] ^= 0xff;
+
+        bytes(0xff, 5);
+        this->block(header, sizeof(header));
+        bytes(0x55, 9);
+        bytes(0xff, 5);
+        this->block(block, sizeof(block));
+        if (damage == BAD_GCR_CODE)
+            gcr[gcr.size() - 100] = 0x00;
+        bytes(0x55, 8);
+    }
+
+    // Buffer the codec can decode in place
+    std::vector<uint8_t> buffer() const
+    {
+        std::vector<uint8_t> b(gcr);
+        b.resize(gcr.size() + GCR_TRACK_SLACK);
+        return b;
+    }
+};
+
+static const uint8_t disk_id[2] = { 'M', 'L' };
+
+static void fill(uint8_t *data, uint8_t track, uint8_t sector)
+{
+    for (uint16_t i = 0; i < 256; i++)
+        data[i] = (uint8_t)(i * 7 + track * 13 + sector);
+}
+
+static TrackWriter track(uint8_t t, uint8_t sectors, uint8_t damaged = 0xff, uint8_t damage = 0)
+{
+    TrackWriter w;
+    uint8_t data[256];
+    for (uint8_t s = 0; s < sectors; s++)
+    {
+        fill(data, t, s);
+        w.sector(t, s, disk_id, data, (s == damaged) ? damage : 0);
+    }
+    w.bytes(0x55, 40);
+    return w;
+}
+
+// Shift the whole track right by bits, the tail falls off
+static std::vector<uint8_t> shifted(const std::vector<uint8_t> &gcr, uint8_t bits)
+{
+    std::vector<uint8_t> out(gcr.size() + GCR_TRACK_SLACK);
+    uint8_t carry = 0x55 << (8 - bits);
+    for (size_t i = 0; i < gcr.size(); i++)
+    {
+        out[i] = carry | (gcr[i] >> bits);
+        carry = gcr[i] << (8 - bits);
+    }
+    return out;
+}
+
+void test_gcr_tables(void)
+{
+    for (uint16_t i = 0; i < 256; i += 4)
+    {
+        uint8_t plain[4] = { (uint8_t)i, (uint8_t)(i + 1), (uint8_t)(i + 2), (uint8_t)(i + 3) };
+        uint8_t gcr[5], back[4];
+        GCRCodec::encode(plain, gcr, 4);
+        TEST_ASSERT_EQUAL_UINT8(4, GCRCodec::decodeGroup(gcr, back));
+        TEST_ASSERT_EQUAL_MEMORY(plain, back, 4);
+    }
+
+    // 00000 is not a GCR code, it breaks the second byte
+    uint8_t plain[4] = { 0x12, 0x34, 0x56, 0x78 };
+    uint8_t gcr[5], back[4];
+    GCRCodec::encode(plain, gcr, 4);
+    gcr[1] &= 0xc1;
+    TEST_ASSERT_EQUAL_UINT8(1, GCRCodec::decodeGroup(gcr, back));
+    TEST_ASSERT_EQUAL_UINT8(0x12, back[0]);
+}
+
+void test_gcr_find_sync(void)
+{
+    // Ten ones make a sync, nine don't
+    uint8_t gcr[24] = { 0x55, 0x7f, 0xc0, 0x55, 0x07, 0xfe, 0x52 };
+    TEST_ASSERT_EQUAL_UINT32(4 * 8 + 5 + 10, GCRCodec::findSync(gcr, 0, 7 * 8));
+
+    // Long syncs end at the first zero, wherever it is
+    uint8_t longsync[32] = { 0x55 };
+    memset(longsync + 1, 0xff, 12);
+    longsync[13] = 0x1f;
+    TEST_ASSERT_EQUAL_UINT32(13 * 8, GCRCodec::findSync(longsync, 0, 16 * 8));
+    TEST_ASSERT_EQUAL_UINT32(16 * 8, GCRCodec::findSync(longsync, 14 * 8, 16 * 8));
+}
+
+void test_gcr_decode_track(void)
+{
+    auto w = track(18, 19);
+    auto gcr = w.buffer();
+    GCRSector sectors[21];
+    TEST_ASSERT_EQUAL_UINT8(19, GCRCodec::decodeTrack(gcr.data(), w.gcr.size(), 18, sectors, 21));
+
+    uint8_t data[256];
+    for (uint8_t s = 0; s < 19; s++)
+    {
+        fill(data, 18, s);
+        TEST_ASSERT_EQUAL_UINT8(SECTOR_OK, sectors[s].status);
+        TEST_ASSERT_EQUAL_MEMORY(disk_id, sectors[s].id, 2);
+        TEST_ASSERT_EQUAL_MEMORY(data, sectors[s].data, 256);
+    }
+    TEST_ASSERT_EQUAL_UINT8(HEADER_NOT_FOUND, sectors[19].status);
+
+    // Headers of another track don't count
+    TEST_ASSERT_EQUAL_UINT8(0, GCRCodec::decodeTrack(gcr.data(), w.gcr.size(), 17, sectors, 21));
+}
+
+void test_gcr_unaligned(void)
+{
+    auto w = track(1, 21);
+    uint8_t data[256];
+    for (uint8_t bits = 1; bits < 8; bits++)
+    {
+        auto gcr = shifted(w.gcr, bits);
+        GCRSector sectors[21];
+        TEST_ASSERT_EQUAL_UINT8(21, GCRCodec::decodeTrack(gcr.data(), w.gcr.size(), 1, sectors, 21));
+
+        fill(data, 1, 20);
+        TEST_ASSERT_EQUAL_MEMORY(data, sectors[20].data, 256);
+    }
+}
+
+void test_gcr_index_wrap(void)
+{
+    // Start the track in the middle of sector 3's data block
+    auto w = track(25, 18);
+    size_t cut = 3 * (5 + 10 + 9 + 5 + 325 + 8) + 5 + 10 + 9 + 5 + 100;
+    std::vector<uint8_t> rotated(w.gcr.begin() + cut, w.gcr.end());
+    rotated.insert(rotated.end(), w.gcr.begin(), w.gcr.begin() + cut);
+    rotated.resize(w.gcr.size() + GCR_TRACK_SLACK);
+
+    GCRSector sector;
+    TEST_ASSERT_EQUAL_UINT8(SECTOR_OK, GCRCodec::decodeSector(rotated.data(), w.gcr.size(), 25, 3, sector));
+
+    uint8_t data[256];
+    fill(data, 25, 3);
+    TEST_ASSERT_EQUAL_MEMORY(data, sector.data, 256);
+}
+
+void test_gcr_errors(void)
+{
+    struct { uint8_t damage; } cases[] = { { BAD_HEADER_CHECKSUM }, { BAD_DATA_CHECKSUM }, { BAD_GCR_CODE } };
+    for (auto &c : cases)
+    {
+        auto w = track(5, 21, 7, c.damage);
+        auto gcr = w.buffer();
+        GCRSector sectors[21];
+        TEST_ASSERT_EQUAL_UINT8(20, GCRCodec::decodeTrack(gcr.data(), w.gcr.size(), 5, sectors, 21));
+        TEST_ASSERT_EQUAL_UINT8(c.damage, sectors[7].status);
+        TEST_ASSERT_EQUAL_UINT8(SECTOR_OK, sectors[8].status);
+    }
+
+    // A header without its data block
+    TrackWriter w;
+    uint8_t header[8] = { 0x08, 0x02 ^ 0x01 ^ 'L' ^ 'M', 0x02, 0x01, 'L', 'M', 0x0f, 0x0f };
+    w.bytes(0xff, 5);
+    w.block(header, sizeof(header));
+    w.bytes(0x55, 400);
+    auto gcr = w.buffer();
+    GCRSector sector;
+    TEST_ASSERT_EQUAL_UINT8(DATA_NOT_FOUND, GCRCodec::decodeSector(gcr.data(), w.gcr.size(), 1, 2, sector));
+}
+
+void test_gcr_track_cache(void)
+{
+    GCRTrackCache cache;
+    TEST_ASSERT_NULL(cache.find(1));
+
+    // Each track decodes once and stays until it is the oldest
+    for (uint8_t t = 1; t <= GCR_TRACK_CACHE_SIZE + 1; t++)
+    {
+        auto w = track(t, 21);
+        auto gcr = w.buffer();
+        auto &sectors = cache.insert(t, gcr.data(), w.gcr.size(), 21);
+        TEST_ASSERT_EQUAL_UINT32(21, sectors.size());
+        TEST_ASSERT_EQUAL_UINT8(SECTOR_OK, sectors[20].status);
+        TEST_ASSERT_TRUE(cache.find(t) == &sectors);
+    }
+    TEST_ASSERT_NULL(cache.find(1));
+    TEST_ASSERT_NOT_NULL(cache.find(2));
+
+    uint8_t data[256];
+    fill(data, GCR_TRACK_CACHE_SIZE + 1, 9);
+    TEST_ASSERT_EQUAL_MEMORY(data, (*cache.find(GCR_TRACK_CACHE_SIZE + 1))[9].data, 256);
+
+    // Recently used tracks survive
+    cache.find(2);
+    auto w = track(30, 17);
+    auto gcr = w.buffer();
+    cache.insert(30, gcr.data(), w.gcr.size(), 17);
+    TEST_ASSERT_NOT_NULL(cache.find(2));
+    TEST_ASSERT_NOT_NULL(cache.find(30));
+
+    cache.clear();
+    TEST_ASSERT_NULL(cache.find(2));
+}
+
+// The decoder this replaces: byte wide sync search and nibble lookups
+// five bytes at a time
+namespace reference
+{
+    bool findSync(const uint8_t *gcr, uint32_t &pos, uint32_t end)
+    {
+        while (pos + 1 < end && !((gcr[pos] & 0x03) == 0x03 && gcr[pos + 1] == 0xff))
+            pos++;
+        if (pos + 1 >= end)
+            return false;
+        pos++;
+        while (pos < end && gcr[pos] == 0xff)
+            pos++;
+        return pos < end;
+    }
+
+    void convert(const uint8_t *gcr, uint8_t *plain)
+    {
+        plain[0] = decode_high[gcr[0] >> 3] | decode_low[((gcr[0] << 2) | (gcr[1] >> 6)) & 0x1f];
+        plain[1] = decode_high[(gcr[1] >> 1) & 0x1f] | decode_low[((gcr[1] << 4) | (gcr[2] >> 4)) & 0x1f];
+        plain[2] = decode_high[((gcr[2] << 1) | (gcr[3] >> 7)) & 0x1f] | decode_low[(gcr[3] >> 2) & 0x1f];
+        plain[3] = decode_high[((gcr[3] << 3) | (gcr[4] >> 5)) & 0x1f] | decode_low[gcr[4] & 0x1f];
+    }
+
+    bool readSector(const uint8_t *gcr, uint32_t end, uint8_t sector, uint8_t *out)
+    {
+        uint32_t pos = 0;
+        uint8_t header[8], block[260];
+        do
+        {
+            if (!findSync(gcr, pos, end) || pos + 10 > end)
+                return false;
+            convert(gcr + pos, header);
+            convert(gcr + pos + 5, header + 4);
+            pos += 10;
+            if (!findSync(gcr, pos, end) || pos + 325 > end)
+                return false;
+        } while (header[0] != 0x08 || header[2] != sector);
+
+        for (uint8_t i = 0; i < 65; i++)
+            convert(gcr + pos + i * 5, block + i * 4);
+        memcpy(out, block + 1, 256);
+        return true;
+    }
+}
+
+template <typename F>
+static double msFor(F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+void test_gcr_benchmark(void)
+{
+    const int rounds = 200;
+    auto w = track(1, 21);
+    auto gcr = w.buffer();
+    uint32_t size = w.gcr.size();
+    double mb = (double)rounds * 21 * 256 / (1024 * 1024);
+    volatile uint8_t sink = 0;
+
+    // Every sector looked up on its own from the start of the track
+    double per_sector = msFor([&] {
+        uint8_t data[256];
+        for (int r = 0; r < rounds; r++)
+            for (uint8_t s = 0; s < 21; s++)
+            {
+                TEST_ASSERT_TRUE(reference::readSector(gcr.data(), size, s, data));
+                sink = sink + data[s];
+            }
+    });
+
+    double single = msFor([&] {
+        GCRSector sector;
+        for (int r = 0; r < rounds; r++)
+            for (uint8_t s = 0; s < 21; s++)
+            {
+                GCRCodec::decodeSector(gcr.data(), size, 1, s, sector);
+                sink = sink + sector.data[s];
+            }
+    });
+
+    double whole = msFor([&] {
+        GCRSector sectors[21];
+        for (int r = 0; r < rounds; r++)
+        {
+            TEST_ASSERT_EQUAL_UINT8(21, GCRCodec::decodeTrack(gcr.data(), size, 1, sectors, 21));
+            sink = sink + sectors[r % 21].data[0];
+        }
+    });
+
+    // What G64MStream does: decode on the first sector, look up the rest
+    double cached = msFor([&] {
+        for (int r = 0; r < rounds; r++)
+        {
+            GCRTrackCache cache;
+            for (uint8_t s = 0; s < 21; s++)
+            {
+                auto sectors = cache.find(1);
+                if (!sectors)
+                    sectors = &cache.insert(1, gcr.data(), size, 21);
+                sink = sink + (*sectors)[s].data[s];
+            }
+        }
+    });
+
+    // Sector data delivered per second
+    printf("\n%-28s %10s\n", "decoder", "MB/s");
+    printf("%-28s %10.2f\n", "nibble tables, per sector", mb / (per_sector / 1000));
+    printf("%-28s %10.2f\n", "10 bit tables, per sector", mb / (single / 1000));
+    printf("%-28s %10.2f\n", "10 bit tables, whole track", mb / (whole / 1000));
+    printf("%-28s %10.2f\n", "track cache, per sector", mb / (cached / 1000));
+}
+
+void process()
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_gcr_tables);
+    RUN_TEST(test_gcr_find_sync);
+    RUN_TEST(test_gcr_decode_track);
+    RUN_TEST(test_gcr_unaligned);
+    RUN_TEST(test_gcr_index_wrap);
+    RUN_TEST(test_gcr_errors);
+    RUN_TEST(test_gcr_track_cache);
+    RUN_TEST(test_gcr_benchmark);
+
+    UNITY_END();
+}
+
+int main()
+{
+    process();
+}
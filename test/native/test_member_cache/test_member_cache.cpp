@@ -0,0 +1,210 @@
+#include "unity.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Small enough for the eviction test
+#define MEMBER_CACHE_MAX_SIZE (512 * 1024)
+
+#include "../components/lz4/lib/lz4.c"
+#include "../lib/meatloaf/archive/member_cache.cpp"
+
+static std::string root;
+
+// A D64 is mostly empty sectors and repeated directory structures
+static std::vector<uint8_t> disk(uint32_t size, uint8_t seed)
+{
+    std::vector<uint8_t> data(size, 0);
+    for (uint32_t i = 0; i < size / 3; i++)
+        data[i] = (uint8_t)((i / 7) * 13 + seed);
+    return data;
+}
+
+static std::vector<uint8_t> noise(uint32_t size, uint32_t seed)
+{
+    std::vector<uint8_t> data(size);
+    for (auto &b : data)
+    {
+        seed = seed * 1103515245 + 12345;
+        b = seed >> 16;
+    }
+    return data;
+}
+
+static bool store(uint64_t key, const std::vector<uint8_t> &data, uint32_t chunk)
+{
+    MemberCache::Writer writer;
+    if (!MemberCache::create(key, data.size(), writer))
+        return false;
+
+    for (uint32_t i = 0; i < data.size(); i += chunk)
+        writer.write(data.data() + i, std::min(chunk, (uint32_t)data.size() - i));
+    return MemberCache::commit(key, writer);
+}
+
+static void fresh()
+{
+    char dir[] = "/tmp/member_cacheXXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    root = dir;
+    MemberCache::setRoot(root);
+}
+
+void test_member_cache_roundtrip(void)
+{
+    fresh();
+
+    uint64_t key = MemberCache::key("http://c64.org/games.zip", "\"abc\":5000000", "game.d64");
+    TEST_ASSERT_TRUE(key != MemberCache::key("http://c64.org/games.zip", "\"abd\":5000000", "game.d64"));
+    TEST_ASSERT_TRUE(key != MemberCache::key("http://c64.org/games.zip", "\"abc\":5000000", "game2.d64"));
+
+    MemberCache::Reader reader;
+    TEST_ASSERT_FALSE(MemberCache::open(key, reader));
+
+    // Odd chunks so blocks fill across writes
+    auto data = disk(174848, 3);
+    TEST_ASSERT_TRUE(store(key, data, 1000));
+
+    auto stats = MemberCache::stats();
+    TEST_ASSERT_EQUAL_UINT32(1, stats.members);
+    TEST_ASSERT_LESS_THAN_UINT32(data.size() / 2, stats.bytes);
+
+    TEST_ASSERT_TRUE(MemberCache::open(key, reader));
+    TEST_ASSERT_EQUAL_UINT32(data.size(), reader.size());
+
+    std::vector<uint8_t> back(data.size());
+    TEST_ASSERT_EQUAL_UINT32(data.size(), reader.read(0, back.data(), back.size()));
+    TEST_ASSERT_TRUE(back == data);
+
+    // Sectors in any order, across block boundaries
+    uint8_t sector[256];
+    for (uint32_t lba : { 357u, 0u, 682u, 15u, 200u })
+    {
+        TEST_ASSERT_EQUAL_UINT32(256, reader.read(lba * 256, sector, 256));
+        TEST_ASSERT_EQUAL_MEMORY(data.data() + lba * 256, sector, 256);
+    }
+    TEST_ASSERT_EQUAL_UINT32(100, reader.read(data.size() - 100, back.data(), 256));
+
+    const uint8_t *view;
+    uint32_t n = reader.view(MEMBER_CACHE_BLOCK_SIZE - 10, &view);
+    TEST_ASSERT_EQUAL_UINT32(10, n);
+    TEST_ASSERT_EQUAL_MEMORY(data.data() + MEMBER_CACHE_BLOCK_SIZE - 10, view, n);
+}
+
+void test_member_cache_incompressible(void)
+{
+    fresh();
+
+    // Blocks that don't shrink are stored as they are
+    uint64_t key = MemberCache::key("sd:/demo.zip", "mtime:1", "DEMO.PRG");
+    auto data = noise(3 * MEMBER_CACHE_BLOCK_SIZE + 77, 1);
+    TEST_ASSERT_TRUE(store(key, data, data.size()));
+
+    MemberCache::Reader reader;
+    TEST_ASSERT_TRUE(MemberCache::open(key, reader));
+    std::vector<uint8_t> back(data.size());
+    TEST_ASSERT_EQUAL_UINT32(data.size(), reader.read(0, back.data(), back.size()));
+    TEST_ASSERT_TRUE(back == data);
+
+    // An incomplete member never shows up
+    MemberCache::Writer writer;
+    uint64_t partial = MemberCache::key("sd:/demo.zip", "mtime:1", "OTHER.PRG");
+    TEST_ASSERT_TRUE(MemberCache::create(partial, 1000, writer));
+    TEST_ASSERT_TRUE(writer.write(data.data(), 500));
+    TEST_ASSERT_FALSE(MemberCache::commit(partial, writer));
+    TEST_ASSERT_FALSE(MemberCache::open(partial, reader));
+}
+
+void test_member_cache_lru(void)
+{
+    fresh();
+
+    // Noise takes its full size on the card, five fit
+    const uint32_t size = 100 * 1024;
+    for (uint32_t i = 0; i < 5; i++)
+        TEST_ASSERT_TRUE(store(MemberCache::key("u", "v", std::to_string(i)), noise(size, i), 4096));
+
+    MemberCache::Reader reader;
+    TEST_ASSERT_TRUE(MemberCache::open(MemberCache::key("u", "v", "0"), reader));
+    reader.close();
+
+    // The sixth pushes out the least recently used, that is 1 now
+    TEST_ASSERT_TRUE(store(MemberCache::key("u", "v", "5"), noise(size, 5), 4096));
+    auto stats = MemberCache::stats();
+    TEST_ASSERT_EQUAL_UINT32(5, stats.members);
+    TEST_ASSERT_EQUAL_UINT32(1, stats.evicted);
+    TEST_ASSERT_FALSE(MemberCache::open(MemberCache::key("u", "v", "1"), reader));
+    TEST_ASSERT_TRUE(MemberCache::open(MemberCache::key("u", "v", "0"), reader));
+
+    // Too big to ever fit
+    MemberCache::Writer writer;
+    TEST_ASSERT_FALSE(MemberCache::create(MemberCache::key("u", "v", "big"), MEMBER_CACHE_MAX_SIZE + 1, writer));
+
+    // The index survives a reboot
+    MemberCache::setRoot(root);
+    stats = MemberCache::stats();
+    TEST_ASSERT_EQUAL_UINT32(5, stats.members);
+    TEST_ASSERT_TRUE(MemberCache::open(MemberCache::key("u", "v", "5"), reader));
+
+    // A member removed from the card is dropped from the index
+    reader.close();
+    uint64_t gone = MemberCache::key("u", "v", "4");
+    char name[32];
+    snprintf(name, sizeof(name), "/%08x%08x.mc", (uint32_t)(gone >> 32), (uint32_t)gone);
+    ::remove((root + name).c_str());
+    TEST_ASSERT_FALSE(MemberCache::open(gone, reader));
+    TEST_ASSERT_EQUAL_UINT32(4, MemberCache::stats().members);
+
+    MemberCache::remove(MemberCache::key("u", "v", "5"));
+    TEST_ASSERT_FALSE(MemberCache::open(MemberCache::key("u", "v", "5"), reader));
+}
+
+void test_member_cache_benchmark(void)
+{
+    fresh();
+
+    using clock = std::chrono::steady_clock;
+    uint64_t key = MemberCache::key("http://c64.org/games.zip", "\"abc\":5000000", "game.d64");
+    auto data = disk(174848, 9);
+
+    auto t0 = clock::now();
+    TEST_ASSERT_TRUE(store(key, data, 256));
+    auto t1 = clock::now();
+
+    const int rounds = 50;
+    std::vector<uint8_t> back(data.size());
+    for (int i = 0; i < rounds; i++)
+    {
+        MemberCache::Reader reader;
+        TEST_ASSERT_TRUE(MemberCache::open(key, reader));
+        reader.read(0, back.data(), back.size());
+    }
+    auto t2 = clock::now();
+    TEST_ASSERT_TRUE(back == data);
+
+    double store_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    double open_ms = std::chrono::duration<double, std::milli>(t2 - t1).count() / rounds;
+    printf("\n%-24s %10s %10s\n", "cached game.d64", "bytes", "ms");
+    printf("%-24s %10u %10.3f\n", "store", MemberCache::stats().bytes, store_ms);
+    printf("%-24s %10u %10.3f\n", "open and read", (uint32_t)data.size(), open_ms);
+}
+
+void process()
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_member_cache_roundtrip);
+    RUN_TEST(test_member_cache_incompressible);
+    RUN_TEST(test_member_cache_lru);
+    RUN_TEST(test_member_cache_benchmark);
+
+    UNITY_END();
+}
+
+int main()
+{
+    process();
+}
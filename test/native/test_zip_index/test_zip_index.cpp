@@ -0,0 +1,212 @@
+#include "unity.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "../lib/meatloaf/archive/zip_index.cpp"
+
+// Archive in memory that counts what a range reader would transfer
+struct MemorySource : public ZipIndex::Source {
+    std::vector<uint8_t> data;
+    uint32_t reads = 0;
+    uint32_t transferred = 0;
+
+    uint32_t size() override { return data.size(); }
+
+    bool read(uint32_t offset, uint8_t *buf, uint32_t size) override
+    {
+        if (offset + size > data.size())
+            return false;
+        memcpy(buf, data.data() + offset, size);
+        reads++;
+        transferred += size;
+        return true;
+    }
+};
+
+// Stored members only, enough for the index
+struct ZipWriter {
+    std::vector<uint8_t> zip;
+    std::vector<uint8_t> directory;
+    uint16_t count = 0;
+
+    static void put16(std::vector<uint8_t> &v, uint16_t x) { v.push_back(x); v.push_back(x >> 8); }
+    static void put32(std::vector<uint8_t> &v, uint32_t x) { put16(v, x); put16(v, x >> 16); }
+
+    void add(const std::string &name, const std::vector<uint8_t> &data, const std::string &extra = "")
+    {
+        uint32_t offset = zip.size();
+        put32(zip, 0x04034b50);
+        put16(zip, 10);
+        put16(zip, 0);
+        put16(zip, ZIP_METHOD_STORED);
+        put32(zip, 0);
+        put32(zip, 0x12345678);
+        put32(zip, data.size());
+        put32(zip, data.size());
+        put16(zip, name.size());
+        put16(zip, extra.size());
+        zip.insert(zip.end(), name.begin(), name.end());
+        zip.insert(zip.end(), extra.begin(), extra.end());
+        zip.insert(zip.end(), data.begin(), data.end());
+
+        put32(directory, 0x02014b50);
+        put16(directory, 20);
+        put16(directory, 10);
+        put16(directory, 0);
+        put16(directory, ZIP_METHOD_STORED);
+        put32(directory, 0);
+        put32(directory, 0x12345678);
+        put32(directory, data.size());
+        put32(directory, data.size());
+        put16(directory, name.size());
+        put16(directory, 0);
+        put16(directory, 0);
+        put16(directory, 0);
+        put16(directory, 0);
+        put32(directory, 0);
+        put32(directory, offset);
+        directory.insert(directory.end(), name.begin(), name.end());
+        count++;
+    }
+
+    std::vector<uint8_t> finish(const std::string &comment = "")
+    {
+        uint32_t offset = zip.size();
+        zip.insert(zip.end(), directory.begin(), directory.end());
+        put32(zip, 0x06054b50);
+        put16(zip, 0);
+        put16(zip, 0);
+        put16(zip, count);
+        put16(zip, count);
+        put32(zip, directory.size());
+        put32(zip, offset);
+        put16(zip, comment.size());
+        zip.insert(zip.end(), comment.begin(), comment.end());
+        return zip;
+    }
+};
+
+static std::vector<uint8_t> content(uint32_t size, uint8_t seed)
+{
+    std::vector<uint8_t> data(size);
+    for (uint32_t i = 0; i < size; i++)
+        data[i] = (uint8_t)(i * 31 + seed);
+    return data;
+}
+
+// A collection of disk images, the way they are served
+static MemorySource collection(uint16_t members, const std::string &comment = "")
+{
+    ZipWriter w;
+    w.add("games/", {});
+    for (uint16_t i = 0; i < members; i++)
+        w.add("games/game" + std::to_string(i) + ".d64", content(174848, i));
+    MemorySource src;
+    src.data = w.finish(comment);
+    return src;
+}
+
+void test_zip_index_small(void)
+{
+    ZipWriter w;
+    w.add("README.TXT", content(100, 1));
+    w.add("demo/DEMO.PRG", content(2000, 2), "extra");
+    MemorySource src;
+    src.data = w.finish();
+
+    ZipIndex index;
+    TEST_ASSERT_TRUE(index.load(src));
+    TEST_ASSERT_EQUAL_UINT32(1, src.reads);
+    TEST_ASSERT_EQUAL_UINT32(2, index.entries().size());
+
+    auto e = index.find("DEMO.PRG");
+    TEST_ASSERT_NOT_NULL(e);
+    TEST_ASSERT_TRUE(e == index.find("demo/DEMO.PRG"));
+    TEST_ASSERT_EQUAL_UINT32(2000, e->size);
+    TEST_ASSERT_EQUAL_UINT16(ZIP_METHOD_STORED, e->method);
+    TEST_ASSERT_NULL(index.find("demo"));
+
+    // The local extra field moves the data
+    uint32_t offset;
+    TEST_ASSERT_TRUE(index.dataOffset(src, *e, offset));
+    TEST_ASSERT_EQUAL_MEMORY(content(2000, 2).data(), src.data.data() + offset, 2000);
+}
+
+void test_zip_index_collection(void)
+{
+    auto src = collection(20);
+
+    ZipIndex index;
+    TEST_ASSERT_TRUE(index.load(src));
+    TEST_ASSERT_EQUAL_UINT32(2, src.reads);
+    TEST_ASSERT_EQUAL_UINT32(21, index.entries().size());
+    TEST_ASSERT_TRUE(index.entries()[0].isDirectory());
+
+    // Opening one image costs its size plus the directory
+    auto e = index.find("game17.d64");
+    TEST_ASSERT_NOT_NULL(e);
+    uint32_t offset;
+    TEST_ASSERT_TRUE(index.dataOffset(src, *e, offset));
+    std::vector<uint8_t> data(e->compressed_size);
+    TEST_ASSERT_TRUE(src.read(offset, data.data(), data.size()));
+    TEST_ASSERT_TRUE(data == content(174848, 17));
+
+    uint32_t overhead = src.transferred - e->compressed_size;
+    TEST_ASSERT_LESS_THAN_UINT32(ZIP_TAIL_SIZE + 2048, overhead);
+
+    printf("\n%-24s %10s\n", "open game17.d64", "bytes");
+    printf("%-24s %10u\n", "header scan", e->header_offset + ZIP_LOCAL_HEADER_SIZE + (uint32_t)e->name.size() + e->compressed_size);
+    printf("%-24s %10u\n", "central directory", src.transferred);
+}
+
+void test_zip_index_comment(void)
+{
+    // A comment longer than the first tail read
+    auto src = collection(3, std::string(3000, 'x'));
+    ZipIndex index;
+    TEST_ASSERT_TRUE(index.load(src));
+    TEST_ASSERT_EQUAL_UINT32(4, index.entries().size());
+}
+
+void test_zip_index_rejects(void)
+{
+    ZipIndex index;
+
+    MemorySource not_zip;
+    not_zip.data = content(5000, 9);
+    TEST_ASSERT_FALSE(index.load(not_zip));
+    TEST_ASSERT_FALSE(index.loaded());
+
+    // ZIP64 sizes are left to libarchive
+    ZipWriter w;
+    w.add("BIG.D81", content(10, 0));
+    MemorySource zip64;
+    zip64.data = w.finish();
+    uint32_t directory = zip64.data.size() - ZIP_END_SIZE - w.directory.size();
+    memset(zip64.data.data() + directory + 24, 0xFF, 4);
+    TEST_ASSERT_FALSE(index.load(zip64));
+
+    // Truncated directory
+    MemorySource broken = collection(2);
+    broken.data.erase(broken.data.end() - ZIP_END_SIZE - 10, broken.data.end() - ZIP_END_SIZE);
+    TEST_ASSERT_FALSE(index.load(broken));
+}
+
+void process()
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_zip_index_small);
+    RUN_TEST(test_zip_index_collection);
+    RUN_TEST(test_zip_index_comment);
+    RUN_TEST(test_zip_index_rejects);
+
+    UNITY_END();
+}
+
+int main()
+{
+    process();
+}
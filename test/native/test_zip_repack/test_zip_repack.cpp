@@ -0,0 +1,397 @@
+#include "unity.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "../lib/meatloaf/archive/zip_index.cpp"
+#include "../lib/meatloaf/archive/zip_repack.cpp"
+
+struct MemorySource : public ZipIndex::Source {
+    std::vector<uint8_t> data;
+
+    uint32_t size() override { return data.size(); }
+
+    bool read(uint32_t offset, uint8_t *buf, uint32_t size) override
+    {
+        if (offset + size > data.size())
+            return false;
+        memcpy(buf, data.data() + offset, size);
+        return true;
+    }
+};
+
+struct MemorySink : public ZipRepacker::Sink {
+    std::vector<uint8_t> data;
+
+    uint32_t position() override { return data.size(); }
+
+    bool write(const uint8_t *buf, uint32_t size) override
+    {
+        data.insert(data.end(), buf, buf + size);
+        return true;
+    }
+
+    bool patch(uint32_t offset, const uint8_t *buf, uint32_t size) override
+    {
+        if (offset + size > data.size())
+            return false;
+        memcpy(data.data() + offset, buf, size);
+        return true;
+    }
+};
+
+static void put16(std::vector<uint8_t> &v, uint16_t x) { v.push_back(x); v.push_back(x >> 8); }
+static void put32(std::vector<uint8_t> &v, uint32_t x) { put16(v, x); put16(v, x >> 16); }
+
+static std::vector<uint8_t> deflated(const std::vector<uint8_t> &data)
+{
+    z_stream z = {};
+    deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    std::vector<uint8_t> out(deflateBound(&z, data.size()));
+    z.next_in = (Bytef *)data.data();
+    z.avail_in = data.size();
+    z.next_out = out.data();
+    z.avail_out = out.size();
+    deflate(&z, Z_FINISH);
+    out.resize(z.total_out);
+    deflateEnd(&z);
+    return out;
+}
+
+static std::vector<uint8_t> inflated(const uint8_t *data, uint32_t size, uint32_t expected)
+{
+    z_stream z = {};
+    inflateInit2(&z, -15);
+    std::vector<uint8_t> out(expected);
+    z.next_in = (Bytef *)data;
+    z.avail_in = size;
+    z.next_out = out.data();
+    z.avail_out = out.size();
+    int status = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+    if (status != Z_STREAM_END || z.total_out != expected)
+        out.clear();
+    return out;
+}
+
+// Deflated or stored members, optionally the way streaming zippers write
+// them: no sizes in the local header, a data descriptor behind the data
+struct ZipWriter {
+    std::vector<uint8_t> zip;
+    std::vector<uint8_t> directory;
+    uint16_t count = 0;
+
+    void add(const std::string &name, const std::vector<uint8_t> &data, uint16_t method, bool descriptor = false, uint16_t flags = 0)
+    {
+        auto stored = (method == ZIP_METHOD_STORED) ? data : deflated(data);
+        uint32_t crc = crc32(0, data.data(), data.size());
+        uint32_t offset = zip.size();
+        if (descriptor)
+            flags |= ZIP_FLAG_DATA_DESCRIPTOR;
+
+        put32(zip, ZIP_LOCAL_SIGNATURE);
+        put16(zip, 20);
+        put16(zip, flags);
+        put16(zip, method);
+        put32(zip, 0x5a210000);
+        put32(zip, descriptor ? 0 : crc);
+        put32(zip, descriptor ? 0 : stored.size());
+        put32(zip, descriptor ? 0 : data.size());
+        put16(zip, name.size());
+        put16(zip, 4);
+        zip.insert(zip.end(), name.begin(), name.end());
+        put32(zip, 0x00000000);
+        zip.insert(zip.end(), stored.begin(), stored.end());
+        if (descriptor)
+        {
+            put32(zip, 0x08074b50);
+            put32(zip, crc);
+            put32(zip, stored.size());
+            put32(zip, data.size());
+        }
+
+        put32(directory, ZIP_CENTRAL_SIGNATURE);
+        put16(directory, 0x031e);
+        put16(directory, 20);
+        put16(directory, flags);
+        put16(directory, method);
+        put32(directory, 0x5a210000);
+        put32(directory, crc);
+        put32(directory, stored.size());
+        put32(directory, data.size());
+        put16(directory, name.size());
+        put16(directory, 0);
+        put16(directory, 3);
+        put16(directory, 0);
+        put16(directory, 0);
+        put32(directory, 0x81a40000);
+        put32(directory, offset);
+        directory.insert(directory.end(), name.begin(), name.end());
+        directory.insert(directory.end(), { 'h', 'i', '!' });
+        count++;
+    }
+
+    std::vector<uint8_t> finish(const std::string &comment = "")
+    {
+        uint32_t offset = zip.size();
+        zip.insert(zip.end(), directory.begin(), directory.end());
+        put32(zip, ZIP_END_SIGNATURE);
+        put16(zip, 0);
+        put16(zip, 0);
+        put16(zip, count);
+        put16(zip, count);
+        put32(zip, directory.size());
+        put32(zip, offset);
+        put16(zip, comment.size());
+        zip.insert(zip.end(), comment.begin(), comment.end());
+        return zip;
+    }
+};
+
+// Half directory structures and empty sectors, half game data
+static std::vector<uint8_t> disk(uint32_t size, uint32_t seed)
+{
+    std::vector<uint8_t> data(size, 0);
+    for (uint32_t i = 0; i < size / 2; i++)
+        data[i] = (uint8_t)((i / 5) * 17 + seed);
+    for (uint32_t i = size / 2; i < size; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (seed >> 16) & 0x3F;
+    }
+    return data;
+}
+
+// The member's contents as the new archive has them, empty if broken
+static std::vector<uint8_t> extract(MemorySource &zip, const ZipIndex::Entry &entry)
+{
+    uint32_t offset;
+    ZipIndex index;
+    if (!index.dataOffset(zip, entry, offset) || offset + entry.compressed_size > zip.data.size())
+        return {};
+
+    const uint8_t *data = zip.data.data() + offset;
+    std::vector<uint8_t> out;
+    if (entry.method == ZIP_METHOD_STORED)
+        out.assign(data, data + entry.compressed_size);
+    else
+        out = inflated(data, entry.compressed_size, entry.size);
+
+    if (out.size() != entry.size || crc32(0, out.data(), out.size()) != entry.crc)
+        return {};
+    return out;
+}
+
+static const ZipIndex::Entry *entry(ZipIndex &index, const std::string &name)
+{
+    auto e = index.find(name);
+    TEST_ASSERT_NOT_NULL(e);
+    return e;
+}
+
+void test_zip_repack_member(void)
+{
+    ZipWriter w;
+    for (uint32_t i = 0; i < 6; i++)
+        w.add("games/game" + std::to_string(i) + ".d64", disk(174848, i), ZIP_METHOD_DEFLATED);
+    MemorySource src;
+    src.data = w.finish("collection");
+
+    ZipIndex index;
+    TEST_ASSERT_TRUE(index.load(src));
+
+    // A high score saved to game2
+    auto image = disk(174848, 2);
+    memset(image.data() + 90000, 0x42, 256);
+    MemorySource data;
+    data.data = image;
+
+    MemorySink out;
+    ZipRepacker repacker(src, index);
+    TEST_ASSERT_TRUE(repacker.repack(*entry(index, "game2.d64"), data, out));
+    TEST_ASSERT_EQUAL_UINT32(out.data.size(), repacker.stats().written);
+
+    MemorySource result;
+    result.data = out.data;
+    ZipIndex repacked;
+    TEST_ASSERT_TRUE(repacked.load(result));
+    TEST_ASSERT_EQUAL_UINT32(6, repacked.entries().size());
+
+    for (uint32_t i = 0; i < 6; i++)
+    {
+        std::string name = "game" + std::to_string(i) + ".d64";
+        auto before = entry(index, name);
+        auto after = entry(repacked, name);
+        TEST_ASSERT_TRUE(extract(result, *after) == (i == 2 ? image : disk(174848, i)));
+        TEST_ASSERT_EQUAL_UINT16(before->time, after->time);
+
+        // The others are the same bytes, just moved
+        if (i != 2)
+        {
+            TEST_ASSERT_EQUAL_UINT32(before->crc, after->crc);
+            TEST_ASSERT_EQUAL_UINT32(before->compressed_size, after->compressed_size);
+            TEST_ASSERT_EQUAL_MEMORY(src.data.data() + before->header_offset, result.data.data() + after->header_offset, before->compressed_size);
+        }
+        if (i < 2)
+            TEST_ASSERT_EQUAL_UINT32(before->header_offset, after->header_offset);
+    }
+
+    // Directory records keep their comments and attributes, the end
+    // record its comment
+    auto after = entry(repacked, "game5.d64");
+    const uint8_t *record = result.data.data() + repacked.directoryOffset() + after->record_offset;
+    TEST_ASSERT_EQUAL_MEMORY("hi!", record + ZIP_CENTRAL_HEADER_SIZE + after->name.size(), 3);
+    TEST_ASSERT_EQUAL_UINT32(0x81a40000, get32(record + 38));
+    TEST_ASSERT_EQUAL_MEMORY("collection", result.data.data() + result.data.size() - 10, 10);
+}
+
+void test_zip_repack_descriptor(void)
+{
+    // Stored members with data descriptors around the one that changes
+    ZipWriter w;
+    w.add("README.TXT", disk(3000, 1), ZIP_METHOD_DEFLATED, true);
+    w.add("DISK.D64", disk(174848, 2), ZIP_METHOD_STORED, true);
+    w.add("NOTES.TXT", disk(5000, 3), ZIP_METHOD_STORED, true);
+    MemorySource src;
+    src.data = w.finish();
+
+    ZipIndex index;
+    TEST_ASSERT_TRUE(index.load(src));
+
+    MemorySource data;
+    data.data = disk(174848, 7);
+    MemorySink out;
+    ZipRepacker repacker(src, index);
+    TEST_ASSERT_TRUE(repacker.repack(*entry(index, "DISK.D64"), data, out));
+
+    MemorySource result;
+    result.data = out.data;
+    ZipIndex repacked;
+    TEST_ASSERT_TRUE(repacked.load(result));
+
+    // Still stored, the sizes are in the local header now
+    auto disk_entry = entry(repacked, "DISK.D64");
+    TEST_ASSERT_EQUAL_UINT16(ZIP_METHOD_STORED, disk_entry->method);
+    TEST_ASSERT_EQUAL_UINT16(0, disk_entry->flags & ZIP_FLAG_DATA_DESCRIPTOR);
+    TEST_ASSERT_EQUAL_UINT32(174848, get32(result.data.data() + disk_entry->header_offset + 18));
+    TEST_ASSERT_TRUE(extract(result, *disk_entry) == data.data);
+
+    // The descriptor behind the old member went with it, the others kept theirs
+    TEST_ASSERT_TRUE(extract(result, *entry(repacked, "README.TXT")) == disk(3000, 1));
+    auto notes = entry(repacked, "NOTES.TXT");
+    TEST_ASSERT_EQUAL_UINT32(disk_entry->header_offset + ZIP_LOCAL_HEADER_SIZE + 8 + 4 + 174848, notes->header_offset);
+    TEST_ASSERT_TRUE(extract(result, *notes) == disk(5000, 3));
+    TEST_ASSERT_EQUAL_UINT32(result.data.size() - ZIP_END_SIZE - repacked.directorySize(), repacked.directoryOffset());
+}
+
+void test_zip_repack_file(void)
+{
+    ZipWriter w;
+    w.add("A.D64", disk(20000, 1), ZIP_METHOD_DEFLATED);
+    w.add("B.D64", disk(20000, 2), ZIP_METHOD_DEFLATED, true);
+    MemorySource src;
+    src.data = w.finish();
+
+    ZipIndex index;
+    TEST_ASSERT_TRUE(index.load(src));
+    MemorySource data;
+    data.data = disk(20000, 9);
+
+    MemorySink memory;
+    TEST_ASSERT_TRUE(ZipRepacker(src, index).repack(*entry(index, "A.D64"), data, memory));
+
+    // The local header is patched in the file the same way
+    FILE *file = tmpfile();
+    TEST_ASSERT_NOT_NULL(file);
+    ZipRepacker::FileSink sink(file);
+    TEST_ASSERT_TRUE(ZipRepacker(src, index).repack(*entry(index, "A.D64"), data, sink));
+
+    std::vector<uint8_t> written(memory.data.size() + 1);
+    rewind(file);
+    TEST_ASSERT_EQUAL_UINT32(memory.data.size(), fread(written.data(), 1, written.size(), file));
+    written.pop_back();
+    fclose(file);
+    TEST_ASSERT_TRUE(written == memory.data);
+}
+
+void test_zip_repack_rejects(void)
+{
+    ZipWriter w;
+    w.add("SECRET.D64", disk(1000, 1), ZIP_METHOD_STORED, false, ZIP_FLAG_ENCRYPTED);
+    MemorySource src;
+    src.data = w.finish();
+
+    ZipIndex index;
+    TEST_ASSERT_TRUE(index.load(src));
+    MemorySource data;
+    data.data = disk(1000, 2);
+    MemorySink out;
+    TEST_ASSERT_FALSE(ZipRepacker(src, index).repack(index.entries()[0], data, out));
+
+    // The index has to match the archive
+    ZipIndex empty;
+    TEST_ASSERT_FALSE(ZipRepacker(src, empty).repack(index.entries()[0], data, out));
+}
+
+// A 5MB collection, one disk image changed. The naive way deflates every
+// member again.
+void test_zip_repack_benchmark(void)
+{
+    using clock = std::chrono::steady_clock;
+
+    ZipWriter w;
+    const uint32_t members = 60;
+    for (uint32_t i = 0; i < members; i++)
+        w.add("game" + std::to_string(i) + ".d64", disk(174848, i), ZIP_METHOD_DEFLATED);
+    MemorySource src;
+    src.data = w.finish();
+
+    ZipIndex index;
+    TEST_ASSERT_TRUE(index.load(src));
+    MemorySource data;
+    data.data = disk(174848, 31);
+    data.data[1000] ^= 0xFF;
+
+    auto t0 = clock::now();
+    uint32_t recompressed = 0;
+    for (uint32_t i = 0; i < members; i++)
+        recompressed += deflated(i == 31 ? data.data : disk(174848, i)).size();
+    auto t1 = clock::now();
+
+    MemorySink out;
+    ZipRepacker repacker(src, index);
+    TEST_ASSERT_TRUE(repacker.repack(*entry(index, "game31.d64"), data, out));
+    auto t2 = clock::now();
+
+    // Deflating costs about the D64, the rest is copying
+    auto &stats = repacker.stats();
+    TEST_ASSERT_EQUAL_UINT32(stats.written, stats.copied + stats.packed + ZIP_LOCAL_HEADER_SIZE + 10 + 4);
+    TEST_ASSERT_LESS_THAN_UINT32(src.data.size() / 20, stats.packed);
+
+    double naive_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    double repack_ms = std::chrono::duration<double, std::milli>(t2 - t1).count();
+    printf("\n%-24s %10s %10s %10s\n", "save game31.d64", "deflated", "copied", "ms");
+    printf("%-24s %10u %10u %10.3f\n", "recompress all", members * 174848, 0, naive_ms);
+    printf("%-24s %10u %10u %10.3f\n", "repack", (uint32_t)data.data.size(), stats.copied, repack_ms);
+    printf("%-24s %10u bytes, member packed to %u\n", "archive", stats.written, stats.packed);
+}
+
+void process()
+{
+    UNITY_BEGIN();
+
+    RUN_TEST(test_zip_repack_member);
+    RUN_TEST(test_zip_repack_descriptor);
+    RUN_TEST(test_zip_repack_file);
+    RUN_TEST(test_zip_repack_rejects);
+    RUN_TEST(test_zip_repack_benchmark);
+
+    UNITY_END();
+}
+
+int main()
+{
+    process();
+}